@@ -7,6 +7,9 @@
 //-------------------------------------------------------------------------------------------------------
 
 #pragma once
+#include <memory>
+#include <new>
+#include <type_traits>
 
 enum class pool_type
 {
@@ -14,14 +17,240 @@ enum class pool_type
 	Paged,
 };
 
+namespace drv
+{
+	namespace details
+	{
+		// Pool tags of the library, so that poolmon attributes its allocations to the subsystem that made them
+		constexpr const ULONG DefaultPoolTag = 'HHDS';
+		constexpr const ULONG LookasideTag = 'LHDS';
+		constexpr const ULONG RingBufferTag = 'BHDS';
+		constexpr const ULONG FramePoolTag = 'CHDS';
+		constexpr const ULONG DeadlineTag = 'DHDS';
+		constexpr const ULONG HashMapTag = 'MHDS';
+		constexpr const ULONG ProcessorTableTag = 'PHDS';
+		constexpr const ULONG RundownTag = 'RHDS';
+		constexpr const ULONG VectorTag = 'VHDS';
+		constexpr const ULONG ArenaTag = 'AHDS';
+		constexpr const ULONG PagedStateTag = 'SHDS';
+
+		// Value of pool_options::preferred_node that leaves the choice of the node to the system
+		constexpr const ULONG AnyNumaNode = ~ULONG{};
+
+		/// <summary>
+		/// Parameters of a pool allocation, passed to the placement forms of operator new:
+		/// `new (drv::pool_options{ .tag = 'MyTg', .preferred_node = node }) T`
+		/// </summary>
+		struct pool_options
+		{
+			pool_type pool = pool_type::NonPaged;
+			// Pool tag shown by poolmon, one per subsystem
+			ULONG tag = DefaultPoolTag;
+			// Memory is taken from this NUMA node while it has free pages. Requires ExAllocatePool3 (Windows Server 2022), ignored on older systems
+			ULONG preferred_node = AnyNumaNode;
+			// Allocations are zeroed unless this is set, for storage that is completely written before it is read
+			bool uninitialized = false;
+		};
+
+		/// <summary>
+		/// Allocate pool memory. Alignments above MEMORY_ALLOCATION_ALIGNMENT are honored by over-allocating
+		/// </summary>
+		/// <returns>Pointer to the allocated memory or nullptr</returns>
+		[[nodiscard]]
+		void *pool_allocate(size_t size, const pool_options &options, size_t alignment = MEMORY_ALLOCATION_ALIGNMENT) noexcept;
+
+		/// <summary>
+		/// Free memory returned by pool_allocate, with the same alignment
+		/// </summary>
+		void pool_free(void *ptr, size_t alignment = MEMORY_ALLOCATION_ALIGNMENT) noexcept;
+	}
+
+	using details::pool_options;
+
+	/// <summary>
+	/// Look up ExAllocatePool2 and ExAllocatePool3. Call from DriverEntry, until then (and on systems without them) the pool is allocated with ExAllocatePoolWithTag
+	/// </summary>
+	void initialize_pool_allocator() noexcept;
+}
+
 extern void *__cdecl operator new(size_t size);
 extern void *__cdecl operator new[](size_t size);
 extern void *__cdecl operator new(size_t size, pool_type pool);
 extern void *__cdecl operator new[](size_t size, pool_type pool);
-extern void *__cdecl operator new(size_t size, std::align_val_t);
+extern void *__cdecl operator new(size_t size, std::align_val_t alignment);
+extern void *__cdecl operator new[](size_t size, std::align_val_t alignment);
+extern void *__cdecl operator new(size_t size, const drv::pool_options &options) noexcept;
+extern void *__cdecl operator new[](size_t size, const drv::pool_options &options) noexcept;
+extern void *__cdecl operator new(size_t size, std::align_val_t alignment, const drv::pool_options &options) noexcept;
+extern void *__cdecl operator new[](size_t size, std::align_val_t alignment, const drv::pool_options &options) noexcept;
 
 extern void operator delete(void *ptr) noexcept;
 extern void operator delete[](void *ptr) noexcept;
 extern void operator delete(void *ptr, size_t) noexcept;
-extern void operator delete(void *ptr, size_t, std::align_val_t) noexcept;
-extern void operator delete[](void *ptr, size_t) noexcept;
\ No newline at end of file
+extern void operator delete[](void *ptr, size_t) noexcept;
+extern void operator delete(void *ptr, std::align_val_t alignment) noexcept;
+extern void operator delete[](void *ptr, std::align_val_t alignment) noexcept;
+extern void operator delete(void *ptr, size_t, std::align_val_t alignment) noexcept;
+extern void operator delete[](void *ptr, size_t, std::align_val_t alignment) noexcept;
+// Placement forms matching the placement operators new
+extern void operator delete(void *ptr, const drv::pool_options &options) noexcept;
+extern void operator delete[](void *ptr, const drv::pool_options &options) noexcept;
+extern void operator delete(void *ptr, std::align_val_t alignment, const drv::pool_options &options) noexcept;
+extern void operator delete[](void *ptr, std::align_val_t alignment, const drv::pool_options &options) noexcept;
+
+namespace drv
+{
+	namespace details
+	{
+		/// <summary>
+		/// Allocate an object without zeroing its storage, as std::make_unique_for_overwrite does
+		/// </summary>
+		/// <returns>Pointer to the object, empty if it cannot be allocated</returns>
+		template<class T>
+			requires (!std::is_array_v<T>)
+		[[nodiscard]]
+		std::unique_ptr<T> make_unique_for_overwrite(pool_options options = {}) noexcept
+		{
+			options.uninitialized = true;
+			return std::unique_ptr<T>{ new (options) T };
+		}
+
+		/// <summary>
+		/// Allocate an array without zeroing its storage, as std::make_unique_for_overwrite does
+		/// </summary>
+		/// <returns>Pointer to the array, empty if it cannot be allocated</returns>
+		template<class T>
+			requires std::is_unbounded_array_v<T>
+		[[nodiscard]]
+		std::unique_ptr<T> make_unique_for_overwrite(size_t count, pool_options options = {}) noexcept
+		{
+			options.uninitialized = true;
+			return std::unique_ptr<T>{ new (options) std::remove_extent_t<T>[count] };
+		}
+
+		/// <summary>
+		/// Lookaside list of fixed-size blocks
+		/// The class has a constexpr constructor and a trivial destructor, so it can be used as a static data member.
+		/// Call destroy when the list is no longer needed
+		/// </summary>
+		class lookaside_list
+		{
+			LOOKASIDE_LIST_EX list{};
+			size_t block_size{};	// zero while the list is not initialized
+
+		public:
+			constexpr lookaside_list() noexcept = default;
+
+			lookaside_list(const lookaside_list &) = delete;
+			lookaside_list &operator =(const lookaside_list &) = delete;
+
+			/// <summary>
+			/// Initialize the list
+			/// </summary>
+			/// <param name="size">Size of each block</param>
+			/// <param name="pool">Pool to allocate blocks from. Blocks from a paged list may only be allocated and freed at IRQL &lt;= APC_LEVEL</param>
+			/// <param name="tag">Pool tag</param>
+			/// <returns>Status code</returns>
+			[[nodiscard]]
+			NTSTATUS initialize(size_t size, pool_type pool = pool_type::NonPaged, ULONG tag = LookasideTag) noexcept
+			{
+				assert(!initialized());
+				const POOL_TYPE pt = pool == pool_type::NonPaged ? NonPagedPoolNx : PagedPool;
+				const auto status = ExInitializeLookasideListEx(&list, nullptr, nullptr, pt, 0, size, tag, 0);
+				if (NT_SUCCESS(status))
+					block_size = size;
+				return status;
+			}
+
+			/// <summary>
+			/// Delete the list and free all cached blocks. All allocated blocks must be freed before this call
+			/// </summary>
+			void destroy() noexcept
+			{
+				if (initialized())
+				{
+					ExDeleteLookasideListEx(&list);
+					block_size = 0;
+				}
+			}
+
+			[[nodiscard]]
+			bool initialized() const noexcept
+			{
+				return block_size != 0;
+			}
+
+			/// <summary>
+			/// Get the size of each block
+			/// </summary>
+			[[nodiscard]]
+			size_t size() const noexcept
+			{
+				return block_size;
+			}
+
+			[[nodiscard]]
+			void *allocate() noexcept
+			{
+				assert(initialized());
+				return ExAllocateFromLookasideListEx(&list);
+			}
+
+			void free(void *ptr) noexcept
+			{
+				assert(initialized());
+				ExFreeToLookasideListEx(&list, ptr);
+			}
+		};
+
+		/// <summary>
+		/// Mixin that serves allocations of a class from a per-type lookaside list
+		/// Call initialize_lookaside before the objects are created (usually from DriverEntry) and delete_lookaside after the last one is destroyed.
+		/// While the list is not initialized, as well as for derived classes of a different size, objects are allocated directly from the pool
+		/// </summary>
+		/// <typeparam name="T">Name of the derived class</typeparam>
+		/// <typeparam name="Pool">Pool to allocate objects from</typeparam>
+		template<class T, pool_type Pool = pool_type::NonPaged>
+		class lookaside_allocated
+		{
+			static inline constinit lookaside_list list;
+
+		public:
+			[[nodiscard]]
+			static NTSTATUS initialize_lookaside() noexcept
+			{
+				return list.initialize(sizeof(T), Pool);
+			}
+
+			static void delete_lookaside() noexcept
+			{
+				list.destroy();
+			}
+
+			[[nodiscard]]
+			static void *operator new(size_t size) noexcept
+			{
+				// list.size() is zero while the list is not initialized
+				if (size == list.size()) [[likely]]
+					return list.allocate();
+				else
+					return ::operator new(size, Pool);
+			}
+
+			static void operator delete(void *ptr, size_t size) noexcept
+			{
+				if (!ptr)
+					return;
+
+				if (size == list.size()) [[likely]]
+					list.free(ptr);
+				else
+					::operator delete(ptr);
+			}
+		};
+	}
+
+	using details::lookaside_list;
+	using details::lookaside_allocated;
+	using details::make_unique_for_overwrite;
+}
@@ -7,77 +7,231 @@
 //-------------------------------------------------------------------------------------------------------
 
 #pragma once
+#include <cstddef>
 #include "allocator.h"
 
-constexpr const auto Tag = 'HHDS';
-
-[[nodiscard]]
-inline void *pool_alloc(size_t size, pool_type type) noexcept
+namespace drv
 {
-	const POOL_TYPE pt = type == pool_type::NonPaged ? NonPagedPoolNx : PagedPool;
+	namespace details
+	{
+		namespace pool
+		{
+			// ExAllocatePool2 and ExAllocatePool3 are not declared for the NTDDI_VERSION the library targets, so their flags and parameters are repeated here
+			constexpr const ULONG64 FlagUninitialized = 0x0000'0000'0000'0002ull;	// POOL_FLAG_UNINITIALIZED
+			constexpr const ULONG64 FlagNonPaged = 0x0000'0000'0000'0040ull;		// POOL_FLAG_NON_PAGED
+			constexpr const ULONG64 FlagPaged = 0x0000'0000'0000'0100ull;			// POOL_FLAG_PAGED
+
+			constexpr const ULONG64 ExtendedParameterNumaNode = 3;					// PoolExtendedParameterNumaNode
+
+			/// <summary>
+			/// Layout of POOL_EXTENDED_PARAMETER
+			/// </summary>
+			struct extended_parameter
+			{
+				ULONG64 type : 8;
+				ULONG64 optional : 1;
+				ULONG64 reserved : 55;
+				union
+				{
+					ULONG64 reserved2;
+					ULONG preferred_node;
+				};
+			};
+			static_assert(sizeof(extended_parameter) == 16);
+
+			using allocate_pool2_t = PVOID (NTAPI *)(ULONG64 flags, SIZE_T size, ULONG tag);
+			using allocate_pool3_t = PVOID (NTAPI *)(ULONG64 flags, SIZE_T size, ULONG tag, const extended_parameter *parameters, ULONG count);
+
+			inline constinit allocate_pool2_t allocate_pool2{};
+			inline constinit allocate_pool3_t allocate_pool3{};
+
+			[[nodiscard]]
+			inline void *allocate(size_t size, const pool_options &options) noexcept
+			{
+				const auto flags = (options.pool == pool_type::NonPaged ? FlagNonPaged : FlagPaged) | (options.uninitialized ? FlagUninitialized : 0);
+
+				if (options.preferred_node != AnyNumaNode && allocate_pool3)
+				{
+					extended_parameter node{};
+					node.type = ExtendedParameterNumaNode;
+					node.preferred_node = options.preferred_node;
+					return allocate_pool3(flags, size, options.tag, &node, 1);
+				}
+
+				if (allocate_pool2) [[likely]]
+					return allocate_pool2(flags, size, options.tag);
+
+				const POOL_TYPE pt = options.pool == pool_type::NonPaged ? NonPagedPoolNx : PagedPool;
 #pragma warning(suppress: 4996)	// The following function is deprecated, but replacement might not be available on target OS
-	return ::ExAllocatePoolWithTag(pt, size, Tag);
-}
+				auto p = ::ExAllocatePoolWithTag(pt, size, options.tag);
+				// Zero the memory as ExAllocatePool2 does
+				if (p && !options.uninitialized)
+					RtlZeroMemory(p, size);
+				return p;
+			}
+		}
 
-inline void pool_free(void *p)
-{
-	if (p)
-		::ExFreePoolWithTag(p, Tag);
+		void *pool_allocate(size_t size, const pool_options &options, size_t alignment) noexcept
+		{
+			if (alignment <= MEMORY_ALLOCATION_ALIGNMENT) [[likely]]
+				return pool::allocate(size, options);
+
+			// The pool only aligns blocks smaller than a page to MEMORY_ALLOCATION_ALIGNMENT. Allocate enough to align the block
+			// and keep the address of the allocation right in front of it
+			if (size > SIZE_MAX - alignment) [[unlikely]]
+				return nullptr;
+
+			const auto block = static_cast<std::byte *>(pool::allocate(size + alignment, options));
+			if (!block) [[unlikely]]
+				return nullptr;
+
+			const auto aligned = reinterpret_cast<std::byte *>((reinterpret_cast<ULONG_PTR>(block) + alignment) & ~(alignment - 1));
+			reinterpret_cast<void **>(aligned)[-1] = block;
+			return aligned;
+		}
+
+		void pool_free(void *ptr, size_t alignment) noexcept
+		{
+			if (!ptr)
+				return;
+
+			if (alignment > MEMORY_ALLOCATION_ALIGNMENT) [[unlikely]]
+				ptr = static_cast<void **>(ptr)[-1];
+
+			// Allocations carry different tags, ExFreePool does not check them
+			::ExFreePool(ptr);
+		}
+	}
+
+	void initialize_pool_allocator() noexcept
+	{
+		PAGED_CODE();
+
+		UNICODE_STRING pool2 = RTL_CONSTANT_STRING(L"ExAllocatePool2");
+		UNICODE_STRING pool3 = RTL_CONSTANT_STRING(L"ExAllocatePool3");
+		details::pool::allocate_pool2 = reinterpret_cast<details::pool::allocate_pool2_t>(MmGetSystemRoutineAddress(&pool2));
+		details::pool::allocate_pool3 = reinterpret_cast<details::pool::allocate_pool3_t>(MmGetSystemRoutineAddress(&pool3));
+	}
 }
 
 [[nodiscard]]
 void *__cdecl operator new(size_t size)
 {
-	return pool_alloc(size, pool_type::NonPaged);
+	return drv::details::pool_allocate(size, {});
 }
 
-[[nodiscard]] 
+[[nodiscard]]
 void *__cdecl operator new[](size_t size)
 {
-	return pool_alloc(size, pool_type::NonPaged);
+	return drv::details::pool_allocate(size, {});
 }
 
 [[nodiscard]]
 void *__cdecl operator new(size_t size, pool_type pool)
 {
-	return pool_alloc(size, pool);
+	return drv::details::pool_allocate(size, { .pool = pool });
 }
 
 [[nodiscard]]
 void *__cdecl operator new[](size_t size, pool_type pool)
 {
-	return pool_alloc(size, pool);
+	return drv::details::pool_allocate(size, { .pool = pool });
+}
+
+[[nodiscard]]
+void *__cdecl operator new(size_t size, std::align_val_t alignment)
+{
+	return drv::details::pool_allocate(size, {}, static_cast<size_t>(alignment));
+}
+
+[[nodiscard]]
+void *__cdecl operator new[](size_t size, std::align_val_t alignment)
+{
+	return drv::details::pool_allocate(size, {}, static_cast<size_t>(alignment));
+}
+
+[[nodiscard]]
+void *__cdecl operator new(size_t size, const drv::pool_options &options) noexcept
+{
+	return drv::details::pool_allocate(size, options);
+}
+
+[[nodiscard]]
+void *__cdecl operator new[](size_t size, const drv::pool_options &options) noexcept
+{
+	return drv::details::pool_allocate(size, options);
+}
+
+[[nodiscard]]
+void *__cdecl operator new(size_t size, std::align_val_t alignment, const drv::pool_options &options) noexcept
+{
+	return drv::details::pool_allocate(size, options, static_cast<size_t>(alignment));
 }
 
 [[nodiscard]]
-void *__cdecl operator new(size_t size, std::align_val_t)
+void *__cdecl operator new[](size_t size, std::align_val_t alignment, const drv::pool_options &options) noexcept
 {
-	return pool_alloc(size, pool_type::NonPaged);
+	return drv::details::pool_allocate(size, options, static_cast<size_t>(alignment));
 }
 
 //
 
 void operator delete(void *ptr) noexcept
 {
-	pool_free(ptr);
+	drv::details::pool_free(ptr);
 }
 
 void operator delete[](void *ptr) noexcept
 {
-	pool_free(ptr);
+	drv::details::pool_free(ptr);
 }
 
 void operator delete(void *ptr, size_t) noexcept
 {
-	pool_free(ptr);
+	drv::details::pool_free(ptr);
 }
 
-void operator delete(void *ptr, size_t, std::align_val_t) noexcept
+void operator delete[](void *ptr, size_t) noexcept
 {
-	pool_free(ptr);
+	drv::details::pool_free(ptr);
 }
 
-void operator delete[](void *ptr, size_t) noexcept
+void operator delete(void *ptr, std::align_val_t alignment) noexcept
+{
+	drv::details::pool_free(ptr, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void *ptr, std::align_val_t alignment) noexcept
+{
+	drv::details::pool_free(ptr, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t alignment) noexcept
+{
+	drv::details::pool_free(ptr, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t alignment) noexcept
+{
+	drv::details::pool_free(ptr, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *ptr, const drv::pool_options &) noexcept
+{
+	drv::details::pool_free(ptr);
+}
+
+void operator delete[](void *ptr, const drv::pool_options &) noexcept
+{
+	drv::details::pool_free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t alignment, const drv::pool_options &) noexcept
+{
+	drv::details::pool_free(ptr, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void *ptr, std::align_val_t alignment, const drv::pool_options &) noexcept
 {
-	pool_free(ptr);
+	drv::details::pool_free(ptr, static_cast<size_t>(alignment));
 }
@@ -0,0 +1,307 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include "allocator.h"
+#include "vector.h"
+
+namespace drv
+{
+	namespace details
+	{
+		/// <summary>
+		/// Monotonic memory resource for scratch allocations made while servicing a single request
+		/// Memory is taken from an optional initial buffer and then from pool chunks of geometrically increasing size. Individual
+		/// allocations are never freed, everything is released at once by release() or the destructor
+		/// The arena is not synchronized: it belongs to one request or coroutine and must outlive all objects allocated from it
+		/// </summary>
+		class monotonic_arena
+		{
+			struct chunk_header
+			{
+				chunk_header *next;
+				size_t size;
+			};
+
+			static constexpr const size_t DefaultChunkSize = 1024;
+			static constexpr const size_t MaxChunkSize = 64 * 1024;
+
+			std::byte *current;
+			std::byte *last;
+			std::byte *const initial_first;
+			std::byte *const initial_last;
+			chunk_header *chunks{};
+			size_t next_chunk_size{ DefaultChunkSize };
+			const pool_options options;
+
+			[[nodiscard]]
+			static std::byte *align_up(std::byte *p, size_t alignment) noexcept
+			{
+				return reinterpret_cast<std::byte *>((reinterpret_cast<ULONG_PTR>(p) + alignment - 1) & ~(alignment - 1));
+			}
+
+			[[nodiscard]]
+			void *allocate_slow(size_t size, size_t alignment) noexcept
+			{
+				// Chunks always have room for the requested block, even if it is larger than the current chunk size
+				constexpr const size_t reserve = sizeof(chunk_header) + alignof(std::max_align_t);
+				if (size > SIZE_MAX - reserve - alignment) [[unlikely]]
+					return nullptr;
+
+				const auto chunk_size = std::max(next_chunk_size, size + alignment + reserve);
+				auto *chunk = static_cast<chunk_header *>(pool_allocate(chunk_size, options));
+				if (!chunk) [[unlikely]]
+					return nullptr;
+
+				chunk->next = chunks;
+				chunk->size = chunk_size;
+				chunks = chunk;
+				next_chunk_size = std::min(next_chunk_size * 2, MaxChunkSize);
+
+				current = align_up(reinterpret_cast<std::byte *>(chunk + 1), alignment);
+				last = reinterpret_cast<std::byte *>(chunk) + chunk_size;
+
+				auto *p = current;
+				current += size;
+				return p;
+			}
+
+			// Blocks are handed out uninitialized, there is no point in zeroing the chunks
+			[[nodiscard]]
+			static constexpr pool_options chunk_options(pool_options options) noexcept
+			{
+				options.uninitialized = true;
+				return options;
+			}
+
+		public:
+			/// <summary>
+			/// Construct an arena that allocates from pool chunks only
+			/// </summary>
+			/// <param name="options">Pool, tag and preferred node of the chunks</param>
+			explicit monotonic_arena(const pool_options &options = { .tag = ArenaTag }) noexcept :
+				current{},
+				last{},
+				initial_first{},
+				initial_last{},
+				options{ chunk_options(options) }
+			{
+			}
+
+			/// <summary>
+			/// Construct an arena that first allocates from `initial` (usually a buffer on the stack or in the request context)
+			/// and goes to the pool only when it is exhausted
+			/// </summary>
+			explicit monotonic_arena(std::span<std::byte> initial, const pool_options &options = { .tag = ArenaTag }) noexcept :
+				current{ initial.data() },
+				last{ initial.data() + initial.size() },
+				initial_first{ initial.data() },
+				initial_last{ initial.data() + initial.size() },
+				options{ chunk_options(options) }
+			{
+			}
+
+			monotonic_arena(const monotonic_arena &) = delete;
+			monotonic_arena &operator =(const monotonic_arena &) = delete;
+
+			~monotonic_arena()
+			{
+				release();
+			}
+
+			/// <summary>
+			/// Allocate an uninitialized block of memory. The block lives until the arena is released
+			/// </summary>
+			/// <param name="alignment">Power of two alignment of the block</param>
+			/// <returns>Pointer to the block or nullptr if a new chunk could not be allocated</returns>
+			[[nodiscard]]
+			void *allocate(size_t size, size_t alignment = alignof(std::max_align_t)) noexcept
+			{
+				assert(alignment && (alignment & (alignment - 1)) == 0);
+				if (current)
+				{
+					auto *p = align_up(current, alignment);
+					if (p <= last && size <= static_cast<size_t>(last - p)) [[likely]]
+					{
+						current = p + size;
+						return p;
+					}
+				}
+				return allocate_slow(size, alignment);
+			}
+
+			/// <summary>
+			/// Individual blocks are not freed. The call is accepted so that the arena can replace a memory resource that frees them
+			/// </summary>
+			static void deallocate([[maybe_unused]] void *ptr, [[maybe_unused]] size_t size, [[maybe_unused]] size_t alignment = alignof(std::max_align_t)) noexcept
+			{
+			}
+
+			/// <summary>
+			/// Allocate uninitialized storage for `count` objects of type T
+			/// </summary>
+			template<class T>
+			[[nodiscard]]
+			T *allocate_array(size_t count) noexcept
+			{
+				if (count > SIZE_MAX / sizeof(T)) [[unlikely]]
+					return nullptr;
+				return static_cast<T *>(allocate(count * sizeof(T), alignof(T)));
+			}
+
+			/// <summary>
+			/// Construct an object in the arena. Destructors are not run on release, so T must be trivially destructible
+			/// </summary>
+			/// <returns>Pointer to the object or nullptr if memory could not be allocated</returns>
+			template<class T, class...Args>
+				requires std::is_trivially_destructible_v<T> && std::constructible_from<T, Args &&...>
+			[[nodiscard]]
+			T *create(Args &&...args) noexcept
+			{
+				auto *p = allocate(sizeof(T), alignof(T));
+				return p ? std::construct_at(static_cast<T *>(p), std::forward<Args>(args)...) : nullptr;
+			}
+
+			/// <summary>
+			/// Free all pool chunks and start allocating from the initial buffer again. All blocks taken from the arena become invalid
+			/// </summary>
+			void release() noexcept
+			{
+				while (chunks)
+					pool_free(std::exchange(chunks, chunks->next));
+
+				current = initial_first;
+				last = initial_last;
+				next_chunk_size = DefaultChunkSize;
+			}
+
+			/// <summary>
+			/// Test if a pointer belongs to the initial buffer or to a chunk of this arena. Intended for assertions
+			/// </summary>
+			[[nodiscard]]
+			bool owns(const void *ptr) const noexcept
+			{
+				const auto *p = static_cast<const std::byte *>(ptr);
+				if (p >= initial_first && p < initial_last)
+					return true;
+				for (auto *chunk = chunks; chunk; chunk = chunk->next)
+					if (p > reinterpret_cast<const std::byte *>(chunk) && p < reinterpret_cast<const std::byte *>(chunk) + chunk->size)
+						return true;
+				return false;
+			}
+		};
+
+		/// <summary>
+		/// Monotonic arena with an initial buffer of N bytes stored inside the object
+		/// Declare it as a local of a dispatch routine or coroutine, or as a member of a request context
+		/// </summary>
+		template<size_t N>
+		class inline_arena : public monotonic_arena
+		{
+			alignas(std::max_align_t) std::byte buffer[N];
+
+		public:
+			explicit inline_arena(const pool_options &options = { .tag = ArenaTag }) noexcept :
+				monotonic_arena{ std::span<std::byte>{ buffer }, options }
+			{
+			}
+		};
+
+		/// <summary>
+		/// Vector that takes its storage from a monotonic arena
+		/// When it grows, elements are moved to a larger block and the old block stays in the arena until it is released
+		/// Operations that fail to allocate return STATUS_INSUFFICIENT_RESOURCES and leave the vector unchanged
+		/// The vector must not outlive its arena
+		/// </summary>
+		template<class T>
+		class arena_vector : public vector_base<T, arena_vector<T>>
+		{
+			using base = vector_base<T, arena_vector<T>>;
+			friend base;
+
+			monotonic_arena *arena;
+			T *first{};
+			size_t capacity_{};
+
+			[[nodiscard]]
+			T *storage() noexcept
+			{
+				return first;
+			}
+
+			[[nodiscard]]
+			const T *storage() const noexcept
+			{
+				return first;
+			}
+
+			[[nodiscard]]
+			NTSTATUS grow(size_t required) noexcept
+			{
+				constexpr const size_t max_elements = SIZE_MAX / sizeof(T);
+				if (required > max_elements) [[unlikely]]
+					return STATUS_INTEGER_OVERFLOW;
+
+				const auto new_capacity = std::max({ required, capacity_ <= max_elements / 2 ? capacity_ * 2 : max_elements, size_t{ 4 } });
+				auto *p = arena->allocate_array<T>(new_capacity);
+				if (!p) [[unlikely]]
+					return STATUS_INSUFFICIENT_RESOURCES;
+
+				std::uninitialized_move(first, first + this->count, p);
+				std::destroy_n(first, this->count);
+				first = p;
+				capacity_ = new_capacity;
+				return STATUS_SUCCESS;
+			}
+
+		public:
+			explicit arena_vector(monotonic_arena &arena) noexcept :
+				arena{ &arena }
+			{
+			}
+
+			arena_vector(const arena_vector &) = delete;
+			arena_vector &operator =(const arena_vector &) = delete;
+
+			arena_vector(arena_vector &&o) noexcept :
+				arena{ o.arena },
+				first{ std::exchange(o.first, nullptr) },
+				capacity_{ std::exchange(o.capacity_, 0) }
+			{
+				this->count = std::exchange(o.count, 0);
+			}
+
+			~arena_vector()
+			{
+				this->destroy_all();
+			}
+
+			[[nodiscard]]
+			size_t capacity() const noexcept
+			{
+				return capacity_;
+			}
+
+			[[nodiscard]]
+			monotonic_arena &get_arena() const noexcept
+			{
+				return *arena;
+			}
+		};
+	}
+
+	using details::monotonic_arena;
+	using details::inline_arena;
+	using details::arena_vector;
+}
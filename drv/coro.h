@@ -0,0 +1,800 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include <atomic>
+#include <bit>
+#include <concepts>
+#include <coroutine>
+#include <optional>
+#include <utility>
+#include "allocator.h"
+#include "irp.h"
+#include "list.h"
+#include "scheduler.h"
+
+namespace drv::coro
+{
+	namespace details
+	{
+		using drv::details::effective_db_list;
+		using drv::details::list_entry;
+
+		/// <summary>
+		/// Per-processor cache of coroutine frames
+		/// Frames up to MaxCachedSize bytes are rounded up to a power-of-two size class and recycled through lock-free per-processor lists,
+		/// larger frames are allocated from the pool directly. Until initialize is called (or if it fails) all frames come from the pool
+		/// initialize must be called at PASSIVE_LEVEL before the first coroutine is started (usually in DriverEntry) and
+		/// uninitialize after the last coroutine frame has been destroyed (usually in DriverUnload)
+		/// </summary>
+		class frame_pool
+		{
+			static constexpr const size_t MinSizeShift = 6;		// 64 bytes
+			static constexpr const size_t SizeClasses = 6;		// 64 .. 2048 bytes
+			// Maximum number of cached frames per size class and processor, excess frames are returned to the pool
+			static constexpr const USHORT MaxDepth = 256;
+
+		public:
+			static constexpr const size_t MaxCachedSize = size_t{ 1 } << (MinSizeShift + SizeClasses - 1);
+
+			struct statistics
+			{
+				ULONG64 hits;		// frames served from a processor cache
+				ULONG64 misses;		// cacheable frames allocated from the pool
+				ULONG64 oversize;	// frames larger than MaxCachedSize
+			};
+
+		private:
+			struct alignas(SYSTEM_CACHE_ALIGNMENT_SIZE) processor_cache
+			{
+				SLIST_HEADER lists[SizeClasses];
+				std::atomic<ULONG64> hits;
+				std::atomic<ULONG64> misses;
+				std::atomic<ULONG64> oversize;
+			};
+
+			static inline constinit processor_cache *caches{};
+			static inline constinit ULONG cache_count{};
+
+			// The compiler initializes the frames, the pool does not have to zero them
+			static constexpr const pool_options frame_options{ .tag = drv::details::FramePoolTag, .uninitialized = true };
+
+			[[nodiscard]]
+			static constexpr size_t size_class(size_t size) noexcept
+			{
+				return size <= (size_t{ 1 } << MinSizeShift) ? 0 : std::bit_width(size - 1) - MinSizeShift;
+			}
+
+			[[nodiscard]]
+			static constexpr size_t class_size(size_t index) noexcept
+			{
+				return size_t{ 1 } << (MinSizeShift + index);
+			}
+
+			[[nodiscard]]
+			static processor_cache *current_cache() noexcept
+			{
+				// The thread may move to another processor right after this call, this only affects locality, the lists are interlocked
+				const auto index = KeGetCurrentProcessorNumberEx(nullptr);
+				return index < cache_count ? &caches[index] : nullptr;
+			}
+
+		public:
+			static NTSTATUS initialize() noexcept
+			{
+				PAGED_CODE();
+				assert(!caches);
+
+				const auto count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+				auto *p = static_cast<processor_cache *>(::operator new(sizeof(processor_cache) * count, std::align_val_t{ alignof(processor_cache) }, pool_options{ .tag = drv::details::ProcessorTableTag }));
+				if (!p) [[unlikely]]
+					return STATUS_INSUFFICIENT_RESOURCES;
+
+				for (ULONG i = 0; i < count; ++i)
+				{
+					auto *cache = std::construct_at(p + i);
+					for (auto &list : cache->lists)
+						InitializeSListHead(&list);
+				}
+
+				caches = p;
+				cache_count = count;
+				return STATUS_SUCCESS;
+			}
+
+			static void uninitialize() noexcept
+			{
+				PAGED_CODE();
+
+				const auto count = std::exchange(cache_count, 0);
+				for (ULONG i = 0; i < count; ++i)
+				{
+					for (auto &list : caches[i].lists)
+						while (auto entry = InterlockedPopEntrySList(&list))
+							::operator delete(entry);
+					std::destroy_at(caches + i);
+				}
+
+				::operator delete(std::exchange(caches, nullptr), std::align_val_t{ alignof(processor_cache) });
+			}
+
+			[[nodiscard]]
+			static void *allocate(size_t size) noexcept
+			{
+				if (size > MaxCachedSize) [[unlikely]]
+				{
+					if (auto *cache = current_cache())
+						cache->oversize.fetch_add(1, std::memory_order_relaxed);
+					return ::operator new(size, frame_options);
+				}
+
+				// Cacheable frames are always allocated with the size of their class, so any of them may be recycled
+				const auto index = size_class(size);
+				if (auto *cache = current_cache()) [[likely]]
+				{
+					if (auto entry = InterlockedPopEntrySList(&cache->lists[index])) [[likely]]
+					{
+						cache->hits.fetch_add(1, std::memory_order_relaxed);
+						return entry;
+					}
+					cache->misses.fetch_add(1, std::memory_order_relaxed);
+				}
+
+				return ::operator new(class_size(index), frame_options);
+			}
+
+			static void free(void *ptr, size_t size) noexcept
+			{
+				if (size <= MaxCachedSize) [[likely]]
+				{
+					if (auto *cache = current_cache()) [[likely]]
+					{
+						auto &list = cache->lists[size_class(size)];
+						if (QueryDepthSList(&list) < MaxDepth)
+						{
+							InterlockedPushEntrySList(&list, static_cast<PSLIST_ENTRY>(ptr));
+							return;
+						}
+					}
+				}
+
+				::operator delete(ptr);
+			}
+
+			/// <summary>
+			/// Get the counters summed over all processors
+			/// </summary>
+			[[nodiscard]]
+			static statistics get_statistics() noexcept
+			{
+				statistics result{};
+				for (ULONG i = 0; i < cache_count; ++i)
+				{
+					result.hits += caches[i].hits.load(std::memory_order_relaxed);
+					result.misses += caches[i].misses.load(std::memory_order_relaxed);
+					result.oversize += caches[i].oversize.load(std::memory_order_relaxed);
+				}
+				return result;
+			}
+		};
+
+		/// <summary>
+		/// Coroutine frame allocation, shared by all promise types
+		/// Frames are served by frame_pool, allocation failures are reported through get_return_object_on_allocation_failure
+		/// </summary>
+		struct frame_allocation
+		{
+			[[nodiscard]]
+			static void *operator new(size_t size) noexcept
+			{
+				return frame_pool::allocate(size);
+			}
+
+			static void operator delete(void *ptr, size_t size) noexcept
+			{
+				frame_pool::free(ptr, size);
+			}
+		};
+
+		/// <summary>
+		/// Return type for coroutines whose caller is not interested in the result
+		/// The coroutine starts immediately and destroys its frame when it finishes
+		/// </summary>
+		class fire_and_forget
+		{
+			bool started{};
+
+			constexpr explicit fire_and_forget(bool started) noexcept :
+				started{ started }
+			{
+			}
+
+		public:
+			struct promise_type : frame_allocation
+			{
+				static constexpr std::suspend_never initial_suspend() noexcept
+				{
+					return {};
+				}
+
+				static constexpr std::suspend_never final_suspend() noexcept
+				{
+					return {};
+				}
+
+				static constexpr fire_and_forget get_return_object() noexcept
+				{
+					return fire_and_forget{ true };
+				}
+
+				static constexpr fire_and_forget get_return_object_on_allocation_failure() noexcept
+				{
+					return fire_and_forget{ false };
+				}
+
+				static constexpr void return_void() noexcept
+				{
+				}
+
+				static constexpr void unhandled_exception() noexcept
+				{
+					// Exceptions are not used in drivers
+				}
+			};
+
+			/// <summary>
+			/// Test if the coroutine has been started. It is false only if its frame could not be allocated, in this case the body has not run
+			/// </summary>
+			[[nodiscard]]
+			constexpr explicit operator bool() const noexcept
+			{
+				return started;
+			}
+		};
+
+		template<class T>
+		class task;
+
+		template<class T>
+		class task_promise;
+
+		/// <summary>
+		/// Common part of task promises: lazy start and symmetric transfer to the awaiting coroutine on completion
+		/// </summary>
+		class task_promise_base : public frame_allocation
+		{
+			template<class T>
+			friend class task;
+
+			std::coroutine_handle<> continuation{ std::noop_coroutine() };
+
+			struct final_awaiter
+			{
+				static constexpr bool await_ready() noexcept
+				{
+					return false;
+				}
+
+				template<class Promise>
+				static std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+				{
+					return handle.promise().continuation;
+				}
+
+				static constexpr void await_resume() noexcept
+				{
+				}
+			};
+
+		public:
+			static constexpr std::suspend_always initial_suspend() noexcept
+			{
+				return {};
+			}
+
+			static constexpr final_awaiter final_suspend() noexcept
+			{
+				return {};
+			}
+
+			static constexpr void unhandled_exception() noexcept
+			{
+				// Exceptions are not used in drivers
+			}
+		};
+
+		template<class T>
+		class task_promise : public task_promise_base
+		{
+			template<class U>
+			friend class task;
+
+			std::optional<T> value;
+
+		public:
+			task<T> get_return_object() noexcept;
+
+			static task<T> get_return_object_on_allocation_failure() noexcept;
+
+			template<class U = T>
+				requires std::constructible_from<T, U &&>
+			void return_value(U &&result) noexcept
+			{
+				value.emplace(std::forward<U>(result));
+			}
+		};
+
+		template<>
+		class task_promise<void> : public task_promise_base
+		{
+		public:
+			task<void> get_return_object() noexcept;
+
+			static task<void> get_return_object_on_allocation_failure() noexcept;
+
+			static constexpr void return_void() noexcept
+			{
+			}
+		};
+
+		/// <summary>
+		/// Lazily started coroutine that produces a value of type T
+		/// The coroutine starts when the task is awaited and resumes the awaiting coroutine by symmetric transfer when it finishes,
+		/// so chains of tasks completing synchronously do not grow the kernel stack
+		/// If the coroutine frame could not be allocated, the task is empty and awaiting it immediately returns
+		/// STATUS_INSUFFICIENT_RESOURCES for task&lt;NTSTATUS&gt; or a value-initialized T otherwise
+		/// The task object owns the coroutine frame and must outlive the co_await expression
+		/// </summary>
+		/// <typeparam name="T">Result type</typeparam>
+		template<class T = void>
+		class [[nodiscard]] task
+		{
+			using handle_type = std::coroutine_handle<task_promise<T>>;
+			handle_type handle;
+
+			friend class task_promise<T>;
+
+			explicit task(handle_type handle) noexcept :
+				handle{ handle }
+			{
+			}
+
+			struct awaiter
+			{
+				handle_type handle;
+
+				bool await_ready() const noexcept
+				{
+					return !handle || handle.done();
+				}
+
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) const noexcept
+				{
+					handle.promise().continuation = awaiting;
+					return handle;
+				}
+
+				T await_resume() const noexcept
+				{
+					if constexpr (!std::is_void_v<T>)
+					{
+						if (!handle) [[unlikely]]
+						{
+							if constexpr (std::same_as<T, NTSTATUS>)
+								return STATUS_INSUFFICIENT_RESOURCES;
+							else
+								return T{};
+						}
+						return std::move(*handle.promise().value);
+					}
+				}
+			};
+
+		public:
+			using promise_type = task_promise<T>;
+
+			task() = default;
+
+			task(const task &) = delete;
+			task &operator =(const task &) = delete;
+
+			task(task &&o) noexcept :
+				handle{ std::exchange(o.handle, {}) }
+			{
+			}
+
+			task &operator =(task &&o) noexcept
+			{
+				if (this != &o)
+				{
+					if (handle)
+						handle.destroy();
+					handle = std::exchange(o.handle, {});
+				}
+				return *this;
+			}
+
+			~task()
+			{
+				if (handle)
+					handle.destroy();
+			}
+
+			/// <summary>
+			/// Test if the coroutine frame has been allocated
+			/// </summary>
+			[[nodiscard]]
+			explicit operator bool() const noexcept
+			{
+				return static_cast<bool>(handle);
+			}
+
+			awaiter operator co_await() const noexcept
+			{
+				return { handle };
+			}
+		};
+
+		template<class T>
+		inline task<T> task_promise<T>::get_return_object() noexcept
+		{
+			return task<T>{ std::coroutine_handle<task_promise>::from_promise(*this) };
+		}
+
+		template<class T>
+		inline task<T> task_promise<T>::get_return_object_on_allocation_failure() noexcept
+		{
+			return {};
+		}
+
+		inline task<void> task_promise<void>::get_return_object() noexcept
+		{
+			return task<void>{ std::coroutine_handle<task_promise>::from_promise(*this) };
+		}
+
+		inline task<void> task_promise<void>::get_return_object_on_allocation_failure() noexcept
+		{
+			return {};
+		}
+
+		/// <summary>
+		/// Resume the awaiting coroutine in the context of a system worker thread at PASSIVE_LEVEL
+		/// </summary>
+		/// <param name="device">Device object the work item is associated with, it is referenced until the work item runs</param>
+		/// <returns>Awaitable object, co_await returns STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES if the work item could not be allocated.
+		/// In the latter case the coroutine continues on the current thread</returns>
+		[[nodiscard]]
+		inline auto resume_background(PDEVICE_OBJECT device, WORK_QUEUE_TYPE queue = DelayedWorkQueue) noexcept
+		{
+			struct awaitable
+			{
+				PDEVICE_OBJECT device;
+				WORK_QUEUE_TYPE queue;
+				NTSTATUS status{ STATUS_SUCCESS };
+
+				static constexpr bool await_ready() noexcept
+				{
+					return false;
+				}
+
+				bool await_suspend(std::coroutine_handle<> handle) noexcept
+				{
+					const auto work_item = IoAllocateWorkItem(device);
+					if (!work_item) [[unlikely]]
+					{
+						status = STATUS_INSUFFICIENT_RESOURCES;
+						return false;
+					}
+
+					IoQueueWorkItemEx(work_item, []([[maybe_unused]] PVOID IoObject, PVOID Context, PIO_WORKITEM IoWorkItem) noexcept
+					{
+						IoFreeWorkItem(IoWorkItem);
+						std::coroutine_handle<>::from_address(Context).resume();
+					}, queue, handle.address());
+					return true;
+				}
+
+				[[nodiscard]]
+				NTSTATUS await_resume() const noexcept
+				{
+					return status;
+				}
+			};
+
+			return awaitable{ device, queue };
+		}
+
+		/// <summary>
+		/// Awaitable that resumes the awaiting coroutine from a scheduler queue. The work item is a part of the awaitable, which lives in the coroutine frame
+		/// If the item could not be queued, the coroutine continues on the current thread and co_await returns the error
+		/// </summary>
+		template<bool Passive>
+		class [[nodiscard]] scheduler_awaitable : drv::details::work_item
+		{
+			std::coroutine_handle<> handle;
+			ULONG processor;
+			NTSTATUS status{ STATUS_SUCCESS };
+
+			static void resume(drv::details::work_item *item) noexcept
+			{
+				static_cast<scheduler_awaitable *>(item)->handle.resume();
+			}
+
+		public:
+			explicit scheduler_awaitable(ULONG processor) noexcept :
+				drv::details::work_item{ {}, &resume },
+				processor{ processor }
+			{
+			}
+
+			static constexpr bool await_ready() noexcept
+			{
+				return false;
+			}
+
+			bool await_suspend(std::coroutine_handle<> awaiting) noexcept
+			{
+				handle = awaiting;
+				// Once the item is queued, the coroutine may be resumed and the awaitable destroyed before this call returns
+				NTSTATUS result;
+				if constexpr (Passive)
+					result = scheduler::queue_passive(*this, processor);
+				else
+					result = scheduler::queue_dispatch(*this, processor);
+				if (nt_success(result)) [[likely]]
+					return true;
+				status = result;
+				return false;
+			}
+
+			[[nodiscard]]
+			NTSTATUS await_resume() const noexcept
+			{
+				return status;
+			}
+		};
+
+		/// <summary>
+		/// Resume the awaiting coroutine in the threaded DPC of a processor, at IRQL &lt;= DISPATCH_LEVEL
+		/// Requires drv::scheduler to be initialized
+		/// </summary>
+		/// <returns>Awaitable object, co_await returns STATUS_SUCCESS or the error returned by scheduler::queue_dispatch</returns>
+		[[nodiscard]]
+		inline auto resume_on(ULONG processor) noexcept
+		{
+			return scheduler_awaitable<false>{ processor };
+		}
+
+		/// <summary>
+		/// Resume the awaiting coroutine in the threaded DPC of the current processor, after the current thread has returned from the dispatch routine
+		/// </summary>
+		[[nodiscard]]
+		inline auto resume_dispatch() noexcept
+		{
+			return scheduler_awaitable<false>{ scheduler::current_processor() };
+		}
+
+		/// <summary>
+		/// Resume the awaiting coroutine at PASSIVE_LEVEL in the scheduler's worker thread of a processor, the current one by default
+		/// Unlike resume_background, the coroutine stays on the processor and no work item is allocated
+		/// </summary>
+		[[nodiscard]]
+		inline auto resume_passive(ULONG processor = scheduler::current_processor()) noexcept
+		{
+			return scheduler_awaitable<true>{ processor };
+		}
+
+		class cancellation_source;
+
+		/// <summary>
+		/// A callback registered with a cancellation source
+		/// </summary>
+		struct cancellation_node
+		{
+			LIST_ENTRY link;
+			void (*invoke)(cancellation_node *) noexcept;
+		};
+
+		/// <summary>
+		/// Lightweight reference to a cancellation source, passed by value to cancellable operations
+		/// A default-constructed token can never be cancelled
+		/// </summary>
+		class cancellation_token
+		{
+			friend class cancellation_source;
+			template<class F>
+			friend class cancellation_registration;
+
+			cancellation_source *source{};
+
+			constexpr explicit cancellation_token(cancellation_source *source) noexcept :
+				source{ source }
+			{
+			}
+
+		public:
+			constexpr cancellation_token() = default;
+
+			[[nodiscard]]
+			constexpr bool can_be_cancelled() const noexcept
+			{
+				return source != nullptr;
+			}
+
+			[[nodiscard]]
+			bool is_cancellation_requested() const noexcept;
+		};
+
+		/// <summary>
+		/// Owner of a cancellation state
+		/// cancel() invokes all registered callbacks once, on the calling thread and without holding any locks
+		/// The source must outlive all tokens and registrations created from it. It may be used at IRQL &lt;= DISPATCH_LEVEL
+		/// </summary>
+		class cancellation_source
+		{
+			template<class F>
+			friend class cancellation_registration;
+
+			KSPIN_LOCK lock;
+			std::atomic<bool> requested{};
+			effective_db_list<cancellation_node, list_entry<cancellation_node, offsetof(cancellation_node, link)>> registrations;
+			// Callback currently invoked by cancel() and the thread running it
+			std::atomic<cancellation_node *> invoking{};
+			PKTHREAD invoking_thread{};
+
+		public:
+			cancellation_source() noexcept
+			{
+				KeInitializeSpinLock(&lock);
+			}
+
+			cancellation_source(const cancellation_source &) = delete;
+			cancellation_source &operator =(const cancellation_source &) = delete;
+
+#if defined(_DEBUG)
+			~cancellation_source()
+			{
+				assert(registrations.empty());
+			}
+#endif
+
+			[[nodiscard]]
+			cancellation_token token() noexcept
+			{
+				return cancellation_token{ this };
+			}
+
+			[[nodiscard]]
+			bool is_cancellation_requested() const noexcept
+			{
+				return requested.load(std::memory_order_acquire);
+			}
+
+			/// <summary>
+			/// Request cancellation and invoke registered callbacks. Subsequent calls have no effect
+			/// </summary>
+			void cancel() noexcept
+			{
+				KIRQL irql;
+				KeAcquireSpinLock(&lock, &irql);
+				if (requested.load(std::memory_order_relaxed))
+				{
+					KeReleaseSpinLock(&lock, irql);
+					return;
+				}
+
+				requested.store(true, std::memory_order_release);
+				invoking_thread = KeGetCurrentThread();
+
+				while (auto node = registrations.remove_head())
+				{
+					node->link.Flink = node->link.Blink = nullptr;	// mark as unlinked
+					invoking.store(node, std::memory_order_relaxed);
+					KeReleaseSpinLock(&lock, irql);
+
+					node->invoke(node);
+
+					KeAcquireSpinLock(&lock, &irql);
+					invoking.store(nullptr, std::memory_order_release);
+				}
+
+				invoking_thread = nullptr;
+				KeReleaseSpinLock(&lock, irql);
+			}
+		};
+
+		inline bool cancellation_token::is_cancellation_requested() const noexcept
+		{
+			return source && source->is_cancellation_requested();
+		}
+
+		/// <summary>
+		/// Registers a callback with the source of a cancellation token for the lifetime of the object
+		/// If cancellation has already been requested, the callback is invoked from the constructor
+		/// The destructor waits for the callback if it is being invoked on another thread
+		/// </summary>
+		/// <typeparam name="F">Callback type, invocable without arguments</typeparam>
+		template<class F>
+		class cancellation_registration : cancellation_node
+		{
+			cancellation_source *source{};
+			[[no_unique_address]] F callback;
+
+			static void invoke_callback(cancellation_node *node) noexcept
+			{
+				static_cast<cancellation_registration *>(node)->callback();
+			}
+
+		public:
+			template<class U>
+				requires std::constructible_from<F, U &&> && std::invocable<F &>
+			cancellation_registration(cancellation_token token, U &&callback) noexcept :
+				cancellation_node{ {}, &invoke_callback },
+				callback{ std::forward<U>(callback) }
+			{
+				if (!token.source)
+					return;
+
+				KIRQL irql;
+				KeAcquireSpinLock(&token.source->lock, &irql);
+				if (token.source->requested.load(std::memory_order_relaxed))
+				{
+					KeReleaseSpinLock(&token.source->lock, irql);
+					this->callback();
+					return;
+				}
+
+				token.source->registrations.add_tail(this);
+				source = token.source;
+				KeReleaseSpinLock(&source->lock, irql);
+			}
+
+			cancellation_registration(const cancellation_registration &) = delete;
+			cancellation_registration &operator =(const cancellation_registration &) = delete;
+
+			~cancellation_registration()
+			{
+				if (!source)
+					return;
+
+				KIRQL irql;
+				KeAcquireSpinLock(&source->lock, &irql);
+				if (link.Flink)
+				{
+					source->registrations.remove(this);
+					KeReleaseSpinLock(&source->lock, irql);
+					return;
+				}
+
+				// The callback has been or is being invoked, wait for it unless it is running on this thread (a callback destroying its own registration)
+				const bool wait = source->invoking.load(std::memory_order_relaxed) == this && source->invoking_thread != KeGetCurrentThread();
+				KeReleaseSpinLock(&source->lock, irql);
+
+				if (wait)
+				{
+					while (source->invoking.load(std::memory_order_acquire) == this)
+						YieldProcessor();
+				}
+			}
+		};
+
+		template<class U>
+		cancellation_registration(cancellation_token, U &&) -> cancellation_registration<std::decay_t<U>>;
+	}
+
+	using details::frame_pool;
+	using details::fire_and_forget;
+	using details::task;
+	using details::resume_background;
+	using details::resume_on;
+	using details::resume_dispatch;
+	using details::resume_passive;
+	using details::cancellation_source;
+	using details::cancellation_token;
+	using details::cancellation_registration;
+}
@@ -7,14 +7,30 @@
 //-------------------------------------------------------------------------------------------------------
 
 #pragma once
+#include <algorithm>
+#include <array>
 #include <cstddef>
+#include <span>
 #include "irp.h"
 #include "list.h"
+#include "lock.h"
+#include "slist.h"
+#include "timer_wheel.h"
 
 namespace drv
 {
 	namespace details
 	{
+		/// <summary>
+		/// Result of a predicate passed to cancel_safe_queue::remove_batch
+		/// </summary>
+		enum class batch_action
+		{
+			take,	// remove the IRP from the queue
+			skip,	// leave the IRP in the queue and continue
+			stop,	// leave the IRP in the queue and stop
+		};
+
 		/// <summary>
 		/// Holds a list of IRPs
 		/// </summary>
@@ -35,6 +51,12 @@ namespace drv
 				return STATUS_SUCCESS;
 			}
 
+			NTSTATUS on_insert_head_impl(PIRP irp, [[maybe_unused]] void *context) noexcept
+			{
+				list.add_head(irp);
+				return STATUS_SUCCESS;
+			}
+
 			void on_remove_impl(PIRP irp) noexcept
 			{
 				list.remove(irp);
@@ -86,15 +108,407 @@ namespace drv
 				if (context && IoGetCurrentIrpStackLocation(stored)->FileObject != context) [[unlikely]]
 					return {};
 
-				return std::exchange(stored, {});
+				// The IRP is released in on_remove_impl
+				return stored;
+			}
+		};
+
+		/// <summary>
+		/// Holds a list of IRPs and indexes them by FILE_OBJECT
+		/// Besides the global FIFO list, each IRP is linked into one of `Buckets` per-file lists selected by a hash of its FILE_OBJECT,
+		/// so peeking with a FILE_OBJECT context (as cleanup does) only visits IRPs of file objects sharing the bucket
+		/// The policy uses Tail.Overlay.DriverContext[0] and [1] to link the per-file lists, the driver must not use them while the IRP is queued
+		/// </summary>
+		/// <typeparam name="Buckets">Number of per-file lists, must be a power of two</typeparam>
+		template<size_t Buckets = 64>
+		class per_file_irp_list
+		{
+			static_assert(Buckets && (Buckets & (Buckets - 1)) == 0, "Buckets must be a power of two");
+
+			using fifo_list = effective_db_list<IRP, list_entry<IRP, offsetof(IRP, Tail.Overlay.ListEntry)>>;
+			using file_list = effective_db_list<IRP, list_entry<IRP, offsetof(IRP, Tail.Overlay.DriverContext)>>;
+
+			fifo_list list;
+			std::array<file_list, Buckets> files;
+
+			[[nodiscard]]
+			static void *file_object(PIRP irp) noexcept
+			{
+				return IoGetCurrentIrpStackLocation(irp)->FileObject;
+			}
+
+			[[nodiscard]]
+			file_list &bucket(void *file_object) noexcept
+			{
+				// FILE_OBJECTs are pool allocations, the lowest bits carry no information
+				const auto value = reinterpret_cast<ULONG_PTR>(file_object) >> 4;
+				return files[(value ^ (value >> 8) ^ (value >> 16)) & (Buckets - 1)];
+			}
+
+		public:
+#if defined(_DEBUG)
+			~per_file_irp_list()
+			{
+				assert(list.empty());
+			}
+#endif
+			NTSTATUS on_insert_impl(PIRP irp, [[maybe_unused]] void *context) noexcept
+			{
+				list.add_tail(irp);
+				bucket(file_object(irp)).add_tail(irp);
+				return STATUS_SUCCESS;
+			}
+
+			NTSTATUS on_insert_head_impl(PIRP irp, [[maybe_unused]] void *context) noexcept
+			{
+				list.add_head(irp);
+				bucket(file_object(irp)).add_head(irp);
+				return STATUS_SUCCESS;
+			}
+
+			void on_remove_impl(PIRP irp) noexcept
+			{
+				bucket(file_object(irp)).remove(irp);
+				list.remove(irp);
+			}
+
+			PIRP on_peek_impl(PIRP irp, void *context) noexcept
+			{
+				if (!context)
+					return irp == nullptr ? list.get_head() : list.get_next(irp);
+
+				auto &files_list = bucket(context);
+				auto next = (irp == nullptr) ? files_list.get_head() : files_list.get_next(irp);
+
+				while (next && file_object(next) != context)
+					next = files_list.get_next(next);
+
+				return next;
+			}
+		};
+
+		/// <summary>
+		/// Holds a separate list of IRPs for each I/O priority level and serves the highest non-empty level first
+		/// The level is taken from the insert context created by insert_context, or from IoGetIoPriorityHint if no context is given
+		/// To bound the delay of low priority requests, a level that has been bypassed by `AgingLimit` removals from higher levels is served first once
+		/// Peeking with a FILE_OBJECT context visits all levels
+		/// The policy uses Tail.Overlay.DriverContext[0] to store the level, the driver must not use it while the IRP is queued
+		/// </summary>
+		/// <typeparam name="AgingLimit">Number of removals from higher levels after which a waiting level is served</typeparam>
+		template<unsigned AgingLimit = 16>
+		class priority_irp_list
+		{
+			static_assert(AgingLimit > 0);
+
+			static constexpr const size_t Levels = MaxIoPriorityTypes;
+
+			using level_list = effective_db_list<IRP, list_entry<IRP, offsetof(IRP, Tail.Overlay.ListEntry)>>;
+
+			std::array<level_list, Levels> levels;
+			// Number of IRPs removed from higher levels since the head of a level was last served
+			std::array<unsigned, Levels> bypassed{};
+			// Order of levels visited by the current peek sequence, computed when the sequence starts
+			std::array<UCHAR, Levels> order{};
+
+			[[nodiscard]]
+			static size_t level_of(PIRP irp) noexcept
+			{
+				return reinterpret_cast<ULONG_PTR>(irp->Tail.Overlay.DriverContext[0]);
+			}
+
+			size_t assign_level(PIRP irp, void *context) noexcept
+			{
+				const auto hint = context ? reinterpret_cast<ULONG_PTR>(context) - 1 : static_cast<ULONG_PTR>(IoGetIoPriorityHint(irp));
+				const auto level = std::min<size_t>(hint, Levels - 1);
+				irp->Tail.Overlay.DriverContext[0] = reinterpret_cast<PVOID>(level);
+
+				// Aging starts when a level gets its first waiting IRP
+				if (levels[level].empty())
+					bypassed[level] = 0;
+				return level;
+			}
+
+			void compute_order() noexcept
+			{
+				// A starved level goes first (the highest one if there are several), then all levels from the highest
+				size_t pos{};
+				size_t starved = Levels;
+				for (size_t level = Levels; level-- > 0; )
+					if (bypassed[level] >= AgingLimit && !levels[level].empty())
+					{
+						starved = level;
+						order[pos++] = static_cast<UCHAR>(level);
+						break;
+					}
+
+				for (size_t level = Levels; level-- > 0; )
+					if (level != starved)
+						order[pos++] = static_cast<UCHAR>(level);
+			}
+
+			[[nodiscard]]
+			PIRP first_from(size_t pos) noexcept
+			{
+				for (; pos < Levels; ++pos)
+					if (auto irp = levels[order[pos]].get_head())
+						return irp;
+				return nullptr;
+			}
+
+			[[nodiscard]]
+			size_t position_of(size_t level) const noexcept
+			{
+				return static_cast<size_t>(std::find(order.begin(), order.end(), static_cast<UCHAR>(level)) - order.begin());
+			}
+
+		public:
+			/// <summary>
+			/// Make an insert context that queues an IRP at the given priority instead of its I/O priority hint
+			/// </summary>
+			[[nodiscard]]
+			static void *insert_context(IO_PRIORITY_HINT priority) noexcept
+			{
+				return reinterpret_cast<void *>(static_cast<ULONG_PTR>(priority) + 1);
+			}
+
+#if defined(_DEBUG)
+			~priority_irp_list()
+			{
+				for (const auto &list : levels)
+					assert(list.empty());
+			}
+#endif
+			NTSTATUS on_insert_impl(PIRP irp, void *context) noexcept
+			{
+				levels[assign_level(irp, context)].add_tail(irp);
+				return STATUS_SUCCESS;
+			}
+
+			NTSTATUS on_insert_head_impl(PIRP irp, void *context) noexcept
+			{
+				levels[assign_level(irp, context)].add_head(irp);
+				return STATUS_SUCCESS;
 			}
+
+			void on_remove_impl(PIRP irp) noexcept
+			{
+				const auto level = level_of(irp);
+				levels[level].remove(irp);
+
+				// Serving a level resets its aging, waiting lower levels age
+				bypassed[level] = 0;
+				for (size_t lower = 0; lower < level; ++lower)
+					if (!levels[lower].empty())
+						++bypassed[lower];
+			}
+
+			PIRP on_peek_impl(PIRP irp, void *context) noexcept
+			{
+				if (!irp)
+					compute_order();
+
+				for (auto next = irp ? levels[level_of(irp)].get_next(irp) : first_from(0);;)
+				{
+					if (!next && irp)
+						next = first_from(position_of(level_of(irp)) + 1);
+
+					if (!next || !context || IoGetCurrentIrpStackLocation(next)->FileObject == context)
+						return next;
+
+					irp = next;
+					next = levels[level_of(irp)].get_next(irp);
+				}
+			}
+		};
+
+		/// <summary>
+		/// Deadline policy: queued IRPs never expire
+		/// </summary>
+		struct no_deadlines
+		{
+		};
+
+		/// <summary>
+		/// Deadline of a timed IRP, used as its CSQ context while it is queued
+		/// </summary>
+		struct deadline_context
+		{
+			SLIST_ENTRY free_link;
+			IO_CSQ_IRP_CONTEXT csq_context;
+			timer_wheel_entry entry;
+			PIRP irp;
 		};
 
-		template<class Derived, class IrpStorage = irp_list>
+		/// <summary>
+		/// Deadline policy: IRPs inserted with insert_with_timeout are completed with STATUS_TIMEOUT when their deadline passes
+		/// Deadlines are kept in a timer wheel driven by a single timer and DPC per queue, which only run while there are deadlines,
+		/// so an expiry tick costs the same regardless of the number of waiting IRPs
+		/// A timed IRP takes a context from a free list. The system CSQ routines may write to the context after the IRP is removed,
+		/// so a context is returned to the free list only after the system is done with it. While the IRP is removed, the queue keeps
+		/// the context pointer in Tail.Overlay.ListEntry.Blink, which the storage no longer uses
+		/// Contexts are only freed when the queue is destroyed, which must happen at PASSIVE_LEVEL
+		/// </summary>
+		/// <typeparam name="TickMs">Resolution of deadlines in milliseconds</typeparam>
+		/// <typeparam name="Levels">Number of timer wheel levels</typeparam>
+		/// <typeparam name="SlotBits">Binary logarithm of the number of slots in a timer wheel level</typeparam>
+		template<ULONG TickMs = 10, unsigned Levels = 3, unsigned SlotBits = 6>
+		class deadline_wheel
+		{
+			static_assert(TickMs > 0);
+
+			// Tick length in interrupt time units (100ns)
+			static constexpr const u64 TickLength = u64{ TickMs } * 10'000;
+
+			KTIMER timer;
+			KDPC dpc;
+			bool armed{};
+			timer_wheel<Levels, SlotBits> wheel;
+			slist<deadline_context, slist_entry<deadline_context, offsetof(deadline_context, free_link)>> free_contexts;
+
+			[[nodiscard]]
+			static u64 current_tick() noexcept
+			{
+				return KeQueryInterruptTime() / TickLength;
+			}
+
+			void arm() noexcept
+			{
+				LARGE_INTEGER due;
+				due.QuadPart = -static_cast<LONGLONG>(TickLength);
+				KeSetTimer(&timer, due, &dpc);
+				armed = true;
+			}
+
+		public:
+			deadline_wheel() noexcept
+			{
+				KeInitializeTimer(&timer);
+			}
+
+			deadline_wheel(const deadline_wheel &) = delete;
+			deadline_wheel &operator =(const deadline_wheel &) = delete;
+
+			~deadline_wheel()
+			{
+				PAGED_CODE();
+				assert(wheel.empty());
+
+				KeCancelTimer(&timer);
+				KeFlushQueuedDpcs();
+
+				for (auto contexts = free_contexts.flush(); auto context = contexts.pop_front();)
+					::operator delete(context);
+			}
+
+			/// <summary>
+			/// Set the routine of the expiry DPC, called once by the queue
+			/// </summary>
+			void initialize(PKDEFERRED_ROUTINE routine, void *context) noexcept
+			{
+				KeInitializeDpc(&dpc, routine, context);
+			}
+
+			/// <summary>
+			/// Compute the expiry tick of a deadline that is `timeout_ms` milliseconds from now
+			/// </summary>
+			[[nodiscard]]
+			static u64 expiry_of(ULONG timeout_ms) noexcept
+			{
+				return (KeQueryInterruptTime() + u64{ timeout_ms } * 10'000 + TickLength - 1) / TickLength;
+			}
+
+			/// <summary>
+			/// Get a context from the free list or allocate a new one. May be called without the queue lock
+			/// </summary>
+			[[nodiscard]]
+			deadline_context *allocate() noexcept
+			{
+				if (auto context = free_contexts.pop())
+					return context;
+
+				auto context = static_cast<deadline_context *>(::operator new(sizeof(deadline_context), pool_options{ .tag = DeadlineTag, .uninitialized = true }));
+				if (context)
+					std::construct_at(context);
+				return context;
+			}
+
+			/// <summary>
+			/// Put a context to the free list. Called after the system CSQ routines are done with the context, or before it has been given to them
+			/// </summary>
+			void release(deadline_context *context) noexcept
+			{
+				free_contexts.push(context);
+			}
+
+			/// <summary>
+			/// Start tracking a deadline, called with the queue lock held
+			/// </summary>
+			void start(deadline_context &context, u64 expiry) noexcept
+			{
+				if (wheel.empty())
+					wheel.reset(current_tick());
+				wheel.insert(context.entry, expiry);
+				if (!armed)
+					arm();
+			}
+
+			/// <summary>
+			/// Stop tracking a deadline, called with the queue lock held. Does nothing if the deadline has already expired
+			/// </summary>
+			void stop(deadline_context &context) noexcept
+			{
+				wheel.remove(context.entry);
+			}
+
+			/// <summary>
+			/// Expire the deadlines that have passed and rearm the timer if there are any left, called by the DPC with the queue lock held
+			/// </summary>
+			template<class F>
+			void expire(F &&f) noexcept
+			{
+				wheel.advance(current_tick(), [&](timer_wheel_entry &entry) noexcept
+				{
+					f(*CONTAINING_RECORD(&entry, deadline_context, entry));
+				});
+
+				if (wheel.empty())
+					armed = false;
+				else
+					arm();
+			}
+		};
+
+		template<class T>
+		concept has_insert_head = requires(T &storage, PIRP irp, void *context)
+		{
+			{ storage.on_insert_head_impl(irp, context) } -> std::same_as<NTSTATUS>;
+		};
+
+		/// <summary>
+		/// Cancel-Safe Queue wrapper
+		/// </summary>
+		/// <typeparam name="Derived">Name of the derived class, it may override csq_on_cancel</typeparam>
+		/// <typeparam name="IrpStorage">IRP storage policy</typeparam>
+		/// <typeparam name="Trace">Trace policy, reports cancellations of stored IRPs</typeparam>
+		/// <typeparam name="Lock">Lock protecting the storage: spin_lock, queued_spin_lock (requires queued_spin_lock::initialize) or rw_spin_lock</typeparam>
+		/// <typeparam name="Deadlines">Deadline policy: no_deadlines or deadline_wheel. With deadline_wheel the queue uses the CSQ contexts of IRPs itself</typeparam>
+		template<class Derived, class IrpStorage = irp_list, class Trace = trace::disabled, basic_lockable Lock = spin_lock, class Deadlines = no_deadlines>
 		class cancel_safe_queue : protected IrpStorage
 		{
+			static constexpr const bool HasDeadlines = !std::same_as<Deadlines, no_deadlines>;
+
 			IO_CSQ queue;
-			KSPIN_LOCK lock;
+			Lock lock;
+			// Declared after the lock, so the expiry DPC is flushed before the lock is destroyed
+			[[no_unique_address]] Deadlines deadlines;
+
+			struct insert_parameters
+			{
+				void *context;
+				bool at_head;
+				deadline_context *deadline{};
+				u64 expiry{};
+			};
 			
 			//
 			static cancel_safe_queue &get(IO_CSQ *ptr) noexcept
@@ -112,20 +526,128 @@ namespace drv
 				return get(ptr).derived();
 			}
 
+			NTSTATUS insert_impl(irp_t &&irp, PIO_CSQ_IRP_CONTEXT Context, insert_parameters parameters) noexcept
+			{
+				const auto raw_irp = std::move(irp).detach();
+				const auto status = IoCsqInsertIrpEx(&queue, raw_irp, Context, &parameters);
+				if (!nt_success(status)) [[unlikely]]
+					std::ignore = irp_t{ raw_irp }.complete<Trace>(status);	// the storage refused the IRP, it is still ours
+				return status;
+			}
+
+			/// <summary>
+			/// Get the deadline of a timed IRP
+			/// </summary>
+			[[nodiscard]]
+			static deadline_context *deadline_of(PIRP irp) noexcept
+			{
+				auto context = static_cast<PIO_CSQ_IRP_CONTEXT>(irp->Tail.Overlay.DriverContext[3]);
+				if (!context || context->Type != IO_TYPE_CSQ_IRP_CONTEXT)
+					return nullptr;
+				return CONTAINING_RECORD(context, deadline_context, csq_context);
+			}
+
+			/// <summary>
+			/// Remove an IRP from the storage and stop its deadline, called with the queue lock held
+			/// The deadline is kept with the IRP until recycle_deadline, as the system may still write to its context
+			/// </summary>
+			void remove_stored(PIRP irp) noexcept
+			{
+				this->on_remove_impl(irp);
+				if constexpr (HasDeadlines)
+				{
+					const auto deadline = deadline_of(irp);
+					if (deadline)
+						deadlines.stop(*deadline);
+					irp->Tail.Overlay.ListEntry.Blink = reinterpret_cast<PLIST_ENTRY>(deadline);
+				}
+			}
+
+			/// <summary>
+			/// Return the deadline of a removed IRP to the free list, called once the system CSQ routines have detached the IRP from its context
+			/// </summary>
+			void recycle_deadline([[maybe_unused]] PIRP irp) noexcept
+			{
+				if constexpr (HasDeadlines)
+				{
+					if (auto deadline = reinterpret_cast<deadline_context *>(std::exchange(irp->Tail.Overlay.ListEntry.Blink, nullptr)))
+						deadlines.release(deadline);
+				}
+			}
+
+			/// <summary>
+			/// Complete the IRPs whose deadlines have passed, called by the expiry DPC
+			/// </summary>
+			static void expire_deadlines([[maybe_unused]] PKDPC Dpc, PVOID DeferredContext, [[maybe_unused]] PVOID SystemArgument1, [[maybe_unused]] PVOID SystemArgument2) noexcept
+			{
+				auto &self = *static_cast<cancel_safe_queue *>(DeferredContext);
+
+				// Expired IRPs are chained through their list entries, which the storage no longer uses
+				PIRP expired{};
+				{
+					auto l = self.lock.acquire();
+					self.deadlines.expire([&](deadline_context &deadline) noexcept
+					{
+						// IoSetCancelRoutine returns nullptr if the IRP is being cancelled, the cancel routine will remove it from the queue
+						const auto irp = deadline.irp;
+						if (IoSetCancelRoutine(irp, nullptr))
+						{
+							self.remove_stored(irp);
+							release_csq_context(irp);
+							self.recycle_deadline(irp);
+							irp->Tail.Overlay.ListEntry.Flink = reinterpret_cast<PLIST_ENTRY>(expired);
+							expired = irp;
+						}
+					});
+				}
+
+				while (expired)
+				{
+					const auto irp = std::exchange(expired, reinterpret_cast<PIRP>(expired->Tail.Overlay.ListEntry.Flink));
+					self.derived().csq_on_timeout(irp_t{ irp });
+				}
+			}
+
+			/// <summary>
+			/// Detach a removed IRP from the queue, as IoCsqRemoveNextIrp does
+			/// </summary>
+			static void release_csq_context(PIRP irp) noexcept
+			{
+				auto context = static_cast<PIO_CSQ_IRP_CONTEXT>(irp->Tail.Overlay.DriverContext[3]);
+				if (context && context->Type == IO_TYPE_CSQ_IRP_CONTEXT)
+					context->Irp = nullptr;
+				irp->Tail.Overlay.DriverContext[3] = nullptr;
+			}
+
 		public:
 			using base_queue = cancel_safe_queue;
 
 			cancel_safe_queue() noexcept
 			{
-				KeInitializeSpinLock(&lock);
 				IoCsqInitializeEx(&queue,
 					[](_IO_CSQ *Csq, PIRP Irp, PVOID InsertContext) noexcept -> NTSTATUS	// InsertIrp
 				{
-					return get(Csq).on_insert_impl(Irp, InsertContext);
+					const auto &parameters = *static_cast<const insert_parameters *>(InsertContext);
+					auto &self = get(Csq);
+					NTSTATUS status;
+					if constexpr (has_insert_head<IrpStorage>)
+						status = parameters.at_head ? self.on_insert_head_impl(Irp, parameters.context) : self.on_insert_impl(Irp, parameters.context);
+					else
+						status = self.on_insert_impl(Irp, parameters.context);
+
+					if constexpr (HasDeadlines)
+					{
+						if (parameters.deadline && nt_success(status))
+						{
+							parameters.deadline->irp = Irp;
+							self.deadlines.start(*parameters.deadline, parameters.expiry);
+						}
+					}
+					return status;
 				},
 					[](PIO_CSQ Csq, PIRP Irp) noexcept
 				{
-					return get(Csq).on_remove_impl(Irp);
+					return get(Csq).remove_stored(Irp);
 				},
 				[](PIO_CSQ Csq, PIRP Irp, PVOID PeekContext) noexcept -> PIRP
 				{
@@ -133,17 +655,25 @@ namespace drv
 				},
 				[](PIO_CSQ Csq, PKIRQL Irql) noexcept
 				{
-					KeAcquireSpinLock(&get(Csq).lock, Irql);
+					// The lock keeps the previous IRQL itself
+					get(Csq).lock.lock();
+					*Irql = DISPATCH_LEVEL;
 				},
-				[](PIO_CSQ Csq, KIRQL Irql) noexcept
+				[](PIO_CSQ Csq, [[maybe_unused]] KIRQL Irql) noexcept
 				{
-					KeReleaseSpinLock(&get(Csq).lock, Irql);
+					get(Csq).lock.unlock();
 				},
 				[](PIO_CSQ Csq, PIRP Irp) noexcept
 				{
+					// The system has detached the IRP from its context by now
+					get(Csq).recycle_deadline(Irp);
+					Trace::cancel(Irp);
 					derived(Csq).csq_on_cancel(irp_t{ Irp });
 				}
 				);
+
+				if constexpr (HasDeadlines)
+					deadlines.initialize(&expire_deadlines, this);
 			}
 
 			cancel_safe_queue(const cancel_safe_queue &) = delete;
@@ -152,18 +682,118 @@ namespace drv
 			// overrides
 			void csq_on_cancel(irp_t &&irp) noexcept
 			{
-				std::ignore = std::move(irp).complete(STATUS_CANCELLED);
+				std::ignore = std::move(irp).complete<Trace>(STATUS_CANCELLED);
+			}
+
+			// Called at DISPATCH_LEVEL for a timed IRP whose deadline has passed
+			void csq_on_timeout(irp_t &&irp) noexcept
+			{
+				std::ignore = std::move(irp).complete<Trace>(STATUS_TIMEOUT);
 			}
 
 			// public API
-			void insert(irp_t &&irp, PIO_CSQ_IRP_CONTEXT Context = nullptr, PVOID InsertContext = nullptr) noexcept
+
+			/// <summary>
+			/// Insert the IRP at the tail of the queue
+			/// If the storage policy refuses the IRP, it is completed with the returned status
+			/// </summary>
+			NTSTATUS insert(irp_t &&irp, PIO_CSQ_IRP_CONTEXT Context = nullptr, PVOID InsertContext = nullptr) noexcept
+			{
+				assert((!HasDeadlines || !Context) && "A queue with deadlines uses IRP contexts itself");
+				return insert_impl(std::move(irp), Context, { InsertContext, false });
+			}
+
+			/// <summary>
+			/// Insert the IRP at the tail of the queue and complete it with STATUS_TIMEOUT (see csq_on_timeout) if it is still queued after `timeout_ms` milliseconds
+			/// If the storage policy refuses the IRP or its deadline cannot be allocated, it is completed with the returned status
+			/// </summary>
+			NTSTATUS insert_with_timeout(irp_t &&irp, ULONG timeout_ms, PVOID InsertContext = nullptr) noexcept
+				requires HasDeadlines
+			{
+				const auto deadline = deadlines.allocate();
+				if (!deadline) [[unlikely]]
+				{
+					std::ignore = std::move(irp).complete<Trace>(STATUS_INSUFFICIENT_RESOURCES);
+					return STATUS_INSUFFICIENT_RESOURCES;
+				}
+
+				const auto status = insert_impl(std::move(irp), &deadline->csq_context, { InsertContext, false, deadline, Deadlines::expiry_of(timeout_ms) });
+				if (!nt_success(status)) [[unlikely]]
+					deadlines.release(deadline);
+				return status;
+			}
+
+			/// <summary>
+			/// Insert the IRP at the head of the queue, used to put back a partially processed IRP without breaking FIFO order
+			/// If the storage policy refuses the IRP, it is completed with the returned status
+			/// </summary>
+			NTSTATUS insert_head(irp_t &&irp, PIO_CSQ_IRP_CONTEXT Context = nullptr, PVOID InsertContext = nullptr) noexcept
+				requires has_insert_head<IrpStorage>
 			{
-				IoCsqInsertIrpEx(&queue, std::move(irp).detach(), Context, InsertContext);
+				assert((!HasDeadlines || !Context) && "A queue with deadlines uses IRP contexts itself");
+				return insert_impl(std::move(irp), Context, { InsertContext, true });
 			}
 
 			irp_t remove_next(PVOID PeekContext = nullptr) noexcept
 			{
-				return irp_t{ IoCsqRemoveNextIrp(&queue, PeekContext) };
+				const auto irp = IoCsqRemoveNextIrp(&queue, PeekContext);
+				if (irp)
+					recycle_deadline(irp);
+				return irp_t{ irp };
+			}
+
+			/// <summary>
+			/// Remove up to `irps.size()` IRPs accepted by a predicate while holding the queue lock once
+			/// </summary>
+			/// <param name="irps">Destination for the removed IRPs, all elements must be empty</param>
+			/// <param name="pred">Predicate called for each IRP in queue order with the queue lock held. Returns bool (take or skip) or batch_action</param>
+			/// <param name="PeekContext">Peek context passed to the storage policy (FILE_OBJECT for the standard policies)</param>
+			/// <returns>Number of removed IRPs, they are stored at the beginning of `irps`</returns>
+			template<class Pred>
+				requires std::invocable<Pred &, PIRP>
+			size_t remove_batch(std::span<irp_t> irps, Pred &&pred, PVOID PeekContext = nullptr) noexcept
+			{
+				size_t count{};
+				auto l = lock.acquire();
+
+				for (auto irp = this->on_peek_impl(nullptr, PeekContext); irp && count < irps.size(); )
+				{
+					// the next IRP must be obtained before the current one is unlinked
+					const auto next = this->on_peek_impl(irp, PeekContext);
+
+					batch_action action;
+					if constexpr (std::same_as<std::invoke_result_t<Pred &, PIRP>, bool>)
+						action = pred(irp) ? batch_action::take : batch_action::skip;
+					else
+						action = pred(irp);
+
+					if (action == batch_action::stop)
+						break;
+
+					// IoSetCancelRoutine returns nullptr if the IRP is being cancelled, the cancel routine will remove it from the queue
+					if (action == batch_action::take && IoSetCancelRoutine(irp, nullptr))
+					{
+						remove_stored(irp);
+						release_csq_context(irp);
+						recycle_deadline(irp);
+						irps[count++].attach(irp);
+					}
+
+					irp = next;
+				}
+
+				return count;
+			}
+
+			/// <summary>
+			/// Remove up to `irps.size()` IRPs while holding the queue lock once
+			/// </summary>
+			/// <param name="irps">Destination for the removed IRPs, all elements must be empty</param>
+			/// <param name="PeekContext">Peek context passed to the storage policy (FILE_OBJECT for the standard policies)</param>
+			/// <returns>Number of removed IRPs, they are stored at the beginning of `irps`</returns>
+			size_t remove_batch(std::span<irp_t> irps, PVOID PeekContext = nullptr) noexcept
+			{
+				return remove_batch(irps, []([[maybe_unused]] PIRP irp) noexcept { return true; }, PeekContext);
 			}
 		};
 
@@ -171,8 +801,11 @@ namespace drv
 		/// Default queue implementation (completes IRP with STATUS_CANCELLED on cancel)
 		/// </summary>
 		/// <typeparam name="IrpStorage"></typeparam>
-		template<class IrpStorage = irp_list>
-		class cancel_safe_queue_default : public cancel_safe_queue<cancel_safe_queue_default<IrpStorage>, IrpStorage>
+		/// <typeparam name="Trace">Trace policy</typeparam>
+		/// <typeparam name="Lock">Lock policy</typeparam>
+		/// <typeparam name="Deadlines">Deadline policy (completes expired IRPs with STATUS_TIMEOUT)</typeparam>
+		template<class IrpStorage = irp_list, class Trace = trace::disabled, basic_lockable Lock = spin_lock, class Deadlines = no_deadlines>
+		class cancel_safe_queue_default : public cancel_safe_queue<cancel_safe_queue_default<IrpStorage, Trace, Lock, Deadlines>, IrpStorage, Trace, Lock, Deadlines>
 		{
 		};
 	}
@@ -181,8 +814,17 @@ namespace drv
 	{
 		using details::irp_list;
 		using details::single_irp;
+		using details::per_file_irp_list;
+		using details::priority_irp_list;
+	}
+
+	namespace deadline_policy
+	{
+		using details::no_deadlines;
+		using details::deadline_wheel;
 	}
 
+	using details::batch_action;
 	using details::cancel_safe_queue;
 	using details::cancel_safe_queue_default;
 }
@@ -25,6 +25,7 @@ namespace drv::ctl
         Special = Any,
         Read,
         Write,
+        ReadWrite,
     };
 
     inline constexpr auto code(u16 device_type, u16 function, Method method, Access access) noexcept
@@ -44,3 +44,15 @@
 #elif defined(_M_ARM64)
 #define _ARM64_
 #endif
+
+// Code section placement
+// DRV_PAGED puts a function into the PAGE section, which is pageable. The function, and everything inlined into it,
+// may only run at IRQL < DISPATCH_LEVEL and should begin with PAGED_CODE(), which checks it in checked builds.
+// DRV_INIT puts a function into the INIT section, which the system discards once DriverEntry returns, so it may only
+// be called from DriverEntry. Use it for DriverEntry itself and for initialization that happens once per driver load.
+//
+// Lambdas defined in the function inherit its section, and code inlined into it is emitted there as well, so do not mark
+// functions that define completion routines or DPCs, or that acquire spin locks either directly or in inlined helpers.
+// Inline functions defined in headers may be emitted in any caller's section, so mark only functions of a single translation unit
+#define DRV_PAGED __declspec(code_seg("PAGE"))
+#define DRV_INIT __declspec(code_seg("INIT"))
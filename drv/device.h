@@ -7,7 +7,9 @@
 //-------------------------------------------------------------------------------------------------------
 
 #pragma once
+#include "allocator.h"
 #include "irp.h"
+#include "lifetime.h"
 #include "onexit.h"
 
 namespace drv
@@ -25,9 +27,69 @@ namespace drv
 			virtual NTSTATUS drv_dispatch(PIRP irp) noexcept = 0;
 		};
 
-		template<class T>
+		template<class T, class Trace, class Lifetime>
 		class device_t;
 
+		/// <summary>
+		/// Cold per-device state kept in paged pool
+		/// C++ device objects live in the device extension, which is nonpaged. State that is only used at PASSIVE_LEVEL, such as configuration
+		/// read in drv_final_construct and names used in PnP requests, may be moved out of it, so that every device keeps less memory resident
+		/// The state may only be created, accessed and destroyed at IRQL &lt; DISPATCH_LEVEL. Never use it from completion routines or DPCs
+		/// </summary>
+		template<class T>
+		class paged_state
+		{
+			std::unique_ptr<T> state;
+
+		public:
+			/// <summary>
+			/// Allocate and construct the state
+			/// </summary>
+			/// <param name="...args">Any values to be passed to the constructor</param>
+			/// <returns>STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES</returns>
+			template<class...Args>
+			[[nodiscard]]
+			NTSTATUS create(Args &&...args) noexcept
+			{
+				PAGED_CODE();
+				state.reset(new (pool_options{ .pool = pool_type::Paged, .tag = PagedStateTag }) T{ std::forward<Args>(args)... });
+				return state ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+			}
+
+			void reset() noexcept
+			{
+				PAGED_CODE();
+				state.reset();
+			}
+
+			[[nodiscard]]
+			explicit operator bool() const noexcept
+			{
+				return static_cast<bool>(state);
+			}
+
+			[[nodiscard]]
+			T *get() const noexcept
+			{
+				PAGED_CODE();
+				return state.get();
+			}
+
+			[[nodiscard]]
+			T *operator ->() const noexcept
+			{
+				assert(state);
+				return get();
+			}
+
+			[[nodiscard]]
+			T &operator *() const noexcept
+			{
+				assert(state);
+				return *get();
+			}
+		};
+
 		template<class T>
 		concept has_final_construct = requires(T & derived)
 		{
@@ -35,18 +97,18 @@ namespace drv
 		};
 
 #define LIST_OF_REQUESTS \
-	X(create) \
-	X(close) \
-	X(cleanup) \
-	X(read) \
-	X(write) \
-	X(device_control) \
-	X(internal_device_control) \
-	X(pnp) \
-	X(power) \
+	X(create, IRP_MJ_CREATE) \
+	X(close, IRP_MJ_CLOSE) \
+	X(cleanup, IRP_MJ_CLEANUP) \
+	X(read, IRP_MJ_READ) \
+	X(write, IRP_MJ_WRITE) \
+	X(device_control, IRP_MJ_DEVICE_CONTROL) \
+	X(internal_device_control, IRP_MJ_INTERNAL_DEVICE_CONTROL) \
+	X(pnp, IRP_MJ_PNP) \
+	X(power, IRP_MJ_POWER) \
 // end of macro
 
-#define X(v) \
+#define X(v, major) \
 		template<class T> \
 		concept has_dispatch_##v = requires(T &derived, irp_t &&irp) \
 		{ \
@@ -56,24 +118,74 @@ namespace drv
 		LIST_OF_REQUESTS
 #undef X
 
+		// Fast I/O routines. They are called by the I/O manager before it builds an IRP and return false to fall back to the IRP path
+		// FastIoRead and FastIoWrite are only called for file objects with a cache map, that is, by file systems
+		// FastIoDeviceControl is called for any device object, the buffers are raw caller addresses that have not been probed
+		template<class T>
+		concept has_fast_io_read = requires(T &derived, PFILE_OBJECT file_object, void *buffer, ULONG length, IO_STATUS_BLOCK &io_status)
+		{
+			{ derived.drv_fast_io_read(file_object, buffer, length, io_status) } -> std::same_as<bool>;
+		};
+
+		template<class T>
+		concept has_fast_io_write = requires(T &derived, PFILE_OBJECT file_object, const void *buffer, ULONG length, IO_STATUS_BLOCK &io_status)
+		{
+			{ derived.drv_fast_io_write(file_object, buffer, length, io_status) } -> std::same_as<bool>;
+		};
+
+		template<class T>
+		concept has_fast_io_device_control = requires(T &derived, PFILE_OBJECT file_object, ULONG code, void *input, ULONG input_length, void *output, ULONG output_length, IO_STATUS_BLOCK &io_status)
+		{
+			{ derived.drv_fast_io_device_control(file_object, code, input, input_length, output, output_length, io_status) } -> std::same_as<bool>;
+		};
+
+		template<class T>
+		concept has_fast_io = has_fast_io_read<T> || has_fast_io_write<T> || has_fast_io_device_control<T>;
+
 		/// <summary>
 		/// Base class for a function device object
+		/// The object is constructed in the nonpaged device extension, keep state used only at PASSIVE_LEVEL in paged_state members
 		/// </summary>
 		/// <typeparam name="Derived">Name of the derived class</typeparam>
-		template<class Derived>
+		/// <typeparam name="Trace">Trace policy, trace::disabled (default) or trace::tracelogging</typeparam>
+		/// <typeparam name="Lifetime">Lifetime policy that keeps the device from being deleted while requests are in progress,
+		/// lifetime::remove_lock (default) or lifetime::cache_aware_rundown</typeparam>
+		template<class Derived, class Trace = trace::disabled, class Lifetime = lifetime::remove_lock>
 		class device_t : public IDevice
 		{
 			PDEVICE_OBJECT ThisDO{};
 		protected:
 			using device_base = device_t;
+			using trace_policy = Trace;
+			using lifetime_policy = Lifetime;
 
-			IO_REMOVE_LOCK RemoveLock;
+			Lifetime RemoveLock;
 			std::atomic<bool> delete_pending{};
 
 			device_t(PDEVICE_OBJECT thisdo) noexcept :
 				ThisDO{ thisdo }
 			{
-				IoInitializeRemoveLock(&RemoveLock, 0, 0, 0);
+			}
+
+			/// <summary>
+			/// Complete IRP, reporting the completion to the trace policy
+			/// </summary>
+			/// <param name="irp">An r-value reference to the IRP</param>
+			/// <param name="status">Completion status</param>
+			/// <param name="information">Completion information</param>
+			/// <returns>The same as passed status</returns>
+			[[nodiscard]]
+			NTSTATUS complete_irp(irp_t &&irp, NTSTATUS status, ULONG_PTR information = 0, CCHAR priority_boost = IO_NO_INCREMENT) noexcept
+			{
+				return std::move(irp).complete<Trace>(status, information, priority_boost);
+			}
+
+			/// <summary>
+			/// Mark IRP pending, reporting it to the trace policy
+			/// </summary>
+			void mark_irp_pending(irp_t &irp) noexcept
+			{
+				irp.mark_pending<Trace>();
 			}
 
 			/// <summary>
@@ -87,7 +199,7 @@ namespace drv
 			NTSTATUS complete_irp_and_release_remove_lock(irp_t &&irp, NTSTATUS status, ULONG_PTR information = 0, CCHAR priority_boost = IO_NO_INCREMENT) noexcept
 			{
 				const auto i = irp.tag();
-				auto result = std::move(irp).complete(status, information, priority_boost);
+				auto result = std::move(irp).complete<Trace>(status, information, priority_boost);
 				this->release_remove_lock(i);
 				return result;
 			}
@@ -98,7 +210,7 @@ namespace drv
 			/// </summary>
 			NTSTATUS drv_dispatch_default(irp_t &&irp) noexcept
 			{
-				return std::move(irp).complete(STATUS_NOT_SUPPORTED);
+				return std::move(irp).complete<Trace>(STATUS_NOT_SUPPORTED);
 			}
 
 			/// <summary>
@@ -115,7 +227,7 @@ namespace drv
 					break;
 				}
 
-				return std::move(irp).complete(STATUS_SUCCESS);
+				return std::move(irp).complete<Trace>(STATUS_SUCCESS);
 			}
 
 			/// <summary>
@@ -129,12 +241,12 @@ namespace drv
 
 				NTSTATUS status = this->acquire_remove_lock(tag);
 				if (STATUS_SUCCESS != status)
-					return std::move(irp).complete(status);
+					return std::move(irp).complete<Trace>(status);
 
 				if (auto stack = irp.current_stack_location(); stack->MinorFunction == IRP_MN_REMOVE_DEVICE)
 				{
 					delete_device(tag);
-					return std::move(irp).complete(STATUS_SUCCESS);
+					return std::move(irp).complete<Trace>(STATUS_SUCCESS);
 				}
 				else
 					return complete_irp_and_release_remove_lock(std::move(irp), STATUS_SUCCESS);
@@ -147,7 +259,7 @@ namespace drv
 			[[nodiscard]]
 			void delete_device(void *tag) noexcept
 			{
-				IoReleaseRemoveLockAndWait(&this->RemoveLock, tag);
+				this->RemoveLock.release_and_wait(tag);
 				auto obj = this->ThisDO;
 				std::destroy_at(static_cast<Derived *>(this));
 				IoDeleteDevice(obj);
@@ -172,58 +284,124 @@ namespace drv
 
 			virtual NTSTATUS drv_dispatch(PIRP Irp) noexcept override
 			{
-				irp_t irp{ Irp };
+				// The IRP must not be accessed after the dispatch routine returns, the trace policy captures everything it needs beforehand
+				const auto context = Trace::dispatch_begin(Irp);
+				const auto status = dispatch_request(irp_t{ Irp });
+				Trace::dispatch_end(context, status);
+				return status;
+			}
+
+			NTSTATUS dispatch_request(irp_t &&irp) noexcept
+			{
 				switch (irp.current_stack_location()->MajorFunction)
 				{
-				case IRP_MJ_READ:
-					if constexpr (has_dispatch_read<Derived>)
-						return derived().drv_dispatch_read(std::move(irp));
-					else
-						break;
-				case IRP_MJ_WRITE:
-					if constexpr (has_dispatch_write<Derived>)
-						return derived().drv_dispatch_write(std::move(irp));
-					else
-						break;
-				case IRP_MJ_DEVICE_CONTROL:
-					if constexpr (has_dispatch_device_control<Derived>)
-						return derived().drv_dispatch_device_control(std::move(irp));
-					else
-						break;
-				case IRP_MJ_INTERNAL_DEVICE_CONTROL:
-					if constexpr (has_dispatch_internal_device_control<Derived>)
-						return derived().drv_dispatch_internal_device_control(std::move(irp));
-					else
-						break;
-				case IRP_MJ_PNP:
-					if constexpr (has_dispatch_pnp<Derived>)
-						return derived().drv_dispatch_pnp(std::move(irp));
-					else
-						break;
-				case IRP_MJ_CREATE:
-					if constexpr (has_dispatch_create<Derived>)
-						return derived().drv_dispatch_create(std::move(irp));
-					else
-						break;
-				case IRP_MJ_CLOSE:
-					if constexpr (has_dispatch_close<Derived>)
-						return derived().drv_dispatch_close(std::move(irp));
-					else
-						break;
-				case IRP_MJ_CLEANUP:
-					if constexpr (has_dispatch_cleanup<Derived>)
-						return derived().drv_dispatch_cleanup(std::move(irp));
-					else
-						break;
-				case IRP_MJ_POWER:
-					if constexpr (has_dispatch_power<Derived>)
-						return derived().drv_dispatch_power(std::move(irp));
-					else
-						break;
+#define X(v, major) \
+				case major: \
+					return dispatch_major<major>(std::move(irp)); \
+// end of macro
+					LIST_OF_REQUESTS
+#undef X
 				}
 				return derived().drv_dispatch_default(std::move(irp));
 			}
 
+			/// <summary>
+			/// Call the dispatch routine for a given major function, resolved at compile time
+			/// </summary>
+			template<UCHAR Major>
+			NTSTATUS dispatch_major(irp_t &&irp) noexcept
+			{
+#define X(v, major) \
+				if constexpr (Major == major && has_dispatch_##v<Derived>) \
+					return derived().drv_dispatch_##v(std::move(irp)); \
+				else \
+// end of macro
+					LIST_OF_REQUESTS
+#undef X
+					return derived().drv_dispatch_default(std::move(irp));
+			}
+
+			/// <summary>
+			/// Driver dispatch routine for a given major function, used by init_dispatch_routines&lt;Derived&gt;
+			/// It calls the handler directly, without going through IDevice and the switch on the major function
+			/// </summary>
+			template<UCHAR Major>
+			static NTSTATUS dispatch_thunk(PDEVICE_OBJECT DeviceObject, PIRP Irp) noexcept
+			{
+				const auto context = Trace::dispatch_begin(Irp);
+				const auto status = static_cast<device_t *>(from_device_object(DeviceObject))->dispatch_major<Major>(irp_t{ Irp });
+				Trace::dispatch_end(context, status);
+				return status;
+			}
+
+			/// <summary>
+			/// Driver dispatch routine for major functions the class does not handle
+			/// </summary>
+			static NTSTATUS default_dispatch_thunk(PDEVICE_OBJECT DeviceObject, PIRP Irp) noexcept
+			{
+				const auto context = Trace::dispatch_begin(Irp);
+				const auto status = static_cast<device_t *>(from_device_object(DeviceObject))->derived().drv_dispatch_default(irp_t{ Irp });
+				Trace::dispatch_end(context, status);
+				return status;
+			}
+
+			/// <summary>
+			/// Call a Fast I/O routine of Derived while holding the remove lock
+			/// </summary>
+			template<class F>
+			static BOOLEAN fast_io_call(PDEVICE_OBJECT DeviceObject, PFILE_OBJECT FileObject, F &&routine) noexcept
+			{
+				auto &self = *from_device_object(DeviceObject);
+				if (!nt_success(self.acquire_remove_lock(FileObject))) [[unlikely]]
+					return FALSE;
+
+				const bool handled = routine(self);
+				self.release_remove_lock(FileObject);
+				return handled;
+			}
+
+			static BOOLEAN fast_io_read_thunk(PFILE_OBJECT FileObject, [[maybe_unused]] PLARGE_INTEGER FileOffset, ULONG Length, [[maybe_unused]] BOOLEAN Wait,
+				[[maybe_unused]] ULONG LockKey, PVOID Buffer, PIO_STATUS_BLOCK IoStatus, PDEVICE_OBJECT DeviceObject) noexcept
+			{
+				return fast_io_call(DeviceObject, FileObject, [&](Derived &self) noexcept
+				{
+					return self.drv_fast_io_read(FileObject, Buffer, Length, *IoStatus);
+				});
+			}
+
+			static BOOLEAN fast_io_write_thunk(PFILE_OBJECT FileObject, [[maybe_unused]] PLARGE_INTEGER FileOffset, ULONG Length, [[maybe_unused]] BOOLEAN Wait,
+				[[maybe_unused]] ULONG LockKey, PVOID Buffer, PIO_STATUS_BLOCK IoStatus, PDEVICE_OBJECT DeviceObject) noexcept
+			{
+				return fast_io_call(DeviceObject, FileObject, [&](Derived &self) noexcept
+				{
+					return self.drv_fast_io_write(FileObject, Buffer, Length, *IoStatus);
+				});
+			}
+
+			static BOOLEAN fast_io_device_control_thunk(PFILE_OBJECT FileObject, [[maybe_unused]] BOOLEAN Wait, PVOID InputBuffer, ULONG InputBufferLength,
+				PVOID OutputBuffer, ULONG OutputBufferLength, ULONG IoControlCode, PIO_STATUS_BLOCK IoStatus, PDEVICE_OBJECT DeviceObject) noexcept
+			{
+				return fast_io_call(DeviceObject, FileObject, [&](Derived &self) noexcept
+				{
+					return self.drv_fast_io_device_control(FileObject, IoControlCode, InputBuffer, InputBufferLength, OutputBuffer, OutputBufferLength, *IoStatus);
+				});
+			}
+
+			static constexpr FAST_IO_DISPATCH make_fast_io_dispatch() noexcept
+			{
+				FAST_IO_DISPATCH table{};
+				table.SizeOfFastIoDispatch = sizeof(table);
+				if constexpr (has_fast_io_read<Derived>)
+					table.FastIoRead = &fast_io_read_thunk;
+				if constexpr (has_fast_io_write<Derived>)
+					table.FastIoWrite = &fast_io_write_thunk;
+				if constexpr (has_fast_io_device_control<Derived>)
+					table.FastIoDeviceControl = &fast_io_device_control_thunk;
+				return table;
+			}
+
+			static inline constinit FAST_IO_DISPATCH fast_io_dispatch = make_fast_io_dispatch();
+
 		public:
 			[[nodiscard]]
 			auto this_do() const noexcept
@@ -243,23 +421,43 @@ namespace drv
 			}
 
 			/// <summary>
-			/// Acquire the remove lock
+			/// Acquire the remove lock through the lifetime policy
 			/// </summary>
 			/// <param name="tag">A custom tag (usually PIRP)</param>
 			/// <returns>STATUS_SUCCESS or an error value if device object has been marked for deletion</returns>
 			[[nodiscard]]
 			NTSTATUS acquire_remove_lock(void *tag) noexcept
 			{
-				return IoAcquireRemoveLock(&RemoveLock, tag);
+				return RemoveLock.acquire(tag);
 			}
 
 			/// <summary>
-			/// Release the remove lock
+			/// Release the remove lock through the lifetime policy
 			/// </summary>
 			/// <param name="tag">A custom tag that should match the one passed in acquire_remove_lock</param>
 			void release_remove_lock(void *tag) noexcept
 			{
-				IoReleaseRemoveLock(&RemoveLock, tag);
+				RemoveLock.release(tag);
+			}
+
+			/// <summary>
+			/// Fill the driver's dispatch table with direct calls to the handlers of Derived
+			/// Major functions Derived handles get their own dispatch routine, all other ones call drv_dispatch_default
+			/// If Derived implements any Fast I/O routines (drv_fast_io_XXX), the driver's Fast I/O dispatch table is set as well
+			/// </summary>
+			static void init_dispatch_table(PDRIVER_OBJECT DriverObject) noexcept
+			{
+				PAGED_CODE();
+				sr::fill(DriverObject->MajorFunction, &default_dispatch_thunk);
+#define X(v, major) \
+				if constexpr (has_dispatch_##v<Derived>) \
+					DriverObject->MajorFunction[major] = &dispatch_thunk<major>; \
+// end of macro
+				LIST_OF_REQUESTS
+#undef X
+
+				if constexpr (has_fast_io<Derived>)
+					DriverObject->FastIoDispatch = &fast_io_dispatch;
 			}
 
 			/// <summary>
@@ -274,6 +472,7 @@ namespace drv
 
 			/// <summary>
 			/// Initialize a C++ device object in the kernel device object's extension
+			/// The caller must call initialize_lifetime before the device receives requests, create_and_attach_device_object does it
 			/// </summary>
 			/// <param name="pdo">Kernel device object</param>
 			/// <param name="...args">Any values to be passed to the constructor</param>
@@ -281,9 +480,19 @@ namespace drv
 			template<class...Args>
 			static Derived *create_device_object(PDEVICE_OBJECT pdo, Args &&...args) noexcept
 			{
+				static_assert(alignof(Derived) <= MEMORY_ALLOCATION_ALIGNMENT, "The device extension does not honor the alignment of Derived");
 				return std::construct_at(from_device_object(pdo), std::forward<Args>(args)...);
 			}
 
+			/// <summary>
+			/// Initialize the lifetime policy of a constructed device object
+			/// </summary>
+			[[nodiscard]]
+			NTSTATUS initialize_lifetime() noexcept
+			{
+				return RemoveLock.initialize();
+			}
+
 			/// <summary>
 			/// Create device object, attaches it to device stack and construct a C++ device object
 			/// </summary>
@@ -313,21 +522,23 @@ namespace drv
 					IoDetachDevice(nextdo);
 				};
 				
-				[[maybe_unused]] auto *p = create_device_object(fido, pdo, fido, nextdo, std::forward<Args>(args)...);
-				
-				if constexpr (has_final_construct<Derived>)
+				auto *p = create_device_object(fido, pdo, fido, nextdo, std::forward<Args>(args)...);
+
+				SCOPE_EXIT_CANCELLABLE(c3)
 				{
-					SCOPE_EXIT_CANCELLABLE(c3)
-					{
-						std::destroy_at(p);
-					};
+					std::destroy_at(p);
+				};
+
+				if (auto status = p->initialize_lifetime(); nt_error(status))
+					return status;
 
+				if constexpr (has_final_construct<Derived>)
+				{
 					if (auto status = p->drv_final_construct(); nt_error(status))
 						return status;
-
-					c3.cancel();
 				}
 
+				c3.cancel();
 				c2.cancel();
 				c1.cancel();
 
@@ -352,8 +563,8 @@ namespace drv
 		/// Integration with boost::intrusive_ptr
 		/// Allows usage of boost::intrusive_ptr<DeviceObject> for managing reference-counting links to C++ device objects
 		/// </summary>
-		template<class Derived>
-		inline void intrusive_ptr_add_ref(device_t<Derived> *p) noexcept
+		template<class Derived, class Trace, class Lifetime>
+		inline void intrusive_ptr_add_ref(device_t<Derived, Trace, Lifetime> *p) noexcept
 		{
 			if (!nt_success(p->acquire_remove_lock(p)))
 				p->set_deleted();
@@ -363,8 +574,8 @@ namespace drv
 		/// Integration with boost::intrusive_ptr
 		/// Allows usage of boost::intrusive_ptr<DeviceObject> for managing reference-counting links to C++ device objects
 		/// </summary>
-		template<class Derived>
-		inline void intrusive_ptr_release(device_t<Derived> *p) noexcept
+		template<class Derived, class Trace, class Lifetime>
+		inline void intrusive_ptr_release(device_t<Derived, Trace, Lifetime> *p) noexcept
 		{
 			p->release_remove_lock(p);
 		}
@@ -373,15 +584,17 @@ namespace drv
 		/// Base class for a filter device object
 		/// </summary>
 		/// <typeparam name="Derived">A name of the derived class</typeparam>
-		template<class Derived>
-		class basic_filter_device_t : public device_t<Derived>
+		/// <typeparam name="Trace">Trace policy, trace::disabled (default) or trace::tracelogging</typeparam>
+		/// <typeparam name="Lifetime">Lifetime policy, lifetime::remove_lock (default) or lifetime::cache_aware_rundown</typeparam>
+		template<class Derived, class Trace = trace::disabled, class Lifetime = lifetime::remove_lock>
+		class basic_filter_device_t : public device_t<Derived, Trace, Lifetime>
 		{
 			PDEVICE_OBJECT PDO{}, NextDO{};
 		protected:
 			using filter_base = basic_filter_device_t;
 
 			basic_filter_device_t(PDEVICE_OBJECT pdo, PDEVICE_OBJECT fido, PDEVICE_OBJECT nextdo) noexcept :
-				device_t<Derived>{ fido },
+				device_t<Derived, Trace, Lifetime>{ fido },
 				PDO{ pdo },
 				NextDO{ nextdo }
 			{
@@ -394,7 +607,7 @@ namespace drv
 			[[nodiscard]]
 			void delete_device(void *tag) noexcept
 			{
-				IoReleaseRemoveLockAndWait(&this->RemoveLock, tag);
+				this->RemoveLock.release_and_wait(tag);
 				IoDetachDevice(NextDO);
 				auto obj = this->this_do();
 				std::destroy_at(static_cast<Derived *>(this));
@@ -425,7 +638,7 @@ namespace drv
 				if (STATUS_SUCCESS != status)
 				{
 					irp.start_next_power_irp();
-					return std::move(irp).complete(status);
+					return std::move(irp).complete<Trace>(status);
 				}
 
 				irp.start_next_power_irp();
@@ -445,7 +658,7 @@ namespace drv
 
 				NTSTATUS status = this->acquire_remove_lock(tag);
 				if (STATUS_SUCCESS != status)
-					return std::move(irp).complete(status);
+					return std::move(irp).complete<Trace>(status);
 
 				irp.skip_stack_location();
 				status = std::move(irp).call_driver(this->NextDO);
@@ -454,6 +667,10 @@ namespace drv
 			}
 		};
 
+		/// <summary>
+		/// Set dispatch routines that forward requests to the device object through the IDevice interface
+		/// Use it if the driver creates device objects of different classes
+		/// </summary>
 		inline void init_dispatch_routines(PDRIVER_OBJECT DriverObject) noexcept
 		{
 			PAGED_CODE();
@@ -463,9 +680,20 @@ namespace drv
 				return static_cast<IDevice *>(DeviceObject->DeviceExtension)->drv_dispatch(Irp);
 			});
 		}
+
+		/// <summary>
+		/// Set dispatch routines that call the handlers of Derived directly, without a virtual call and a switch per request
+		/// All device objects created by the driver must be of class Derived
+		/// </summary>
+		template<class Derived>
+		inline void init_dispatch_routines(PDRIVER_OBJECT DriverObject) noexcept
+		{
+			Derived::init_dispatch_table(DriverObject);
+		}
 	}
 
 	using details::device_t;
+	using details::paged_state;
 	using details::basic_filter_device_t;
 	using details::irp_t;
 	using details::init_dispatch_routines;
@@ -479,6 +707,6 @@ namespace drv
 #define DISPATCH_PROLOG(Irp) \
 { \
 	if (auto status = this->acquire_remove_lock((Irp).tag()); !nt_success(status)) [[unlikely]] \
-		return std::move(Irp).complete(status); \
+		return this->complete_irp(std::move(Irp), status); \
 } \
 // end of macro
@@ -0,0 +1,708 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <functional>
+#include <memory>
+#include <utility>
+#include "allocator.h"
+
+#if defined(_M_AMD64)
+#include <emmintrin.h>
+#elif defined(_M_ARM64)
+#include <arm64_neon.h>
+#endif
+
+namespace drv
+{
+	namespace details
+	{
+		namespace hash_table
+		{
+			// Control byte values. A full slot stores 7 bits of its hash (H2), so the high bit is only set for empty and deleted slots
+			constexpr const int8_t Empty = -128;	// 0x80
+			constexpr const int8_t Deleted = -2;	// 0xFE
+
+			constexpr const size_t GroupWidth = 16;
+
+			/// <summary>
+			/// Set of matching positions in a group, one bit (or one bit per nibble on ARM64) for each control byte
+			/// </summary>
+			template<class T, int Shift>
+			class bitmask
+			{
+				T mask;
+
+			public:
+				explicit constexpr bitmask(T mask) noexcept :
+					mask{ mask }
+				{
+				}
+
+				[[nodiscard]]
+				explicit constexpr operator bool() const noexcept
+				{
+					return mask != 0;
+				}
+
+				/// <summary>
+				/// Get the index of the first matching position
+				/// </summary>
+				[[nodiscard]]
+				constexpr size_t lowest() const noexcept
+				{
+					return static_cast<size_t>(std::countr_zero(mask)) >> Shift;
+				}
+
+				constexpr void clear_lowest() noexcept
+				{
+					mask &= mask - 1;
+				}
+			};
+
+#if defined(_M_AMD64)
+			/// <summary>
+			/// 16 control bytes probed at once with SSE2
+			/// </summary>
+			class group
+			{
+				__m128i ctrl;
+
+			public:
+				using mask_type = bitmask<uint32_t, 0>;
+
+				explicit group(const int8_t *pos) noexcept :
+					ctrl{ _mm_load_si128(reinterpret_cast<const __m128i *>(pos)) }
+				{
+				}
+
+				[[nodiscard]]
+				mask_type match(int8_t h2) const noexcept
+				{
+					return mask_type{ static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl))) };
+				}
+
+				[[nodiscard]]
+				mask_type match_empty() const noexcept
+				{
+					return match(Empty);
+				}
+
+				[[nodiscard]]
+				mask_type match_empty_or_deleted() const noexcept
+				{
+					// Only empty and deleted slots have the high bit set
+					return mask_type{ static_cast<uint32_t>(_mm_movemask_epi8(ctrl)) };
+				}
+			};
+#elif defined(_M_ARM64)
+			/// <summary>
+			/// 16 control bytes probed at once with NEON
+			/// NEON has no movemask, the comparison result is narrowed to 4 bits per byte instead
+			/// </summary>
+			class group
+			{
+				uint8x16_t ctrl;
+
+				[[nodiscard]]
+				static uint64_t to_mask(uint8x16_t cmp) noexcept
+				{
+					return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4)), 0) & 0x8888'8888'8888'8888ull;
+				}
+
+			public:
+				using mask_type = bitmask<uint64_t, 2>;
+
+				explicit group(const int8_t *pos) noexcept :
+					ctrl{ vld1q_u8(reinterpret_cast<const uint8_t *>(pos)) }
+				{
+				}
+
+				[[nodiscard]]
+				mask_type match(int8_t h2) const noexcept
+				{
+					return mask_type{ to_mask(vceqq_u8(ctrl, vdupq_n_u8(static_cast<uint8_t>(h2)))) };
+				}
+
+				[[nodiscard]]
+				mask_type match_empty() const noexcept
+				{
+					return match(Empty);
+				}
+
+				[[nodiscard]]
+				mask_type match_empty_or_deleted() const noexcept
+				{
+					return mask_type{ to_mask(vcltq_s8(vreinterpretq_s8_u8(ctrl), vdupq_n_s8(0))) };
+				}
+			};
+#else
+			/// <summary>
+			/// Portable group implementation
+			/// </summary>
+			class group
+			{
+				const int8_t *ctrl;
+
+				template<class Pred>
+				[[nodiscard]]
+				uint32_t collect(Pred pred) const noexcept
+				{
+					uint32_t mask{};
+					for (size_t i = 0; i < GroupWidth; ++i)
+						if (pred(ctrl[i]))
+							mask |= 1u << i;
+					return mask;
+				}
+
+			public:
+				using mask_type = bitmask<uint32_t, 0>;
+
+				explicit group(const int8_t *pos) noexcept :
+					ctrl{ pos }
+				{
+				}
+
+				[[nodiscard]]
+				mask_type match(int8_t h2) const noexcept
+				{
+					return mask_type{ collect([=](int8_t c) noexcept { return c == h2; }) };
+				}
+
+				[[nodiscard]]
+				mask_type match_empty() const noexcept
+				{
+					return match(Empty);
+				}
+
+				[[nodiscard]]
+				mask_type match_empty_or_deleted() const noexcept
+				{
+					return mask_type{ collect([](int8_t c) noexcept { return c < 0; }) };
+				}
+			};
+#endif
+
+			/// <summary>
+			/// Spread the hash value over all bits. std::hash of pointers and GUIDs does not mix its input, while the table uses the top bits for H2
+			/// </summary>
+			[[nodiscard]]
+			constexpr uint64_t mix(size_t hash) noexcept
+			{
+				return static_cast<uint64_t>(hash) * 0x9e37'79b9'7f4a'7c15ull;
+			}
+
+			[[nodiscard]]
+			constexpr size_t h1(uint64_t hash) noexcept
+			{
+				return static_cast<size_t>(hash >> 7);
+			}
+
+			[[nodiscard]]
+			constexpr int8_t h2(uint64_t hash) noexcept
+			{
+				return static_cast<int8_t>(hash >> 57);
+			}
+
+			/// <summary>
+			/// Number of elements a table of `capacity` slots may hold, the maximum load factor is 7/8
+			/// </summary>
+			[[nodiscard]]
+			constexpr size_t max_load(size_t capacity) noexcept
+			{
+				return capacity - capacity / 8;
+			}
+
+			/// <summary>
+			/// Smallest capacity able to hold `count` elements
+			/// </summary>
+			[[nodiscard]]
+			constexpr size_t capacity_for(size_t count) noexcept
+			{
+				return std::bit_ceil(std::max(GroupWidth, count + count / 7 + 1));
+			}
+		}
+
+		/// <summary>
+		/// Open addressing hash map in the style of SwissTable
+		/// Control bytes are kept separately from the slots (SoA), a lookup compares 16 control bytes at once with SSE2 or NEON
+		/// and touches the slots only for the candidates whose 7-bit hash fragment matches
+		/// Capacity is a power of two, groups of 16 slots are probed in triangular sequence
+		/// Insertion is fallible and returns an error instead of throwing
+		/// </summary>
+		/// <typeparam name="K">Key type</typeparam>
+		/// <typeparam name="V">Value type</typeparam>
+		/// <typeparam name="Hash">Hash function</typeparam>
+		/// <typeparam name="KeyEqual">Key comparison function</typeparam>
+		/// <typeparam name="Pool">Pool the table is allocated from</typeparam>
+		/// <typeparam name="Growable">If true, insertion grows the table. Otherwise, the table is allocated once with initialize and never allocates later</typeparam>
+		template<class K, class V, class Hash, class KeyEqual, pool_type Pool, bool Growable>
+		class basic_flat_hash_map
+		{
+			static_assert(std::is_nothrow_move_constructible_v<K> && std::is_nothrow_move_constructible_v<V>, "Keys and values must be nothrow move constructible");
+
+			struct slot
+			{
+				K key;
+				V value;
+
+				template<class KK, class...Args>
+				slot(KK &&key, Args &&...args) noexcept :
+					key{ std::forward<KK>(key) },
+					value(std::forward<Args>(args)...)
+				{
+				}
+			};
+
+			static_assert(alignof(slot) <= MEMORY_ALLOCATION_ALIGNMENT, "Pool allocations do not support the alignment of the slot");
+
+			int8_t *ctrl{};
+			slot *slots{};
+			size_t capacity_{};
+			size_t count{};
+			size_t growth_left{};
+
+			[[no_unique_address]] Hash hasher;
+			[[no_unique_address]] KeyEqual key_equal;
+
+			[[nodiscard]]
+			size_t group_mask() const noexcept
+			{
+				return capacity_ / hash_table::GroupWidth - 1;
+			}
+
+			[[nodiscard]]
+			uint64_t hash_of(const K &key) const noexcept
+			{
+				return hash_table::mix(hasher(key));
+			}
+
+			/// <summary>
+			/// Call `f(slot_index)` for every candidate slot of a key, stop when `f` returns true or the probe sequence reaches an empty slot
+			/// </summary>
+			template<class F>
+			[[nodiscard]]
+			slot *probe(uint64_t hash, F &&f) const noexcept
+			{
+				const auto mask = group_mask();
+				const auto h2 = hash_table::h2(hash);
+				auto g = hash_table::h1(hash) & mask;
+				for (size_t step = 1; ; ++step)
+				{
+					const auto base = g * hash_table::GroupWidth;
+					const hash_table::group grp{ ctrl + base };
+					for (auto m = grp.match(h2); m; m.clear_lowest())
+					{
+						auto *s = slots + base + m.lowest();
+						if (f(*s))
+							return s;
+					}
+					if (grp.match_empty())
+						return nullptr;
+					// Triangular probing visits every group exactly once when the number of groups is a power of two
+					g = (g + step) & mask;
+					if (step > mask)
+						return nullptr;
+				}
+			}
+
+			/// <summary>
+			/// Find the first empty or deleted slot in the probe sequence of a hash
+			/// </summary>
+			[[nodiscard]]
+			size_t find_first_non_full(uint64_t hash) const noexcept
+			{
+				const auto mask = group_mask();
+				auto g = hash_table::h1(hash) & mask;
+				for (size_t step = 1; ; ++step)
+				{
+					const auto base = g * hash_table::GroupWidth;
+					if (auto m = hash_table::group{ ctrl + base }.match_empty_or_deleted())
+						return base + m.lowest();
+					g = (g + step) & mask;
+				}
+			}
+
+			[[nodiscard]]
+			static size_t allocation_size(size_t capacity) noexcept
+			{
+				return capacity * (sizeof(int8_t) + sizeof(slot));
+			}
+
+			[[nodiscard]]
+			NTSTATUS allocate(size_t capacity) noexcept
+			{
+				if (capacity > SIZE_MAX / (sizeof(int8_t) + sizeof(slot))) [[unlikely]]
+					return STATUS_INTEGER_OVERFLOW;
+
+				// Slots follow control bytes. Capacity is a multiple of 16, so slots stay aligned
+				auto *p = static_cast<std::byte *>(::operator new(allocation_size(capacity), pool_options{ .pool = Pool, .tag = HashMapTag, .uninitialized = true }));
+				if (!p) [[unlikely]]
+					return STATUS_INSUFFICIENT_RESOURCES;
+
+				ctrl = reinterpret_cast<int8_t *>(p);
+				slots = reinterpret_cast<slot *>(p + capacity);
+				capacity_ = capacity;
+				count = 0;
+				growth_left = hash_table::max_load(capacity);
+				std::memset(ctrl, static_cast<uint8_t>(hash_table::Empty), capacity);
+				return STATUS_SUCCESS;
+			}
+
+			void destroy_slots() noexcept
+			{
+				if constexpr (!std::is_trivially_destructible_v<slot>)
+				{
+					for (size_t i = 0; i < capacity_ && count; ++i)
+						if (ctrl[i] >= 0)
+						{
+							std::destroy_at(slots + i);
+							--count;
+						}
+				}
+				count = 0;
+			}
+
+			void release() noexcept
+			{
+				destroy_slots();
+				if (ctrl)
+					::operator delete(ctrl);
+				ctrl = nullptr;
+				slots = nullptr;
+				capacity_ = 0;
+				growth_left = 0;
+			}
+
+			/// <summary>
+			/// Move all elements into a new table of `new_capacity` slots
+			/// </summary>
+			[[nodiscard]]
+			NTSTATUS resize(size_t new_capacity) noexcept
+			{
+				auto old_ctrl = ctrl;
+				auto old_slots = slots;
+				auto old_capacity = capacity_;
+				auto old_count = count;
+
+				// allocate does not change the object if it fails
+				if (auto status = allocate(new_capacity); !nt_success(status))
+					return status;
+
+				for (size_t i = 0; i < old_capacity; ++i)
+					if (old_ctrl[i] >= 0)
+					{
+						const auto hash = hash_of(old_slots[i].key);
+						const auto target = find_first_non_full(hash);
+						ctrl[target] = hash_table::h2(hash);
+						std::construct_at(slots + target, std::move(old_slots[i]));
+						std::destroy_at(old_slots + i);
+					}
+
+				count = old_count;
+				growth_left -= count;
+				if (old_ctrl)
+					::operator delete(old_ctrl);
+				return STATUS_SUCCESS;
+			}
+
+			/// <summary>
+			/// Remove deleted markers without allocating, by placing every element at its best position again
+			/// </summary>
+			void drop_deleted() noexcept
+			{
+				// Mark every full slot as deleted (still to be placed) and every deleted one as empty
+				for (size_t i = 0; i < capacity_; ++i)
+					ctrl[i] = ctrl[i] < 0 ? hash_table::Empty : hash_table::Deleted;
+
+				for (size_t i = 0; i < capacity_; ++i)
+				{
+					if (ctrl[i] != hash_table::Deleted)
+						continue;
+
+					const auto hash = hash_of(slots[i].key);
+					const auto target = find_first_non_full(hash);
+					if (target / hash_table::GroupWidth == i / hash_table::GroupWidth)
+					{
+						// Already in the best group it can get
+						ctrl[i] = hash_table::h2(hash);
+						continue;
+					}
+
+					if (ctrl[target] == hash_table::Empty)
+					{
+						std::construct_at(slots + target, std::move(slots[i]));
+						std::destroy_at(slots + i);
+						ctrl[target] = hash_table::h2(hash);
+						ctrl[i] = hash_table::Empty;
+					}
+					else
+					{
+						// Target holds an element that has not been placed yet. Swap and process the new occupant of slot i
+						std::swap(slots[i].key, slots[target].key);
+						std::swap(slots[i].value, slots[target].value);
+						ctrl[target] = hash_table::h2(hash);
+						--i;
+					}
+				}
+				growth_left = hash_table::max_load(capacity_) - count;
+			}
+
+			/// <summary>
+			/// Make room for one more element
+			/// </summary>
+			[[nodiscard]]
+			NTSTATUS prepare_insert() noexcept
+			{
+				if (growth_left) [[likely]]
+					return STATUS_SUCCESS;
+
+				if (!capacity_)
+				{
+					if constexpr (Growable)
+						return allocate(hash_table::GroupWidth);
+					else
+						return STATUS_INSUFFICIENT_RESOURCES;
+				}
+
+				// If deleted markers take at least half of the load, cleaning them up is enough
+				const auto deleted = hash_table::max_load(capacity_) - count;
+				if (deleted && (!Growable || count <= hash_table::max_load(capacity_) / 2))
+				{
+					drop_deleted();
+					return STATUS_SUCCESS;
+				}
+
+				if constexpr (Growable)
+					return resize(capacity_ * 2);
+				else
+					return STATUS_INSUFFICIENT_RESOURCES;
+			}
+
+		public:
+			using key_type = K;
+			using mapped_type = V;
+
+			/// <summary>
+			/// Result of try_emplace
+			/// </summary>
+			struct insert_result
+			{
+				V *value;		// Inserted or already existing value
+				bool inserted;	// true if a new element has been inserted
+			};
+
+			basic_flat_hash_map() = default;
+
+			basic_flat_hash_map(const basic_flat_hash_map &) = delete;
+			basic_flat_hash_map &operator =(const basic_flat_hash_map &) = delete;
+
+			basic_flat_hash_map(basic_flat_hash_map &&o) noexcept :
+				ctrl{ std::exchange(o.ctrl, {}) },
+				slots{ std::exchange(o.slots, {}) },
+				capacity_{ std::exchange(o.capacity_, {}) },
+				count{ std::exchange(o.count, {}) },
+				growth_left{ std::exchange(o.growth_left, {}) }
+			{
+			}
+
+			basic_flat_hash_map &operator =(basic_flat_hash_map &&o) noexcept
+			{
+				if (this != &o)
+				{
+					release();
+					ctrl = std::exchange(o.ctrl, {});
+					slots = std::exchange(o.slots, {});
+					capacity_ = std::exchange(o.capacity_, {});
+					count = std::exchange(o.count, {});
+					growth_left = std::exchange(o.growth_left, {});
+				}
+				return *this;
+			}
+
+			~basic_flat_hash_map()
+			{
+				release();
+			}
+
+			/// <summary>
+			/// Allocate the table for at least `max_count` elements. Existing elements are destroyed
+			/// A fixed-capacity map must be initialized before use, typically at PASSIVE_LEVEL
+			/// </summary>
+			[[nodiscard]]
+			NTSTATUS initialize(size_t max_count) noexcept
+			{
+				release();
+				return allocate(hash_table::capacity_for(max_count));
+			}
+
+			/// <summary>
+			/// Make sure the map can hold `new_count` elements without growing
+			/// </summary>
+			[[nodiscard]]
+			NTSTATUS reserve(size_t new_count) noexcept requires Growable
+			{
+				if (new_count <= count + growth_left)
+					return STATUS_SUCCESS;
+				return resize(hash_table::capacity_for(new_count));
+			}
+
+			[[nodiscard]]
+			size_t size() const noexcept
+			{
+				return count;
+			}
+
+			[[nodiscard]]
+			bool empty() const noexcept
+			{
+				return count == 0;
+			}
+
+			[[nodiscard]]
+			size_t capacity() const noexcept
+			{
+				return capacity_;
+			}
+
+			/// <summary>
+			/// Find the value for a key
+			/// </summary>
+			/// <returns>Pointer to the value or nullptr if the key is not found</returns>
+			[[nodiscard]]
+			V *find(const K &key) noexcept
+			{
+				if (!count)
+					return nullptr;
+				auto *s = probe(hash_of(key), [&](const slot &s) noexcept { return key_equal(s.key, key); });
+				return s ? &s->value : nullptr;
+			}
+
+			[[nodiscard]]
+			const V *find(const K &key) const noexcept
+			{
+				return const_cast<basic_flat_hash_map *>(this)->find(key);
+			}
+
+			[[nodiscard]]
+			bool contains(const K &key) const noexcept
+			{
+				return find(key) != nullptr;
+			}
+
+			/// <summary>
+			/// Insert a new element constructed from `args` if the key is not in the map
+			/// </summary>
+			/// <returns>Pointer to the value and insertion flag, or an error if the table could not be enlarged</returns>
+			template<class KK, class...Args>
+				requires std::constructible_from<K, KK &&> && std::constructible_from<V, Args &&...>
+			[[nodiscard]]
+			std::expected<insert_result, NTSTATUS> try_emplace(KK &&key, Args &&...args) noexcept
+			{
+				const auto hash = hash_of(key);
+				if (count)
+				{
+					if (auto *s = probe(hash, [&](const slot &s) noexcept { return key_equal(s.key, key); }))
+						return insert_result{ &s->value, false };
+				}
+
+				if (auto status = prepare_insert(); !nt_success(status))
+					return std::unexpected(status);
+
+				const auto index = find_first_non_full(hash);
+				// Reusing an empty slot consumes the growth budget, reusing a deleted one does not
+				growth_left -= ctrl[index] == hash_table::Empty;
+				ctrl[index] = hash_table::h2(hash);
+				auto *s = std::construct_at(slots + index, std::forward<KK>(key), std::forward<Args>(args)...);
+				++count;
+				return insert_result{ &s->value, true };
+			}
+
+			/// <summary>
+			/// Remove the element with the given key
+			/// </summary>
+			/// <returns>true if the element has been found and removed</returns>
+			bool erase(const K &key) noexcept
+			{
+				if (!count)
+					return false;
+
+				auto *s = probe(hash_of(key), [&](const slot &s) noexcept { return key_equal(s.key, key); });
+				if (!s)
+					return false;
+
+				const auto index = static_cast<size_t>(s - slots);
+				std::destroy_at(s);
+				--count;
+
+				// A probe never continues past a group with an empty slot, so the slot may become empty instead of deleted
+				if (hash_table::group{ ctrl + index / hash_table::GroupWidth * hash_table::GroupWidth }.match_empty())
+				{
+					ctrl[index] = hash_table::Empty;
+					++growth_left;
+				}
+				else
+					ctrl[index] = hash_table::Deleted;
+				return true;
+			}
+
+			/// <summary>
+			/// Remove all elements, the table is kept
+			/// </summary>
+			void clear() noexcept
+			{
+				destroy_slots();
+				if (capacity_)
+					std::memset(ctrl, static_cast<uint8_t>(hash_table::Empty), capacity_);
+				growth_left = hash_table::max_load(capacity_);
+			}
+
+			/// <summary>
+			/// Call `f(key, value)` for every element. The map must not be modified during the call
+			/// </summary>
+			template<class F>
+			void for_each(F &&f) noexcept
+			{
+				for (size_t i = 0; i < capacity_; ++i)
+					if (ctrl[i] >= 0)
+						f(std::as_const(slots[i].key), slots[i].value);
+			}
+
+			template<class F>
+			void for_each(F &&f) const noexcept
+			{
+				for (size_t i = 0; i < capacity_; ++i)
+					if (ctrl[i] >= 0)
+						f(slots[i].key, std::as_const(slots[i].value));
+			}
+		};
+
+		/// <summary>
+		/// Growable hash map allocated from paged pool. Must not be modified or searched above APC_LEVEL
+		/// </summary>
+		template<class K, class V, class Hash = std::hash<K>, class KeyEqual = std::equal_to<K>>
+		using flat_hash_map = basic_flat_hash_map<K, V, Hash, KeyEqual, pool_type::Paged, true>;
+
+		/// <summary>
+		/// Fixed-capacity hash map allocated from nonpaged pool by initialize
+		/// After initialization it never allocates and may be used at DISPATCH_LEVEL (under a spin lock)
+		/// </summary>
+		template<class K, class V, class Hash = std::hash<K>, class KeyEqual = std::equal_to<K>>
+		using fixed_flat_hash_map = basic_flat_hash_map<K, V, Hash, KeyEqual, pool_type::NonPaged, false>;
+	}
+
+	using details::basic_flat_hash_map;
+	using details::flat_hash_map;
+	using details::fixed_flat_hash_map;
+}
@@ -7,12 +7,68 @@
 //-------------------------------------------------------------------------------------------------------
 
 #pragma once
+#include <atomic>
+#include <coroutine>
 #include "ntstatus.h"
+#include "trace.h"
 
 namespace drv
 {
 	namespace details
 	{
+		/// <summary>
+		/// Awaitable returned by irp_t::forward_async
+		/// </summary>
+		class forward_awaitable
+		{
+			PIRP irp;
+			PDEVICE_OBJECT target;
+			std::coroutine_handle<> continuation;
+			// Set by whichever comes first, the completion routine or await_suspend after IoCallDriver returns. The second one resumes the coroutine
+			std::atomic<bool> rendezvous{};
+
+		public:
+			forward_awaitable(PIRP irp, PDEVICE_OBJECT target) noexcept :
+				irp{ irp },
+				target{ target }
+			{
+			}
+
+			forward_awaitable(const forward_awaitable &) = delete;
+			forward_awaitable &operator =(const forward_awaitable &) = delete;
+
+			static constexpr bool await_ready() noexcept
+			{
+				return false;
+			}
+
+			bool await_suspend(std::coroutine_handle<> handle) noexcept
+			{
+				continuation = handle;
+
+				IoCopyCurrentIrpStackLocationToNext(irp);
+				IoSetCompletionRoutine(irp, []([[maybe_unused]] PDEVICE_OBJECT DeviceObject, [[maybe_unused]] PIRP Irp, PVOID Context) noexcept -> NTSTATUS
+				{
+					auto self = static_cast<forward_awaitable *>(Context);
+					if (self->rendezvous.exchange(true, std::memory_order_acq_rel))
+						self->continuation.resume();
+					// The IRP is owned by the coroutine again
+					return STATUS_MORE_PROCESSING_REQUIRED;
+				}, this, true, true, true);
+
+				std::ignore = IoCallDriver(target, irp);
+
+				// If the request has already been completed, continue on this thread instead of nesting in the completion routine
+				return !rendezvous.exchange(true, std::memory_order_acq_rel);
+			}
+
+			[[nodiscard]]
+			NTSTATUS await_resume() const noexcept
+			{
+				return irp->IoStatus.Status;
+			}
+		};
+
 		/// <summary>
 		/// IRP wrapper
 		/// </summary>
@@ -20,7 +76,7 @@ namespace drv
 		{
 			PIRP irp{};
 
-			template<class T>
+			template<class T, class Trace, class Lifetime>
 			friend class device_t;
 
 			void assert_non_empty() const noexcept
@@ -124,11 +180,14 @@ namespace drv
 			/// <param name="status">Status to set for IRP</param>
 			/// <param name="information">Additional information to set for IRP</param>
 			/// <param name="priority_boost">Thread priority boost</param>
+			/// <typeparam name="Trace">Trace policy used to report the completion</typeparam>
 			/// <returns>Status passed in `status` parameter</returns>
+			template<class Trace = trace::disabled>
 			[[nodiscard]]
 			NTSTATUS complete(NTSTATUS status, ULONG_PTR information = 0, CCHAR priority_boost = IO_NO_INCREMENT) && noexcept
 			{
 				assert_non_empty();
+				Trace::complete(irp, status, information);
 				irp->IoStatus.Status = status;
 				irp->IoStatus.Information = information;
 				::IoCompleteRequest(std::move(*this).detach(), priority_boost);
@@ -141,11 +200,14 @@ namespace drv
 			/// </summary>
 			/// <param name="status">Status to set for IRP</param>
 			/// <param name="priority_boost">Thread priority boost</param>
+			/// <typeparam name="Trace">Trace policy used to report the completion</typeparam>
 			/// <returns>Status passed in `status` parameter</returns>
+			template<class Trace = trace::disabled>
 			[[nodiscard]]
 			NTSTATUS complete(IO_STATUS_BLOCK status, CCHAR priority_boost = IO_NO_INCREMENT) && noexcept
 			{
 				assert_non_empty();
+				Trace::complete(irp, status.Status, status.Information);
 				irp->IoStatus = status;
 				::IoCompleteRequest(std::move(*this).detach(), priority_boost);
 				return status.Status;
@@ -198,6 +260,34 @@ namespace drv
 				return IoGetNextIrpStackLocation(irp);
 			}
 
+			/// <summary>
+			/// Get a system-space address of the buffer described by the IRP's MDL (used by Direct I/O requests)
+			/// The mapping is cached in the MDL, subsequent calls are cheap
+			/// </summary>
+			/// <param name="priority">Page priority and mapping flags</param>
+			/// <returns>Mapped address or nullptr if the IRP has no MDL or the mapping failed</returns>
+			[[nodiscard]]
+			void *mdl_system_address(ULONG priority = NormalPagePriority | MdlMappingNoExecute) const noexcept
+			{
+				assert_non_empty();
+				return irp->MdlAddress ? MmGetSystemAddressForMdlSafe(irp->MdlAddress, priority) : nullptr;
+			}
+
+			/// <summary>
+			/// Pass the IRP to another driver and resume the awaiting coroutine when the request is completed
+			/// The completion routine returns STATUS_MORE_PROCESSING_REQUIRED, so the IRP is still owned by this object after co_await
+			/// and must be completed again. The coroutine may be resumed at DISPATCH_LEVEL in the context of the completing driver
+			/// A dispatch routine that returns before the IRP is completed must mark it pending and return STATUS_PENDING
+			/// </summary>
+			/// <param name="target">Device object to pass the IRP to</param>
+			/// <returns>Awaitable object, co_await returns the final status of the IRP</returns>
+			[[nodiscard]]
+			auto forward_async(PDEVICE_OBJECT target) const noexcept
+			{
+				assert_non_empty();
+				return forward_awaitable{ irp, target };
+			}
+
 			/// <summary>
 			/// Skip current stack location
 			/// </summary>
@@ -209,10 +299,14 @@ namespace drv
 
 			/// <summary>
 			/// Mark IRP pending
+			/// Must be called before the IRP is queued or forwarded, so that the trace policy reports it before it may be completed
 			/// </summary>
+			/// <typeparam name="Trace">Trace policy used to report that the IRP is pending</typeparam>
+			template<class Trace = trace::disabled>
 			void mark_pending() noexcept
 			{
 				assert_non_empty();
+				Trace::pend(irp);
 				IoMarkIrpPending(irp);
 			}
 
@@ -0,0 +1,112 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include "allocator.h"
+
+// Lifetime policies of device_t. A policy protects the device object from being deleted while requests are in progress:
+//   NTSTATUS initialize() noexcept         - called once after the device object is constructed, before any request is dispatched
+//   NTSTATUS acquire(void *tag) noexcept   - STATUS_SUCCESS, or an error if the device is being deleted
+//   void release(void *tag) noexcept
+//   void release_and_wait(void *tag) noexcept - release the caller's reference and wait until all other ones are released. Further
+//                                               calls to acquire fail
+
+namespace drv::lifetime
+{
+	/// <summary>
+	/// Lifetime policy based on IO_REMOVE_LOCK. Every acquire and release modifies a single counter shared by all processors
+	/// Checked builds of the system validate the tags passed to acquire and release
+	/// </summary>
+	class remove_lock
+	{
+		IO_REMOVE_LOCK lock;
+
+	public:
+		remove_lock() noexcept
+		{
+			IoInitializeRemoveLock(&lock, 0, 0, 0);
+		}
+
+		remove_lock(const remove_lock &) = delete;
+		remove_lock &operator =(const remove_lock &) = delete;
+
+		[[nodiscard]]
+		static constexpr NTSTATUS initialize() noexcept
+		{
+			return STATUS_SUCCESS;
+		}
+
+		[[nodiscard]]
+		NTSTATUS acquire(void *tag) noexcept
+		{
+			return IoAcquireRemoveLock(&lock, tag);
+		}
+
+		void release(void *tag) noexcept
+		{
+			IoReleaseRemoveLock(&lock, tag);
+		}
+
+		void release_and_wait(void *tag) noexcept
+		{
+			IoReleaseRemoveLockAndWait(&lock, tag);
+		}
+	};
+
+	/// <summary>
+	/// Lifetime policy based on EX_RUNDOWN_REF_CACHE_AWARE. The reference count is split into per-processor counters on
+	/// separate cache lines, so acquire and release issued on different processors do not contend
+	/// Waiting for the release is more expensive, since all counters are collected. Tags are not validated
+	/// </summary>
+	class cache_aware_rundown
+	{
+		PEX_RUNDOWN_REF_CACHE_AWARE ref{};
+
+	public:
+		cache_aware_rundown() = default;
+
+		cache_aware_rundown(const cache_aware_rundown &) = delete;
+		cache_aware_rundown &operator =(const cache_aware_rundown &) = delete;
+
+		~cache_aware_rundown()
+		{
+			if (ref)
+				ExFreeCacheAwareRundownProtection(ref);
+		}
+
+		/// <summary>
+		/// Allocate the per-processor counters from nonpaged pool
+		/// </summary>
+		[[nodiscard]]
+		NTSTATUS initialize() noexcept
+		{
+			ref = ExAllocateCacheAwareRundownProtection(NonPagedPoolNx, drv::details::RundownTag);
+			return ref ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		[[nodiscard]]
+		NTSTATUS acquire([[maybe_unused]] void *tag) noexcept
+		{
+			return ExAcquireRundownProtectionCacheAware(ref) ? STATUS_SUCCESS : STATUS_DELETE_PENDING;
+		}
+
+		void release([[maybe_unused]] void *tag) noexcept
+		{
+			ExReleaseRundownProtectionCacheAware(ref);
+		}
+
+		/// <summary>
+		/// Must be called at PASSIVE_LEVEL, as IoReleaseRemoveLockAndWait
+		/// </summary>
+		void release_and_wait([[maybe_unused]] void *tag) noexcept
+		{
+			ExReleaseRundownProtectionCacheAware(ref);
+			ExWaitForRundownProtectionReleaseCacheAware(ref);
+		}
+	};
+}
@@ -0,0 +1,292 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include <bit>
+#include <concepts>
+#include <memory>
+#include <utility>
+#include "allocator.h"
+
+namespace drv
+{
+	namespace details
+	{
+		/// <summary>
+		/// Lock that may be used with std::scoped_lock (BasicLockable) and also provides a guard with acquire()
+		/// </summary>
+		template<class T>
+		concept basic_lockable = requires(T &lock)
+		{
+			lock.lock();
+			lock.unlock();
+			lock.acquire();
+		};
+
+		/// <summary>
+		/// Guard that holds a lock until it is destroyed
+		/// </summary>
+		template<class Lock>
+		class [[nodiscard]] lock_guard
+		{
+			Lock &lock;
+
+		public:
+			explicit lock_guard(Lock &lock) noexcept :
+				lock{ lock }
+			{
+				lock.lock();
+			}
+
+			lock_guard(const lock_guard &) = delete;
+			lock_guard &operator =(const lock_guard &) = delete;
+
+			~lock_guard()
+			{
+				lock.unlock();
+			}
+		};
+
+		/// <summary>
+		/// Executive spin lock (KeAcquireSpinLock). May be acquired at IRQL <= DISPATCH_LEVEL
+		/// The previous IRQL is stored in the lock object by its owner, so lock and unlock need no arguments
+		/// </summary>
+		class spin_lock
+		{
+			KSPIN_LOCK spin_lock_{};
+			KIRQL old_irql{};
+
+		public:
+			spin_lock() noexcept
+			{
+				KeInitializeSpinLock(&spin_lock_);
+			}
+
+			spin_lock(const spin_lock &) = delete;
+			spin_lock &operator =(const spin_lock &) = delete;
+
+			void lock() noexcept
+			{
+				KIRQL irql;
+				KeAcquireSpinLock(&spin_lock_, &irql);
+				old_irql = irql;
+			}
+
+			void unlock() noexcept
+			{
+				KeReleaseSpinLock(&spin_lock_, old_irql);
+			}
+
+			[[nodiscard]]
+			auto acquire() noexcept
+			{
+				return lock_guard{ *this };
+			}
+		};
+
+		/// <summary>
+		/// In-stack queued spin lock. Waiters spin on their own queue entries and acquire the lock in FIFO order,
+		/// which avoids the cache-line bouncing and unfairness of an ordinary spin lock under contention
+		/// May be acquired at IRQL <= DISPATCH_LEVEL
+		/// acquire() keeps the queue entry in the returned guard and needs no preparation
+		/// lock() and unlock() (used by std::scoped_lock and cancel_safe_queue) keep queue entries in a per-processor table,
+		/// which must be created with initialize at PASSIVE_LEVEL (usually in DriverEntry) and destroyed with uninitialize in DriverUnload
+		/// </summary>
+		class queued_spin_lock
+		{
+			// Number of queued spin locks a processor may hold at the same time through lock()
+			static constexpr const ULONG MaxNesting = 8;
+
+			struct alignas(SYSTEM_CACHE_ALIGNMENT_SIZE) processor_entries
+			{
+				KLOCK_QUEUE_HANDLE handles[MaxNesting];
+				KIRQL old_irql[MaxNesting];
+				ULONG used;
+			};
+
+			static inline constinit processor_entries *entries{};
+			static inline constinit ULONG entry_count{};
+
+			KSPIN_LOCK spin_lock_{};
+
+			[[nodiscard]]
+			bool owns(const KLOCK_QUEUE_HANDLE &handle) const noexcept
+			{
+				// The low bits of the queue entry's lock pointer hold the wait and owner flags
+				return (reinterpret_cast<ULONG_PTR>(handle.LockQueue.Lock) & ~ULONG_PTR{ 3 }) == reinterpret_cast<ULONG_PTR>(&spin_lock_);
+			}
+
+		public:
+			/// <summary>
+			/// Guard that holds a queued spin lock, the queue entry is stored in the guard itself
+			/// </summary>
+			class [[nodiscard]] guard
+			{
+				KLOCK_QUEUE_HANDLE handle;
+
+			public:
+				explicit guard(queued_spin_lock &lock) noexcept
+				{
+					KeAcquireInStackQueuedSpinLock(&lock.spin_lock_, &handle);
+				}
+
+				// Other processors may link to the queue entry while it is in the queue, so the guard cannot be moved
+				guard(const guard &) = delete;
+				guard &operator =(const guard &) = delete;
+
+				~guard()
+				{
+					KeReleaseInStackQueuedSpinLock(&handle);
+				}
+			};
+
+			static NTSTATUS initialize() noexcept
+			{
+				PAGED_CODE();
+				assert(!entries);
+
+				const auto count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+				auto *p = static_cast<processor_entries *>(::operator new(sizeof(processor_entries) * count, std::align_val_t{ alignof(processor_entries) }, pool_options{ .tag = ProcessorTableTag }));
+				if (!p) [[unlikely]]
+					return STATUS_INSUFFICIENT_RESOURCES;
+
+				for (ULONG i = 0; i < count; ++i)
+					std::construct_at(p + i)->used = 0;
+
+				entries = p;
+				entry_count = count;
+				return STATUS_SUCCESS;
+			}
+
+			static void uninitialize() noexcept
+			{
+				PAGED_CODE();
+				entry_count = 0;
+				::operator delete(std::exchange(entries, nullptr), std::align_val_t{ alignof(processor_entries) });
+			}
+
+			queued_spin_lock() noexcept
+			{
+				KeInitializeSpinLock(&spin_lock_);
+			}
+
+			queued_spin_lock(const queued_spin_lock &) = delete;
+			queued_spin_lock &operator =(const queued_spin_lock &) = delete;
+
+			void lock() noexcept
+			{
+				assert(entries && "queued_spin_lock::initialize must be called before lock()");
+
+				// The thread cannot move to another processor at DISPATCH_LEVEL, so the processor's entry stays ours until unlock
+				KIRQL irql;
+				KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+				auto &cpu = entries[KeGetCurrentProcessorNumberEx(nullptr)];
+				const auto slot = static_cast<ULONG>(std::countr_one(cpu.used));
+				assert(slot < MaxNesting);
+				cpu.used |= 1u << slot;
+				cpu.old_irql[slot] = irql;
+				KeAcquireInStackQueuedSpinLockAtDpcLevel(&spin_lock_, &cpu.handles[slot]);
+			}
+
+			void unlock() noexcept
+			{
+				auto &cpu = entries[KeGetCurrentProcessorNumberEx(nullptr)];
+				for (auto used = cpu.used; used; used &= used - 1)
+				{
+					const auto slot = static_cast<ULONG>(std::countr_zero(used));
+					if (owns(cpu.handles[slot]))
+					{
+						const auto irql = cpu.old_irql[slot];
+						KeReleaseInStackQueuedSpinLockFromDpcLevel(&cpu.handles[slot]);
+						cpu.used &= ~(1u << slot);
+						KeLowerIrql(irql);
+						return;
+					}
+				}
+				assert(false && "queued_spin_lock::unlock called by a processor that does not hold the lock");
+			}
+
+			[[nodiscard]]
+			guard acquire() noexcept
+			{
+				return guard{ *this };
+			}
+		};
+
+		/// <summary>
+		/// Executive reader/writer spin lock (ExAcquireSpinLockShared/Exclusive). May be acquired at IRQL <= DISPATCH_LEVEL
+		/// Any number of readers may hold the lock at the same time, which suits read-mostly state
+		/// lock() and unlock() take the lock exclusively
+		/// </summary>
+		class rw_spin_lock
+		{
+			EX_SPIN_LOCK spin_lock_{};
+			KIRQL old_irql{};
+
+		public:
+			/// <summary>
+			/// Guard that holds the lock shared. Readers may have different previous IRQLs, so each guard keeps its own
+			/// </summary>
+			class [[nodiscard]] shared_guard
+			{
+				rw_spin_lock &lock;
+				KIRQL irql;
+
+			public:
+				explicit shared_guard(rw_spin_lock &lock) noexcept :
+					lock{ lock },
+					irql{ ExAcquireSpinLockShared(&lock.spin_lock_) }
+				{
+				}
+
+				shared_guard(const shared_guard &) = delete;
+				shared_guard &operator =(const shared_guard &) = delete;
+
+				~shared_guard()
+				{
+					ExReleaseSpinLockShared(&lock.spin_lock_, irql);
+				}
+			};
+
+			rw_spin_lock() = default;
+
+			rw_spin_lock(const rw_spin_lock &) = delete;
+			rw_spin_lock &operator =(const rw_spin_lock &) = delete;
+
+			void lock() noexcept
+			{
+				const auto irql = ExAcquireSpinLockExclusive(&spin_lock_);
+				old_irql = irql;
+			}
+
+			void unlock() noexcept
+			{
+				ExReleaseSpinLockExclusive(&spin_lock_, old_irql);
+			}
+
+			[[nodiscard]]
+			auto acquire() noexcept
+			{
+				return lock_guard{ *this };
+			}
+
+			[[nodiscard]]
+			shared_guard acquire_shared() noexcept
+			{
+				return shared_guard{ *this };
+			}
+		};
+	}
+
+	using details::basic_lockable;
+	using details::lock_guard;
+	using details::spin_lock;
+	using details::queued_spin_lock;
+	using details::rw_spin_lock;
+}
@@ -0,0 +1,168 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <concepts>
+#include <cstddef>
+#include <memory>
+#include "allocator.h"
+
+namespace drv
+{
+	namespace details
+	{
+		/// <summary>
+		/// Block of N counters for statistics updated from any processor
+		/// Every processor has its own copy of the block in a separate cache line, updates only touch the copy of the current processor.
+		/// Reading a counter sums the copies of all processors, so the value is not an atomic snapshot of concurrent updates
+		/// Until initialize succeeds, all processors update a single shared copy, so the counters work, but contend, without the table
+		/// May be updated and read at any IRQL &lt;= DISPATCH_LEVEL
+		/// </summary>
+		/// <typeparam name="T">Integral counter type. Counters wrap around, and a counter that is incremented on one processor and decremented
+		/// on another one has copies that wrap, but the sum is correct</typeparam>
+		/// <typeparam name="N">Number of counters in the block</typeparam>
+		/// <typeparam name="Index">Type used to select a counter, usually an enumeration with values 0 to N - 1</typeparam>
+		template<std::integral T, size_t N = 1, class Index = size_t>
+			requires std::atomic<T>::is_always_lock_free
+		class percpu_counter
+		{
+			using counters = std::array<std::atomic<T>, N>;
+
+			struct alignas(SYSTEM_CACHE_ALIGNMENT_SIZE) processor_counters
+			{
+				counters values{};
+			};
+
+			processor_counters *table{};
+			ULONG table_size{};
+			// The shared copy is not over-aligned, since the counter is embedded in objects that may not honor the cache line
+			// alignment, such as device extensions. All processors contend on it anyway
+			counters shared{};
+
+			[[nodiscard]]
+			counters &local() noexcept
+			{
+				// The thread may move to another processor right after this call, the update is then made to the copy of
+				// the previous one. The counters stay correct, since the copies are updated atomically
+				const auto index = KeGetCurrentProcessorNumberEx(nullptr);
+				return index < table_size ? table[index].values : shared;
+			}
+
+			[[nodiscard]]
+			static constexpr size_t to_index(Index index) noexcept
+			{
+				const auto i = static_cast<size_t>(index);
+				assert(i < N);
+				return i;
+			}
+
+		public:
+			percpu_counter() = default;
+
+			percpu_counter(const percpu_counter &) = delete;
+			percpu_counter &operator =(const percpu_counter &) = delete;
+
+			~percpu_counter()
+			{
+				if (table)
+					::operator delete(table, std::align_val_t{ alignof(processor_counters) });
+			}
+
+			/// <summary>
+			/// Allocate the per-processor copies. Must be called at PASSIVE_LEVEL before the counters are updated from other threads
+			/// </summary>
+			/// <returns>STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES, in which case the counters keep using the shared copy</returns>
+			[[nodiscard]]
+			NTSTATUS initialize() noexcept
+			{
+				PAGED_CODE();
+				assert(!table);
+
+				const auto count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+				auto *p = static_cast<processor_counters *>(::operator new(sizeof(processor_counters) * count, std::align_val_t{ alignof(processor_counters) }, pool_options{ .tag = ProcessorTableTag, .uninitialized = true }));
+				if (!p) [[unlikely]]
+					return STATUS_INSUFFICIENT_RESOURCES;
+				std::uninitialized_value_construct_n(p, count);
+
+				table = p;
+				table_size = count;
+				return STATUS_SUCCESS;
+			}
+
+			void add(Index index, T delta) noexcept
+			{
+				local()[to_index(index)].fetch_add(delta, std::memory_order_relaxed);
+			}
+
+			void increment(Index index) noexcept
+			{
+				add(index, 1);
+			}
+
+			void decrement(Index index) noexcept
+			{
+				local()[to_index(index)].fetch_sub(1, std::memory_order_relaxed);
+			}
+
+			/// <summary>
+			/// Get the sum of a counter over all processors
+			/// </summary>
+			[[nodiscard]]
+			T value(Index index) const noexcept
+			{
+				const auto i = to_index(index);
+				T result = shared[i].load(std::memory_order_relaxed);
+				for (ULONG cpu = 0; cpu < table_size; ++cpu)
+					result += table[cpu].values[i].load(std::memory_order_relaxed);
+				return result;
+			}
+
+			/// <summary>
+			/// Get the sums of all counters, collecting each processor's copy once
+			/// </summary>
+			[[nodiscard]]
+			std::array<T, N> values() const noexcept
+			{
+				std::array<T, N> result;
+				for (size_t i = 0; i < N; ++i)
+					result[i] = shared[i].load(std::memory_order_relaxed);
+				for (ULONG cpu = 0; cpu < table_size; ++cpu)
+					for (size_t i = 0; i < N; ++i)
+						result[i] += table[cpu].values[i].load(std::memory_order_relaxed);
+				return result;
+			}
+
+			// Single counter interface
+
+			void add(T delta) noexcept requires (N == 1)
+			{
+				add(Index{}, delta);
+			}
+
+			void increment() noexcept requires (N == 1)
+			{
+				add(Index{}, 1);
+			}
+
+			void decrement() noexcept requires (N == 1)
+			{
+				decrement(Index{});
+			}
+
+			[[nodiscard]]
+			T value() const noexcept requires (N == 1)
+			{
+				return value(Index{});
+			}
+		};
+	}
+
+	using details::percpu_counter;
+}
@@ -0,0 +1,186 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <utility>
+#include <algorithm>
+#include "allocator.h"
+
+namespace drv
+{
+	namespace details
+	{
+		/// <summary>
+		/// Fixed-capacity circular byte buffer
+		/// Reads and writes wrap around the end of the storage, their cost only depends on the number of bytes moved
+		/// The class is not synchronized, callers must provide their own locking
+		/// </summary>
+		class ring_buffer
+		{
+			std::unique_ptr<std::byte[]> storage;
+			size_t capacity_{};
+			size_t head{};		// read position
+			size_t tail{};		// write position
+			size_t used{};
+
+			[[nodiscard]]
+			size_t advance(size_t position, size_t bytes) const noexcept
+			{
+				position += bytes;
+				return position >= capacity_ ? position - capacity_ : position;
+			}
+
+		public:
+			using span_pair = std::pair<std::span<std::byte>, std::span<std::byte>>;
+			using const_span_pair = std::pair<std::span<const std::byte>, std::span<const std::byte>>;
+
+			ring_buffer() = default;
+
+			/// <summary>
+			/// Construct the buffer and allocate its storage from the non-paged pool
+			/// </summary>
+			/// <param name="capacity">Buffer capacity in bytes. If allocation fails, the capacity of the constructed buffer is zero</param>
+			explicit ring_buffer(size_t capacity) noexcept :
+				storage{ make_unique_for_overwrite<std::byte[]>(capacity, { .tag = RingBufferTag }) },
+				capacity_{ storage ? capacity : 0 }
+			{
+			}
+
+			ring_buffer(const ring_buffer &) = delete;
+			ring_buffer &operator =(const ring_buffer &) = delete;
+
+			[[nodiscard]]
+			size_t capacity() const noexcept
+			{
+				return capacity_;
+			}
+
+			[[nodiscard]]
+			size_t size() const noexcept
+			{
+				return used;
+			}
+
+			[[nodiscard]]
+			size_t free_space() const noexcept
+			{
+				return capacity_ - used;
+			}
+
+			[[nodiscard]]
+			bool empty() const noexcept
+			{
+				return used == 0;
+			}
+
+			[[nodiscard]]
+			bool full() const noexcept
+			{
+				return used == capacity_;
+			}
+
+			/// <summary>
+			/// Get the stored data as two contiguous spans, the second one is non-empty only if the data wraps around
+			/// </summary>
+			[[nodiscard]]
+			const_span_pair readable() const noexcept
+			{
+				const auto first = std::min(used, capacity_ - head);
+				return { { storage.get() + head, first }, { storage.get(), used - first } };
+			}
+
+			/// <summary>
+			/// Get the free space as two contiguous spans, the second one is non-empty only if the free space wraps around
+			/// Use commit to make the written bytes a part of the stored data
+			/// </summary>
+			[[nodiscard]]
+			span_pair writable() noexcept
+			{
+				const auto free = free_space();
+				const auto first = std::min(free, capacity_ - tail);
+				return { { storage.get() + tail, first }, { storage.get(), free - first } };
+			}
+
+			/// <summary>
+			/// Append bytes previously written to the spans returned by writable
+			/// </summary>
+			void commit(size_t bytes) noexcept
+			{
+				assert(bytes <= free_space());
+				tail = advance(tail, bytes);
+				used += bytes;
+			}
+
+			/// <summary>
+			/// Discard bytes from the beginning of the stored data
+			/// </summary>
+			void consume(size_t bytes) noexcept
+			{
+				assert(bytes <= used);
+				used -= bytes;
+				if (used == 0) [[likely]]
+					head = tail = 0;	// keep subsequent writes contiguous
+				else
+					head = advance(head, bytes);
+			}
+
+			/// <summary>
+			/// Copy at most `destination.size()` bytes from the beginning of the stored data without consuming them
+			/// </summary>
+			/// <returns>Number of bytes copied</returns>
+			size_t peek(std::span<std::byte> destination) const noexcept
+			{
+				const auto [first, second] = readable();
+				const auto from_first = std::min(first.size(), destination.size());
+				const auto from_second = std::min(second.size(), destination.size() - from_first);
+				std::copy_n(first.data(), from_first, destination.data());
+				std::copy_n(second.data(), from_second, destination.data() + from_first);
+				return from_first + from_second;
+			}
+
+			/// <summary>
+			/// Move at most `destination.size()` bytes from the beginning of the stored data
+			/// </summary>
+			/// <returns>Number of bytes moved</returns>
+			size_t read(std::span<std::byte> destination) noexcept
+			{
+				const auto bytes = peek(destination);
+				consume(bytes);
+				return bytes;
+			}
+
+			/// <summary>
+			/// Append as many bytes from `data` as fit into the free space
+			/// </summary>
+			/// <returns>Number of bytes appended</returns>
+			size_t write(std::span<const std::byte> data) noexcept
+			{
+				const auto [first, second] = writable();
+				const auto to_first = std::min(first.size(), data.size());
+				const auto to_second = std::min(second.size(), data.size() - to_first);
+				std::copy_n(data.data(), to_first, first.data());
+				std::copy_n(data.data() + to_first, to_second, second.data());
+				commit(to_first + to_second);
+				return to_first + to_second;
+			}
+
+			/// <summary>
+			/// Discard all stored data
+			/// </summary>
+			void clear() noexcept
+			{
+				head = tail = used = 0;
+			}
+		};
+	}
+
+	using details::ring_buffer;
+}
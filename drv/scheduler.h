@@ -0,0 +1,233 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include "allocator.h"
+#include "slist.h"
+
+namespace drv
+{
+	namespace details
+	{
+		/// <summary>
+		/// Unit of work queued to the scheduler
+		/// The item is owned by the caller and must stay valid until its routine is called. The routine may free or reuse the item
+		/// </summary>
+		struct work_item
+		{
+			SLIST_ENTRY link;
+			void (*routine)(work_item *item) noexcept;
+		};
+
+		/// <summary>
+		/// Per-processor work queues
+		/// Every processor has a threaded DPC that runs dispatch items and a worker thread with affinity to the processor that runs passive items,
+		/// so work can be moved to the processor whose caches hold its data instead of running on the thread that issued the request
+		/// Items are queued with a single interlocked push, the DPC is inserted and the worker is woken only when its queue was empty.
+		/// Items queued to one processor run in the order they were queued
+		/// initialize must be called at PASSIVE_LEVEL (usually in DriverEntry) and uninitialize in DriverUnload, after which no items may be queued.
+		/// Items queued before uninitialize still run
+		/// </summary>
+		class scheduler
+		{
+			using item_list = slist<work_item, slist_entry<work_item, offsetof(work_item, link)>>;
+
+			struct alignas(SYSTEM_CACHE_ALIGNMENT_SIZE) processor_queue
+			{
+				item_list dispatch_items;
+				KDPC dpc;
+				// Producers of dispatch and passive items do not contend for the same cache line
+				alignas(SYSTEM_CACHE_ALIGNMENT_SIZE) item_list passive_items;
+				KEVENT wake;
+				PKTHREAD thread;
+				ULONG index;
+			};
+
+			static inline constinit processor_queue *queues{};
+			static inline constinit ULONG queue_count{};
+			static inline constinit std::atomic<bool> stopping{};
+
+			static void run(item_list::chain_type items) noexcept
+			{
+				// The list returns the most recently queued item first
+				items.reverse();
+				while (auto *item = items.pop_front())
+					item->routine(item);
+			}
+
+			static void dpc_routine([[maybe_unused]] PKDPC Dpc, PVOID DeferredContext, [[maybe_unused]] PVOID SystemArgument1, [[maybe_unused]] PVOID SystemArgument2) noexcept
+			{
+				run(static_cast<processor_queue *>(DeferredContext)->dispatch_items.flush());
+			}
+
+			static void worker_routine(PVOID StartContext) noexcept
+			{
+				auto &queue = *static_cast<processor_queue *>(StartContext);
+
+				PROCESSOR_NUMBER number;
+				if (nt_success(KeGetProcessorNumberFromIndex(queue.index, &number)))
+				{
+					GROUP_AFFINITY affinity{ .Mask = KAFFINITY{ 1 } << number.Number, .Group = number.Group };
+					KeSetSystemGroupAffinityThread(&affinity, nullptr);
+				}
+
+				for (;;)
+				{
+					KeWaitForSingleObject(&queue.wake, Executive, KernelMode, FALSE, nullptr);
+					run(queue.passive_items.flush());
+					if (stopping.load(std::memory_order_acquire))
+						break;
+				}
+
+				// Items may have been queued after the last flush, but before uninitialize set the flag
+				run(queue.passive_items.flush());
+				PsTerminateSystemThread(STATUS_SUCCESS);
+			}
+
+			[[nodiscard]]
+			static NTSTATUS start_worker(processor_queue &queue) noexcept
+			{
+				OBJECT_ATTRIBUTES attributes;
+				InitializeObjectAttributes(&attributes, nullptr, OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+				HANDLE handle;
+				if (auto status = PsCreateSystemThread(&handle, THREAD_ALL_ACCESS, &attributes, nullptr, nullptr, &worker_routine, &queue); !nt_success(status))
+					return status;
+
+				// The object is referenced so that uninitialize can wait for the thread to exit
+				const auto status = ObReferenceObjectByHandle(handle, SYNCHRONIZE, *PsThreadType, KernelMode, reinterpret_cast<PVOID *>(&queue.thread), nullptr);
+				ZwClose(handle);
+				return status;
+			}
+
+			[[nodiscard]]
+			static processor_queue *queue_of(ULONG processor) noexcept
+			{
+				return processor < queue_count ? &queues[processor] : nullptr;
+			}
+
+		public:
+			static NTSTATUS initialize() noexcept
+			{
+				PAGED_CODE();
+				assert(!queues);
+
+				const auto count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+				auto *p = static_cast<processor_queue *>(::operator new(sizeof(processor_queue) * count, std::align_val_t{ alignof(processor_queue) }, pool_options{ .tag = ProcessorTableTag }));
+				if (!p) [[unlikely]]
+					return STATUS_INSUFFICIENT_RESOURCES;
+
+				queues = p;
+				for (ULONG i = 0; i < count; ++i)
+				{
+					auto &queue = *std::construct_at(p + i);
+					queue.index = i;
+					queue.thread = nullptr;
+					KeInitializeEvent(&queue.wake, SynchronizationEvent, FALSE);
+					KeInitializeThreadedDpc(&queue.dpc, &dpc_routine, &queue);
+
+					PROCESSOR_NUMBER number;
+					if (nt_success(KeGetProcessorNumberFromIndex(i, &number)))
+						KeSetTargetProcessorDpcEx(&queue.dpc, &number);
+
+					// The queue is destroyed by uninitialize from now on, with or without a worker
+					queue_count = i + 1;
+					if (auto status = start_worker(queue); !nt_success(status))
+					{
+						uninitialize();
+						return status;
+					}
+				}
+
+				return STATUS_SUCCESS;
+			}
+
+			static void uninitialize() noexcept
+			{
+				PAGED_CODE();
+
+				stopping.store(true, std::memory_order_release);
+				const auto count = std::exchange(queue_count, 0);
+				for (ULONG i = 0; i < count; ++i)
+				{
+					auto &queue = queues[i];
+					if (queue.thread)
+					{
+						KeSetEvent(&queue.wake, IO_NO_INCREMENT, FALSE);
+						KeWaitForSingleObject(queue.thread, Executive, KernelMode, FALSE, nullptr);
+						ObDereferenceObject(queue.thread);
+					}
+				}
+
+				KeFlushQueuedDpcs();
+
+				for (ULONG i = 0; i < count; ++i)
+					std::destroy_at(queues + i);
+				::operator delete(std::exchange(queues, nullptr), std::align_val_t{ alignof(processor_queue) });
+				stopping.store(false, std::memory_order_relaxed);
+			}
+
+			/// <summary>
+			/// Get the index of the processor the caller runs on. The thread may move to another processor right after the call unless it runs at DISPATCH_LEVEL
+			/// </summary>
+			[[nodiscard]]
+			static ULONG current_processor() noexcept
+			{
+				return KeGetCurrentProcessorNumberEx(nullptr);
+			}
+
+			/// <summary>
+			/// Run an item in the threaded DPC of a processor. The routine is called at IRQL &lt;= DISPATCH_LEVEL:
+			/// threaded DPCs run at PASSIVE_LEVEL in a real-time thread, or at DISPATCH_LEVEL if threaded DPCs are disabled on the system
+			/// May be called at IRQL &lt;= DISPATCH_LEVEL
+			/// </summary>
+			/// <param name="processor">Processor index, as returned by KeGetCurrentProcessorNumberEx</param>
+			/// <returns>STATUS_SUCCESS, STATUS_DEVICE_NOT_READY if the scheduler has not been initialized or STATUS_INVALID_PARAMETER for an unknown processor</returns>
+			[[nodiscard]]
+			static NTSTATUS queue_dispatch(work_item &item, ULONG processor) noexcept
+			{
+				if (!queues) [[unlikely]]
+					return STATUS_DEVICE_NOT_READY;
+				auto *queue = queue_of(processor);
+				if (!queue) [[unlikely]]
+					return STATUS_INVALID_PARAMETER;
+
+				if (queue->dispatch_items.push(&item))
+					KeInsertQueueDpc(&queue->dpc, nullptr, nullptr);
+				return STATUS_SUCCESS;
+			}
+
+			/// <summary>
+			/// Run an item at PASSIVE_LEVEL in the worker thread of a processor
+			/// May be called at IRQL &lt;= DISPATCH_LEVEL
+			/// </summary>
+			/// <param name="processor">Processor index, as returned by KeGetCurrentProcessorNumberEx</param>
+			/// <returns>STATUS_SUCCESS, STATUS_DEVICE_NOT_READY if the scheduler has not been initialized or STATUS_INVALID_PARAMETER for an unknown processor</returns>
+			[[nodiscard]]
+			static NTSTATUS queue_passive(work_item &item, ULONG processor) noexcept
+			{
+				if (!queues) [[unlikely]]
+					return STATUS_DEVICE_NOT_READY;
+				auto *queue = queue_of(processor);
+				if (!queue) [[unlikely]]
+					return STATUS_INVALID_PARAMETER;
+
+				if (queue->passive_items.push(&item))
+					KeSetEvent(&queue->wake, IO_NO_INCREMENT, FALSE);
+				return STATUS_SUCCESS;
+			}
+		};
+	}
+
+	using details::work_item;
+	using details::scheduler;
+}
@@ -0,0 +1,258 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include <cstddef>
+#include <span>
+#include <utility>
+#include <algorithm>
+#include "allocator.h"
+
+namespace drv
+{
+	namespace details
+	{
+		/// <summary>
+		/// Byte FIFO stored in a chain of fixed-size segments taken from a lookaside list
+		/// Segments are allocated as data is written and returned to the list as soon as they are read, so an empty buffer holds no memory
+		/// and a large capacity does not require a large contiguous allocation
+		/// The interface follows ring_buffer. The class is not synchronized, callers must provide their own locking
+		/// </summary>
+		class segmented_buffer
+		{
+			struct segment
+			{
+				segment *next;
+				// segment data follows
+			};
+
+			lookaside_list *segments;
+			segment *first{};		// read segment
+			segment *last{};		// write segment
+			segment *spare{};		// segments allocated by reserve and not written yet
+			size_t head{};			// read position in the first segment
+			size_t tail{};			// write position in the last segment
+			size_t used{};
+			size_t spare_count{};
+			size_t capacity_;
+
+			[[nodiscard]]
+			size_t segment_size() const noexcept
+			{
+				return segments->size() - sizeof(segment);
+			}
+
+			[[nodiscard]]
+			static std::byte *data_of(segment *s) noexcept
+			{
+				return reinterpret_cast<std::byte *>(s + 1);
+			}
+
+			[[nodiscard]]
+			segment *take_segment() noexcept
+			{
+				if (spare)
+				{
+					--spare_count;
+					return std::exchange(spare, spare->next);
+				}
+				return static_cast<segment *>(segments->allocate());
+			}
+
+			// Room left in the allocated segments
+			[[nodiscard]]
+			size_t allocated_room() const noexcept
+			{
+				return (last ? segment_size() - tail : 0) + spare_count * segment_size();
+			}
+
+			void free_chain(segment *s) noexcept
+			{
+				while (s)
+					segments->free(std::exchange(s, s->next));
+			}
+
+			void free_all() noexcept
+			{
+				free_chain(std::exchange(first, nullptr));
+				free_chain(std::exchange(spare, nullptr));
+				last = nullptr;
+				head = tail = used = spare_count = 0;
+			}
+
+		public:
+			/// <summary>
+			/// Construct an empty buffer. No memory is allocated until data is written
+			/// </summary>
+			/// <param name="segments">Initialized lookaside list, its block size is the size of a segment including a pointer-sized header.
+			/// The list may be shared by many buffers and must outlive them</param>
+			/// <param name="capacity">Maximum number of bytes stored</param>
+			segmented_buffer(lookaside_list &segments, size_t capacity) noexcept :
+				segments{ &segments },
+				capacity_{ capacity }
+			{
+				assert(segments.initialized() && segments.size() > sizeof(segment));
+			}
+
+			segmented_buffer(const segmented_buffer &) = delete;
+			segmented_buffer &operator =(const segmented_buffer &) = delete;
+
+			~segmented_buffer()
+			{
+				free_all();
+			}
+
+			[[nodiscard]]
+			size_t capacity() const noexcept
+			{
+				return capacity_;
+			}
+
+			[[nodiscard]]
+			size_t size() const noexcept
+			{
+				return used;
+			}
+
+			/// <summary>
+			/// Get the number of bytes that may be written before the capacity is reached. Writes may store less if a segment cannot be allocated
+			/// </summary>
+			[[nodiscard]]
+			size_t free_space() const noexcept
+			{
+				return capacity_ - used;
+			}
+
+			[[nodiscard]]
+			bool empty() const noexcept
+			{
+				return used == 0;
+			}
+
+			[[nodiscard]]
+			bool full() const noexcept
+			{
+				return used == capacity_;
+			}
+
+			/// <summary>
+			/// Allocate the segments needed to write `bytes` bytes, so that the following writes of that many bytes store all of them
+			/// </summary>
+			/// <returns>false if `bytes` exceeds the free space or a segment could not be allocated. Segments allocated so far are kept</returns>
+			[[nodiscard]]
+			bool reserve(size_t bytes) noexcept
+			{
+				if (bytes > free_space())
+					return false;
+
+				for (auto room = allocated_room(); room < bytes; room += segment_size())
+				{
+					auto *s = static_cast<segment *>(segments->allocate());
+					if (!s) [[unlikely]]
+						return false;
+					s->next = spare;
+					spare = s;
+					++spare_count;
+				}
+				return true;
+			}
+
+			/// <summary>
+			/// Copy at most `destination.size()` bytes from the beginning of the stored data without consuming them
+			/// </summary>
+			/// <returns>Number of bytes copied</returns>
+			size_t peek(std::span<std::byte> destination) const noexcept
+			{
+				const auto bytes = std::min(destination.size(), used);
+				auto offset = head;
+				size_t copied{};
+				for (auto *s = first; copied < bytes; s = s->next, offset = 0)
+				{
+					const auto chunk = std::min(segment_size() - offset, bytes - copied);
+					std::copy_n(data_of(s) + offset, chunk, destination.data() + copied);
+					copied += chunk;
+				}
+				return copied;
+			}
+
+			/// <summary>
+			/// Discard bytes from the beginning of the stored data. Segments that have been read completely are freed
+			/// </summary>
+			void consume(size_t bytes) noexcept
+			{
+				assert(bytes <= used);
+				used -= bytes;
+				if (used == 0)
+				{
+					free_all();
+					return;
+				}
+
+				// The write segment still holds data, so it is never freed here
+				head += bytes;
+				while (head >= segment_size())
+				{
+					head -= segment_size();
+					segments->free(std::exchange(first, first->next));
+				}
+			}
+
+			/// <summary>
+			/// Move at most `destination.size()` bytes from the beginning of the stored data
+			/// </summary>
+			/// <returns>Number of bytes moved</returns>
+			size_t read(std::span<std::byte> destination) noexcept
+			{
+				const auto bytes = peek(destination);
+				consume(bytes);
+				return bytes;
+			}
+
+			/// <summary>
+			/// Append as many bytes from `data` as fit into the free space
+			/// </summary>
+			/// <returns>Number of bytes appended. It is less than requested if the capacity is reached or a segment could not be allocated</returns>
+			size_t write(std::span<const std::byte> data) noexcept
+			{
+				const auto bytes = std::min(data.size(), free_space());
+				size_t written{};
+				while (written < bytes)
+				{
+					if (!last || tail == segment_size())
+					{
+						auto *s = take_segment();
+						if (!s) [[unlikely]]
+							break;
+						s->next = nullptr;
+						(last ? last->next : first) = s;
+						last = s;
+						tail = 0;
+					}
+
+					const auto chunk = std::min(segment_size() - tail, bytes - written);
+					std::copy_n(data.data() + written, chunk, data_of(last) + tail);
+					tail += chunk;
+					written += chunk;
+				}
+
+				used += written;
+				return written;
+			}
+
+			/// <summary>
+			/// Discard all stored data and free all segments
+			/// </summary>
+			void clear() noexcept
+			{
+				free_all();
+			}
+		};
+	}
+
+	using details::segmented_buffer;
+}
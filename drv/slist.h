@@ -0,0 +1,260 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include <cstddef>
+#include <iterator>
+#include <utility>
+#include "list.h"
+
+namespace drv
+{
+	namespace details
+	{
+		/// <summary>
+		/// Link of an element in an slist: an SLIST_ENTRY member of T at a given offset
+		/// The member must be aligned to MEMORY_ALLOCATION_ALIGNMENT, which SLIST_ENTRY guarantees for members of pool allocated objects
+		/// </summary>
+		template<class T, size_t offset>
+		struct slist_entry
+		{
+			using link_type = SLIST_ENTRY;
+
+			template<class V>
+			static auto *to_link(V *ptr) noexcept requires t_or_const<T, V>
+			{
+				return reinterpret_cast<pointer_like<V, link_type>>(reinterpret_cast<std::byte *>(ptr) + offset);
+			}
+
+			template<class V>
+			static auto *to_T(V *ptr) noexcept requires t_or_const<link_type, V>
+			{
+				return reinterpret_cast<pointer_like<V, T>>(reinterpret_cast<std::byte *>(ptr) - offset);
+			}
+
+			template<class V>
+			static auto &next(V *cur) noexcept requires t_or_const<link_type, V>
+			{
+				return cur->Next;
+			}
+		};
+
+		/// <summary>
+		/// Chain of elements taken from an slist at once by flush, most recently pushed first
+		/// The chain is owned by the caller and is not synchronized
+		/// </summary>
+		template<class T, class LinkEntry>
+		class slist_chain
+		{
+			using link_type = typename LinkEntry::link_type;
+
+			link_type *first{};
+
+		public:
+			class iterator
+			{
+				link_type *current{};
+
+			public:
+				using iterator_category = std::forward_iterator_tag;
+				using value_type = T;
+				using difference_type = std::ptrdiff_t;
+				using pointer = T *;
+				using reference = T &;
+
+				iterator() = default;
+
+				explicit iterator(link_type *link) noexcept :
+					current{ link }
+				{
+				}
+
+				[[nodiscard]]
+				T &operator *() const noexcept
+				{
+					return *LinkEntry::to_T(current);
+				}
+
+				[[nodiscard]]
+				T *operator ->() const noexcept
+				{
+					return LinkEntry::to_T(current);
+				}
+
+				iterator &operator ++() noexcept
+				{
+					current = LinkEntry::next(current);
+					return *this;
+				}
+
+				iterator operator ++(int) noexcept
+				{
+					auto r = *this;
+					++*this;
+					return r;
+				}
+
+				[[nodiscard]]
+				bool operator ==(const iterator &o) const noexcept = default;
+			};
+
+			slist_chain() = default;
+
+			explicit slist_chain(link_type *first) noexcept :
+				first{ first }
+			{
+			}
+
+			slist_chain(const slist_chain &) = delete;
+			slist_chain &operator =(const slist_chain &) = delete;
+
+			slist_chain(slist_chain &&o) noexcept :
+				first{ std::exchange(o.first, nullptr) }
+			{
+			}
+
+			slist_chain &operator =(slist_chain &&o) noexcept
+			{
+				assert(empty());
+				first = std::exchange(o.first, nullptr);
+				return *this;
+			}
+
+			~slist_chain()
+			{
+				assert(empty());
+			}
+
+			[[nodiscard]]
+			bool empty() const noexcept
+			{
+				return !first;
+			}
+
+			/// <summary>
+			/// Iterate the elements without detaching them. The loop body must not free or reuse the current element, use pop_front for that
+			/// </summary>
+			[[nodiscard]]
+			iterator begin() const noexcept
+			{
+				return iterator{ first };
+			}
+
+			[[nodiscard]]
+			iterator end() const noexcept
+			{
+				return {};
+			}
+
+			/// <summary>
+			/// Detach the first element of the chain
+			/// </summary>
+			/// <returns>The element or nullptr if the chain is empty</returns>
+			[[nodiscard]]
+			T *pop_front() noexcept
+			{
+				if (!first)
+					return nullptr;
+				auto *link = std::exchange(first, LinkEntry::next(first));
+				return LinkEntry::to_T(link);
+			}
+
+			/// <summary>
+			/// Reverse the chain, so that the elements are visited in the order they were pushed
+			/// </summary>
+			void reverse() noexcept
+			{
+				link_type *reversed{};
+				while (first)
+				{
+					auto *next = LinkEntry::next(first);
+					LinkEntry::next(first) = reversed;
+					reversed = std::exchange(first, next);
+				}
+				first = reversed;
+			}
+		};
+
+		/// <summary>
+		/// Lock-free intrusive stack based on SLIST_HEADER
+		/// push and pop may be called concurrently from any number of processors at IRQL <= DISPATCH_LEVEL, flush takes all elements at once.
+		/// Typical uses are free lists and passing work from many producers (DPCs, completion routines) to a single consumer
+		/// The stack does not own the elements. The header must be aligned to MEMORY_ALLOCATION_ALIGNMENT, as SLIST_HEADER is
+		/// </summary>
+		/// <typeparam name="T">Element type</typeparam>
+		/// <typeparam name="LinkEntry">slist_entry&lt;T, offsetof(T, member)&gt; that locates the SLIST_ENTRY member of T</typeparam>
+		template<class T, class LinkEntry>
+		class slist
+		{
+			static_assert(std::same_as<typename LinkEntry::link_type, SLIST_ENTRY>, "slist requires an SLIST_ENTRY link");
+
+			SLIST_HEADER head;
+
+		public:
+			using value_type = T;
+			using chain_type = slist_chain<T, LinkEntry>;
+
+			slist() noexcept
+			{
+				InitializeSListHead(&head);
+			}
+
+			slist(const slist &) = delete;
+			slist &operator =(const slist &) = delete;
+
+			/// <summary>
+			/// Push an element to the top of the stack
+			/// </summary>
+			/// <returns>true if the stack was empty. A producer can use it to schedule the consumer only once per batch</returns>
+			bool push(T *element) noexcept
+			{
+				return InterlockedPushEntrySList(&head, LinkEntry::to_link(element)) == nullptr;
+			}
+
+			/// <summary>
+			/// Pop the element from the top of the stack
+			/// </summary>
+			/// <returns>The element or nullptr if the stack is empty</returns>
+			[[nodiscard]]
+			T *pop() noexcept
+			{
+				auto *link = InterlockedPopEntrySList(&head);
+				return link ? LinkEntry::to_T(link) : nullptr;
+			}
+
+			/// <summary>
+			/// Take all elements of the stack with a single interlocked operation
+			/// </summary>
+			/// <returns>Chain of the elements, most recently pushed first</returns>
+			[[nodiscard]]
+			chain_type flush() noexcept
+			{
+				return chain_type{ InterlockedFlushSList(&head) };
+			}
+
+			/// <summary>
+			/// Get the number of elements. The value may be outdated by the time it is returned
+			/// </summary>
+			[[nodiscard]]
+			USHORT depth() noexcept
+			{
+				return QueryDepthSList(&head);
+			}
+
+			[[nodiscard]]
+			bool empty() noexcept
+			{
+				return depth() == 0;
+			}
+		};
+	}
+
+	using details::slist_entry;
+	using details::slist_chain;
+	using details::slist;
+}
@@ -0,0 +1,183 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include <algorithm>
+#include <array>
+#include "intdefs.h"
+
+namespace drv
+{
+	namespace details
+	{
+		/// <summary>
+		/// Entry of a timer_wheel, embedded into the object that has a deadline
+		/// </summary>
+		struct timer_wheel_entry
+		{
+			LIST_ENTRY link{};
+			u64 expiry{};
+
+			[[nodiscard]]
+			bool linked() const noexcept
+			{
+				return link.Flink != nullptr;
+			}
+		};
+
+		/// <summary>
+		/// Hierarchical timer wheel. Time is measured in ticks, the caller decides how long a tick is
+		/// Level 0 has a slot for each of the next 2^SlotBits ticks, every next level has slots that are 2^SlotBits times longer
+		/// Insertion and removal are O(1). Advancing by one tick expires the entries of one slot and, once per 2^SlotBits ticks, moves
+		/// the entries of a slot of the next level down
+		/// Deadlines beyond the range of the top level are parked at its far end and placed again when they are reached
+		/// The class is not synchronized, callers must provide their own locking
+		/// </summary>
+		/// <typeparam name="Levels">Number of levels</typeparam>
+		/// <typeparam name="SlotBits">Binary logarithm of the number of slots in a level</typeparam>
+		template<unsigned Levels = 3, unsigned SlotBits = 6>
+		class timer_wheel
+		{
+			static_assert(Levels > 0 && SlotBits > 0 && Levels * SlotBits < 64);
+
+			static constexpr const size_t Slots = size_t{ 1 } << SlotBits;
+			static constexpr const u64 SlotMask = Slots - 1;
+			// Number of ticks covered by the wheel
+			static constexpr const u64 Range = u64{ 1 } << (Levels * SlotBits);
+
+			std::array<std::array<LIST_ENTRY, Slots>, Levels> slots;
+			u64 current{};
+			size_t count{};
+
+			void place(timer_wheel_entry &entry) noexcept
+			{
+				const auto delta = std::min(entry.expiry - current, Range - 1);
+				const auto effective = current + delta;
+
+				unsigned level = 0;
+				while (level + 1 < Levels && delta >= (u64{ 1 } << ((level + 1) * SlotBits)))
+					++level;
+
+				InsertTailList(&slots[level][(effective >> (level * SlotBits)) & SlotMask], &entry.link);
+			}
+
+		public:
+			explicit timer_wheel(u64 now = 0) noexcept :
+				current{ now }
+			{
+				for (auto &level : slots)
+					for (auto &slot : level)
+						InitializeListHead(&slot);
+			}
+
+			timer_wheel(const timer_wheel &) = delete;
+			timer_wheel &operator =(const timer_wheel &) = delete;
+
+			[[nodiscard]]
+			size_t size() const noexcept
+			{
+				return count;
+			}
+
+			[[nodiscard]]
+			bool empty() const noexcept
+			{
+				return !count;
+			}
+
+			/// <summary>
+			/// Get the current tick
+			/// </summary>
+			[[nodiscard]]
+			u64 now() const noexcept
+			{
+				return current;
+			}
+
+			/// <summary>
+			/// Move the current tick of an empty wheel, usually to the present time before the first entry is inserted
+			/// </summary>
+			void reset(u64 now) noexcept
+			{
+				assert(empty());
+				current = now;
+			}
+
+			/// <summary>
+			/// Insert an entry that expires at the given tick. Entries already due expire on the next tick
+			/// </summary>
+			void insert(timer_wheel_entry &entry, u64 expiry) noexcept
+			{
+				assert(!entry.linked());
+				entry.expiry = std::max(expiry, current + 1);
+				place(entry);
+				++count;
+			}
+
+			/// <summary>
+			/// Remove an entry that has not expired yet. Does nothing if the entry is not in the wheel
+			/// </summary>
+			void remove(timer_wheel_entry &entry) noexcept
+			{
+				if (!entry.linked())
+					return;
+
+				RemoveEntryList(&entry.link);
+				entry.link = {};
+				--count;
+			}
+
+			/// <summary>
+			/// Advance the current tick up to `now`, calling `expire` for each entry that becomes due
+			/// Expired entries are removed from the wheel before `expire` is called
+			/// </summary>
+			template<class F>
+			void advance(u64 now, F &&expire) noexcept
+			{
+				while (current < now)
+				{
+					// Nothing to expire on the way, jump straight to the end
+					if (empty())
+					{
+						current = now;
+						break;
+					}
+
+					++current;
+
+					// Move down the entries of the next level slots that begin on this tick
+					for (unsigned level = 1; level < Levels && !(current & ((u64{ 1 } << (level * SlotBits)) - 1)); ++level)
+					{
+						auto &slot = slots[level][(current >> (level * SlotBits)) & SlotMask];
+						while (!IsListEmpty(&slot))
+							place(*CONTAINING_RECORD(RemoveHeadList(&slot), timer_wheel_entry, link));
+					}
+
+					auto &due = slots[0][current & SlotMask];
+					while (!IsListEmpty(&due))
+					{
+						auto &entry = *CONTAINING_RECORD(RemoveHeadList(&due), timer_wheel_entry, link);
+						if (entry.expiry > current)
+						{
+							// A parked entry that is still beyond the range of the wheel
+							place(entry);
+							continue;
+						}
+
+						entry.link = {};
+						--count;
+						expire(entry);
+					}
+				}
+			}
+		};
+	}
+
+	using details::timer_wheel_entry;
+	using details::timer_wheel;
+}
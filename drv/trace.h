@@ -0,0 +1,191 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include <TraceLoggingProvider.h>
+
+// Provider used by the trace::tracelogging policy, defined in trace_impl.h
+TRACELOGGING_DECLARE_PROVIDER(drv_trace_provider);
+
+namespace drv::trace
+{
+	namespace details
+	{
+		constexpr const ULONGLONG KeywordDispatch = 0x1;
+		constexpr const ULONGLONG KeywordQueue = 0x2;
+
+		/// <summary>
+		/// Get the number of bytes requested by an IRP, or 0 for requests without a data buffer
+		/// </summary>
+		[[nodiscard]]
+		inline ULONG request_length(const IO_STACK_LOCATION *stack) noexcept
+		{
+			switch (stack->MajorFunction)
+			{
+			case IRP_MJ_READ:
+				return stack->Parameters.Read.Length;
+			case IRP_MJ_WRITE:
+				return stack->Parameters.Write.Length;
+			case IRP_MJ_DEVICE_CONTROL:
+			case IRP_MJ_INTERNAL_DEVICE_CONTROL:
+				return stack->Parameters.DeviceIoControl.OutputBufferLength;
+			default:
+				return 0;
+			}
+		}
+
+		[[nodiscard]]
+		inline ULONG64 elapsed_microseconds(LONGLONG start) noexcept
+		{
+			LARGE_INTEGER frequency;
+			const auto now = KeQueryPerformanceCounter(&frequency);
+			return static_cast<ULONG64>(now.QuadPart - start) * 1'000'000 / frequency.QuadPart;
+		}
+	}
+
+	using details::request_length;
+
+	/// <summary>
+	/// Trace policy that emits nothing. All its functions are empty and compile to nothing
+	/// </summary>
+	struct disabled
+	{
+		static constexpr const bool enabled = false;
+
+		struct dispatch_context
+		{
+		};
+
+		static constexpr dispatch_context dispatch_begin([[maybe_unused]] PIRP irp) noexcept
+		{
+			return {};
+		}
+
+		static constexpr void dispatch_end([[maybe_unused]] const dispatch_context &context, [[maybe_unused]] NTSTATUS status) noexcept
+		{
+		}
+
+		static constexpr void pend([[maybe_unused]] PIRP irp) noexcept
+		{
+		}
+
+		static constexpr void complete([[maybe_unused]] PIRP irp, [[maybe_unused]] NTSTATUS status, [[maybe_unused]] ULONG_PTR information) noexcept
+		{
+		}
+
+		static constexpr void cancel([[maybe_unused]] PIRP irp) noexcept
+		{
+		}
+	};
+
+	/// <summary>
+	/// Trace policy that writes TraceLogging events to the drv_trace_provider provider
+	/// Events:
+	///   DispatchBegin - Irp, MajorFunction, MinorFunction, Length
+	///   DispatchEnd   - Irp, MajorFunction, Status, LatencyUs (time spent in the dispatch routine)
+	///   Pend          - Irp, MajorFunction, the IRP has been marked pending. It is written before the IRP is queued, so it precedes Complete
+	///   Complete      - Irp, Status, Information
+	///   Cancel        - Irp, the IRP has been cancelled while stored in a cancel-safe queue
+	/// The time an IRP spends pending is the distance between its Pend and Complete events, correlated by the Irp field
+	/// The provider must be registered with register_provider, events are not written until then
+	/// </summary>
+	struct tracelogging
+	{
+		static constexpr const bool enabled = true;
+
+		struct dispatch_context
+		{
+			PIRP irp;
+			UCHAR major_function;
+			LONGLONG start;		// 0 if the provider was not listening when the request arrived
+		};
+
+		static dispatch_context dispatch_begin(PIRP irp) noexcept
+		{
+			const auto stack = IoGetCurrentIrpStackLocation(irp);
+			if (!TraceLoggingProviderEnabled(drv_trace_provider, TRACE_LEVEL_VERBOSE, details::KeywordDispatch))
+				return { irp, stack->MajorFunction, 0 };
+
+			TraceLoggingWrite(drv_trace_provider, "DispatchBegin",
+				TraceLoggingLevel(TRACE_LEVEL_VERBOSE),
+				TraceLoggingKeyword(details::KeywordDispatch),
+				TraceLoggingPointer(irp, "Irp"),
+				TraceLoggingUInt8(stack->MajorFunction, "MajorFunction"),
+				TraceLoggingUInt8(stack->MinorFunction, "MinorFunction"),
+				TraceLoggingUInt32(details::request_length(stack), "Length"));
+
+			return { irp, stack->MajorFunction, KeQueryPerformanceCounter(nullptr).QuadPart };
+		}
+
+		/// <summary>
+		/// Called after the dispatch routine returns. The IRP may have already been completed and freed, it is only used as an identifier
+		/// </summary>
+		static void dispatch_end(const dispatch_context &context, NTSTATUS status) noexcept
+		{
+			if (!context.start)
+				return;
+
+			TraceLoggingWrite(drv_trace_provider, "DispatchEnd",
+				TraceLoggingLevel(TRACE_LEVEL_VERBOSE),
+				TraceLoggingKeyword(details::KeywordDispatch),
+				TraceLoggingPointer(context.irp, "Irp"),
+				TraceLoggingUInt8(context.major_function, "MajorFunction"),
+				TraceLoggingNTStatus(status, "Status"),
+				TraceLoggingUInt64(details::elapsed_microseconds(context.start), "LatencyUs"));
+		}
+
+		/// <summary>
+		/// Called when the IRP is marked pending, before it is queued or passed to anyone who may complete it
+		/// </summary>
+		static void pend(PIRP irp) noexcept
+		{
+			if (!TraceLoggingProviderEnabled(drv_trace_provider, TRACE_LEVEL_VERBOSE, details::KeywordQueue))
+				return;
+
+			TraceLoggingWrite(drv_trace_provider, "Pend",
+				TraceLoggingLevel(TRACE_LEVEL_VERBOSE),
+				TraceLoggingKeyword(details::KeywordQueue),
+				TraceLoggingPointer(irp, "Irp"),
+				TraceLoggingUInt8(IoGetCurrentIrpStackLocation(irp)->MajorFunction, "MajorFunction"));
+		}
+
+		static void complete(PIRP irp, NTSTATUS status, ULONG_PTR information) noexcept
+		{
+			TraceLoggingWrite(drv_trace_provider, "Complete",
+				TraceLoggingLevel(TRACE_LEVEL_VERBOSE),
+				TraceLoggingKeyword(details::KeywordQueue),
+				TraceLoggingPointer(irp, "Irp"),
+				TraceLoggingNTStatus(status, "Status"),
+				TraceLoggingUInt64(information, "Information"));
+		}
+
+		static void cancel(PIRP irp) noexcept
+		{
+			TraceLoggingWrite(drv_trace_provider, "Cancel",
+				TraceLoggingLevel(TRACE_LEVEL_VERBOSE),
+				TraceLoggingKeyword(details::KeywordQueue),
+				TraceLoggingPointer(irp, "Irp"));
+		}
+	};
+
+	/// <summary>
+	/// Register the drv_trace_provider provider. Call it from DriverEntry when the trace::tracelogging policy is used
+	/// </summary>
+	inline NTSTATUS register_provider() noexcept
+	{
+		return TraceLoggingRegister(drv_trace_provider);
+	}
+
+	/// <summary>
+	/// Unregister the drv_trace_provider provider. Call it from DriverUnload
+	/// </summary>
+	inline void unregister_provider() noexcept
+	{
+		TraceLoggingUnregister(drv_trace_provider);
+	}
+}
@@ -0,0 +1,14 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include "trace.h"
+
+// {9a9bb7d6-18df-4e14-8166-569850f8c261}
+TRACELOGGING_DEFINE_PROVIDER(drv_trace_provider, "Drv.Irp",
+	(0x9a9bb7d6, 0x18df, 0x4e14, 0x81, 0x66, 0x56, 0x98, 0x50, 0xf8, 0xc2, 0x61));
@@ -7,8 +7,21 @@
 //-------------------------------------------------------------------------------------------------------
 
 #pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <string_view>
 #include <ranges>
+#include <type_traits>
+#include "arena.h"
+
+#if defined(_M_AMD64)
+#include <emmintrin.h>
+#elif defined(_M_ARM64)
+#include <arm64_neon.h>
+#endif
 
 namespace drv
 {
@@ -29,15 +42,345 @@ namespace drv
 			return bytes / sizeof(Char);
 		}
 
-		template<class Char>
-		inline constexpr bool compare_safe_equal(std::basic_string_view<Char> l, std::basic_string_view<Char> r) noexcept
+		namespace string_simd
 		{
-			auto f = [](Char c) constexpr noexcept
+			// Number of code units processed at once, also the size of the folding buffer of the case-insensitive hash
+			template<class Char>
+			constexpr const size_t BlockWidth = 16 / sizeof(Char);
+
+			/// <summary>
+			/// Upper-case a code unit the way RtlEqualUnicodeString and RtlEqualString do, with the ASCII range handled inline
+			/// </summary>
+			template<class Char>
+			[[nodiscard]]
+			inline Char to_upper(Char c) noexcept
+			{
+				if (static_cast<std::make_unsigned_t<Char>>(c) < 0x80)
+					return ('a' <= c && c <= 'z') ? static_cast<Char>(c - 'a' + 'A') : c;
+				if constexpr (sizeof(Char) == sizeof(WCHAR))
+					return RtlUpcaseUnicodeChar(c);
+				else
+					return RtlUpperChar(c);
+			}
+
+#if defined(_M_AMD64)
+			/// <summary>
+			/// 16 bytes of a string compared and folded at once with SSE2
+			/// AVX2 is not used: kernel code has to save the extended processor state around any use of YMM registers
+			/// </summary>
+			template<class Char>
+			class block
+			{
+				static_assert(sizeof(Char) == 1 || sizeof(Char) == 2, "Only 8-bit and 16-bit code units are supported");
+
+				__m128i v;
+
+				explicit block(__m128i v) noexcept :
+					v{ v }
+				{
+				}
+
+				[[nodiscard]]
+				static __m128i splat(int c) noexcept
+				{
+					if constexpr (sizeof(Char) == 1)
+						return _mm_set1_epi8(static_cast<char>(c));
+					else
+						return _mm_set1_epi16(static_cast<short>(c));
+				}
+
+				[[nodiscard]]
+				static __m128i cmpeq(__m128i a, __m128i b) noexcept
+				{
+					if constexpr (sizeof(Char) == 1)
+						return _mm_cmpeq_epi8(a, b);
+					else
+						return _mm_cmpeq_epi16(a, b);
+				}
+
+				[[nodiscard]]
+				static __m128i cmpgt(__m128i a, __m128i b) noexcept
+				{
+					if constexpr (sizeof(Char) == 1)
+						return _mm_cmpgt_epi8(a, b);
+					else
+						return _mm_cmpgt_epi16(a, b);
+				}
+
+			public:
+				explicit block(const Char *p) noexcept :
+					v{ _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)) }
+				{
+				}
+
+				void store(Char *p) const noexcept
+				{
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(p), v);
+				}
+
+				[[nodiscard]]
+				bool operator ==(const block &o) const noexcept
+				{
+					return _mm_movemask_epi8(cmpeq(v, o.v)) == 0xffff;
+				}
+
+				[[nodiscard]]
+				friend block operator |(const block &l, const block &r) noexcept
+				{
+					return block{ _mm_or_si128(l.v, r.v) };
+				}
+
+				[[nodiscard]]
+				bool ascii() const noexcept
+				{
+					if constexpr (sizeof(Char) == 1)
+						return _mm_movemask_epi8(v) == 0;
+					else
+						return _mm_movemask_epi8(cmpeq(_mm_and_si128(v, splat(0xff80)), _mm_setzero_si128())) == 0xffff;
+				}
+
+				/// <summary>
+				/// Upper-case all code units. Only valid for ASCII blocks, where the signed comparisons are exact
+				/// </summary>
+				[[nodiscard]]
+				block to_upper() const noexcept
+				{
+					const auto lower = _mm_and_si128(cmpgt(v, splat('a' - 1)), cmpgt(splat('z' + 1), v));
+					const auto delta = _mm_and_si128(lower, splat('a' - 'A'));
+					if constexpr (sizeof(Char) == 1)
+						return block{ _mm_sub_epi8(v, delta) };
+					else
+						return block{ _mm_sub_epi16(v, delta) };
+				}
+			};
+#elif defined(_M_ARM64)
+			/// <summary>
+			/// 16 bytes of a string compared and folded at once with NEON
+			/// </summary>
+			template<class Char>
+			class block
+			{
+				static_assert(sizeof(Char) == 1 || sizeof(Char) == 2, "Only 8-bit and 16-bit code units are supported");
+
+				using lane_type = std::conditional_t<sizeof(Char) == 1, uint8_t, uint16_t>;
+				using vector_type = std::conditional_t<sizeof(Char) == 1, uint8x16_t, uint16x8_t>;
+
+				vector_type v;
+
+				explicit block(vector_type v) noexcept :
+					v{ v }
+				{
+				}
+
+				[[nodiscard]]
+				static vector_type splat(lane_type c) noexcept
+				{
+					if constexpr (sizeof(Char) == 1)
+						return vdupq_n_u8(c);
+					else
+						return vdupq_n_u16(c);
+				}
+
+			public:
+				explicit block(const Char *p) noexcept
+				{
+					if constexpr (sizeof(Char) == 1)
+						v = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+					else
+						v = vld1q_u16(reinterpret_cast<const uint16_t *>(p));
+				}
+
+				void store(Char *p) const noexcept
+				{
+					if constexpr (sizeof(Char) == 1)
+						vst1q_u8(reinterpret_cast<uint8_t *>(p), v);
+					else
+						vst1q_u16(reinterpret_cast<uint16_t *>(p), v);
+				}
+
+				[[nodiscard]]
+				bool operator ==(const block &o) const noexcept
+				{
+					if constexpr (sizeof(Char) == 1)
+						return vminvq_u8(vceqq_u8(v, o.v)) == 0xff;
+					else
+						return vminvq_u16(vceqq_u16(v, o.v)) == 0xffff;
+				}
+
+				[[nodiscard]]
+				friend block operator |(const block &l, const block &r) noexcept
+				{
+					if constexpr (sizeof(Char) == 1)
+						return block{ vorrq_u8(l.v, r.v) };
+					else
+						return block{ vorrq_u16(l.v, r.v) };
+				}
+
+				[[nodiscard]]
+				bool ascii() const noexcept
+				{
+					if constexpr (sizeof(Char) == 1)
+						return vmaxvq_u8(v) < 0x80;
+					else
+						return vmaxvq_u16(v) < 0x80;
+				}
+
+				/// <summary>
+				/// Upper-case all code units. Only valid for ASCII blocks
+				/// </summary>
+				[[nodiscard]]
+				block to_upper() const noexcept
+				{
+					if constexpr (sizeof(Char) == 1)
+					{
+						const auto lower = vandq_u8(vcgeq_u8(v, splat('a')), vcleq_u8(v, splat('z')));
+						return block{ vsubq_u8(v, vandq_u8(lower, splat('a' - 'A'))) };
+					}
+					else
+					{
+						const auto lower = vandq_u16(vcgeq_u16(v, splat('a')), vcleq_u16(v, splat('z')));
+						return block{ vsubq_u16(v, vandq_u16(lower, splat('a' - 'A'))) };
+					}
+				}
+			};
+#endif
+
+			template<class Char>
+			[[nodiscard]]
+			inline bool equal(const Char *l, const Char *r, size_t n) noexcept
+			{
+				size_t i{};
+#if defined(_M_AMD64) || defined(_M_ARM64)
+				for (; i + BlockWidth<Char> <= n; i += BlockWidth<Char>)
+					if (!(block<Char>{ l + i } == block<Char>{ r + i }))
+						return false;
+#endif
+				for (; i < n; ++i)
+					if (l[i] != r[i])
+						return false;
+				return true;
+			}
+
+			template<class Char>
+			[[nodiscard]]
+			inline bool equal_case_insensitive(const Char *l, const Char *r, size_t n) noexcept
+			{
+				size_t i{};
+#if defined(_M_AMD64) || defined(_M_ARM64)
+				for (; i + BlockWidth<Char> <= n; i += BlockWidth<Char>)
+				{
+					const block<Char> a{ l + i }, b{ r + i };
+					if (a == b)
+						continue;
+					if ((a | b).ascii())
+					{
+						if (a.to_upper() == b.to_upper())
+							continue;
+						return false;
+					}
+
+					// Only a block with non-ASCII code units is folded one code unit at a time
+					for (size_t j = i; j < i + BlockWidth<Char>; ++j)
+						if (l[j] != r[j] && to_upper(l[j]) != to_upper(r[j]))
+							return false;
+				}
+#endif
+				for (; i < n; ++i)
+					if (l[i] != r[i] && to_upper(l[i]) != to_upper(r[i]))
+						return false;
+				return true;
+			}
+
+			/// <summary>
+			/// Hash of a byte sequence consumed 8 bytes at a time. The result is not well-mixed in the low bits, hash tables mix it again
+			/// </summary>
+			class hasher
 			{
-				return ('A' <= c && c <= 'Z') ? c + 'a' - 'A' : c;
+				uint64_t h;
+
+				void add(uint64_t word) noexcept
+				{
+					h = (h ^ word) * 0xbf58'476d'1ce4'e5b9ull;
+					h ^= h >> 31;
+				}
+
+			public:
+				explicit hasher(size_t bytes) noexcept :
+					h{ 0x9e37'79b9'7f4a'7c15ull ^ bytes }
+				{
+				}
+
+				void add_bytes(const void *data, size_t bytes) noexcept
+				{
+					auto p = static_cast<const std::byte *>(data);
+					for (; bytes >= sizeof(uint64_t); bytes -= sizeof(uint64_t), p += sizeof(uint64_t))
+					{
+						uint64_t word;
+						std::memcpy(&word, p, sizeof(word));
+						add(word);
+					}
+
+					if (bytes)
+					{
+						uint64_t word{};
+						std::memcpy(&word, p, bytes);
+						add(word);
+					}
+				}
+
+				[[nodiscard]]
+				size_t get() const noexcept
+				{
+					return static_cast<size_t>(h);
+				}
 			};
 
-			return sr::equal(l, r, {}, f, f);
+			template<class Char>
+			[[nodiscard]]
+			inline size_t hash(const Char *p, size_t n) noexcept
+			{
+				hasher h{ n * sizeof(Char) };
+				h.add_bytes(p, n * sizeof(Char));
+				return h.get();
+			}
+
+			/// <summary>
+			/// Hash of the upper-cased string, so that strings equal by equal_case_insensitive have equal hashes
+			/// </summary>
+			template<class Char>
+			[[nodiscard]]
+			inline size_t hash_case_insensitive(const Char *p, size_t n) noexcept
+			{
+				hasher h{ n * sizeof(Char) };
+				Char folded[BlockWidth<Char>];
+				size_t i{};
+#if defined(_M_AMD64) || defined(_M_ARM64)
+				for (; i + BlockWidth<Char> <= n; i += BlockWidth<Char>)
+				{
+					const block<Char> b{ p + i };
+					if (b.ascii())
+						b.to_upper().store(folded);
+					else
+						std::transform(p + i, p + i + BlockWidth<Char>, folded, to_upper<Char>);
+					h.add_bytes(folded, sizeof(folded));
+				}
+#endif
+				while (i < n)
+				{
+					const auto count = std::min(n - i, BlockWidth<Char>);
+					std::transform(p + i, p + i + count, folded, to_upper<Char>);
+					h.add_bytes(folded, count * sizeof(Char));
+					i += count;
+				}
+				return h.get();
+			}
+		}
+
+		template<class Char>
+		[[nodiscard]]
+		inline bool compare_safe_equal(std::basic_string_view<Char> l, std::basic_string_view<Char> r) noexcept
+		{
+			return l.size() == r.size() && string_simd::equal_case_insensitive(l.data(), r.data(), l.size());
 		}
 
 		// TODO: consider adding support for specifying pool type
@@ -48,6 +391,10 @@ namespace drv
 			using char_type = std::decay_t<decltype(*std::declval<Base>().Buffer)>;
 
 		private:
+			/// <summary>
+			/// Make sure the buffer holds `length` characters and the zero terminator
+			/// </summary>
+			/// <returns>The buffer or nullptr if the pool is exhausted, the string is left empty in this case</returns>
 			char_type *allocate(size_t length) noexcept
 			{
 				if (length + 1 > from_bytes<char_type>(this->MaximumLength))
@@ -55,29 +402,42 @@ namespace drv
 					// For compatibility with os support for UNICODE strings, we need to allocate one more character
 					// and make it zero
 					delete[]this->Buffer;
+					static_cast<Base &>(*this) = {};
+					// The noexcept allocation function, so the result may be checked for nullptr
+					auto *p = new (pool_options{}) char_type[length + 1];
+					if (!p) [[unlikely]]
+						return nullptr;
+					this->Buffer = p;
 					this->MaximumLength = to_bytes<char_type>((USHORT)(length + 1));
-					this->Buffer = new char_type[length + 1];
-					this->Buffer[length] = 0;
 				}
 
+				this->Buffer[length] = 0;
 				return this->Buffer;
 			}
+
+			void assign(std::basic_string_view<char_type> string) noexcept
+			{
+				if (auto *p = allocate(string.size())) [[likely]]
+				{
+					sr::copy(string, p);
+					this->Length = to_bytes<char_type>((USHORT) string.size());
+				}
+			}
 		public:
 			pool_allocation_strategy() noexcept :
 				Base{}
 			{
 			}
 
-			pool_allocation_strategy(const pool_allocation_strategy &o) noexcept
+			pool_allocation_strategy(const pool_allocation_strategy &o) noexcept :
+				pool_allocation_strategy{ std::basic_string_view<char_type>{ o.Buffer, from_bytes<char_type>(o.Length) } }
 			{
-				sr::copy(o.get_view(), this->allocate(o.size()));
-				this->Length = this->MaximumLength;
 			}
 
 			pool_allocation_strategy &operator =(const pool_allocation_strategy &o) noexcept
 			{
-				sr::copy(o.get_view(), this->allocate(o.size()));
-				this->Length = to_bytes<char_type>(o.size());
+				if (this != &o)
+					*this = std::basic_string_view<char_type>{ o.Buffer, from_bytes<char_type>(o.Length) };
 
 				return *this;
 			}
@@ -94,17 +454,15 @@ namespace drv
 				return *this;
 			}
 
-			pool_allocation_strategy(std::basic_string_view<char_type> string) noexcept
+			pool_allocation_strategy(std::basic_string_view<char_type> string) noexcept :
+				Base{}
 			{
-				sr::copy(string, this->allocate(string.size()));
-				this->Length = this->MaximumLength;
+				assign(string);
 			}
 
 			pool_allocation_strategy &operator =(std::basic_string_view<char_type> string) noexcept
 			{
-				sr::copy(string, this->allocate(string.size()));
-				this->Length = to_bytes<char_type>((USHORT) string.size());
-
+				assign(string);
 				return *this;
 			}
 
@@ -120,6 +478,104 @@ namespace drv
 			}
 		};
 
+		/// <summary>
+		/// Strategy for strings that take their buffers from a monotonic arena, such as names built while servicing a request
+		/// Buffers are not freed individually, they are released together with the arena. The string must not outlive the arena
+		/// </summary>
+		template<class Base = UNICODE_STRING>
+		class arena_allocation_strategy : public Base
+		{
+		protected:
+			using char_type = std::decay_t<decltype(*std::declval<Base>().Buffer)>;
+
+		private:
+			monotonic_arena *arena{};
+
+			void assign(std::basic_string_view<char_type> string) noexcept
+			{
+				// Reuse the buffer if it is large enough, the zero terminator is kept for compatibility with OS support for strings
+				if (string.size() + 1 > from_bytes<char_type>(this->MaximumLength))
+				{
+					auto *p = arena && string.size() < from_bytes<char_type>(USHORT{ 0xffff }) ? arena->allocate_array<char_type>(string.size() + 1) : nullptr;
+					if (!p) [[unlikely]]
+					{
+						// Leave the string empty, as pool_allocation_strategy does when the pool is exhausted
+						this->Length = 0;
+						return;
+					}
+					this->Buffer = p;
+					this->MaximumLength = to_bytes<char_type>((USHORT)(string.size() + 1));
+				}
+
+				sr::copy(string, this->Buffer);
+				this->Buffer[string.size()] = 0;
+				this->Length = to_bytes<char_type>((USHORT) string.size());
+			}
+
+		public:
+			arena_allocation_strategy() noexcept :
+				Base{}
+			{
+			}
+
+			explicit arena_allocation_strategy(monotonic_arena &arena) noexcept :
+				Base{},
+				arena{ &arena }
+			{
+			}
+
+			arena_allocation_strategy(monotonic_arena &arena, std::basic_string_view<char_type> string) noexcept :
+				Base{},
+				arena{ &arena }
+			{
+				assign(string);
+			}
+
+			// A copy is made in the arena of the source string
+			arena_allocation_strategy(const arena_allocation_strategy &o) noexcept :
+				Base{},
+				arena{ o.arena }
+			{
+				assign({ o.Buffer, from_bytes<char_type>(o.Length) });
+			}
+
+			arena_allocation_strategy &operator =(const arena_allocation_strategy &o) noexcept
+			{
+				if (this != &o)
+				{
+					if (!arena)
+						arena = o.arena;
+					assign({ o.Buffer, from_bytes<char_type>(o.Length) });
+				}
+				return *this;
+			}
+
+			arena_allocation_strategy(arena_allocation_strategy &&o) noexcept :
+				Base{ std::move(o) },
+				arena{ o.arena }
+			{
+				static_cast<Base &>(o) = {};
+			}
+
+			arena_allocation_strategy &operator =(arena_allocation_strategy &&o) noexcept
+			{
+				std::swap(static_cast<Base &>(*this), static_cast<Base &>(o));
+				std::swap(arena, o.arena);
+				return *this;
+			}
+
+			arena_allocation_strategy &operator =(std::basic_string_view<char_type> string) noexcept
+			{
+				assign(string);
+				return *this;
+			}
+
+			void free() noexcept
+			{
+				static_cast<Base &>(*this) = {};
+			}
+		};
+
 		template<class Base = UNICODE_STRING>
 		class sys_allocation_strategy : public Base
 		{
@@ -249,14 +705,21 @@ namespace drv
 
 			constexpr bool operator ==(std::basic_string_view<char_type> v) const noexcept
 			{
-				return this->get_view() == v;
+				if consteval
+				{
+					return this->get_view() == v;
+				}
+				else
+				{
+					return this->size() == v.size() && string_simd::equal(this->data(), v.data(), v.size());
+				}
 			}
 
 			template<template<class> class OtherStrategy>
 			[[nodiscard]]
 			constexpr bool operator ==(const string_t<Base, OtherStrategy> &o) const noexcept
 			{
-				return this->get_view() == o.get_view();
+				return *this == o.get_view();
 			}
 
 			template<template<class> class OtherStrategy>
@@ -272,6 +735,30 @@ namespace drv
 				return compare_safe_equal(get_view(), v);
 			}
 
+			[[nodiscard]]
+			bool starts_with(std::basic_string_view<char_type> prefix) const noexcept
+			{
+				return prefix.size() <= size() && string_simd::equal(data(), prefix.data(), prefix.size());
+			}
+
+			[[nodiscard]]
+			bool starts_with_case_insensitive(std::basic_string_view<char_type> prefix) const noexcept
+			{
+				return prefix.size() <= size() && string_simd::equal_case_insensitive(data(), prefix.data(), prefix.size());
+			}
+
+			[[nodiscard]]
+			size_t hash() const noexcept
+			{
+				return string_simd::hash(data(), size());
+			}
+
+			[[nodiscard]]
+			size_t hash_case_insensitive() const noexcept
+			{
+				return string_simd::hash_case_insensitive(data(), size());
+			}
+
 			[[nodiscard]]
 			constexpr auto *data(this auto &self) noexcept
 			{
@@ -329,6 +816,43 @@ namespace drv
 	using sys_unicode_string_t = details::string_t<UNICODE_STRING, details::sys_allocation_strategy>;
 	using static_unicode_string_t = details::string_t<UNICODE_STRING, details::static_allocation_strategy>;
 	using external_unicode_string_t = details::string_t<UNICODE_STRING, details::external_allocation_strategy>;
+	using arena_unicode_string_t = details::string_t<UNICODE_STRING, details::arena_allocation_strategy>;
+
+	/// <summary>
+	/// Hash and equality for hash map keys matched without regard to case, as the object manager matches device names
+	/// </summary>
+	struct string_hash_case_insensitive
+	{
+		template<class Base, template<class> class AllocationStrategy>
+		[[nodiscard]]
+		size_t operator()(const details::string_t<Base, AllocationStrategy> &s) const noexcept
+		{
+			return s.hash_case_insensitive();
+		}
+	};
+
+	struct string_equal_case_insensitive
+	{
+		template<class Base, template<class> class L, template<class> class R>
+		[[nodiscard]]
+		bool operator()(const details::string_t<Base, L> &l, const details::string_t<Base, R> &r) const noexcept
+		{
+			return l.equal_case_insensitive(r);
+		}
+	};
+}
+
+namespace std
+{
+	template<class Base, template<class> class AllocationStrategy>
+	struct hash<drv::details::string_t<Base, AllocationStrategy>>
+	{
+		[[nodiscard]]
+		size_t operator()(const drv::details::string_t<Base, AllocationStrategy> &s) const noexcept
+		{
+			return s.hash();
+		}
+	};
 }
 
 
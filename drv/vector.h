@@ -0,0 +1,565 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include "allocator.h"
+#include "ntstatus.h"
+
+namespace drv
+{
+	namespace details
+	{
+		/// <summary>
+		/// Common part of static_vector and small_vector
+		/// Derived provides the storage through storage() and capacity() and may implement grow(required) to enlarge it
+		/// Operations that may need more storage return NTSTATUS instead of throwing, the vector is unchanged if they fail
+		/// </summary>
+		template<class T, class Derived>
+		class vector_base
+		{
+			static_assert(std::is_nothrow_move_constructible_v<T>, "Elements must be nothrow move constructible");
+			static_assert(std::is_nothrow_destructible_v<T>);
+
+		protected:
+			size_t count{};
+
+			constexpr vector_base() = default;
+
+			[[nodiscard]]
+			T *storage() noexcept
+			{
+				return static_cast<Derived *>(this)->storage();
+			}
+
+			[[nodiscard]]
+			const T *storage() const noexcept
+			{
+				return static_cast<const Derived *>(this)->storage();
+			}
+
+			[[nodiscard]]
+			NTSTATUS ensure_capacity(size_t required) noexcept
+			{
+				if (required <= capacity()) [[likely]]
+					return STATUS_SUCCESS;
+				return static_cast<Derived *>(this)->grow(required);
+			}
+
+			void destroy_all() noexcept
+			{
+				std::destroy_n(storage(), count);
+				count = 0;
+			}
+
+			/// <summary>
+			/// Check if the range refers to elements of this vector. Addresses are compared with std::less, since the built-in comparison
+			/// of pointers into different objects is unspecified
+			/// </summary>
+			[[nodiscard]]
+			bool is_own_range(std::span<const T> values) const noexcept
+			{
+				return !values.empty() && !std::less<>{}(values.data(), storage()) && std::less<>{}(values.data(), storage() + count);
+			}
+
+		public:
+			using value_type = T;
+			using size_type = size_t;
+			using reference = T &;
+			using const_reference = const T &;
+			using iterator = T *;
+			using const_iterator = const T *;
+
+			[[nodiscard]]
+			size_t capacity() const noexcept
+			{
+				return static_cast<const Derived *>(this)->capacity();
+			}
+
+			[[nodiscard]]
+			size_t size() const noexcept
+			{
+				return count;
+			}
+
+			[[nodiscard]]
+			bool empty() const noexcept
+			{
+				return count == 0;
+			}
+
+			[[nodiscard]]
+			T *data() noexcept
+			{
+				return storage();
+			}
+
+			[[nodiscard]]
+			const T *data() const noexcept
+			{
+				return storage();
+			}
+
+			[[nodiscard]]
+			iterator begin() noexcept
+			{
+				return storage();
+			}
+
+			[[nodiscard]]
+			iterator end() noexcept
+			{
+				return storage() + count;
+			}
+
+			[[nodiscard]]
+			const_iterator begin() const noexcept
+			{
+				return storage();
+			}
+
+			[[nodiscard]]
+			const_iterator end() const noexcept
+			{
+				return storage() + count;
+			}
+
+			[[nodiscard]]
+			T &operator [](size_t index) noexcept
+			{
+				assert(index < count);
+				return storage()[index];
+			}
+
+			[[nodiscard]]
+			const T &operator [](size_t index) const noexcept
+			{
+				assert(index < count);
+				return storage()[index];
+			}
+
+			[[nodiscard]]
+			T &front() noexcept
+			{
+				assert(count);
+				return storage()[0];
+			}
+
+			[[nodiscard]]
+			const T &front() const noexcept
+			{
+				assert(count);
+				return storage()[0];
+			}
+
+			[[nodiscard]]
+			T &back() noexcept
+			{
+				assert(count);
+				return storage()[count - 1];
+			}
+
+			[[nodiscard]]
+			const T &back() const noexcept
+			{
+				assert(count);
+				return storage()[count - 1];
+			}
+
+			operator std::span<T>() noexcept
+			{
+				return { storage(), count };
+			}
+
+			operator std::span<const T>() const noexcept
+			{
+				return { storage(), count };
+			}
+
+			/// <summary>
+			/// Make sure the vector can hold at least `new_capacity` elements
+			/// </summary>
+			[[nodiscard]]
+			NTSTATUS reserve(size_t new_capacity) noexcept
+			{
+				return ensure_capacity(new_capacity);
+			}
+
+			/// <summary>
+			/// Construct a new element at the end of the vector
+			/// </summary>
+			/// <returns>STATUS_SUCCESS or an error if the storage could not be enlarged, the element is not constructed in this case</returns>
+			template<class...Args>
+				requires std::constructible_from<T, Args &&...>
+			[[nodiscard]]
+			NTSTATUS emplace_back(Args &&...args) noexcept
+			{
+				if (count == capacity()) [[unlikely]]
+				{
+					// An argument may refer to an element of this vector, construct the new element before storage is reallocated
+					T value(std::forward<Args>(args)...);
+					if (auto status = ensure_capacity(count + 1); !nt_success(status))
+						return status;
+					std::construct_at(storage() + count, std::move(value));
+				}
+				else
+					std::construct_at(storage() + count, std::forward<Args>(args)...);
+				++count;
+				return STATUS_SUCCESS;
+			}
+
+			[[nodiscard]]
+			NTSTATUS push_back(const T &value) noexcept
+			{
+				return emplace_back(value);
+			}
+
+			[[nodiscard]]
+			NTSTATUS push_back(T &&value) noexcept
+			{
+				return emplace_back(std::move(value));
+			}
+
+			/// <summary>
+			/// Append copies of all elements of a range
+			/// </summary>
+			[[nodiscard]]
+			NTSTATUS append(std::span<const T> values) noexcept
+			{
+				// The range may refer to elements of this vector, which are moved if storage is reallocated, so find them again by index
+				const auto own = is_own_range(values);
+				const auto offset = own ? static_cast<size_t>(values.data() - storage()) : 0;
+				if (auto status = ensure_capacity(count + values.size()); !nt_success(status))
+					return status;
+				if (own)
+					values = { storage() + offset, values.size() };
+				std::uninitialized_copy(values.begin(), values.end(), storage() + count);
+				count += values.size();
+				return STATUS_SUCCESS;
+			}
+
+			/// <summary>
+			/// Replace the contents of the vector with copies of all elements of a range
+			/// </summary>
+			[[nodiscard]]
+			NTSTATUS assign(std::span<const T> values) noexcept
+			{
+				// A range of this vector's own elements is kept by erasing everything around it
+				if (is_own_range(values))
+				{
+					const auto first = begin() + (values.data() - storage());
+					erase(first + values.size(), end());
+					erase(begin(), first);
+					return STATUS_SUCCESS;
+				}
+
+				if (auto status = ensure_capacity(values.size()); !nt_success(status))
+					return status;
+				destroy_all();
+				std::uninitialized_copy(values.begin(), values.end(), storage());
+				count = values.size();
+				return STATUS_SUCCESS;
+			}
+
+			/// <summary>
+			/// Insert a new element before `position`
+			/// </summary>
+			template<class...Args>
+				requires std::constructible_from<T, Args &&...>
+			[[nodiscard]]
+			NTSTATUS emplace(const_iterator position, Args &&...args) noexcept
+			{
+				const auto index = static_cast<size_t>(position - begin());
+				assert(index <= count);
+				if (auto status = emplace_back(std::forward<Args>(args)...); !nt_success(status))
+					return status;
+				std::rotate(begin() + index, end() - 1, end());
+				return STATUS_SUCCESS;
+			}
+
+			/// <summary>
+			/// Change the number of elements, new elements are value-initialized
+			/// </summary>
+			[[nodiscard]]
+			NTSTATUS resize(size_t new_size) noexcept requires std::default_initializable<T>
+			{
+				if (new_size <= count)
+				{
+					std::destroy(begin() + new_size, end());
+					count = new_size;
+					return STATUS_SUCCESS;
+				}
+
+				if (auto status = ensure_capacity(new_size); !nt_success(status))
+					return status;
+				std::uninitialized_value_construct(end(), begin() + new_size);
+				count = new_size;
+				return STATUS_SUCCESS;
+			}
+
+			void pop_back() noexcept
+			{
+				assert(count);
+				std::destroy_at(storage() + --count);
+			}
+
+			iterator erase(const_iterator first, const_iterator last) noexcept
+			{
+				const auto from = begin() + (first - begin());
+				const auto to = begin() + (last - begin());
+				const auto new_end = std::move(to, end(), from);
+				std::destroy(new_end, end());
+				count = static_cast<size_t>(new_end - begin());
+				return from;
+			}
+
+			iterator erase(const_iterator position) noexcept
+			{
+				return erase(position, position + 1);
+			}
+
+			void clear() noexcept
+			{
+				destroy_all();
+			}
+		};
+
+		/// <summary>
+		/// Vector with a fixed capacity of N elements stored inside the object, it never allocates
+		/// Operations that would exceed the capacity fail with STATUS_BUFFER_TOO_SMALL
+		/// </summary>
+		template<class T, size_t N>
+		class static_vector : public vector_base<T, static_vector<T, N>>
+		{
+			using base = vector_base<T, static_vector<T, N>>;
+			friend base;
+
+			alignas(T) std::byte buffer[sizeof(T) * N];
+
+			[[nodiscard]]
+			T *storage() noexcept
+			{
+				return reinterpret_cast<T *>(buffer);
+			}
+
+			[[nodiscard]]
+			const T *storage() const noexcept
+			{
+				return reinterpret_cast<const T *>(buffer);
+			}
+
+			static NTSTATUS grow([[maybe_unused]] size_t required) noexcept
+			{
+				return STATUS_BUFFER_TOO_SMALL;
+			}
+
+		public:
+			static_vector() = default;
+
+			static_vector(const static_vector &o) noexcept requires std::copy_constructible<T>
+			{
+				std::uninitialized_copy(o.begin(), o.end(), storage());
+				this->count = o.count;
+			}
+
+			static_vector(static_vector &&o) noexcept
+			{
+				std::uninitialized_move(o.begin(), o.end(), storage());
+				this->count = o.count;
+				o.destroy_all();
+			}
+
+			static_vector &operator =(const static_vector &o) noexcept requires std::copy_constructible<T>
+			{
+				if (this != &o)
+				{
+					this->destroy_all();
+					std::uninitialized_copy(o.begin(), o.end(), storage());
+					this->count = o.count;
+				}
+				return *this;
+			}
+
+			static_vector &operator =(static_vector &&o) noexcept
+			{
+				if (this != &o)
+				{
+					this->destroy_all();
+					std::uninitialized_move(o.begin(), o.end(), storage());
+					this->count = o.count;
+					o.destroy_all();
+				}
+				return *this;
+			}
+
+			~static_vector()
+			{
+				this->destroy_all();
+			}
+
+			[[nodiscard]]
+			static constexpr size_t capacity() noexcept
+			{
+				return N;
+			}
+		};
+
+		/// <summary>
+		/// Vector that stores up to N elements inside the object and moves to pool memory when it grows beyond that
+		/// Operations that fail to allocate return STATUS_INSUFFICIENT_RESOURCES and leave the vector unchanged
+		/// The vector cannot be copied implicitly, since the copy may fail. Use assign instead
+		/// </summary>
+		/// <typeparam name="T">Element type</typeparam>
+		/// <typeparam name="N">Number of elements stored inline</typeparam>
+		/// <typeparam name="Pool">Pool used for the heap storage</typeparam>
+		template<class T, size_t N, pool_type Pool = pool_type::NonPaged>
+		class small_vector : public vector_base<T, small_vector<T, N, Pool>>
+		{
+			static_assert(alignof(T) <= MEMORY_ALLOCATION_ALIGNMENT, "Pool allocations do not support the alignment of T");
+
+			using base = vector_base<T, small_vector<T, N, Pool>>;
+			friend base;
+
+			T *first;
+			size_t capacity_{ N };
+			alignas(T) std::byte buffer[sizeof(T) * N];
+
+			[[nodiscard]]
+			bool is_inline() const noexcept
+			{
+				return first == reinterpret_cast<const T *>(buffer);
+			}
+
+			[[nodiscard]]
+			T *storage() noexcept
+			{
+				return first;
+			}
+
+			[[nodiscard]]
+			const T *storage() const noexcept
+			{
+				return first;
+			}
+
+			[[nodiscard]]
+			NTSTATUS grow(size_t required) noexcept
+			{
+				constexpr const size_t max_elements = SIZE_MAX / sizeof(T);
+				if (required > max_elements) [[unlikely]]
+					return STATUS_INTEGER_OVERFLOW;
+
+				// Grow geometrically to make a sequence of appends amortized O(1)
+				const auto new_capacity = std::max(required, capacity_ <= max_elements / 2 ? capacity_ * 2 : max_elements);
+				auto *p = static_cast<T *>(::operator new(new_capacity * sizeof(T), pool_options{ .pool = Pool, .tag = VectorTag, .uninitialized = true }));
+				if (!p) [[unlikely]]
+					return STATUS_INSUFFICIENT_RESOURCES;
+
+				std::uninitialized_move(first, first + this->count, p);
+				std::destroy_n(first, this->count);
+				free_storage();
+				first = p;
+				capacity_ = new_capacity;
+				return STATUS_SUCCESS;
+			}
+
+			void free_storage() noexcept
+			{
+				if (!is_inline())
+					::operator delete(first);
+			}
+
+			void take(small_vector &o) noexcept
+			{
+				if (o.is_inline())
+				{
+					first = reinterpret_cast<T *>(buffer);
+					capacity_ = N;
+					std::uninitialized_move(o.begin(), o.end(), first);
+					this->count = o.count;
+					o.destroy_all();
+				}
+				else
+				{
+					// Steal the heap storage
+					first = std::exchange(o.first, reinterpret_cast<T *>(o.buffer));
+					capacity_ = std::exchange(o.capacity_, N);
+					this->count = std::exchange(o.count, 0);
+				}
+			}
+
+		public:
+			small_vector() noexcept :
+				first{ reinterpret_cast<T *>(buffer) }
+			{
+			}
+
+			small_vector(const small_vector &) = delete;
+			small_vector &operator =(const small_vector &) = delete;
+
+			small_vector(small_vector &&o) noexcept
+			{
+				take(o);
+			}
+
+			small_vector &operator =(small_vector &&o) noexcept
+			{
+				if (this != &o)
+				{
+					this->destroy_all();
+					free_storage();
+					take(o);
+				}
+				return *this;
+			}
+
+			~small_vector()
+			{
+				this->destroy_all();
+				free_storage();
+			}
+
+			[[nodiscard]]
+			size_t capacity() const noexcept
+			{
+				return capacity_;
+			}
+
+			/// <summary>
+			/// Move the elements back to the inline storage or to a smaller heap block if possible
+			/// </summary>
+			[[nodiscard]]
+			NTSTATUS shrink_to_fit() noexcept
+			{
+				if (is_inline() || this->count == capacity_)
+					return STATUS_SUCCESS;
+
+				T *p;
+				if (this->count <= N)
+					p = reinterpret_cast<T *>(buffer);
+				else if (p = static_cast<T *>(::operator new(this->count * sizeof(T), pool_options{ .pool = Pool, .tag = VectorTag, .uninitialized = true })); !p) [[unlikely]]
+					return STATUS_INSUFFICIENT_RESOURCES;
+
+				std::uninitialized_move(first, first + this->count, p);
+				std::destroy_n(first, this->count);
+				::operator delete(first);
+				first = p;
+				capacity_ = std::max(this->count, N);
+				return STATUS_SUCCESS;
+			}
+		};
+	}
+
+	using details::static_vector;
+	using details::small_vector;
+}
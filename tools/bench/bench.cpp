@@ -0,0 +1,670 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Benchmark for the sample drivers
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "pch.h"
+#include <wdm/function/function_ex.h>
+#include <wdm/filter/filter_ex.h>
+
+namespace
+{
+	// Size of the buffer of a private channel of the function driver
+	constexpr const size_t ChannelBufferSize = 256 * 1024;
+	// Size of the buffer shared by the handles that use channel 0
+	constexpr const size_t SharedBufferSize = 1 * 1024 * 1024;
+	// Number of private channels of the function driver
+	constexpr const unsigned PrivateChannels = 63;
+	// Time a thread waits for a completion before it checks whether the run is over
+	constexpr const DWORD CompletionPollMs = 50;
+
+	enum class target_t
+	{
+		function,
+		filter,
+	};
+
+	enum class workload_t
+	{
+		read_write,		// WriteFile followed by ReadFile of the same size
+		ioctl,			// IOCTL_WRITE followed by IOCTL_READ of the same size
+		version,		// IOCTL_GET_VERSION
+	};
+
+	enum class io_mode_t
+	{
+		sync,
+		overlapped,
+	};
+
+	enum class format_t
+	{
+		json,
+		csv,
+	};
+
+	struct options_t
+	{
+		target_t target{ target_t::function };
+		workload_t workload{ workload_t::read_write };
+		io_mode_t mode{ io_mode_t::sync };
+		format_t format{ format_t::json };
+		std::vector<size_t> sizes{ 64, 4096, 65536 };
+		std::vector<unsigned> threads{ 1 };
+		unsigned depth{ 1 };
+		unsigned duration_ms{ 5000 };
+		unsigned warmup_ms{ 1000 };
+		bool private_channels{};
+	};
+
+	/// <summary>
+	/// Result of a single thread
+	/// </summary>
+	struct thread_result_t
+	{
+		std::vector<u64> latencies;		// performance counter ticks
+		u64 bytes{};
+		u64 errors{};
+	};
+
+	/// <summary>
+	/// Time window of a run, in performance counter ticks. Operations started before `begin` are warm-up and are not counted
+	/// </summary>
+	struct window_t
+	{
+		i64 begin;
+		i64 end;
+	};
+
+	[[nodiscard]]
+	i64 now() noexcept
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return counter.QuadPart;
+	}
+
+	[[nodiscard]]
+	i64 frequency() noexcept
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		return frequency.QuadPart;
+	}
+
+	template<class T>
+	[[nodiscard]]
+	std::optional<T> parse_number(std::string_view text) noexcept
+	{
+		T value{};
+		const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+		if (ec != std::errc{} || end != text.data() + text.size())
+			return std::nullopt;
+		return value;
+	}
+
+	/// <summary>
+	/// Parse a comma-separated list of positive numbers
+	/// </summary>
+	template<class T>
+	[[nodiscard]]
+	std::optional<std::vector<T>> parse_list(std::string_view text) noexcept
+	{
+		std::vector<T> result;
+		while (!text.empty())
+		{
+			const auto comma = text.find(',');
+			const auto value = parse_number<T>(text.substr(0, comma));
+			if (!value || !*value)
+				return std::nullopt;
+			result.push_back(*value);
+			if (comma == text.npos)
+				break;
+			text.remove_prefix(comma + 1);
+		}
+		if (result.empty())
+			return std::nullopt;
+		return result;
+	}
+
+	void usage() noexcept
+	{
+		std::println(stderr,
+			"Usage: bench [options]\n"
+			"  --target function|filter          device to open (default: function)\n"
+			"  --workload read-write|ioctl|version\n"
+			"                                    requests to send (default: read-write, version for the filter)\n"
+			"  --mode sync|overlapped            I/O mode (default: sync)\n"
+			"  --sizes N[,N...]                  message sizes in bytes (default: 64,4096,65536)\n"
+			"  --threads N[,N...]                thread counts (default: 1)\n"
+			"  --depth N                         requests in flight per thread in overlapped mode (default: 1)\n"
+			"  --duration MS                     measured time of each run (default: 5000)\n"
+			"  --warmup MS                       time before measurement starts (default: 1000)\n"
+			"  --channels                        give each thread a private channel of the function driver\n"
+			"  --format json|csv                 output format (default: json)");
+	}
+
+	[[nodiscard]]
+	std::optional<options_t> parse_options(std::span<char *> args) noexcept
+	{
+		options_t options;
+		bool workload_set{};
+
+		for (size_t i = 0; i < args.size(); ++i)
+		{
+			const std::string_view name{ args[i] };
+			if (name == "--channels")
+			{
+				options.private_channels = true;
+				continue;
+			}
+
+			if (i + 1 == args.size())
+				return std::nullopt;
+			const std::string_view value{ args[++i] };
+
+			if (name == "--target")
+			{
+				if (value == "function")
+					options.target = target_t::function;
+				else if (value == "filter")
+					options.target = target_t::filter;
+				else
+					return std::nullopt;
+			}
+			else if (name == "--workload")
+			{
+				if (value == "read-write")
+					options.workload = workload_t::read_write;
+				else if (value == "ioctl")
+					options.workload = workload_t::ioctl;
+				else if (value == "version")
+					options.workload = workload_t::version;
+				else
+					return std::nullopt;
+				workload_set = true;
+			}
+			else if (name == "--mode")
+			{
+				if (value == "sync")
+					options.mode = io_mode_t::sync;
+				else if (value == "overlapped")
+					options.mode = io_mode_t::overlapped;
+				else
+					return std::nullopt;
+			}
+			else if (name == "--format")
+			{
+				if (value == "json")
+					options.format = format_t::json;
+				else if (value == "csv")
+					options.format = format_t::csv;
+				else
+					return std::nullopt;
+			}
+			else if (name == "--sizes")
+			{
+				auto sizes = parse_list<size_t>(value);
+				if (!sizes)
+					return std::nullopt;
+				options.sizes = std::move(*sizes);
+			}
+			else if (name == "--threads")
+			{
+				auto threads = parse_list<unsigned>(value);
+				if (!threads)
+					return std::nullopt;
+				options.threads = std::move(*threads);
+			}
+			else if (name == "--depth")
+			{
+				const auto depth = parse_number<unsigned>(value);
+				if (!depth || !*depth)
+					return std::nullopt;
+				options.depth = *depth;
+			}
+			else if (name == "--duration")
+			{
+				const auto duration = parse_number<unsigned>(value);
+				if (!duration || !*duration)
+					return std::nullopt;
+				options.duration_ms = *duration;
+			}
+			else if (name == "--warmup")
+			{
+				const auto warmup = parse_number<unsigned>(value);
+				if (!warmup)
+					return std::nullopt;
+				options.warmup_ms = *warmup;
+			}
+			else
+				return std::nullopt;
+		}
+
+		// The filter only understands IOCTL_GET_VERSION, the function driver does not handle it
+		if (options.target == target_t::filter && !workload_set)
+			options.workload = workload_t::version;
+		if ((options.target == target_t::filter) != (options.workload == workload_t::version))
+			return std::nullopt;
+
+		// Version requests have a fixed size
+		if (options.workload == workload_t::version)
+			options.sizes = { sizeof(filter::version_info) };
+
+		return options;
+	}
+
+	/// <summary>
+	/// Get the path of the first present device that exposes the given interface
+	/// </summary>
+	[[nodiscard]]
+	std::optional<std::wstring> find_device(const GUID &interface_guid) noexcept
+	{
+		for (;;)
+		{
+			ULONG length{};
+			if (CM_Get_Device_Interface_List_SizeW(&length, const_cast<GUID *>(&interface_guid), nullptr, CM_GET_DEVICE_INTERFACE_LIST_PRESENT) != CR_SUCCESS)
+				return std::nullopt;
+
+			std::wstring list(length, L'\0');
+			const auto result = CM_Get_Device_Interface_ListW(const_cast<GUID *>(&interface_guid), nullptr, list.data(), length, CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
+			// An interface may arrive between the two calls
+			if (result == CR_BUFFER_SMALL)
+				continue;
+			if (result != CR_SUCCESS || list.empty() || !list[0])
+				return std::nullopt;
+
+			// The list is a sequence of null-terminated strings, take the first one
+			return std::wstring{ list.c_str() };
+		}
+	}
+
+	[[nodiscard]]
+	wil::unique_hfile open_device(const std::wstring &path, const options_t &options, unsigned thread_index) noexcept
+	{
+		std::wstring name{ path };
+		if (options.target == target_t::function && options.private_channels)
+			name += L'\\' + std::to_wstring(1 + thread_index % PrivateChannels);
+
+		const DWORD flags = options.mode == io_mode_t::overlapped ? FILE_FLAG_OVERLAPPED : 0;
+		return wil::unique_hfile{ CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, flags, nullptr) };
+	}
+
+	/// <summary>
+	/// A write and a read in synchronous mode must not block on a full buffer, otherwise the threads of a run wait for each other forever
+	/// </summary>
+	[[nodiscard]]
+	bool fits_into_buffer(const options_t &options, size_t size, unsigned threads) noexcept
+	{
+		if (options.workload == workload_t::version || options.mode == io_mode_t::overlapped)
+			return true;
+
+		if (options.private_channels)
+		{
+			// Threads share a private channel when there are more of them than channels
+			const auto per_channel = (threads + PrivateChannels - 1) / PrivateChannels;
+			return per_channel * size <= ChannelBufferSize;
+		}
+		return threads * size <= SharedBufferSize;
+	}
+
+	//
+	// Synchronous mode
+	//
+
+	[[nodiscard]]
+	bool sync_write(HANDLE device, workload_t workload, std::span<std::byte> buffer) noexcept
+	{
+		DWORD bytes{};
+		const auto ok = workload == workload_t::ioctl ?
+			DeviceIoControl(device, function::IOCTL_WRITE, nullptr, 0, buffer.data(), static_cast<DWORD>(buffer.size()), &bytes, nullptr) :
+			WriteFile(device, buffer.data(), static_cast<DWORD>(buffer.size()), &bytes, nullptr);
+		return ok && bytes == buffer.size();
+	}
+
+	/// <summary>
+	/// Read until the buffer is full, as the driver completes a read with the data that is available
+	/// </summary>
+	[[nodiscard]]
+	bool sync_read(HANDLE device, workload_t workload, std::span<std::byte> buffer) noexcept
+	{
+		while (!buffer.empty())
+		{
+			DWORD bytes{};
+			const auto ok = workload == workload_t::ioctl ?
+				DeviceIoControl(device, function::IOCTL_READ, nullptr, 0, buffer.data(), static_cast<DWORD>(buffer.size()), &bytes, nullptr) :
+				ReadFile(device, buffer.data(), static_cast<DWORD>(buffer.size()), &bytes, nullptr);
+			if (!ok || !bytes)
+				return false;
+			buffer = buffer.subspan(bytes);
+		}
+		return true;
+	}
+
+	/// <summary>
+	/// Run synchronous operations until the end of the window
+	/// An operation of the read-write and ioctl workloads is a round trip: the message is written and then read back
+	/// </summary>
+	void run_sync(HANDLE device, const options_t &options, size_t size, window_t window, thread_result_t &result) noexcept
+	{
+		std::vector<std::byte> buffer(size, std::byte{ 0x5a });
+
+		for (;;)
+		{
+			const auto start = now();
+			if (start >= window.end)
+				break;
+
+			bool ok;
+			if (options.workload == workload_t::version)
+			{
+				filter::version_info info{};
+				DWORD bytes{};
+				ok = DeviceIoControl(device, filter::IOCTL_GET_VERSION, nullptr, 0, &info, sizeof(info), &bytes, nullptr) && bytes == sizeof(info);
+			}
+			else
+				ok = sync_write(device, options.workload, buffer) && sync_read(device, options.workload, buffer);
+
+			if (start < window.begin)
+				continue;
+
+			if (!ok)
+			{
+				++result.errors;
+				continue;
+			}
+			result.latencies.push_back(static_cast<u64>(now() - start));
+			result.bytes += size;
+		}
+	}
+
+	//
+	// Overlapped mode
+	//
+
+	/// <summary>
+	/// Request slot of a thread in overlapped mode. Slots with even indices write, slots with odd indices read
+	/// </summary>
+	struct slot_t
+	{
+		OVERLAPPED overlapped{};
+		std::vector<std::byte> buffer;
+		i64 start{};
+		bool write{};
+	};
+
+	[[nodiscard]]
+	bool submit(HANDLE device, const options_t &options, slot_t &slot) noexcept
+	{
+		slot.overlapped = {};
+		slot.start = now();
+
+		const auto data = slot.buffer.data();
+		const auto length = static_cast<DWORD>(slot.buffer.size());
+		BOOL ok;
+		switch (options.workload)
+		{
+		case workload_t::version:
+			ok = DeviceIoControl(device, filter::IOCTL_GET_VERSION, nullptr, 0, data, length, nullptr, &slot.overlapped);
+			break;
+		case workload_t::ioctl:
+			ok = DeviceIoControl(device, slot.write ? function::IOCTL_WRITE : function::IOCTL_READ, nullptr, 0, data, length, nullptr, &slot.overlapped);
+			break;
+		default:
+			ok = slot.write ?
+				WriteFile(device, data, length, nullptr, &slot.overlapped) :
+				ReadFile(device, data, length, nullptr, &slot.overlapped);
+			break;
+		}
+
+		// Completion is posted to the port both for synchronous success and for pending requests
+		return ok || GetLastError() == ERROR_IO_PENDING;
+	}
+
+	/// <summary>
+	/// Keep `depth` requests of each kind in flight until the end of the window. An operation is a single request
+	/// </summary>
+	void run_overlapped(HANDLE device, const options_t &options, size_t size, window_t window, thread_result_t &result) noexcept
+	{
+		wil::unique_handle port{ CreateIoCompletionPort(device, nullptr, 0, 1) };
+		if (!port)
+		{
+			++result.errors;
+			return;
+		}
+
+		// Read-write workloads need a reader for each writer, version requests are all of one kind
+		const auto kinds = options.workload == workload_t::version ? 1u : 2u;
+		std::vector<slot_t> slots(options.depth * kinds);
+		for (size_t i = 0; i < slots.size(); ++i)
+		{
+			slots[i].buffer.resize(size, std::byte{ 0x5a });
+			slots[i].write = kinds == 2 && !(i % 2);
+		}
+
+		size_t in_flight{};
+		for (auto &slot : slots)
+		{
+			if (submit(device, options, slot))
+				++in_flight;
+			else
+				++result.errors;
+		}
+
+		std::array<OVERLAPPED_ENTRY, 64> entries;
+		bool stopping{};
+		while (in_flight)
+		{
+			if (!stopping && now() >= window.end)
+			{
+				// Requests that wait for data or room in the buffer never complete on their own
+				stopping = true;
+				CancelIoEx(device, nullptr);
+			}
+
+			ULONG count{};
+			if (!GetQueuedCompletionStatusEx(port.get(), entries.data(), static_cast<ULONG>(entries.size()), &count, CompletionPollMs, FALSE))
+				continue;
+
+			const auto completed = now();
+			for (const auto &entry : std::span{ entries.data(), count })
+			{
+				auto &slot = *CONTAINING_RECORD(entry.lpOverlapped, slot_t, overlapped);
+				--in_flight;
+
+				// Internal holds the NTSTATUS of the request
+				const auto failed = static_cast<LONG>(entry.lpOverlapped->Internal) < 0;
+				if (stopping)
+					continue;
+
+				if (slot.start >= window.begin)
+				{
+					if (failed)
+						++result.errors;
+					else
+					{
+						result.latencies.push_back(static_cast<u64>(completed - slot.start));
+						result.bytes += entry.dwNumberOfBytesTransferred;
+					}
+				}
+
+				if (submit(device, options, slot))
+					++in_flight;
+				else
+					++result.errors;
+			}
+		}
+	}
+
+	//
+	// Report
+	//
+
+	struct summary_t
+	{
+		u64 ops{};
+		u64 bytes{};
+		u64 errors{};
+		double seconds{};
+		double p50_us{};
+		double p99_us{};
+		double p999_us{};
+		double max_us{};
+	};
+
+	[[nodiscard]]
+	summary_t summarize(std::vector<thread_result_t> &results, unsigned duration_ms) noexcept
+	{
+		summary_t summary;
+		summary.seconds = duration_ms / 1000.0;
+
+		std::vector<u64> latencies;
+		for (auto &result : results)
+		{
+			summary.bytes += result.bytes;
+			summary.errors += result.errors;
+			latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+		}
+		summary.ops = latencies.size();
+		if (latencies.empty())
+			return summary;
+
+		std::ranges::sort(latencies);
+		const auto us_per_tick = 1'000'000.0 / frequency();
+		const auto percentile = [&](double p) noexcept {
+			const auto index = std::min(static_cast<size_t>(p * latencies.size()), latencies.size() - 1);
+			return latencies[index] * us_per_tick;
+		};
+		summary.p50_us = percentile(0.5);
+		summary.p99_us = percentile(0.99);
+		summary.p999_us = percentile(0.999);
+		summary.max_us = latencies.back() * us_per_tick;
+		return summary;
+	}
+
+	[[nodiscard]]
+	std::string_view name_of(target_t target) noexcept
+	{
+		return target == target_t::function ? "function" : "filter";
+	}
+
+	[[nodiscard]]
+	std::string_view name_of(workload_t workload) noexcept
+	{
+		switch (workload)
+		{
+		case workload_t::ioctl:
+			return "ioctl";
+		case workload_t::version:
+			return "version";
+		default:
+			return "read-write";
+		}
+	}
+
+	[[nodiscard]]
+	std::string_view name_of(io_mode_t mode) noexcept
+	{
+		return mode == io_mode_t::sync ? "sync" : "overlapped";
+	}
+
+	void print_header(const options_t &options) noexcept
+	{
+		if (options.format == format_t::csv)
+			std::println("target,workload,mode,channels,size,threads,depth,ops,errors,ops_per_sec,mb_per_sec,p50_us,p99_us,p999_us,max_us");
+	}
+
+	void print_summary(const options_t &options, size_t size, unsigned threads, const summary_t &summary) noexcept
+	{
+		const auto ops_per_sec = summary.ops / summary.seconds;
+		const auto mb_per_sec = summary.bytes / summary.seconds / (1024.0 * 1024.0);
+		const auto channels = options.private_channels ? "private" : "shared";
+
+		if (options.format == format_t::csv)
+			std::println("{},{},{},{},{},{},{},{},{},{:.1f},{:.2f},{:.2f},{:.2f},{:.2f},{:.2f}",
+				name_of(options.target), name_of(options.workload), name_of(options.mode), channels, size, threads, options.depth,
+				summary.ops, summary.errors, ops_per_sec, mb_per_sec, summary.p50_us, summary.p99_us, summary.p999_us, summary.max_us);
+		else
+			std::println(R"({{"target":"{}","workload":"{}","mode":"{}","channels":"{}","size":{},"threads":{},"depth":{},"ops":{},"errors":{},)"
+				R"("ops_per_sec":{:.1f},"mb_per_sec":{:.2f},"p50_us":{:.2f},"p99_us":{:.2f},"p999_us":{:.2f},"max_us":{:.2f}}})",
+				name_of(options.target), name_of(options.workload), name_of(options.mode), channels, size, threads, options.depth,
+				summary.ops, summary.errors, ops_per_sec, mb_per_sec, summary.p50_us, summary.p99_us, summary.p999_us, summary.max_us);
+	}
+
+	/// <summary>
+	/// Run one configuration. All handles are opened before the threads start so that open time is not measured
+	/// </summary>
+	[[nodiscard]]
+	bool run(const std::wstring &path, const options_t &options, size_t size, unsigned threads) noexcept
+	{
+		std::vector<wil::unique_hfile> devices;
+		for (unsigned i = 0; i < threads; ++i)
+		{
+			auto device = open_device(path, options, i);
+			if (!device)
+			{
+				std::println(stderr, "Unable to open the device, error {}", GetLastError());
+				return false;
+			}
+			devices.push_back(std::move(device));
+		}
+
+		const auto ticks_per_ms = frequency() / 1000;
+		window_t window;
+		window.begin = now() + options.warmup_ms * ticks_per_ms;
+		window.end = window.begin + options.duration_ms * ticks_per_ms;
+
+		std::vector<thread_result_t> results(threads);
+		{
+			std::vector<std::jthread> workers;
+			for (unsigned i = 0; i < threads; ++i)
+				workers.emplace_back([&, i] {
+					const auto device = devices[i].get();
+					if (options.mode == io_mode_t::sync)
+						run_sync(device, options, size, window, results[i]);
+					else
+						run_overlapped(device, options, size, window, results[i]);
+				});
+		}
+
+		print_summary(options, size, threads, summarize(results, options.duration_ms));
+		return true;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const auto options = parse_options({ argv + 1, static_cast<size_t>(argc - 1) });
+	if (!options)
+	{
+		usage();
+		return 1;
+	}
+
+	const auto &interface_guid = options->target == target_t::function ? function::GUID_DEVINTERFACE_MY_FUNCTION : filter::GUID_DEVINTERFACE_MY_FILTER;
+	const auto path = find_device(interface_guid);
+	if (!path)
+	{
+		std::println(stderr, "The {} device is not present", name_of(options->target));
+		return 2;
+	}
+
+	print_header(*options);
+	for (const auto threads : options->threads)
+		for (const auto size : options->sizes)
+		{
+			if (!fits_into_buffer(*options, size, threads))
+			{
+				std::println(stderr, "Skipping size {} with {} threads: messages in flight do not fit into the channel buffer", size, threads);
+				continue;
+			}
+			if (!run(*path, *options, size, threads))
+				return 3;
+		}
+	return 0;
+}
@@ -0,0 +1,903 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// User-mode shim of the kernel APIs used by drv
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+// This header replaces <ntifs.h> and <wdm.h> in a user-mode build of the drv headers
+// It declares the kernel types the headers use with the fields they access and implements the routines they call on top of Win32:
+//   - IRQL is tracked per thread, raising it does not prevent preemption
+//   - every thread acts as its own processor, so per-processor state (queued_spin_lock) works as long as there are at most HostMaxProcessors threads
+//   - spin locks spin on the lock word, as the kernel ones do
+//   - IoCsq* routines follow the documented behavior of the system cancel-safe queue, IoCancelIrp runs the cancel routine synchronously
+//   - IoCompleteRequest runs completion routines and then calls host_irp_completed, IRPs are owned and freed by the caller
+//   - kernel timers never fire
+//   - threaded DPCs run synchronously on the thread that queues them
+//   - system threads and work items run on Win32 threads, which are not bound to processors
+// Non-inline routines are defined in km_shim_impl.h, which must be included by exactly one source file
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define WIN32_NO_STATUS
+#include <windows.h>
+#undef WIN32_NO_STATUS
+#include <ntstatus.h>
+#include <winternl.h>
+
+#include <cassert>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cwctype>
+#include <atomic>
+#include <bit>
+#include <new>
+#include <utility>
+#include <drv/intdefs.h>
+
+//
+// Basic definitions
+//
+
+#define PASSIVE_LEVEL 0
+#define APC_LEVEL 1
+#define DISPATCH_LEVEL 2
+
+#define IO_NO_INCREMENT 0
+
+#ifndef NT_SUCCESS
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+#endif
+
+#ifndef SYSTEM_CACHE_ALIGNMENT_SIZE
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#endif
+
+#define NT_ASSERT(e) assert(e)
+
+typedef UCHAR KIRQL, *PKIRQL;
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+typedef volatile LONG EX_SPIN_LOCK, *PEX_SPIN_LOCK;
+
+// Upper bound of the number of threads that may use per-processor state at the same time
+constexpr const ULONG HostMaxProcessors = 64;
+
+namespace host::details
+{
+	inline thread_local KIRQL current_irql{ PASSIVE_LEVEL };
+
+	/// <summary>
+	/// Number of the virtual processor of a thread, released when the thread exits
+	/// </summary>
+	class processor_slot
+	{
+		static inline constinit std::atomic<u64> used{};
+		ULONG number;
+
+	public:
+		processor_slot() noexcept
+		{
+			auto current = used.load(std::memory_order_relaxed);
+			do
+			{
+				assert(~current && "more than HostMaxProcessors threads use per-processor state");
+				number = static_cast<ULONG>(std::countr_one(current));
+			} while (!used.compare_exchange_weak(current, current | (u64{ 1 } << number), std::memory_order_relaxed));
+		}
+
+		processor_slot(const processor_slot &) = delete;
+		processor_slot &operator =(const processor_slot &) = delete;
+
+		~processor_slot()
+		{
+			used.fetch_and(~(u64{ 1 } << number), std::memory_order_relaxed);
+		}
+
+		[[nodiscard]]
+		ULONG get() const noexcept
+		{
+			return number;
+		}
+	};
+}
+
+[[nodiscard]]
+inline KIRQL KeGetCurrentIrql() noexcept
+{
+	return host::details::current_irql;
+}
+
+#define PAGED_CODE() assert(KeGetCurrentIrql() <= APC_LEVEL)
+
+//
+// Lists
+//
+
+inline void InitializeListHead(PLIST_ENTRY ListHead) noexcept
+{
+	ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+[[nodiscard]]
+inline bool IsListEmpty(const LIST_ENTRY *ListHead) noexcept
+{
+	return ListHead->Flink == ListHead;
+}
+
+inline bool RemoveEntryList(PLIST_ENTRY Entry) noexcept
+{
+	const auto next = Entry->Flink;
+	const auto prev = Entry->Blink;
+	prev->Flink = next;
+	next->Blink = prev;
+	return next == prev;
+}
+
+inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead) noexcept
+{
+	const auto entry = ListHead->Flink;
+	RemoveEntryList(entry);
+	return entry;
+}
+
+inline PLIST_ENTRY RemoveTailList(PLIST_ENTRY ListHead) noexcept
+{
+	const auto entry = ListHead->Blink;
+	RemoveEntryList(entry);
+	return entry;
+}
+
+inline void InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry) noexcept
+{
+	const auto prev = ListHead->Blink;
+	Entry->Flink = ListHead;
+	Entry->Blink = prev;
+	prev->Flink = Entry;
+	ListHead->Blink = Entry;
+}
+
+inline void InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry) noexcept
+{
+	const auto next = ListHead->Flink;
+	Entry->Flink = next;
+	Entry->Blink = ListHead;
+	next->Blink = Entry;
+	ListHead->Flink = Entry;
+}
+
+//
+// Strings
+//
+
+// The CRT tables stand in for the system upcase table
+[[nodiscard]]
+inline WCHAR RtlUpcaseUnicodeChar(WCHAR SourceCharacter) noexcept
+{
+	return static_cast<WCHAR>(std::towupper(SourceCharacter));
+}
+
+[[nodiscard]]
+inline CHAR RtlUpperChar(CHAR Character) noexcept
+{
+	return static_cast<CHAR>(std::toupper(static_cast<unsigned char>(Character)));
+}
+
+//
+// IRQL, processors and spin locks
+//
+
+inline void KeRaiseIrql(KIRQL NewIrql, PKIRQL OldIrql) noexcept
+{
+	assert(NewIrql >= host::details::current_irql);
+	*OldIrql = std::exchange(host::details::current_irql, NewIrql);
+}
+
+inline void KeLowerIrql(KIRQL NewIrql) noexcept
+{
+	assert(NewIrql <= host::details::current_irql);
+	host::details::current_irql = NewIrql;
+}
+
+[[nodiscard]]
+inline ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber) noexcept
+{
+	static thread_local const host::details::processor_slot slot;
+	if (ProcNumber)
+		*ProcNumber = { 0, static_cast<UCHAR>(slot.get()), 0 };
+	return slot.get();
+}
+
+[[nodiscard]]
+inline ULONG KeQueryMaximumProcessorCountEx([[maybe_unused]] USHORT GroupNumber) noexcept
+{
+	return HostMaxProcessors;
+}
+
+namespace host::details
+{
+	inline void acquire_spin(KSPIN_LOCK &lock) noexcept
+	{
+		std::atomic_ref<KSPIN_LOCK> word{ lock };
+		while (word.exchange(1, std::memory_order_acquire))
+			while (word.load(std::memory_order_relaxed))
+				YieldProcessor();
+	}
+
+	inline void release_spin(KSPIN_LOCK &lock) noexcept
+	{
+		std::atomic_ref<KSPIN_LOCK>{ lock }.store(0, std::memory_order_release);
+	}
+}
+
+inline void KeInitializeSpinLock(PKSPIN_LOCK SpinLock) noexcept
+{
+	*SpinLock = 0;
+}
+
+inline void KeAcquireSpinLock(PKSPIN_LOCK SpinLock, PKIRQL OldIrql) noexcept
+{
+	KeRaiseIrql(DISPATCH_LEVEL, OldIrql);
+	host::details::acquire_spin(*SpinLock);
+}
+
+inline void KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql) noexcept
+{
+	host::details::release_spin(*SpinLock);
+	KeLowerIrql(NewIrql);
+}
+
+typedef struct _KSPIN_LOCK_QUEUE
+{
+	struct _KSPIN_LOCK_QUEUE *volatile Next;
+	PKSPIN_LOCK volatile Lock;
+} KSPIN_LOCK_QUEUE, *PKSPIN_LOCK_QUEUE;
+
+typedef struct _KLOCK_QUEUE_HANDLE
+{
+	KSPIN_LOCK_QUEUE LockQueue;
+	KIRQL OldIrql;
+} KLOCK_QUEUE_HANDLE, *PKLOCK_QUEUE_HANDLE;
+
+// Queued spin locks are served in arrival order by the kernel. The shim spins on the lock word, which keeps the cost of an uncontended acquisition
+inline void KeAcquireInStackQueuedSpinLockAtDpcLevel(PKSPIN_LOCK SpinLock, PKLOCK_QUEUE_HANDLE LockHandle) noexcept
+{
+	host::details::acquire_spin(*SpinLock);
+	LockHandle->LockQueue.Next = nullptr;
+	LockHandle->LockQueue.Lock = SpinLock;
+}
+
+inline void KeReleaseInStackQueuedSpinLockFromDpcLevel(PKLOCK_QUEUE_HANDLE LockHandle) noexcept
+{
+	const auto lock = LockHandle->LockQueue.Lock;
+	LockHandle->LockQueue.Lock = nullptr;
+	host::details::release_spin(*lock);
+}
+
+inline void KeAcquireInStackQueuedSpinLock(PKSPIN_LOCK SpinLock, PKLOCK_QUEUE_HANDLE LockHandle) noexcept
+{
+	KeRaiseIrql(DISPATCH_LEVEL, &LockHandle->OldIrql);
+	KeAcquireInStackQueuedSpinLockAtDpcLevel(SpinLock, LockHandle);
+}
+
+inline void KeReleaseInStackQueuedSpinLock(PKLOCK_QUEUE_HANDLE LockHandle) noexcept
+{
+	const auto irql = LockHandle->OldIrql;
+	KeReleaseInStackQueuedSpinLockFromDpcLevel(LockHandle);
+	KeLowerIrql(irql);
+}
+
+// The lock word is the number of shared owners, or -1 while it is held exclusively
+[[nodiscard]]
+inline KIRQL ExAcquireSpinLockShared(PEX_SPIN_LOCK SpinLock) noexcept
+{
+	KIRQL irql;
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	std::atomic_ref<LONG> word{ *const_cast<LONG *>(SpinLock) };
+	for (auto value = word.load(std::memory_order_relaxed);;)
+	{
+		if (value < 0)
+		{
+			YieldProcessor();
+			value = word.load(std::memory_order_relaxed);
+		}
+		else if (word.compare_exchange_weak(value, value + 1, std::memory_order_acquire, std::memory_order_relaxed))
+			return irql;
+	}
+}
+
+inline void ExReleaseSpinLockShared(PEX_SPIN_LOCK SpinLock, KIRQL OldIrql) noexcept
+{
+	std::atomic_ref<LONG>{ *const_cast<LONG *>(SpinLock) }.fetch_sub(1, std::memory_order_release);
+	KeLowerIrql(OldIrql);
+}
+
+[[nodiscard]]
+inline KIRQL ExAcquireSpinLockExclusive(PEX_SPIN_LOCK SpinLock) noexcept
+{
+	KIRQL irql;
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	std::atomic_ref<LONG> word{ *const_cast<LONG *>(SpinLock) };
+	for (LONG expected = 0; !word.compare_exchange_weak(expected, -1, std::memory_order_acquire, std::memory_order_relaxed); expected = 0)
+		YieldProcessor();
+	return irql;
+}
+
+inline void ExReleaseSpinLockExclusive(PEX_SPIN_LOCK SpinLock, KIRQL OldIrql) noexcept
+{
+	std::atomic_ref<LONG>{ *const_cast<LONG *>(SpinLock) }.store(0, std::memory_order_release);
+	KeLowerIrql(OldIrql);
+}
+
+//
+// Time, timers and DPCs
+//
+
+[[nodiscard]]
+inline LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency) noexcept
+{
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	if (PerformanceFrequency)
+		QueryPerformanceFrequency(PerformanceFrequency);
+	return counter;
+}
+
+// Interrupt time in 100ns units
+[[nodiscard]]
+inline ULONGLONG KeQueryInterruptTime() noexcept
+{
+	ULONGLONG time;
+	QueryUnbiasedInterruptTime(&time);
+	return time;
+}
+
+struct _KDPC;
+typedef void KDEFERRED_ROUTINE(struct _KDPC *Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+typedef KDEFERRED_ROUTINE *PKDEFERRED_ROUTINE;
+
+typedef struct _KDPC
+{
+	PKDEFERRED_ROUTINE DeferredRoutine;
+	PVOID DeferredContext;
+} KDPC, *PKDPC, *PRKDPC;
+
+typedef struct _KTIMER
+{
+	LARGE_INTEGER DueTime;
+	PKDPC Dpc;
+} KTIMER, *PKTIMER;
+
+inline void KeInitializeDpc(PRKDPC Dpc, PKDEFERRED_ROUTINE DeferredRoutine, PVOID DeferredContext) noexcept
+{
+	Dpc->DeferredRoutine = DeferredRoutine;
+	Dpc->DeferredContext = DeferredContext;
+}
+
+inline void KeInitializeTimer(PKTIMER Timer) noexcept
+{
+	*Timer = {};
+}
+
+// Timers are recorded but never fire
+inline BOOLEAN KeSetTimer(PKTIMER Timer, LARGE_INTEGER DueTime, PKDPC Dpc) noexcept
+{
+	const BOOLEAN was_set = Timer->Dpc != nullptr;
+	Timer->DueTime = DueTime;
+	Timer->Dpc = Dpc;
+	return was_set;
+}
+
+inline BOOLEAN KeCancelTimer(PKTIMER Timer) noexcept
+{
+	const BOOLEAN was_set = Timer->Dpc != nullptr;
+	Timer->Dpc = nullptr;
+	return was_set;
+}
+
+inline void KeFlushQueuedDpcs() noexcept
+{
+}
+
+inline void KeInitializeThreadedDpc(PRKDPC Dpc, PKDEFERRED_ROUTINE DeferredRoutine, PVOID DeferredContext) noexcept
+{
+	KeInitializeDpc(Dpc, DeferredRoutine, DeferredContext);
+}
+
+inline NTSTATUS KeSetTargetProcessorDpcEx([[maybe_unused]] PKDPC Dpc, [[maybe_unused]] PPROCESSOR_NUMBER ProcNumber) noexcept
+{
+	return STATUS_SUCCESS;
+}
+
+// The routine runs before the call returns, so the DPC is never found queued
+inline BOOLEAN KeInsertQueueDpc(PRKDPC Dpc, PVOID SystemArgument1, PVOID SystemArgument2) noexcept
+{
+	Dpc->DeferredRoutine(Dpc, Dpc->DeferredContext, SystemArgument1, SystemArgument2);
+	return TRUE;
+}
+
+[[nodiscard]]
+inline NTSTATUS KeGetProcessorNumberFromIndex(ULONG ProcIndex, PPROCESSOR_NUMBER ProcNumber) noexcept
+{
+	if (ProcIndex >= HostMaxProcessors)
+		return STATUS_INVALID_PARAMETER;
+	*ProcNumber = { 0, static_cast<UCHAR>(ProcIndex), 0 };
+	return STATUS_SUCCESS;
+}
+
+//
+// Events and threads
+//
+
+typedef CCHAR KPROCESSOR_MODE;
+
+#define KernelMode 0
+#define UserMode 1
+
+typedef enum _KWAIT_REASON
+{
+	Executive,
+} KWAIT_REASON;
+
+typedef enum _EVENT_TYPE
+{
+	NotificationEvent,
+	SynchronizationEvent,
+} EVENT_TYPE;
+
+// Common header of the objects KeWaitForSingleObject waits for. Waiters sleep on the signal state with WaitOnAddress
+typedef struct _DISPATCHER_HEADER
+{
+	LONG Type;
+	LONG SignalState;
+} DISPATCHER_HEADER;
+
+typedef struct _KEVENT
+{
+	DISPATCHER_HEADER Header;
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+// The object of a thread created with PsCreateSystemThread, or a placeholder identifying any other thread
+typedef struct _KTHREAD *PKTHREAD;
+
+inline void KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State) noexcept
+{
+	Event->Header.Type = Type;
+	Event->Header.SignalState = State;
+}
+
+LONG KeSetEvent(PRKEVENT Event, LONG Increment, BOOLEAN Wait) noexcept;
+
+// Only infinite waits are supported
+NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Timeout) noexcept;
+
+[[nodiscard]]
+PKTHREAD KeGetCurrentThread() noexcept;
+
+inline void KeSetSystemGroupAffinityThread([[maybe_unused]] PGROUP_AFFINITY Affinity, PGROUP_AFFINITY PreviousAffinity) noexcept
+{
+	if (PreviousAffinity)
+		*PreviousAffinity = {};
+}
+
+typedef void KSTART_ROUTINE(PVOID StartContext);
+typedef KSTART_ROUTINE *PKSTART_ROUTINE;
+
+struct _OBJECT_TYPE;
+typedef struct _OBJECT_TYPE *POBJECT_TYPE;
+typedef struct _OBJECT_HANDLE_INFORMATION *POBJECT_HANDLE_INFORMATION;
+
+extern POBJECT_TYPE *PsThreadType;
+
+#ifndef OBJ_KERNEL_HANDLE
+#define OBJ_KERNEL_HANDLE 0x00000200L
+#endif
+
+// The returned handle is the thread object itself, it holds a reference to it until ZwClose
+[[nodiscard]]
+NTSTATUS PsCreateSystemThread(PHANDLE ThreadHandle, ULONG DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes, HANDLE ProcessHandle, struct _CLIENT_ID *ClientId,
+	PKSTART_ROUTINE StartRoutine, PVOID StartContext) noexcept;
+
+[[noreturn]]
+NTSTATUS PsTerminateSystemThread(NTSTATUS ExitStatus) noexcept;
+
+// Only thread handles and objects are supported
+[[nodiscard]]
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle, ACCESS_MASK DesiredAccess, POBJECT_TYPE ObjectType, KPROCESSOR_MODE AccessMode, PVOID *Object,
+	POBJECT_HANDLE_INFORMATION HandleInformation) noexcept;
+void ObDereferenceObject(PVOID Object) noexcept;
+NTSTATUS ZwClose(HANDLE Handle) noexcept;
+
+//
+// Pool
+//
+
+typedef enum _POOL_TYPE
+{
+	NonPagedPool,
+	PagedPool,
+	NonPagedPoolNx = 512,
+} POOL_TYPE;
+
+[[nodiscard]]
+inline PVOID ExAllocatePoolWithTag([[maybe_unused]] POOL_TYPE PoolType, SIZE_T NumberOfBytes, [[maybe_unused]] ULONG Tag) noexcept
+{
+	return _aligned_malloc(NumberOfBytes ? NumberOfBytes : 1, MEMORY_ALLOCATION_ALIGNMENT);
+}
+
+inline void ExFreePoolWithTag(PVOID P, [[maybe_unused]] ULONG Tag) noexcept
+{
+	_aligned_free(P);
+}
+
+inline void ExFreePool(PVOID P) noexcept
+{
+	_aligned_free(P);
+}
+
+// No system routines can be looked up, so drv/allocator_impl.h falls back to ExAllocatePoolWithTag
+[[nodiscard]]
+inline PVOID MmGetSystemRoutineAddress([[maybe_unused]] PUNICODE_STRING SystemRoutineName) noexcept
+{
+	return nullptr;
+}
+
+#ifndef RTL_CONSTANT_STRING
+#define RTL_CONSTANT_STRING(s) { sizeof(s) - sizeof((s)[0]), sizeof(s), const_cast<PWSTR>(s) }
+#endif
+
+// Lookaside list: a free list of blocks on top of the pool
+typedef struct _LOOKASIDE_LIST_EX
+{
+	SLIST_HEADER ListHead;
+	SIZE_T Size;
+	USHORT Depth;
+} LOOKASIDE_LIST_EX, *PLOOKASIDE_LIST_EX;
+
+[[nodiscard]]
+NTSTATUS ExInitializeLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, PVOID Allocate, PVOID Free, POOL_TYPE PoolType, ULONG Flags, SIZE_T Size, ULONG Tag, USHORT Depth) noexcept;
+void ExDeleteLookasideListEx(PLOOKASIDE_LIST_EX Lookaside) noexcept;
+
+[[nodiscard]]
+PVOID ExAllocateFromLookasideListEx(PLOOKASIDE_LIST_EX Lookaside) noexcept;
+void ExFreeToLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, PVOID Entry) noexcept;
+
+//
+// I/O manager
+//
+
+#define IRP_MJ_CREATE 0x00
+#define IRP_MJ_CLOSE 0x02
+#define IRP_MJ_READ 0x03
+#define IRP_MJ_WRITE 0x04
+#define IRP_MJ_DEVICE_CONTROL 0x0e
+#define IRP_MJ_INTERNAL_DEVICE_CONTROL 0x0f
+#define IRP_MJ_CLEANUP 0x12
+#define IRP_MJ_POWER 0x16
+#define IRP_MJ_PNP 0x1b
+#define IRP_MJ_MAXIMUM_FUNCTION 0x1b
+
+#define SL_PENDING_RETURNED 0x01
+#define SL_INVOKE_ON_CANCEL 0x20
+#define SL_INVOKE_ON_SUCCESS 0x40
+#define SL_INVOKE_ON_ERROR 0x80
+
+typedef enum _IO_PRIORITY_HINT
+{
+	IoPriorityVeryLow = 0,
+	IoPriorityLow,
+	IoPriorityNormal,
+	IoPriorityHigh,
+	IoPriorityCritical,
+	MaxIoPriorityTypes
+} IO_PRIORITY_HINT;
+
+typedef enum _MM_PAGE_PRIORITY
+{
+	LowPagePriority,
+	NormalPagePriority = 16,
+	HighPagePriority = 32,
+} MM_PAGE_PRIORITY;
+
+#define MdlMappingNoExecute 0x40000000
+
+struct _IRP;
+struct _DEVICE_OBJECT;
+
+typedef NTSTATUS DRIVER_DISPATCH(struct _DEVICE_OBJECT *DeviceObject, struct _IRP *Irp);
+typedef DRIVER_DISPATCH *PDRIVER_DISPATCH;
+typedef void DRIVER_CANCEL(struct _DEVICE_OBJECT *DeviceObject, struct _IRP *Irp);
+typedef DRIVER_CANCEL *PDRIVER_CANCEL;
+typedef NTSTATUS IO_COMPLETION_ROUTINE(struct _DEVICE_OBJECT *DeviceObject, struct _IRP *Irp, PVOID Context);
+typedef IO_COMPLETION_ROUTINE *PIO_COMPLETION_ROUTINE;
+
+typedef struct _DRIVER_OBJECT
+{
+	PDRIVER_DISPATCH MajorFunction[IRP_MJ_MAXIMUM_FUNCTION + 1];
+} DRIVER_OBJECT, *PDRIVER_OBJECT;
+
+typedef struct _DEVICE_OBJECT
+{
+	PDRIVER_OBJECT DriverObject;
+	CCHAR StackSize;
+} DEVICE_OBJECT, *PDEVICE_OBJECT;
+
+typedef struct _FILE_OBJECT
+{
+	PDEVICE_OBJECT DeviceObject;
+	PVOID FsContext;
+	PVOID FsContext2;
+	UNICODE_STRING FileName;
+} FILE_OBJECT, *PFILE_OBJECT;
+
+typedef struct _MDL
+{
+	struct _MDL *Next;
+	PVOID MappedSystemVa;
+	ULONG ByteCount;
+} MDL, *PMDL;
+
+// Buffers are always mapped in user mode
+[[nodiscard]]
+inline PVOID MmGetSystemAddressForMdlSafe(PMDL Mdl, [[maybe_unused]] ULONG Priority) noexcept
+{
+	return Mdl->MappedSystemVa;
+}
+
+typedef struct _IO_STACK_LOCATION
+{
+	UCHAR MajorFunction;
+	UCHAR MinorFunction;
+	UCHAR Flags;
+	UCHAR Control;
+
+	union
+	{
+		struct
+		{
+			ULONG Length;
+			ULONG Key;
+			LARGE_INTEGER ByteOffset;
+		} Read;
+
+		struct
+		{
+			ULONG Length;
+			ULONG Key;
+			LARGE_INTEGER ByteOffset;
+		} Write;
+
+		struct
+		{
+			ULONG OutputBufferLength;
+			ULONG InputBufferLength;
+			ULONG IoControlCode;
+			PVOID Type3InputBuffer;
+		} DeviceIoControl;
+
+		struct
+		{
+			PVOID Argument1;
+			PVOID Argument2;
+			PVOID Argument3;
+			PVOID Argument4;
+		} Others;
+	} Parameters;
+
+	PDEVICE_OBJECT DeviceObject;
+	PFILE_OBJECT FileObject;
+	PIO_COMPLETION_ROUTINE CompletionRoutine;
+	PVOID Context;
+} IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+
+// The stack locations follow the IRP in memory, the current one starts at the highest address
+typedef struct _IRP
+{
+	PMDL MdlAddress;
+	ULONG Flags;
+
+	union
+	{
+		struct _IRP *MasterIrp;
+		PVOID SystemBuffer;
+	} AssociatedIrp;
+
+	IO_STATUS_BLOCK IoStatus;
+	CHAR RequestorMode;
+	BOOLEAN PendingReturned;
+	CHAR StackCount;
+	CHAR CurrentLocation;
+	BOOLEAN Cancel;
+	IO_PRIORITY_HINT PriorityHint;
+	PDRIVER_CANCEL volatile CancelRoutine;
+	PVOID UserBuffer;
+
+	union
+	{
+		struct
+		{
+			struct
+			{
+				PVOID DriverContext[4];
+			};
+			PVOID Thread;
+			struct
+			{
+				LIST_ENTRY ListEntry;
+				struct _IO_STACK_LOCATION *CurrentStackLocation;
+			};
+			PFILE_OBJECT OriginalFileObject;
+		} Overlay;
+	} Tail;
+} IRP, *PIRP;
+
+[[nodiscard]]
+PIRP IoAllocateIrp(CCHAR StackSize, BOOLEAN ChargeQuota) noexcept;
+void IoFreeIrp(PIRP Irp) noexcept;
+
+[[nodiscard]]
+inline PIO_STACK_LOCATION IoGetCurrentIrpStackLocation(PIRP Irp) noexcept
+{
+	assert(Irp->CurrentLocation <= Irp->StackCount + 1);
+	return Irp->Tail.Overlay.CurrentStackLocation;
+}
+
+[[nodiscard]]
+inline PIO_STACK_LOCATION IoGetNextIrpStackLocation(PIRP Irp) noexcept
+{
+	assert(Irp->CurrentLocation > 1);
+	return Irp->Tail.Overlay.CurrentStackLocation - 1;
+}
+
+inline void IoSetNextIrpStackLocation(PIRP Irp) noexcept
+{
+	--Irp->CurrentLocation;
+	--Irp->Tail.Overlay.CurrentStackLocation;
+}
+
+inline void IoSkipCurrentIrpStackLocation(PIRP Irp) noexcept
+{
+	++Irp->CurrentLocation;
+	++Irp->Tail.Overlay.CurrentStackLocation;
+}
+
+inline void IoCopyCurrentIrpStackLocationToNext(PIRP Irp) noexcept
+{
+	const auto current = IoGetCurrentIrpStackLocation(Irp);
+	const auto next = IoGetNextIrpStackLocation(Irp);
+	*next = *current;
+	next->CompletionRoutine = nullptr;
+	next->Context = nullptr;
+	next->Control = 0;
+}
+
+inline void IoSetCompletionRoutine(PIRP Irp, PIO_COMPLETION_ROUTINE CompletionRoutine, PVOID Context, BOOLEAN InvokeOnSuccess, BOOLEAN InvokeOnError, BOOLEAN InvokeOnCancel) noexcept
+{
+	const auto next = IoGetNextIrpStackLocation(Irp);
+	next->CompletionRoutine = CompletionRoutine;
+	next->Context = Context;
+	next->Control = 0;
+	if (InvokeOnSuccess)
+		next->Control |= SL_INVOKE_ON_SUCCESS;
+	if (InvokeOnError)
+		next->Control |= SL_INVOKE_ON_ERROR;
+	if (InvokeOnCancel)
+		next->Control |= SL_INVOKE_ON_CANCEL;
+}
+
+inline void IoMarkIrpPending(PIRP Irp) noexcept
+{
+	IoGetCurrentIrpStackLocation(Irp)->Control |= SL_PENDING_RETURNED;
+}
+
+inline PDRIVER_CANCEL IoSetCancelRoutine(PIRP Irp, PDRIVER_CANCEL CancelRoutine) noexcept
+{
+	return std::atomic_ref<PDRIVER_CANCEL>{ const_cast<PDRIVER_CANCEL &>(Irp->CancelRoutine) }.exchange(CancelRoutine, std::memory_order_acq_rel);
+}
+
+[[nodiscard]]
+inline IO_PRIORITY_HINT IoGetIoPriorityHint(PIRP Irp) noexcept
+{
+	return Irp->PriorityHint;
+}
+
+inline NTSTATUS IoSetIoPriorityHint(PIRP Irp, IO_PRIORITY_HINT PriorityHint) noexcept
+{
+	Irp->PriorityHint = PriorityHint;
+	return STATUS_SUCCESS;
+}
+
+// Called when the last completion routine of an IRP has run, the IRP is owned by the caller of IoAllocateIrp again
+using host_irp_completed_t = void(PIRP Irp);
+inline constinit host_irp_completed_t *host_irp_completed{};
+
+void IoCompleteRequest(PIRP Irp, CCHAR PriorityBoost) noexcept;
+NTSTATUS IoCallDriver(PDEVICE_OBJECT DeviceObject, PIRP Irp) noexcept;
+
+// Set the cancel flag and call the cancel routine on the calling thread
+BOOLEAN IoCancelIrp(PIRP Irp) noexcept;
+
+inline NTSTATUS PoCallDriver(PDEVICE_OBJECT DeviceObject, PIRP Irp) noexcept
+{
+	return IoCallDriver(DeviceObject, Irp);
+}
+
+inline void PoStartNextPowerIrp([[maybe_unused]] PIRP Irp) noexcept
+{
+}
+
+typedef enum _WORK_QUEUE_TYPE
+{
+	CriticalWorkQueue,
+	DelayedWorkQueue,
+	HyperCriticalWorkQueue,
+} WORK_QUEUE_TYPE;
+
+typedef struct _IO_WORKITEM *PIO_WORKITEM;
+typedef void IO_WORKITEM_ROUTINE_EX(PVOID IoObject, PVOID Context, PIO_WORKITEM IoWorkItem);
+typedef IO_WORKITEM_ROUTINE_EX *PIO_WORKITEM_ROUTINE_EX;
+
+// Work items run on the Win32 thread pool
+[[nodiscard]]
+PIO_WORKITEM IoAllocateWorkItem(PDEVICE_OBJECT DeviceObject) noexcept;
+void IoFreeWorkItem(PIO_WORKITEM IoWorkItem) noexcept;
+void IoQueueWorkItemEx(PIO_WORKITEM IoWorkItem, PIO_WORKITEM_ROUTINE_EX WorkerRoutine, WORK_QUEUE_TYPE QueueType, PVOID Context) noexcept;
+
+//
+// Cancel-safe queues
+//
+
+#define IO_TYPE_CSQ_IRP_CONTEXT 1
+#define IO_TYPE_CSQ 2
+#define IO_TYPE_CSQ_EX 3
+
+struct _IO_CSQ;
+
+typedef struct _IO_CSQ_IRP_CONTEXT
+{
+	ULONG Type;
+	PIRP Irp;
+	struct _IO_CSQ *Csq;
+} IO_CSQ_IRP_CONTEXT, *PIO_CSQ_IRP_CONTEXT;
+
+typedef NTSTATUS IO_CSQ_INSERT_IRP_EX(struct _IO_CSQ *Csq, PIRP Irp, PVOID InsertContext);
+typedef void IO_CSQ_REMOVE_IRP(struct _IO_CSQ *Csq, PIRP Irp);
+typedef PIRP IO_CSQ_PEEK_NEXT_IRP(struct _IO_CSQ *Csq, PIRP Irp, PVOID PeekContext);
+typedef void IO_CSQ_ACQUIRE_LOCK(struct _IO_CSQ *Csq, PKIRQL Irql);
+typedef void IO_CSQ_RELEASE_LOCK(struct _IO_CSQ *Csq, KIRQL Irql);
+typedef void IO_CSQ_COMPLETE_CANCELED_IRP(struct _IO_CSQ *Csq, PIRP Irp);
+
+typedef IO_CSQ_INSERT_IRP_EX *PIO_CSQ_INSERT_IRP_EX;
+typedef IO_CSQ_REMOVE_IRP *PIO_CSQ_REMOVE_IRP;
+typedef IO_CSQ_PEEK_NEXT_IRP *PIO_CSQ_PEEK_NEXT_IRP;
+typedef IO_CSQ_ACQUIRE_LOCK *PIO_CSQ_ACQUIRE_LOCK;
+typedef IO_CSQ_RELEASE_LOCK *PIO_CSQ_RELEASE_LOCK;
+typedef IO_CSQ_COMPLETE_CANCELED_IRP *PIO_CSQ_COMPLETE_CANCELED_IRP;
+
+typedef struct _IO_CSQ
+{
+	ULONG Type;
+	PIO_CSQ_INSERT_IRP_EX CsqInsertIrp;
+	PIO_CSQ_REMOVE_IRP CsqRemoveIrp;
+	PIO_CSQ_PEEK_NEXT_IRP CsqPeekNextIrp;
+	PIO_CSQ_ACQUIRE_LOCK CsqAcquireLock;
+	PIO_CSQ_RELEASE_LOCK CsqReleaseLock;
+	PIO_CSQ_COMPLETE_CANCELED_IRP CsqCompleteCanceledIrp;
+	PVOID ReservePointer;
+} IO_CSQ, *PIO_CSQ;
+
+NTSTATUS IoCsqInitializeEx(PIO_CSQ Csq, PIO_CSQ_INSERT_IRP_EX CsqInsertIrp, PIO_CSQ_REMOVE_IRP CsqRemoveIrp, PIO_CSQ_PEEK_NEXT_IRP CsqPeekNextIrp,
+	PIO_CSQ_ACQUIRE_LOCK CsqAcquireLock, PIO_CSQ_RELEASE_LOCK CsqReleaseLock, PIO_CSQ_COMPLETE_CANCELED_IRP CsqCompleteCanceledIrp) noexcept;
+
+NTSTATUS IoCsqInsertIrpEx(PIO_CSQ Csq, PIRP Irp, PIO_CSQ_IRP_CONTEXT Context, PVOID InsertContext) noexcept;
+
+[[nodiscard]]
+PIRP IoCsqRemoveNextIrp(PIO_CSQ Csq, PVOID PeekContext) noexcept;
+
+[[nodiscard]]
+PIRP IoCsqRemoveIrp(PIO_CSQ Csq, PIO_CSQ_IRP_CONTEXT Context) noexcept;
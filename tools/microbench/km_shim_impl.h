@@ -0,0 +1,426 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// User-mode shim of the kernel APIs used by drv
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+#include "km_shim.h"
+
+// The library's operators new and delete replace the CRT ones, so the benchmarks measure the same allocation paths as the drivers
+#include <drv/allocator_impl.h>
+
+//
+// Lookaside lists
+//
+
+namespace
+{
+	// Blocks are SLIST entries while they are cached, which requires MEMORY_ALLOCATION_ALIGNMENT
+	[[nodiscard]]
+	SIZE_T lookaside_block_size(SIZE_T size) noexcept
+	{
+		return size < sizeof(SLIST_ENTRY) ? sizeof(SLIST_ENTRY) : size;
+	}
+}
+
+NTSTATUS ExInitializeLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, [[maybe_unused]] PVOID Allocate, [[maybe_unused]] PVOID Free, [[maybe_unused]] POOL_TYPE PoolType,
+	[[maybe_unused]] ULONG Flags, SIZE_T Size, [[maybe_unused]] ULONG Tag, USHORT Depth) noexcept
+{
+	InitializeSListHead(&Lookaside->ListHead);
+	Lookaside->Size = lookaside_block_size(Size);
+	Lookaside->Depth = Depth ? Depth : 256;
+	return STATUS_SUCCESS;
+}
+
+void ExDeleteLookasideListEx(PLOOKASIDE_LIST_EX Lookaside) noexcept
+{
+	while (auto entry = InterlockedPopEntrySList(&Lookaside->ListHead))
+		_aligned_free(entry);
+}
+
+PVOID ExAllocateFromLookasideListEx(PLOOKASIDE_LIST_EX Lookaside) noexcept
+{
+	if (auto entry = InterlockedPopEntrySList(&Lookaside->ListHead))
+		return entry;
+	return _aligned_malloc(Lookaside->Size, MEMORY_ALLOCATION_ALIGNMENT);
+}
+
+void ExFreeToLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, PVOID Entry) noexcept
+{
+	if (QueryDepthSList(&Lookaside->ListHead) >= Lookaside->Depth)
+		_aligned_free(Entry);
+	else
+		InterlockedPushEntrySList(&Lookaside->ListHead, static_cast<PSLIST_ENTRY>(Entry));
+}
+
+//
+// IRPs
+//
+
+PIRP IoAllocateIrp(CCHAR StackSize, [[maybe_unused]] BOOLEAN ChargeQuota) noexcept
+{
+	assert(StackSize > 0);
+	const auto size = sizeof(IRP) + StackSize * sizeof(IO_STACK_LOCATION);
+	auto irp = static_cast<PIRP>(ExAllocatePoolWithTag(NonPagedPoolNx, size, 'prIH'));
+	if (!irp)
+		return nullptr;
+
+	memset(irp, 0, size);
+	irp->StackCount = StackSize;
+	irp->CurrentLocation = StackSize + 1;
+	irp->PriorityHint = IoPriorityNormal;
+	// The first driver gets the last stack location, the location past it is the one IoCallDriver moves from
+	irp->Tail.Overlay.CurrentStackLocation = reinterpret_cast<PIO_STACK_LOCATION>(irp + 1) + StackSize;
+	return irp;
+}
+
+void IoFreeIrp(PIRP Irp) noexcept
+{
+	ExFreePoolWithTag(Irp, 'prIH');
+}
+
+NTSTATUS IoCallDriver(PDEVICE_OBJECT DeviceObject, PIRP Irp) noexcept
+{
+	IoSetNextIrpStackLocation(Irp);
+	const auto stack = IoGetCurrentIrpStackLocation(Irp);
+	stack->DeviceObject = DeviceObject;
+	return DeviceObject->DriverObject->MajorFunction[stack->MajorFunction](DeviceObject, Irp);
+}
+
+void IoCompleteRequest(PIRP Irp, [[maybe_unused]] CCHAR PriorityBoost) noexcept
+{
+	assert(Irp->CurrentLocation <= Irp->StackCount + 1);
+	assert(Irp->IoStatus.Status != STATUS_PENDING);
+
+	// Run completion routines from the current stack location up, as the I/O manager does
+	while (Irp->CurrentLocation <= Irp->StackCount)
+	{
+		const auto stack = IoGetCurrentIrpStackLocation(Irp);
+		Irp->PendingReturned = (stack->Control & SL_PENDING_RETURNED) != 0;
+		IoSkipCurrentIrpStackLocation(Irp);
+		const auto routine = stack->CompletionRoutine;
+		const auto status = Irp->IoStatus.Status;
+		const bool invoke = routine &&
+			((NT_SUCCESS(status) && (stack->Control & SL_INVOKE_ON_SUCCESS)) ||
+			(!NT_SUCCESS(status) && (stack->Control & SL_INVOKE_ON_ERROR)) ||
+			(Irp->Cancel && (stack->Control & SL_INVOKE_ON_CANCEL)));
+
+		if (invoke)
+		{
+			// The routine gets the device object of the driver that set it, which is one location up
+			const auto device = Irp->CurrentLocation <= Irp->StackCount ? IoGetCurrentIrpStackLocation(Irp)->DeviceObject : nullptr;
+			if (routine(device, Irp, stack->Context) == STATUS_MORE_PROCESSING_REQUIRED)
+				return;
+		}
+		else if (Irp->PendingReturned && Irp->CurrentLocation <= Irp->StackCount)
+			IoMarkIrpPending(Irp);
+	}
+
+	if (host_irp_completed)
+		host_irp_completed(Irp);
+}
+
+BOOLEAN IoCancelIrp(PIRP Irp) noexcept
+{
+	Irp->Cancel = TRUE;
+	const auto routine = IoSetCancelRoutine(Irp, nullptr);
+	if (!routine)
+		return FALSE;
+
+	routine(nullptr, Irp);
+	return TRUE;
+}
+
+//
+// Events and threads
+//
+
+struct _KTHREAD
+{
+	DISPATCHER_HEADER Header;
+	std::atomic<LONG> references;
+	PKSTART_ROUTINE routine;
+	PVOID context;
+};
+
+struct _IO_WORKITEM
+{
+	PDEVICE_OBJECT device;
+	PIO_WORKITEM_ROUTINE_EX routine;
+	PVOID context;
+};
+
+namespace
+{
+	POBJECT_TYPE thread_object_type{};
+
+	// Object of the current thread if it has been created by PsCreateSystemThread
+	thread_local PKTHREAD current_system_thread{};
+	// Identifies other threads, it is never waited for
+	thread_local _KTHREAD current_thread_placeholder{};
+
+	void release_thread(PKTHREAD Thread) noexcept
+	{
+		if (Thread->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			std::destroy_at(Thread);
+			ExFreePoolWithTag(Thread, 'rhTH');
+		}
+	}
+}
+
+POBJECT_TYPE *PsThreadType = &thread_object_type;
+
+LONG KeSetEvent(PRKEVENT Event, [[maybe_unused]] LONG Increment, [[maybe_unused]] BOOLEAN Wait) noexcept
+{
+	const auto previous = std::atomic_ref{ Event->Header.SignalState }.exchange(1, std::memory_order_release);
+	// A synchronization event releases a single waiter
+	if (Event->Header.Type == SynchronizationEvent)
+		WakeByAddressSingle(&Event->Header.SignalState);
+	else
+		WakeByAddressAll(&Event->Header.SignalState);
+	return previous;
+}
+
+NTSTATUS KeWaitForSingleObject(PVOID Object, [[maybe_unused]] KWAIT_REASON WaitReason, [[maybe_unused]] KPROCESSOR_MODE WaitMode, [[maybe_unused]] BOOLEAN Alertable,
+	[[maybe_unused]] PLARGE_INTEGER Timeout) noexcept
+{
+	assert(!Timeout);
+
+	auto &header = *static_cast<DISPATCHER_HEADER *>(Object);
+	std::atomic_ref state{ header.SignalState };
+	for (;;)
+	{
+		// A synchronization event is reset by the wait that is satisfied, other objects stay signaled
+		if (header.Type == SynchronizationEvent ? state.exchange(0, std::memory_order_acquire) : state.load(std::memory_order_acquire))
+			return STATUS_SUCCESS;
+
+		LONG unsignaled{};
+		WaitOnAddress(&header.SignalState, &unsignaled, sizeof(unsignaled), INFINITE);
+	}
+}
+
+PKTHREAD KeGetCurrentThread() noexcept
+{
+	return current_system_thread ? current_system_thread : &current_thread_placeholder;
+}
+
+NTSTATUS PsCreateSystemThread(PHANDLE ThreadHandle, [[maybe_unused]] ULONG DesiredAccess, [[maybe_unused]] POBJECT_ATTRIBUTES ObjectAttributes,
+	[[maybe_unused]] HANDLE ProcessHandle, [[maybe_unused]] struct _CLIENT_ID *ClientId, PKSTART_ROUTINE StartRoutine, PVOID StartContext) noexcept
+{
+	auto thread = static_cast<PKTHREAD>(ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(_KTHREAD), 'rhTH'));
+	if (!thread)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	// One reference is held by the returned handle, the other one by the running thread
+	std::construct_at(thread, DISPATCHER_HEADER{ NotificationEvent, 0 }, 2, StartRoutine, StartContext);
+
+	const auto handle = CreateThread(nullptr, 0, [](LPVOID Parameter) noexcept -> DWORD
+	{
+		current_system_thread = static_cast<PKTHREAD>(Parameter);
+		current_system_thread->routine(current_system_thread->context);
+		PsTerminateSystemThread(STATUS_SUCCESS);
+	}, thread, 0, nullptr);
+
+	if (!handle)
+	{
+		std::destroy_at(thread);
+		ExFreePoolWithTag(thread, 'rhTH');
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	CloseHandle(handle);
+	*ThreadHandle = thread;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS PsTerminateSystemThread(NTSTATUS ExitStatus) noexcept
+{
+	const auto thread = std::exchange(current_system_thread, nullptr);
+	assert(thread && "only threads created by PsCreateSystemThread may terminate themselves");
+
+	// The thread object is signaled when the thread exits
+	std::atomic_ref{ thread->Header.SignalState }.store(1, std::memory_order_release);
+	WakeByAddressAll(&thread->Header.SignalState);
+	release_thread(thread);
+	ExitThread(static_cast<DWORD>(ExitStatus));
+}
+
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle, [[maybe_unused]] ACCESS_MASK DesiredAccess, [[maybe_unused]] POBJECT_TYPE ObjectType,
+	[[maybe_unused]] KPROCESSOR_MODE AccessMode, PVOID *Object, [[maybe_unused]] POBJECT_HANDLE_INFORMATION HandleInformation) noexcept
+{
+	assert(ObjectType == *PsThreadType);
+
+	const auto thread = static_cast<PKTHREAD>(Handle);
+	thread->references.fetch_add(1, std::memory_order_relaxed);
+	*Object = thread;
+	return STATUS_SUCCESS;
+}
+
+void ObDereferenceObject(PVOID Object) noexcept
+{
+	release_thread(static_cast<PKTHREAD>(Object));
+}
+
+NTSTATUS ZwClose(HANDLE Handle) noexcept
+{
+	release_thread(static_cast<PKTHREAD>(Handle));
+	return STATUS_SUCCESS;
+}
+
+//
+// Work items
+//
+
+PIO_WORKITEM IoAllocateWorkItem(PDEVICE_OBJECT DeviceObject) noexcept
+{
+	auto item = static_cast<PIO_WORKITEM>(ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(_IO_WORKITEM), 'IWIH'));
+	if (item)
+		*item = { DeviceObject };
+	return item;
+}
+
+void IoFreeWorkItem(PIO_WORKITEM IoWorkItem) noexcept
+{
+	ExFreePoolWithTag(IoWorkItem, 'IWIH');
+}
+
+void IoQueueWorkItemEx(PIO_WORKITEM IoWorkItem, PIO_WORKITEM_ROUTINE_EX WorkerRoutine, [[maybe_unused]] WORK_QUEUE_TYPE QueueType, PVOID Context) noexcept
+{
+	IoWorkItem->routine = WorkerRoutine;
+	IoWorkItem->context = Context;
+
+	[[maybe_unused]] const auto submitted = TrySubmitThreadpoolCallback([]([[maybe_unused]] PTP_CALLBACK_INSTANCE Instance, PVOID Parameter) noexcept
+	{
+		const auto item = static_cast<PIO_WORKITEM>(Parameter);
+		item->routine(item->device, item->context, item);
+	}, IoWorkItem, nullptr);
+	assert(submitted);
+}
+
+//
+// Cancel-safe queues
+//
+
+namespace
+{
+	[[nodiscard]]
+	PIO_CSQ csq_of(PIRP Irp) noexcept
+	{
+		// DriverContext[3] holds either the queue or the IRP context, both start with a type field
+		const auto p = Irp->Tail.Overlay.DriverContext[3];
+		if (*static_cast<const ULONG *>(p) == IO_TYPE_CSQ_IRP_CONTEXT)
+			return static_cast<PIO_CSQ_IRP_CONTEXT>(p)->Csq;
+		return static_cast<PIO_CSQ>(p);
+	}
+
+	// Called by the queue with its lock held, after the IRP has been removed
+	void csq_detach(PIRP Irp) noexcept
+	{
+		const auto p = Irp->Tail.Overlay.DriverContext[3];
+		if (*static_cast<const ULONG *>(p) == IO_TYPE_CSQ_IRP_CONTEXT)
+			static_cast<PIO_CSQ_IRP_CONTEXT>(p)->Irp = nullptr;
+		Irp->Tail.Overlay.DriverContext[3] = nullptr;
+	}
+
+	void csq_cancel_routine([[maybe_unused]] PDEVICE_OBJECT DeviceObject, PIRP Irp) noexcept
+	{
+		const auto csq = csq_of(Irp);
+		KIRQL irql;
+		csq->CsqAcquireLock(csq, &irql);
+		csq->CsqRemoveIrp(csq, Irp);
+		csq_detach(Irp);
+		csq->CsqReleaseLock(csq, irql);
+		csq->CsqCompleteCanceledIrp(csq, Irp);
+	}
+}
+
+NTSTATUS IoCsqInitializeEx(PIO_CSQ Csq, PIO_CSQ_INSERT_IRP_EX CsqInsertIrp, PIO_CSQ_REMOVE_IRP CsqRemoveIrp, PIO_CSQ_PEEK_NEXT_IRP CsqPeekNextIrp,
+	PIO_CSQ_ACQUIRE_LOCK CsqAcquireLock, PIO_CSQ_RELEASE_LOCK CsqReleaseLock, PIO_CSQ_COMPLETE_CANCELED_IRP CsqCompleteCanceledIrp) noexcept
+{
+	*Csq = { IO_TYPE_CSQ_EX, CsqInsertIrp, CsqRemoveIrp, CsqPeekNextIrp, CsqAcquireLock, CsqReleaseLock, CsqCompleteCanceledIrp, nullptr };
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS IoCsqInsertIrpEx(PIO_CSQ Csq, PIRP Irp, PIO_CSQ_IRP_CONTEXT Context, PVOID InsertContext) noexcept
+{
+	KIRQL irql;
+	Csq->CsqAcquireLock(Csq, &irql);
+
+	if (Context)
+	{
+		*Context = { IO_TYPE_CSQ_IRP_CONTEXT, Irp, Csq };
+		Irp->Tail.Overlay.DriverContext[3] = Context;
+	}
+	else
+		Irp->Tail.Overlay.DriverContext[3] = Csq;
+
+	const auto status = Csq->CsqInsertIrp(Csq, Irp, InsertContext);
+	if (!NT_SUCCESS(status))
+	{
+		Irp->Tail.Overlay.DriverContext[3] = nullptr;
+		if (Context)
+			Context->Irp = nullptr;
+		Csq->CsqReleaseLock(Csq, irql);
+		return status;
+	}
+
+	IoMarkIrpPending(Irp);
+	IoSetCancelRoutine(Irp, &csq_cancel_routine);
+
+	// The IRP has been cancelled before the cancel routine was set, complete it here unless the cancel routine is already running
+	if (Irp->Cancel && IoSetCancelRoutine(Irp, nullptr))
+	{
+		Csq->CsqRemoveIrp(Csq, Irp);
+		csq_detach(Irp);
+		Csq->CsqReleaseLock(Csq, irql);
+		Csq->CsqCompleteCanceledIrp(Csq, Irp);
+		return status;
+	}
+
+	Csq->CsqReleaseLock(Csq, irql);
+	return status;
+}
+
+PIRP IoCsqRemoveNextIrp(PIO_CSQ Csq, PVOID PeekContext) noexcept
+{
+	KIRQL irql;
+	Csq->CsqAcquireLock(Csq, &irql);
+
+	// Skip IRPs whose cancel routines are running, they remove themselves
+	auto irp = Csq->CsqPeekNextIrp(Csq, nullptr, PeekContext);
+	while (irp && !IoSetCancelRoutine(irp, nullptr))
+		irp = Csq->CsqPeekNextIrp(Csq, irp, PeekContext);
+
+	if (irp)
+	{
+		Csq->CsqRemoveIrp(Csq, irp);
+		csq_detach(irp);
+	}
+
+	Csq->CsqReleaseLock(Csq, irql);
+	return irp;
+}
+
+PIRP IoCsqRemoveIrp(PIO_CSQ Csq, PIO_CSQ_IRP_CONTEXT Context) noexcept
+{
+	KIRQL irql;
+	Csq->CsqAcquireLock(Csq, &irql);
+
+	auto irp = Context->Irp;
+	if (irp && IoSetCancelRoutine(irp, nullptr))
+	{
+		Csq->CsqRemoveIrp(Csq, irp);
+		csq_detach(irp);
+	}
+	else
+		irp = nullptr;
+
+	Csq->CsqReleaseLock(Csq, irql);
+	return irp;
+}
@@ -0,0 +1,677 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Microbenchmarks of the drv data structures
+//
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "pch.h"
+#include "km_shim_impl.h"
+
+namespace
+{
+	//
+	// Helpers
+	//
+
+	/// <summary>
+	/// IRPs with a single stack location, as a driver sees them in its dispatch routine
+	/// Requests are spread over `files` file objects in round-robin order
+	/// </summary>
+	class irp_set
+	{
+		std::vector<FILE_OBJECT> file_objects;
+		std::vector<PIRP> irps;
+
+	public:
+		explicit irp_set(size_t count, size_t files = 1) :
+			file_objects(files)
+		{
+			irps.reserve(count);
+			for (size_t i = 0; i < count; ++i)
+			{
+				auto irp = IoAllocateIrp(1, FALSE);
+				const auto stack = IoGetNextIrpStackLocation(irp);
+				stack->MajorFunction = IRP_MJ_READ;
+				stack->FileObject = &file_objects[i % files];
+				IoSetNextIrpStackLocation(irp);
+				irps.push_back(irp);
+			}
+		}
+
+		irp_set(const irp_set &) = delete;
+		irp_set &operator =(const irp_set &) = delete;
+
+		~irp_set()
+		{
+			for (auto irp : irps)
+				IoFreeIrp(irp);
+		}
+
+		[[nodiscard]]
+		size_t size() const noexcept
+		{
+			return irps.size();
+		}
+
+		[[nodiscard]]
+		PIRP operator [](size_t index) const noexcept
+		{
+			return irps[index];
+		}
+
+		[[nodiscard]]
+		PFILE_OBJECT file(size_t index) noexcept
+		{
+			return &file_objects[index];
+		}
+	};
+
+	template<class Storage, class Lock = drv::spin_lock>
+	using queue_t = drv::cancel_safe_queue_default<Storage, drv::trace::disabled, Lock>;
+
+	// Benchmarks that take a queue length use these
+	constexpr const int64_t MinQueueLength = 8;
+	constexpr const int64_t MaxQueueLength = 4096;
+
+	//
+	// effective_db_list
+	//
+
+	struct node_t
+	{
+		LIST_ENTRY link;
+		u64 value;
+	};
+
+	using node_list = drv::details::effective_db_list<node_t, drv::details::list_entry<node_t, offsetof(node_t, link)>>;
+
+	void list_add_tail_remove_head(benchmark::State &state)
+	{
+		std::vector<node_t> nodes(static_cast<size_t>(state.range(0)));
+		node_list list;
+
+		for ([[maybe_unused]] auto _ : state)
+		{
+			for (auto &node : nodes)
+				list.add_tail(&node);
+			while (auto node = list.remove_head())
+				benchmark::DoNotOptimize(node);
+		}
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+	}
+	BENCHMARK(list_add_tail_remove_head)->RangeMultiplier(8)->Range(MinQueueLength, MaxQueueLength);
+
+	void list_remove_middle(benchmark::State &state)
+	{
+		std::vector<node_t> nodes(static_cast<size_t>(state.range(0)));
+		node_list list;
+		for (auto &node : nodes)
+			list.add_tail(&node);
+
+		std::vector<size_t> order(nodes.size());
+		std::iota(order.begin(), order.end(), size_t{});
+		std::ranges::shuffle(order, std::mt19937{ 42 });
+
+		for ([[maybe_unused]] auto _ : state)
+		{
+			for (const auto index : order)
+			{
+				list.remove(&nodes[index]);
+				list.add_tail(&nodes[index]);
+			}
+		}
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+		list.clear();
+	}
+	BENCHMARK(list_remove_middle)->RangeMultiplier(8)->Range(MinQueueLength, MaxQueueLength);
+
+	void list_iterate(benchmark::State &state)
+	{
+		std::vector<node_t> nodes(static_cast<size_t>(state.range(0)));
+		node_list list;
+		for (auto &node : nodes)
+			list.add_tail(&node);
+
+		for ([[maybe_unused]] auto _ : state)
+		{
+			u64 sum{};
+			for (auto node = list.get_head(); node; node = list.get_next(node))
+				sum += node->value;
+			benchmark::DoNotOptimize(sum);
+		}
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+		list.clear();
+	}
+	BENCHMARK(list_iterate)->RangeMultiplier(8)->Range(MinQueueLength, MaxQueueLength);
+
+	//
+	// slist
+	//
+
+	struct slist_node_t
+	{
+		SLIST_ENTRY link;
+		u64 value;
+	};
+
+	using node_slist = drv::slist<slist_node_t, drv::slist_entry<slist_node_t, offsetof(slist_node_t, link)>>;
+
+	void slist_push_pop(benchmark::State &state)
+	{
+		std::vector<slist_node_t> nodes(static_cast<size_t>(state.range(0)));
+		node_slist list;
+
+		for ([[maybe_unused]] auto _ : state)
+		{
+			for (auto &node : nodes)
+				list.push(&node);
+			while (auto node = list.pop())
+				benchmark::DoNotOptimize(node);
+		}
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+	}
+	BENCHMARK(slist_push_pop)->RangeMultiplier(8)->Range(MinQueueLength, MaxQueueLength);
+
+	void slist_push_flush(benchmark::State &state)
+	{
+		std::vector<slist_node_t> nodes(static_cast<size_t>(state.range(0)));
+		node_slist list;
+
+		for ([[maybe_unused]] auto _ : state)
+		{
+			for (auto &node : nodes)
+				list.push(&node);
+			for (auto chain = list.flush(); auto node = chain.pop_front();)
+				benchmark::DoNotOptimize(node);
+		}
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+	}
+	BENCHMARK(slist_push_flush)->RangeMultiplier(8)->Range(MinQueueLength, MaxQueueLength);
+
+	/// <summary>
+	/// Push and pop one node per iteration on a stack shared by all benchmark threads, the lock-free counterpart of csq_contended
+	/// </summary>
+	void slist_contended(benchmark::State &state)
+	{
+		static node_slist list;
+		slist_node_t own{};
+
+		// As in csq_contended, a thread pushes whichever node it popped last, and the stack is not empty after its own push
+		auto node = &own;
+		for ([[maybe_unused]] auto _ : state)
+		{
+			list.push(node);
+			node = list.pop();
+			benchmark::DoNotOptimize(node);
+		}
+		state.SetItemsProcessed(state.iterations());
+
+		// Nodes are on the stacks of the benchmark threads, leave the list empty for the next run
+		while (list.pop())
+			;
+	}
+	BENCHMARK(slist_contended)->ThreadRange(1, 8)->UseRealTime();
+
+	//
+	// Statistics counters
+	//
+
+	/// <summary>
+	/// Increment a counter shared by all benchmark threads, the baseline for percpu_counter_contended
+	/// </summary>
+	void atomic_counter_contended(benchmark::State &state)
+	{
+		alignas(64) static std::atomic<u64> counter;
+		for ([[maybe_unused]] auto _ : state)
+			counter.fetch_add(1, std::memory_order_relaxed);
+		state.SetItemsProcessed(state.iterations());
+	}
+	BENCHMARK(atomic_counter_contended)->ThreadRange(1, 8)->UseRealTime();
+
+	/// <summary>
+	/// Increment a counter that every benchmark thread updates in the copy of its own virtual processor
+	/// </summary>
+	void percpu_counter_contended(benchmark::State &state)
+	{
+		static drv::percpu_counter<u64> counter;
+		// Initialized once by whichever thread of the first run gets here first
+		static const bool initialized = nt_success(counter.initialize());
+		if (!initialized)
+		{
+			state.SkipWithError("percpu_counter initialization failed");
+			return;
+		}
+
+		for ([[maybe_unused]] auto _ : state)
+			counter.increment();
+		state.SetItemsProcessed(state.iterations());
+	}
+	BENCHMARK(percpu_counter_contended)->ThreadRange(1, 8)->UseRealTime();
+
+	//
+	// cancel_safe_queue
+	//
+
+	/// <summary>
+	/// Insert all IRPs and remove them in queue order
+	/// </summary>
+	template<class Storage>
+	void csq_insert_remove(benchmark::State &state)
+	{
+		irp_set irps{ static_cast<size_t>(state.range(0)) };
+		queue_t<Storage> queue;
+
+		for ([[maybe_unused]] auto _ : state)
+		{
+			for (size_t i = 0; i < irps.size(); ++i)
+				std::ignore = queue.insert(drv::irp_t{ irps[i] });
+			while (auto irp = queue.remove_next())
+				benchmark::DoNotOptimize(std::move(irp).detach());
+		}
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+	}
+	BENCHMARK_TEMPLATE(csq_insert_remove, drv::storage_policy::irp_list)->RangeMultiplier(8)->Range(MinQueueLength, MaxQueueLength);
+	BENCHMARK_TEMPLATE(csq_insert_remove, drv::storage_policy::per_file_irp_list<>)->RangeMultiplier(8)->Range(MinQueueLength, MaxQueueLength);
+	BENCHMARK_TEMPLATE(csq_insert_remove, drv::storage_policy::priority_irp_list<>)->RangeMultiplier(8)->Range(MinQueueLength, MaxQueueLength);
+
+	/// <summary>
+	/// Remove the IRPs of one file object from a queue shared by `state.range(1)` file objects, as cleanup does, and put them back
+	/// </summary>
+	template<class Storage>
+	void csq_filtered_remove(benchmark::State &state)
+	{
+		const auto files = static_cast<size_t>(state.range(1));
+		irp_set irps{ static_cast<size_t>(state.range(0)), files };
+		queue_t<Storage> queue;
+		for (size_t i = 0; i < irps.size(); ++i)
+			std::ignore = queue.insert(drv::irp_t{ irps[i] });
+
+		std::vector<drv::irp_t> removed;
+		removed.reserve(irps.size());
+		size_t file{};
+		for ([[maybe_unused]] auto _ : state)
+		{
+			const auto file_object = irps.file(file);
+			file = (file + 1) % files;
+
+			while (auto irp = queue.remove_next(file_object))
+				removed.push_back(std::move(irp));
+			for (auto &irp : removed)
+				std::ignore = queue.insert(std::move(irp));
+			removed.clear();
+		}
+		state.SetItemsProcessed(state.iterations() * state.range(0) / state.range(1));
+
+		while (auto irp = queue.remove_next())
+			std::ignore = std::move(irp).detach();
+	}
+	BENCHMARK_TEMPLATE(csq_filtered_remove, drv::storage_policy::irp_list)->ArgsProduct({ { 256, 4096 }, { 4, 64 } });
+	BENCHMARK_TEMPLATE(csq_filtered_remove, drv::storage_policy::per_file_irp_list<>)->ArgsProduct({ { 256, 4096 }, { 4, 64 } });
+
+	/// <summary>
+	/// Insert all IRPs and remove them in batches of `state.range(1)` with the queue lock held once per batch
+	/// </summary>
+	void csq_remove_batch(benchmark::State &state)
+	{
+		irp_set irps{ static_cast<size_t>(state.range(0)) };
+		queue_t<drv::storage_policy::irp_list> queue;
+		std::vector<drv::irp_t> batch(static_cast<size_t>(state.range(1)));
+
+		for ([[maybe_unused]] auto _ : state)
+		{
+			for (size_t i = 0; i < irps.size(); ++i)
+				std::ignore = queue.insert(drv::irp_t{ irps[i] });
+
+			while (const auto count = queue.remove_batch(batch))
+				for (auto &irp : std::span{ batch }.first(count))
+					benchmark::DoNotOptimize(std::move(irp).detach());
+		}
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+	}
+	BENCHMARK(csq_remove_batch)->ArgsProduct({ { 256, 4096 }, { 1, 16, 64 } });
+
+	/// <summary>
+	/// Insert and remove one IRP per iteration from a queue shared by all benchmark threads
+	/// </summary>
+	template<class Lock>
+	void csq_contended(benchmark::State &state)
+	{
+		static queue_t<drv::storage_policy::irp_list, Lock> queue;
+		irp_set irps{ 1 };
+
+		// A thread may remove an IRP inserted by another one, so it keeps inserting whichever IRP it removed last.
+		// Every thread removes only after its own insert, so the queue is never empty at that point
+		auto irp = irps[0];
+		for ([[maybe_unused]] auto _ : state)
+		{
+			std::ignore = queue.insert(drv::irp_t{ irp });
+			irp = queue.remove_next().detach();
+			benchmark::DoNotOptimize(irp);
+		}
+		state.SetItemsProcessed(state.iterations());
+	}
+	BENCHMARK_TEMPLATE(csq_contended, drv::spin_lock)->ThreadRange(1, 8)->UseRealTime();
+	BENCHMARK_TEMPLATE(csq_contended, drv::queued_spin_lock)->ThreadRange(1, 8)->UseRealTime();
+	BENCHMARK_TEMPLATE(csq_contended, drv::rw_spin_lock)->ThreadRange(1, 8)->UseRealTime();
+
+	//
+	// Buffers
+	//
+
+	void ring_buffer_write_read(benchmark::State &state)
+	{
+		const auto size = static_cast<size_t>(state.range(0));
+		drv::ring_buffer buffer{ 64 * 1024 };
+		std::vector<std::byte> data(size, std::byte{ 0x5a });
+
+		// Start in the middle, so some transfers wrap around the end of the storage
+		std::vector<std::byte> offset(buffer.capacity() / 2 + 3);
+		buffer.write(offset);
+
+		for ([[maybe_unused]] auto _ : state)
+		{
+			buffer.write(data);
+			benchmark::DoNotOptimize(buffer.read(data));
+		}
+		state.SetBytesProcessed(state.iterations() * state.range(0) * 2);
+	}
+	BENCHMARK(ring_buffer_write_read)->RangeMultiplier(8)->Range(16, 16 * 1024);
+
+	void segmented_buffer_write_read(benchmark::State &state)
+	{
+		const auto size = static_cast<size_t>(state.range(0));
+		drv::lookaside_list segments;
+		if (!nt_success(segments.initialize(4096)))
+		{
+			state.SkipWithError("lookaside list initialization failed");
+			return;
+		}
+
+		{
+			drv::segmented_buffer buffer{ segments, 64 * 1024 };
+			std::vector<std::byte> data(size, std::byte{ 0x5a });
+
+			// Keep a partially read segment in the buffer, so transfers cross segment boundaries and segments are recycled
+			std::vector<std::byte> offset(4096 / 2 + 3);
+			buffer.write(offset);
+
+			for ([[maybe_unused]] auto _ : state)
+			{
+				buffer.write(data);
+				benchmark::DoNotOptimize(buffer.read(data));
+			}
+			state.SetBytesProcessed(state.iterations() * state.range(0) * 2);
+		}
+		segments.destroy();
+	}
+	BENCHMARK(segmented_buffer_write_read)->RangeMultiplier(8)->Range(16, 16 * 1024);
+
+	void static_vector_append_erase(benchmark::State &state)
+	{
+		const auto count = static_cast<size_t>(state.range(0));
+		drv::details::static_vector<u32, 4096> vector;
+		std::vector<u32> values(count);
+		std::iota(values.begin(), values.end(), 0u);
+		std::ignore = vector.append(values);
+
+		for ([[maybe_unused]] auto _ : state)
+		{
+			// Append at the tail and erase the same number of elements at the head, which moves the rest
+			std::ignore = vector.append(values);
+			vector.erase(vector.begin(), vector.begin() + static_cast<ptrdiff_t>(count));
+			benchmark::DoNotOptimize(vector.data());
+		}
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+	}
+	BENCHMARK(static_vector_append_erase)->RangeMultiplier(8)->Range(8, 2048);
+
+	void small_vector_push_back(benchmark::State &state)
+	{
+		const auto count = static_cast<size_t>(state.range(0));
+
+		for ([[maybe_unused]] auto _ : state)
+		{
+			drv::details::small_vector<u64, 16> vector;
+			for (size_t i = 0; i < count; ++i)
+				std::ignore = vector.push_back(i);
+			benchmark::DoNotOptimize(vector.data());
+		}
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+	}
+	BENCHMARK(small_vector_push_back)->RangeMultiplier(4)->Range(8, 1024);
+
+	//
+	// Scratch allocations
+	//
+
+	// Sizes of the temporary blocks a request handler makes: parsed payload, a couple of names, a few small records
+	constexpr const size_t scratch_sizes[] = { 64, 24, 200, 16, 48, 512, 32, 96 };
+
+	void scratch_pool(benchmark::State &state)
+	{
+		void *blocks[std::size(scratch_sizes)];
+
+		for ([[maybe_unused]] auto _ : state)
+		{
+			for (size_t i = 0; i < std::size(scratch_sizes); ++i)
+				blocks[i] = drv::details::pool_allocate(scratch_sizes[i], { .uninitialized = true });
+			benchmark::DoNotOptimize(blocks);
+			for (auto *block : blocks)
+				drv::details::pool_free(block);
+		}
+		state.SetItemsProcessed(state.iterations() * std::size(scratch_sizes));
+	}
+	BENCHMARK(scratch_pool);
+
+	void scratch_arena(benchmark::State &state)
+	{
+		void *blocks[std::size(scratch_sizes)];
+
+		for ([[maybe_unused]] auto _ : state)
+		{
+			drv::inline_arena<512> arena;
+			for (size_t i = 0; i < std::size(scratch_sizes); ++i)
+				blocks[i] = arena.allocate(scratch_sizes[i]);
+			benchmark::DoNotOptimize(blocks);
+		}
+		state.SetItemsProcessed(state.iterations() * std::size(scratch_sizes));
+	}
+	BENCHMARK(scratch_arena);
+
+	void arena_vector_push_back(benchmark::State &state)
+	{
+		const auto count = static_cast<size_t>(state.range(0));
+
+		for ([[maybe_unused]] auto _ : state)
+		{
+			drv::inline_arena<1024> arena;
+			drv::arena_vector<u64> vector{ arena };
+			for (size_t i = 0; i < count; ++i)
+				std::ignore = vector.push_back(i);
+			benchmark::DoNotOptimize(vector.data());
+		}
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+	}
+	BENCHMARK(arena_vector_push_back)->RangeMultiplier(4)->Range(8, 1024);
+
+	//
+	// Coroutines
+	//
+
+	drv::coro::task<int> chain_link(int depth) noexcept
+	{
+		if (!depth)
+			co_return 0;
+		co_return co_await chain_link(depth - 1) + 1;
+	}
+
+	drv::coro::fire_and_forget run_chain(int depth, int &result) noexcept
+	{
+		result = co_await chain_link(depth);
+	}
+
+	/// <summary>
+	/// Run a chain of nested tasks that complete synchronously, each of them allocates a frame
+	/// With Pooled the frames are recycled by frame_pool, otherwise every frame is allocated from the pool
+	/// </summary>
+	template<bool Pooled>
+	void coro_task_chain(benchmark::State &state)
+	{
+		if constexpr (Pooled)
+		{
+			if (!nt_success(drv::coro::frame_pool::initialize()))
+			{
+				state.SkipWithError("frame_pool initialization failed");
+				return;
+			}
+		}
+
+		const auto depth = static_cast<int>(state.range(0));
+		int result{};
+		for ([[maybe_unused]] auto _ : state)
+		{
+			if (!run_chain(depth, result))
+			{
+				state.SkipWithError("coroutine frame allocation failed");
+				break;
+			}
+			benchmark::DoNotOptimize(result);
+		}
+		state.SetItemsProcessed(state.iterations() * (depth + 1));
+
+		if constexpr (Pooled)
+		{
+			const auto statistics = drv::coro::frame_pool::get_statistics();
+			state.counters["hit_ratio"] = static_cast<double>(statistics.hits) / static_cast<double>(std::max<ULONG64>(statistics.hits + statistics.misses, 1));
+			drv::coro::frame_pool::uninitialize();
+		}
+	}
+	BENCHMARK_TEMPLATE(coro_task_chain, false)->RangeMultiplier(4)->Range(1, 64);
+	BENCHMARK_TEMPLATE(coro_task_chain, true)->RangeMultiplier(4)->Range(1, 64);
+
+	// Number of coroutines that have finished on the worker thread. The counter outlives the benchmark, the worker touches it after the last wait returns
+	std::atomic<u64> passive_hops;
+
+	drv::coro::fire_and_forget hop_to_worker() noexcept
+	{
+		std::ignore = co_await drv::coro::resume_passive(0);
+		passive_hops.fetch_add(1, std::memory_order_release);
+		passive_hops.notify_one();
+	}
+
+	/// <summary>
+	/// Move a coroutine to the scheduler's worker thread of processor 0 and wait until it finishes there
+	/// </summary>
+	void scheduler_passive_round_trip(benchmark::State &state)
+	{
+		for ([[maybe_unused]] auto _ : state)
+		{
+			const auto target = passive_hops.load(std::memory_order_relaxed) + 1;
+			if (!hop_to_worker())
+			{
+				state.SkipWithError("coroutine frame allocation failed");
+				break;
+			}
+
+			for (auto hops = passive_hops.load(std::memory_order_acquire); hops != target; hops = passive_hops.load(std::memory_order_acquire))
+				passive_hops.wait(hops, std::memory_order_acquire);
+		}
+		state.SetItemsProcessed(state.iterations());
+	}
+	BENCHMARK(scheduler_passive_round_trip)->UseRealTime();
+
+	//
+	// Strings
+	//
+
+	/// <summary>
+	/// Two equal strings of `length` characters, stored separately so the comparison reads both. The second one may be in upper case
+	/// </summary>
+	struct string_pair
+	{
+		std::wstring left;
+		std::wstring right;
+
+		explicit string_pair(size_t length, bool different_case = false) :
+			left(length, L'\0'),
+			right(length, L'\0')
+		{
+			for (size_t i = 0; i < length; ++i)
+			{
+				left[i] = static_cast<wchar_t>(L'a' + i % 26);
+				right[i] = static_cast<wchar_t>((different_case ? L'A' : L'a') + i % 26);
+			}
+		}
+	};
+
+	void string_equal(benchmark::State &state)
+	{
+		const string_pair strings{ static_cast<size_t>(state.range(0)) };
+		const drv::static_unicode_string_t left{ strings.left };
+		const drv::static_unicode_string_t right{ strings.right };
+
+		for ([[maybe_unused]] auto _ : state)
+			benchmark::DoNotOptimize(left == right);
+		state.SetBytesProcessed(state.iterations() * state.range(0) * sizeof(wchar_t));
+	}
+	BENCHMARK(string_equal)->RangeMultiplier(4)->Range(8, 8 * 1024);
+
+	void string_equal_case_insensitive(benchmark::State &state)
+	{
+		const string_pair strings{ static_cast<size_t>(state.range(0)), true };
+		const drv::static_unicode_string_t left{ strings.left };
+		const drv::static_unicode_string_t right{ strings.right };
+
+		for ([[maybe_unused]] auto _ : state)
+			benchmark::DoNotOptimize(left.equal_case_insensitive(right));
+		state.SetBytesProcessed(state.iterations() * state.range(0) * sizeof(wchar_t));
+	}
+	BENCHMARK(string_equal_case_insensitive)->RangeMultiplier(4)->Range(8, 8 * 1024);
+
+	void string_hash(benchmark::State &state)
+	{
+		const string_pair strings{ static_cast<size_t>(state.range(0)) };
+		const drv::static_unicode_string_t string{ strings.left };
+
+		for ([[maybe_unused]] auto _ : state)
+			benchmark::DoNotOptimize(std::hash<drv::static_unicode_string_t>{}(string));
+		state.SetBytesProcessed(state.iterations() * state.range(0) * sizeof(wchar_t));
+	}
+	BENCHMARK(string_hash)->RangeMultiplier(4)->Range(8, 8 * 1024);
+
+	void string_hash_case_insensitive(benchmark::State &state)
+	{
+		const string_pair strings{ static_cast<size_t>(state.range(0)) };
+		const drv::static_unicode_string_t string{ strings.left };
+
+		for ([[maybe_unused]] auto _ : state)
+			benchmark::DoNotOptimize(drv::string_hash_case_insensitive{}(string));
+		state.SetBytesProcessed(state.iterations() * state.range(0) * sizeof(wchar_t));
+	}
+	BENCHMARK(string_hash_case_insensitive)->RangeMultiplier(4)->Range(8, 8 * 1024);
+}
+
+int main(int argc, char **argv)
+{
+	// Per-processor state of the queued spin lock, as DriverEntry would create it
+	if (!nt_success(drv::queued_spin_lock::initialize()))
+		return 1;
+	// Worker threads and DPCs of the coroutine scheduler
+	if (!nt_success(drv::scheduler::initialize()))
+		return 1;
+
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+
+	drv::scheduler::uninitialize();
+	drv::queued_spin_lock::uninitialize();
+	return 0;
+}
@@ -0,0 +1,54 @@
+//-------------------------------------------------------------------------------------------------------
+// drv - Windows Driver C++ Support Library
+// Copyright (C) 2025 HHD Software Ltd.
+// Written by Alex Bessonov
+//
+// Microbenchmarks of the drv data structures
+// 
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+// Kernel API shim
+#include "km_shim.h"
+
+// STL
+#include <string_view>
+#include <utility>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <bit>
+#include <array>
+#include <ranges>
+#include <tuple>
+#include <optional>
+#include <span>
+#include <expected>
+#include <coroutine>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+// drv
+#include <drv/allocator.h>
+#include <drv/arena.h>
+#include <drv/coro.h>
+#include <drv/ntstatus.h>
+#include <drv/list.h>
+#include <drv/lock.h>
+#include <drv/percpu.h>
+#include <drv/csq.h>
+#include <drv/ring_buffer.h>
+#include <drv/scheduler.h>
+#include <drv/segmented_buffer.h>
+#include <drv/slist.h>
+#include <drv/vector.h>
+#include <drv/ustring.h>
+
+// Google Benchmark
+#include <benchmark/benchmark.h>
+
+using namespace std::literals;
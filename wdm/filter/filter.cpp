@@ -9,17 +9,202 @@
 //-------------------------------------------------------------------------------------------------------
 
 #include "pch.h"
+#include <drv/flat_hash_map.h>
+#include <drv/lock.h>
+#include <drv/percpu.h>
 #include "filter_ex.h"
 
+// Maximum number of handles that may have the trace buffer mapped at the same time
+constexpr const size_t MaxTraceMappings = 16;
+// Pool tag of the trace buffer
+constexpr const ULONG TraceBufferTag = 'tLHD';
+
+/// <summary>
+/// Counters of a filter device, in the order of filter::statistics fields
+/// </summary>
+enum class statistic
+{
+	version_requests,
+	forwarded_requests,
+	pended_requests,
+	failed_requests,
+	bytes_read,
+	bytes_written,
+
+	count
+};
+
+static_assert(sizeof(filter::statistics) == sizeof(u64) * std::to_underlying(statistic::count));
+
+/// <summary>
+/// Request trace buffer: a ring of fixed-size records for each processor, in nonpaged memory described by an MDL,
+/// so that it can be mapped into the address space of a collector process and read there without system calls
+/// </summary>
+class trace_buffer_t
+{
+	filter::trace_buffer_header *header{};
+	PMDL mdl{};
+	size_t size{};
+
+	[[nodiscard]]
+	filter::trace_processor_ring *rings() const noexcept
+	{
+		return reinterpret_cast<filter::trace_processor_ring *>(header + 1);
+	}
+
+public:
+	trace_buffer_t() = default;
+	trace_buffer_t(const trace_buffer_t &) = delete;
+	trace_buffer_t &operator =(const trace_buffer_t &) = delete;
+
+	~trace_buffer_t()
+	{
+		if (mdl)
+			IoFreeMdl(mdl);
+		::operator delete(header);
+	}
+
+	/// <summary>
+	/// Allocate the buffer, must be called at PASSIVE_LEVEL
+	/// </summary>
+	[[nodiscard]]
+	NTSTATUS initialize() noexcept
+	{
+		PAGED_CODE();
+
+		const auto processor_count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+		// The buffer takes whole pages, so that mapping it does not expose other pool allocations
+		const auto bytes = ROUND_TO_PAGES(sizeof(filter::trace_buffer_header) + processor_count * sizeof(filter::trace_processor_ring));
+
+		// The pool zeroes the buffer, so no stale data is mapped into user mode
+		auto *p = static_cast<filter::trace_buffer_header *>(::operator new(bytes, drv::pool_options{ .tag = TraceBufferTag }));
+		if (!p) [[unlikely]]
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		mdl = IoAllocateMdl(p, static_cast<ULONG>(bytes), false, false, nullptr);
+		if (!mdl) [[unlikely]]
+		{
+			::operator delete(p);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		MmBuildMdlForNonPagedPool(mdl);
+
+		LARGE_INTEGER frequency;
+		KeQueryPerformanceCounter(&frequency);
+		p->processor_count = processor_count;
+		p->records_per_processor = filter::TraceRecordsPerProcessor;
+		p->frequency = frequency.QuadPart;
+
+		header = p;
+		size = bytes;
+		return STATUS_SUCCESS;
+	}
+
+	[[nodiscard]]
+	bool enabled() const noexcept
+	{
+		return header != nullptr;
+	}
+
+	[[nodiscard]]
+	size_t mapping_size() const noexcept
+	{
+		return size;
+	}
+
+	/// <summary>
+	/// Append a record to the ring of the current processor, overwriting the oldest one. May be called at IRQL <= DISPATCH_LEVEL
+	/// </summary>
+	void write(const filter::trace_record &record) noexcept
+	{
+		// Each ring has a single producer, the processor it belongs to. At DISPATCH_LEVEL no other thread may run on it
+		KIRQL irql;
+		KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+		if (const auto index = KeGetCurrentProcessorNumberEx(nullptr); index < header->processor_count) [[likely]]
+		{
+			auto &ring = rings()[index];
+			const auto position = ring.head;
+			auto &slot = ring.records[position % filter::TraceRecordsPerProcessor];
+
+			// Readers ignore the record while its sequence is 0
+			std::atomic_ref{ slot.sequence }.store(0, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+
+			auto value = record;
+			value.sequence = 0;
+			slot = value;
+
+			std::atomic_ref{ slot.sequence }.store(position + 1, std::memory_order_release);
+			std::atomic_ref{ ring.head }.store(position + 1, std::memory_order_release);
+		}
+
+		KeLowerIrql(irql);
+	}
+
+	/// <summary>
+	/// Map the buffer read-only into the address space of the current process
+	/// </summary>
+	[[nodiscard]]
+	NTSTATUS map_user(void **address) noexcept
+	{
+		__try
+		{
+			*address = MmMapLockedPagesSpecifyCache(mdl, UserMode, MmCached, nullptr, false, NormalPagePriority | MdlMappingNoWrite | MdlMappingNoExecute);
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER)
+		{
+			return GetExceptionCode();
+		}
+		return *address ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	/// <summary>
+	/// Remove a mapping created by map_user, must be called in the context of the process the buffer has been mapped into
+	/// </summary>
+	void unmap_user(void *address) noexcept
+	{
+		MmUnmapLockedPages(address, mdl);
+	}
+};
+
 class filter_device_t : public drv::basic_filter_device_t<filter_device_t>
 {
+	/// <summary>
+	/// User-mode mapping of the trace buffer created for a handle
+	/// </summary>
+	struct trace_mapping_t
+	{
+		void *address;
+		PEPROCESS process;
+	};
+
 	// Illustrate the usage of convenient UNICODE_STRING wrapper
+	// The name is used in the PnP completion routine, which may run at DISPATCH_LEVEL, so it cannot be kept in paged_state
 	drv::unicode_string_t devinterface;
-	// Illustrate the usage of std::atomic
-	std::atomic<int> counter{};
+	// Every forwarded request is counted, so each processor counts in its own cache line
+	drv::percpu_counter<u64, std::to_underlying(statistic::count), statistic> statistics;
+	// Trace of forwarded requests, tracing is disabled if it could not be allocated
+	trace_buffer_t trace_buffer;
+	// The filter does not own FILE_OBJECT::FsContext, so mappings are indexed by file object
+	drv::fixed_flat_hash_map<PFILE_OBJECT, trace_mapping_t> trace_mappings;
+	drv::spin_lock trace_mappings_lock;
+	// Entry in the list of all filter devices, walked when a process exits
+	LIST_ENTRY devices_entry;
+
+	// All filter devices of the driver. Devices are added and removed at PASSIVE_LEVEL, the process notification walks the list
+	// and unmaps with the mutex held, so a device cannot be deleted under it
+	static inline LIST_ENTRY devices;
+	static inline FAST_MUTEX devices_mutex;
 
 	//
 	NTSTATUS on_pnp_completion(PIRP irp) noexcept;
+	NTSTATUS on_request_completion(PIRP irp, LONGLONG start) noexcept;
+	NTSTATUS map_trace_buffer(drv::irp_t &&irp) noexcept;
+	NTSTATUS get_statistics(drv::irp_t &&irp) noexcept;
+	void unmap_trace_buffer(const trace_mapping_t &mapping) noexcept;
+	void remove_process_mappings(PEPROCESS process) noexcept;
+	static void on_process_notify(HANDLE parent_id, HANDLE process_id, BOOLEAN create) noexcept;
 
 public:
 	filter_device_t(PDEVICE_OBJECT pdo, PDEVICE_OBJECT fido, PDEVICE_OBJECT nextdo) noexcept :
@@ -30,10 +215,27 @@ public:
 			copiedflags = DO_DIRECT_IO;
 		fido->Flags |= copiedflags | DO_POWER_PAGABLE;
 		fido->Flags &= ~DO_DEVICE_INITIALIZING;
+		InitializeListHead(&devices_entry);
+	}
+
+	~filter_device_t() noexcept
+	{
+		ExAcquireFastMutex(&devices_mutex);
+		RemoveEntryList(&devices_entry);
+		ExReleaseFastMutex(&devices_mutex);
 	}
 
+	static NTSTATUS initialize_process_notify() noexcept;
+	static void uninitialize_process_notify() noexcept;
+
 	NTSTATUS drv_final_construct() noexcept;
 
+	[[nodiscard]]
+	NTSTATUS drv_dispatch_default(drv::irp_t &&irp) noexcept;
+
+	[[nodiscard]]
+	NTSTATUS drv_dispatch_cleanup(drv::irp_t &&irp) noexcept;
+
 	[[nodiscard]]
 	NTSTATUS drv_dispatch_device_control(drv::irp_t &&irp) noexcept;
 
@@ -41,11 +243,39 @@ public:
 	NTSTATUS drv_dispatch_pnp(drv::irp_t &&irp) noexcept;
 };
 
+/// <summary>
+/// Set driver dispatch routines. All device objects of this driver are filter_device_t objects, so they are dispatched directly
+/// Called once from DriverEntry, so the code is discarded after the driver is loaded
+/// </summary>
+DRV_INIT void Driver_InitDispatchRoutines(PDRIVER_OBJECT DriverObject) noexcept
+{
+	drv::init_dispatch_routines<filter_device_t>(DriverObject);
+}
+
+/// <summary>
+/// Register the process notification that removes the trace buffer mappings of exiting processes
+/// Called once from DriverEntry, so the code is discarded after the driver is loaded
+/// </summary>
+DRV_INIT NTSTATUS Driver_InitProcessNotify() noexcept
+{
+	return filter_device_t::initialize_process_notify();
+}
+
+/// <summary>
+/// Implementation of driver's Unload routine. It is called after all devices have been removed
+/// </summary>
+DRV_PAGED void Driver_Unload([[maybe_unused]] PDRIVER_OBJECT DriverObject)
+{
+	PAGED_CODE();
+
+	filter_device_t::uninitialize_process_notify();
+}
+
 /// <summary>
 /// Implementation of drivers' AddDevice routine
 /// It creates a filter device object (FiDO), attaches it to device stack and creates an instance of filter_device_t class
 /// </summary>
-NTSTATUS Driver_AddDevice(PDRIVER_OBJECT DriverObject, PDEVICE_OBJECT pdo)
+DRV_PAGED NTSTATUS Driver_AddDevice(PDRIVER_OBJECT DriverObject, PDEVICE_OBJECT pdo)
 {
 	// AddDevice is called at PASSIVE_LEVEL
 	PAGED_CODE();
@@ -53,17 +283,62 @@ NTSTATUS Driver_AddDevice(PDRIVER_OBJECT DriverObject, PDEVICE_OBJECT pdo)
 	return filter_device_t::create_and_attach_device_object(DriverObject, pdo);
 }
 
-NTSTATUS filter_device_t::drv_final_construct() noexcept
+DRV_PAGED NTSTATUS filter_device_t::drv_final_construct() noexcept
 {
 	PAGED_CODE();
 
 	drv::sys_unicode_string_t link;
 	auto status = IoRegisterDeviceInterface(pdo(), &filter::GUID_DEVINTERFACE_MY_FILTER, nullptr, &link); 
 
-	if (nt_success(status))
-		devinterface = link;
-		
-	return status;
+	if (!nt_success(status))
+		return status;
+
+	devinterface = link;
+
+	// The device works without tracing if there is not enough memory for it. Without the mapping table, the buffer cannot be mapped
+	// Without the per-processor table the counters still work, only slower
+	std::ignore = trace_buffer.initialize();
+	std::ignore = statistics.initialize();
+	std::ignore = trace_mappings.initialize(MaxTraceMappings);
+
+	ExAcquireFastMutex(&devices_mutex);
+	InsertTailList(&devices, &devices_entry);
+	ExReleaseFastMutex(&devices_mutex);
+
+	return STATUS_SUCCESS;
+}
+
+DRV_INIT NTSTATUS filter_device_t::initialize_process_notify() noexcept
+{
+	PAGED_CODE();
+
+	InitializeListHead(&devices);
+	ExInitializeFastMutex(&devices_mutex);
+	return PsSetCreateProcessNotifyRoutine(on_process_notify, false);
+}
+
+DRV_PAGED void filter_device_t::uninitialize_process_notify() noexcept
+{
+	PAGED_CODE();
+
+	std::ignore = PsSetCreateProcessNotifyRoutine(on_process_notify, true);
+}
+
+/// <summary>
+/// Process notification routine. When a process exits, it is called at PASSIVE_LEVEL in the context of the process' last thread, before its
+/// address space is destroyed. A handle duplicated into another process may outlive the process that has mapped the trace buffer,
+/// so the mappings cannot wait for the handle to be closed
+/// </summary>
+void filter_device_t::on_process_notify([[maybe_unused]] HANDLE parent_id, [[maybe_unused]] HANDLE process_id, BOOLEAN create) noexcept
+{
+	if (create)
+		return;
+
+	const auto process = PsGetCurrentProcess();
+	ExAcquireFastMutex(&devices_mutex);
+	for (auto entry = devices.Flink; entry != &devices; entry = entry->Flink)
+		CONTAINING_RECORD(entry, filter_device_t, devices_entry)->remove_process_mappings(process);
+	ExReleaseFastMutex(&devices_mutex);
 }
 
 /// <summary>
@@ -111,15 +386,223 @@ NTSTATUS filter_device_t::drv_dispatch_device_control(drv::irp_t &&irp) noexcept
 		{
 			auto *pv = static_cast<filter::version_info *>(irp->AssociatedIrp.SystemBuffer);
 			pv->current_version = filter::CurrentVersion;
-			pv->requested_count = counter.fetch_add(1, std::memory_order_relaxed);
+			pv->requested_count = static_cast<int>(statistics.value(statistic::version_requests));
+			statistics.increment(statistic::version_requests);
 
 			return complete_irp_and_release_remove_lock(std::move(irp), STATUS_SUCCESS, sizeof(*pv));
 		}
 		else
 			return complete_irp_and_release_remove_lock(std::move(irp), STATUS_INSUFFICIENT_RESOURCES);
+
+	case filter::IOCTL_MAP_TRACE_BUFFER:
+		return map_trace_buffer(std::move(irp));
+
+	case filter::IOCTL_GET_STATISTICS:
+		return get_statistics(std::move(irp));
+	}
+
+	return drv_dispatch_default(std::move(irp));
+}
+
+/// <summary>
+/// Map the trace buffer into the calling process
+/// The request must come directly from a user-mode caller, so that it is processed in the caller's process context
+/// </summary>
+NTSTATUS filter_device_t::map_trace_buffer(drv::irp_t &&irp) noexcept
+{
+	DISPATCH_PROLOG(irp);
+
+	const auto stack = irp.current_stack_location();
+	if (stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(filter::trace_mapping))
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_BUFFER_TOO_SMALL);
+
+	if (!trace_buffer.enabled())
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_NOT_SUPPORTED);
+
+	const auto process = PsGetCurrentProcess();
+	if (irp->RequestorMode != UserMode || IoGetRequestorProcess(irp.operator->()) != process)
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_INVALID_DEVICE_REQUEST);
+
+	const auto file_object = stack->FileObject;
+	{
+		auto l = trace_mappings_lock.acquire();
+		if (trace_mappings.contains(file_object))
+			return complete_irp_and_release_remove_lock(std::move(irp), STATUS_INVALID_DEVICE_STATE);
+	}
+
+	trace_mapping_t mapping{ nullptr, process };
+	if (auto status = trace_buffer.map_user(&mapping.address); !nt_success(status))
+		return complete_irp_and_release_remove_lock(std::move(irp), status);
+
+	ObReferenceObject(process);
+
+	bool inserted;
+	{
+		auto l = trace_mappings_lock.acquire();
+		const auto result = trace_mappings.try_emplace(file_object, mapping);
+		inserted = result && result->inserted;
 	}
 
-	return filter_base::drv_dispatch_default(std::move(irp));
+	if (!inserted)
+	{
+		// Either the table is full or another request of the same handle has won
+		unmap_trace_buffer(mapping);
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_INSUFFICIENT_RESOURCES);
+	}
+
+	auto *result = static_cast<filter::trace_mapping *>(irp->AssociatedIrp.SystemBuffer);
+	result->address = reinterpret_cast<ULONG_PTR>(mapping.address);
+	result->size = trace_buffer.mapping_size();
+	return complete_irp_and_release_remove_lock(std::move(irp), STATUS_SUCCESS, sizeof(*result));
+}
+
+/// <summary>
+/// Return the filter's counters, summed over all processors
+/// </summary>
+NTSTATUS filter_device_t::get_statistics(drv::irp_t &&irp) noexcept
+{
+	DISPATCH_PROLOG(irp);
+
+	if (irp.current_stack_location()->Parameters.DeviceIoControl.OutputBufferLength < sizeof(filter::statistics))
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_BUFFER_TOO_SMALL);
+
+	const auto values = statistics.values();
+	const auto at = [&](statistic s) noexcept { return values[std::to_underlying(s)]; };
+	*static_cast<filter::statistics *>(irp->AssociatedIrp.SystemBuffer) = {
+		.version_requests = at(statistic::version_requests),
+		.forwarded_requests = at(statistic::forwarded_requests),
+		.pended_requests = at(statistic::pended_requests),
+		.failed_requests = at(statistic::failed_requests),
+		.bytes_read = at(statistic::bytes_read),
+		.bytes_written = at(statistic::bytes_written),
+	};
+	return complete_irp_and_release_remove_lock(std::move(irp), STATUS_SUCCESS, sizeof(filter::statistics));
+}
+
+/// <summary>
+/// Remove a user-mode mapping of the trace buffer. The last handle may be closed by another process, attach to the mapping's one if necessary
+/// </summary>
+void filter_device_t::unmap_trace_buffer(const trace_mapping_t &mapping) noexcept
+{
+	if (mapping.process == PsGetCurrentProcess())
+		trace_buffer.unmap_user(mapping.address);
+	else
+	{
+		KAPC_STATE apc_state;
+		KeStackAttachProcess(mapping.process, &apc_state);
+		trace_buffer.unmap_user(mapping.address);
+		KeUnstackDetachProcess(&apc_state);
+	}
+	ObDereferenceObject(mapping.process);
+}
+
+/// <summary>
+/// Remove all user-mode mappings of the trace buffer created by the process, which must be the current one
+/// </summary>
+void filter_device_t::remove_process_mappings(PEPROCESS process) noexcept
+{
+	for (;;)
+	{
+		// Mappings are unmapped with the spin lock released, so take them one at a time
+		std::optional<std::pair<PFILE_OBJECT, trace_mapping_t>> found;
+		{
+			auto l = trace_mappings_lock.acquire();
+			trace_mappings.for_each([&](PFILE_OBJECT file_object, const trace_mapping_t &mapping) noexcept
+			{
+				if (!found && mapping.process == process)
+					found.emplace(file_object, mapping);
+			});
+			if (found)
+				trace_mappings.erase(found->first);
+		}
+
+		if (!found)
+			break;
+		unmap_trace_buffer(found->second);
+	}
+}
+
+/// <summary>
+/// CLEANUP dispatch routine
+/// Removes the trace buffer mapping of the handle, unless its process has already exited, and forwards the request
+/// </summary>
+NTSTATUS filter_device_t::drv_dispatch_cleanup(drv::irp_t &&irp) noexcept
+{
+	const auto file_object = irp.current_stack_location()->FileObject;
+
+	std::optional<trace_mapping_t> mapping;
+	{
+		auto l = trace_mappings_lock.acquire();
+		if (const auto p = trace_mappings.find(file_object))
+		{
+			mapping = *p;
+			trace_mappings.erase(file_object);
+		}
+	}
+
+	if (mapping)
+		unmap_trace_buffer(*mapping);
+
+	return drv_dispatch_default(std::move(irp));
+}
+
+/// <summary>
+/// Default dispatch routine
+/// Forwards the request with a completion routine that counts it and records it in the trace buffer
+/// </summary>
+NTSTATUS filter_device_t::drv_dispatch_default(drv::irp_t &&irp) noexcept
+{
+	DISPATCH_PROLOG(irp);
+	statistics.increment(statistic::forwarded_requests);
+
+	// The start time is passed to the completion routine as its context
+	const auto start = trace_buffer.enabled() ? KeQueryPerformanceCounter(nullptr).QuadPart : 0;
+	irp.copy_stack_location();
+	irp.set_completion_routine([](PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context) noexcept
+	{
+		return from_device_object(DeviceObject)->on_request_completion(Irp, reinterpret_cast<LONGLONG>(Context));
+	}, reinterpret_cast<PVOID>(start));
+
+	// The remove lock is released by the completion routine
+	return std::move(irp).call_driver(next_do());
+}
+
+/// <summary>
+/// Completion routine of forwarded requests, updates the counters and writes a trace record
+/// </summary>
+NTSTATUS filter_device_t::on_request_completion(PIRP irp, LONGLONG start) noexcept
+{
+	if (irp->PendingReturned)
+	{
+		IoMarkIrpPending(irp);
+		statistics.increment(statistic::pended_requests);
+	}
+
+	const auto stack = IoGetCurrentIrpStackLocation(irp);
+	if (!nt_success(irp->IoStatus.Status))
+		statistics.increment(statistic::failed_requests);
+	else if (stack->MajorFunction == IRP_MJ_READ)
+		statistics.add(statistic::bytes_read, irp->IoStatus.Information);
+	else if (stack->MajorFunction == IRP_MJ_WRITE)
+		statistics.add(statistic::bytes_written, irp->IoStatus.Information);
+
+	if (trace_buffer.enabled())
+	{
+		const bool is_control = stack->MajorFunction == IRP_MJ_DEVICE_CONTROL || stack->MajorFunction == IRP_MJ_INTERNAL_DEVICE_CONTROL;
+
+		filter::trace_record record{};
+		record.start = start;
+		record.latency = static_cast<ULONG64>(KeQueryPerformanceCounter(nullptr).QuadPart - start);
+		record.control_code = is_control ? stack->Parameters.DeviceIoControl.IoControlCode : 0;
+		record.length = drv::trace::request_length(stack);
+		record.status = irp->IoStatus.Status;
+		record.major_function = stack->MajorFunction;
+		record.minor_function = stack->MinorFunction;
+		trace_buffer.write(record);
+	}
+
+	release_remove_lock(irp);
+	return STATUS_CONTINUE_COMPLETION;
 }
 
 /// <summary>
@@ -25,6 +25,70 @@ namespace filter
 	constexpr const auto CurrentVersion = 1;
 	constexpr const u16 FilterDriver = 0x1234;
 	constexpr const auto IOCTL_GET_VERSION = drv::ctl::code(FilterDriver, 0x1, drv::ctl::Method::Buffered, drv::ctl::Access::Read);
+	// Map the request trace buffer into the address space of the calling process, returns trace_mapping
+	// The mapping is read-only and is removed when the handle is closed or the calling process exits, whichever comes first
+	constexpr const auto IOCTL_MAP_TRACE_BUFFER = drv::ctl::code(FilterDriver, 0x2, drv::ctl::Method::Buffered, drv::ctl::Access::Read);
+	// Get the counters of the filter, returns statistics
+	constexpr const auto IOCTL_GET_STATISTICS = drv::ctl::code(FilterDriver, 0x3, drv::ctl::Method::Buffered, drv::ctl::Access::Read);
+
+	/// <summary>
+	/// Output of IOCTL_GET_STATISTICS, counted since the filter was attached
+	/// The driver keeps a copy of the counters for each processor and sums them for the request, so they are not an atomic snapshot
+	/// </summary>
+	struct statistics
+	{
+		u64 version_requests;	// IOCTL_GET_VERSION requests
+		u64 forwarded_requests;	// requests passed to the lower driver
+		u64 pended_requests;	// forwarded requests the lower driver completed asynchronously
+		u64 failed_requests;	// forwarded requests completed with an error status
+		u64 bytes_read;			// bytes returned by completed read requests
+		u64 bytes_written;		// bytes taken by completed write requests
+	};
+
+	constexpr const u32 TraceRecordsPerProcessor = 1024;
+
+	/// <summary>
+	/// Record of a request forwarded by the filter
+	/// A record is being written while its sequence is 0. The n-th record written on a processor gets sequence n + 1 and is stored at index n % TraceRecordsPerProcessor
+	/// A reader copies a record and accepts it if its sequence is the same before and after the copy
+	/// </summary>
+	struct trace_record
+	{
+		u64 sequence;
+		i64 start;			// QueryPerformanceCounter value when the request was dispatched
+		u64 latency;		// performance counter ticks from dispatch to completion
+		u32 control_code;	// I/O control code for device control requests, 0 otherwise
+		u32 length;			// requested length
+		i32 status;			// final status
+		u8 major_function;
+		u8 minor_function;
+		u16 reserved;
+	};
+
+	/// <summary>
+	/// Per-processor ring, only written by its processor. head is the number of records written so far
+	/// </summary>
+	struct trace_processor_ring
+	{
+		alignas(64) u64 head;
+		alignas(64) trace_record records[TraceRecordsPerProcessor];
+	};
+
+	/// <summary>
+	/// The trace buffer starts with this header, followed by processor_count trace_processor_ring structures
+	/// </summary>
+	struct alignas(64) trace_buffer_header
+	{
+		u32 processor_count;
+		u32 records_per_processor;
+		i64 frequency;		// performance counter frequency
+	};
+
+	struct trace_mapping
+	{
+		u64 address;		// user-mode address of trace_buffer_header
+		u64 size;			// size of the mapping in bytes
+	};
 
 	constexpr const auto GUID_DEVINTERFACE_MY_FILTER = "{cd87ec5b-5ac2-4e58-9d9e-0e92e7d5f09f}"_guid;
 }
@@ -13,14 +13,25 @@
 #include <drv/allocator_impl.h>
 
 // Forward declare AddDevice routine
-DRIVER_ADD_DEVICE Driver_AddDevice;
+DRV_PAGED DRIVER_ADD_DEVICE Driver_AddDevice;
+// Forward declare dispatch routines initialization
+DRV_INIT void Driver_InitDispatchRoutines(PDRIVER_OBJECT DriverObject) noexcept;
+// Forward declare process notification registration
+DRV_INIT NTSTATUS Driver_InitProcessNotify() noexcept;
+// Forward declare Unload routine
+DRV_PAGED DRIVER_UNLOAD Driver_Unload;
 
-extern "C" NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, [[maybe_unused]] PUNICODE_STRING RegistryPath)
+extern "C" DRV_INIT NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, [[maybe_unused]] PUNICODE_STRING RegistryPath)
 {
 	// DriverEntry is called at PASSIVE_LEVEL
 	PAGED_CODE();
 
-	drv::init_dispatch_routines(DriverObject);
+	drv::initialize_pool_allocator();
+	if (auto status = Driver_InitProcessNotify(); !nt_success(status))
+		return status;
+
+	Driver_InitDispatchRoutines(DriverObject);
 	DriverObject->DriverExtension->AddDevice = Driver_AddDevice;
+	DriverObject->DriverUnload = Driver_Unload;
 	return STATUS_SUCCESS;
 }
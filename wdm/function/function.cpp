@@ -11,100 +11,618 @@
 #include "pch.h"
 #include <drv/decl.h>
 #include <drv/csq.h>
+#include <drv/lock.h>
+#include <drv/percpu.h>
+#include <drv/segmented_buffer.h>
 
 #include "function_ex.h"
 
-constexpr const auto MaxBufferSize = 1 * 1024 * 1024;
+// Buffer size of channel 0, unless the MaxBufferSize REG_DWORD value of the device's hardware key sets another one
+constexpr const size_t DefaultMaxBufferSize = 1 * 1024 * 1024;
+// Number of channels. Channel 0 is shared by all handles that do not select another one
+constexpr const size_t MaxChannels = 64;
+// Buffer size of channels other than channel 0, they are created on first use. Overridden by the ChannelBufferSize value
+constexpr const size_t DefaultChannelBufferSize = 256 * 1024;
+// Limits of the buffer sizes read from the registry
+constexpr const size_t MinBufferSize = 4 * 1024;
+constexpr const size_t MaxBufferSizeLimit = 256 * 1024 * 1024;
+// Buffers are chains of segments of this size (including the segment header), taken from a per-device lookaside list
+constexpr const size_t SegmentSize = 4 * 1024;
+// Read and write requests use Direct I/O, which saves the I/O manager's copy to and from an intermediate system buffer
+constexpr const bool UseDirectIo = true;
+// Maximum number of pending requests taken from a queue with one lock acquisition
+constexpr const size_t PumpBatchSize = 16;
+// Maximum size of a request served by Fast I/O, the data is staged in a stack buffer of this size
+constexpr const size_t FastIoMaxLength = 512;
+// Pool tags of channels, shared rings and file contexts
+constexpr const ULONG ChannelTag = 'nFHD';
+constexpr const ULONG SharedRingTag = 'rFHD';
+constexpr const ULONG FileContextTag = 'fFHD';
+constexpr const ULONG SegmentTag = 'sFHD';
 
 /// <summary>
-/// A simple queue implementation
+/// Counters of a device, in the order of function::statistics fields
 /// </summary>
-class static_buffer
+enum class statistic
 {
-	std::unique_ptr<std::byte[]> storage{ std::make_unique_for_overwrite<std::byte[]>(MaxBufferSize) };
-	size_t used{};
+	open_handles,
+	read_requests,
+	write_requests,
+	fast_io_requests,
+	bytes_read,
+	bytes_written,
+	pended_reads,
+	pended_writes,
+	cancelled_requests,
+
+	count
+};
+
+// Statistics are updated on every request, so each processor counts in its own cache line
+using device_statistics = drv::percpu_counter<u64, std::to_underlying(statistic::count), statistic>;
+static_assert(sizeof(function::statistics) == sizeof(u64) * std::to_underlying(statistic::count));
+
+/// <summary>
+/// Get the data length of a read or write request
+/// IOCTL_READ and IOCTL_WRITE requests are served as reads and writes, their data is described by the output buffer
+/// </summary>
+[[nodiscard]]
+ULONG request_length(PIRP irp) noexcept
+{
+	switch (const auto stack = IoGetCurrentIrpStackLocation(irp); stack->MajorFunction)
+	{
+	case IRP_MJ_READ:
+		return stack->Parameters.Read.Length;
+	case IRP_MJ_WRITE:
+		return stack->Parameters.Write.Length;
+	default:
+		return stack->Parameters.DeviceIoControl.OutputBufferLength;
+	}
+}
+
+[[nodiscard]]
+ULONG request_length(const drv::irp_t &irp) noexcept
+{
+	return request_length(irp.operator->());
+}
+
+/// <summary>
+/// Get the data buffer of a read or write request
+/// </summary>
+/// <returns>Request buffer or std::nullopt if the buffer could not be mapped into the system address space</returns>
+[[nodiscard]]
+std::optional<std::span<std::byte>> request_buffer(const drv::irp_t &irp) noexcept
+{
+	const auto length = request_length(irp);
+	if (!length)
+		return std::span<std::byte>{};
+
+	void *data;
+	// METHOD_IN_DIRECT and METHOD_OUT_DIRECT control requests always describe the buffer with an MDL
+	if (UseDirectIo || irp.current_stack_location()->MajorFunction == IRP_MJ_DEVICE_CONTROL)
+		data = irp.mdl_system_address();
+	else
+		data = irp->AssociatedIrp.SystemBuffer;
+
+	if (!data) [[unlikely]]
+		return std::nullopt;
+
+	return std::span{ static_cast<std::byte *>(data), length };
+}
+
+/// <summary>
+/// Copy data to a buffer passed to a Fast I/O routine. The I/O manager does not probe these buffers
+/// Must not be called with spin locks held, the buffer may be pageable
+/// </summary>
+[[nodiscard]]
+NTSTATUS copy_to_caller(void *destination, const void *source, size_t length) noexcept
+{
+	__try
+	{
+		if (ExGetPreviousMode() != KernelMode)
+			ProbeForWrite(destination, length, 1);
+		memcpy(destination, source, length);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		return GetExceptionCode();
+	}
+	return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Check that a buffer passed to a Fast I/O routine is writable, before data that cannot be put back is taken for it
+/// </summary>
+[[nodiscard]]
+NTSTATUS probe_caller_buffer(void *destination, size_t length) noexcept
+{
+	__try
+	{
+		if (ExGetPreviousMode() != KernelMode)
+			ProbeForWrite(destination, length, 1);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		return GetExceptionCode();
+	}
+	return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Copy data from a buffer passed to a Fast I/O routine. The I/O manager does not probe these buffers
+/// Must not be called with spin locks held, the buffer may be pageable
+/// </summary>
+[[nodiscard]]
+NTSTATUS copy_from_caller(void *destination, const void *source, size_t length) noexcept
+{
+	__try
+	{
+		if (ExGetPreviousMode() != KernelMode)
+			ProbeForRead(const_cast<void *>(source), length, 1);
+		memcpy(destination, source, length);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		return GetExceptionCode();
+	}
+	return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Get the number of bytes already consumed from a pending write request
+/// DriverContext[0] and [1] are used by the per-file queue storage, DriverContext[3] by the CSQ itself
+/// </summary>
+[[nodiscard]]
+size_t bytes_taken(PIRP irp) noexcept
+{
+	return reinterpret_cast<ULONG_PTR>(irp->Tail.Overlay.DriverContext[2]);
+}
+
+void set_bytes_taken(PIRP irp, size_t bytes) noexcept
+{
+	irp->Tail.Overlay.DriverContext[2] = reinterpret_cast<PVOID>(bytes);
+}
+
+[[nodiscard]]
+size_t bytes_taken(const drv::irp_t &irp) noexcept
+{
+	return bytes_taken(irp.operator->());
+}
+
+void set_bytes_taken(const drv::irp_t &irp, size_t bytes) noexcept
+{
+	set_bytes_taken(irp.operator->(), bytes);
+}
+
+// Number of bytes a pending read request can still accept
+constexpr const auto pending_read_size = [](PIRP irp) noexcept -> size_t
+{
+	return request_length(irp);
+};
+
+// Number of bytes a pending write request still has to give
+constexpr const auto pending_write_size = [](PIRP irp) noexcept -> size_t
+{
+	return request_length(irp) - bytes_taken(irp);
+};
+
+/// <summary>
+/// Make a remove_batch predicate that takes IRPs until their total length (as returned by `length`) covers `budget` bytes
+/// </summary>
+[[nodiscard]]
+auto take_while_budget(size_t budget, auto length) noexcept
+{
+	return [budget, length](PIRP irp) mutable noexcept
+	{
+		if (!budget)
+			return drv::batch_action::stop;
+		budget -= std::min<size_t>(budget, length(irp));
+		return drv::batch_action::take;
+	};
+}
+
+/// <summary>
+/// Read a buffer size from a REG_DWORD value of an open registry key
+/// </summary>
+/// <returns>The value clamped to [MinBufferSize, MaxBufferSizeLimit], or `default_size` if the value does not exist or is not a REG_DWORD</returns>
+[[nodiscard]]
+DRV_PAGED size_t query_buffer_size(HANDLE key, const wchar_t *value_name, size_t default_size) noexcept
+{
+	PAGED_CODE();
+
+	UNICODE_STRING name;
+	RtlInitUnicodeString(&name, value_name);
+
+	alignas(KEY_VALUE_PARTIAL_INFORMATION) std::array<std::byte, sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(ULONG)> buffer;
+	const auto info = reinterpret_cast<PKEY_VALUE_PARTIAL_INFORMATION>(buffer.data());
+	ULONG result_length;
+	if (!nt_success(ZwQueryValueKey(key, &name, KeyValuePartialInformation, info, static_cast<ULONG>(buffer.size()), &result_length))
+		|| info->Type != REG_DWORD || info->DataLength != sizeof(ULONG))
+		return default_size;
+
+	ULONG value;
+	memcpy(&value, info->Data, sizeof(value));
+	return std::clamp<size_t>(value, MinBufferSize, MaxBufferSizeLimit);
+}
+
+/// <summary>
+/// Get the channel number from the name a handle is opened with. "" and "\" select the shared channel 0, "\N" selects channel N
+/// </summary>
+/// <returns>Channel number or std::nullopt if the name is not valid</returns>
+[[nodiscard]]
+std::optional<size_t> parse_channel_name(const UNICODE_STRING &name) noexcept
+{
+	std::wstring_view view{ name.Buffer, name.Length / sizeof(wchar_t) };
+	if (view.starts_with(L'\\'))
+		view.remove_prefix(1);
+
+	size_t index{};
+	for (const auto c : view)
+	{
+		if (c < L'0' || c > L'9')
+			return std::nullopt;
+		index = index * 10 + (c - L'0');
+		if (index >= MaxChannels)
+			return std::nullopt;
+	}
+	return index;
+}
+
+/// <summary>
+/// IOCTL_READ_BATCH or IOCTL_WRITE_BATCH request with a private copy of its header and descriptors
+/// </summary>
+struct batch_t
+{
+	std::span<std::byte> data;
+	function::batch_header header;
+	std::array<function::batch_descriptor, function::MaxBatchRecords> descriptors;
+
+	[[nodiscard]]
+	std::span<function::batch_descriptor> records() noexcept
+	{
+		return std::span{ descriptors }.first(header.count);
+	}
+
+	[[nodiscard]]
+	bool framed() const noexcept
+	{
+		return header.flags & function::BatchRecords;
+	}
+};
+
+/// <summary>
+/// Copy the header and descriptors of a batch request and validate them
+/// The buffer is shared with the application, which may change it at any time, so only the copies are used later
+/// </summary>
+[[nodiscard]]
+NTSTATUS parse_batch(const drv::irp_t &irp, batch_t &batch) noexcept
+{
+	const auto buffer = request_buffer(irp);
+	if (!buffer) [[unlikely]]
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	if (buffer->size() < sizeof(batch.header))
+		return STATUS_BUFFER_TOO_SMALL;
+	memcpy(&batch.header, buffer->data(), sizeof(batch.header));
+
+	if (batch.header.count > function::MaxBatchRecords || (batch.header.flags & ~function::BatchRecords))
+		return STATUS_INVALID_PARAMETER;
+
+	const auto data_offset = function::batch_data_offset(batch.header.count);
+	if (buffer->size() < data_offset)
+		return STATUS_BUFFER_TOO_SMALL;
+
+	const auto records = batch.records();
+	memcpy(records.data(), buffer->data() + sizeof(batch.header), records.size_bytes());
+
+	for (const auto &record : records)
+		if (record.offset < data_offset || record.offset > buffer->size() || record.length > buffer->size() - record.offset)
+			return STATUS_INVALID_PARAMETER;
+
+	batch.data = *buffer;
+	return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Complete a pending write with the number of bytes taken from it
+/// A write that is cancelled after a reader has received part of its data succeeds with that part, since the data cannot be given back.
+/// Only a write nothing has been taken from is completed with STATUS_CANCELLED
+/// </summary>
+NTSTATUS complete_write(drv::irp_t &&irp) noexcept
+{
+	if (const auto taken = bytes_taken(irp))
+		return std::move(irp).complete(STATUS_SUCCESS, taken);
+	return std::move(irp).complete(STATUS_CANCELLED);
+}
+
+/// <summary>
+/// Queue of pending writes
+/// Partly consumed writes are put back at the head of the queue with the channel's buffer lock held. If such a write has been cancelled,
+/// the insertion reports it to csq_on_cancel right away, so a write cancelled during requeue is handed back to the caller, which completes it
+/// once the lock is released
+/// </summary>
+class write_queue_t : public drv::cancel_safe_queue<write_queue_t, drv::storage_policy::per_file_irp_list<>>
+{
+	// The thread that is in requeue and the slot of the write it is inserting. Other threads never see their own thread here
+	std::atomic<PKTHREAD> requeuing_thread{};
+	drv::irp_t *requeue_slot{};
+
+public:
+	void csq_on_cancel(drv::irp_t &&irp) noexcept
+	{
+		if (requeuing_thread.load(std::memory_order_relaxed) == KeGetCurrentThread())
+			*requeue_slot = std::move(irp);
+		else
+			std::ignore = complete_write(std::move(irp));
+	}
+
+	/// <summary>
+	/// Put writes back at the head of the queue in their original order. Called with the buffer lock held, which also serializes requeue calls
+	/// No request is completed: a write that has been cancelled is left in its slot, and the caller completes it with complete_write after
+	/// it releases the lock. The per-file storage never refuses an IRP, so every other slot is empty on return
+	/// </summary>
+	void requeue(std::span<drv::irp_t> writes) noexcept
+	{
+		requeuing_thread.store(KeGetCurrentThread(), std::memory_order_relaxed);
+		for (auto &write : writes | rv::reverse)
+		{
+			requeue_slot = &write;
+			std::ignore = insert_head(std::move(write));
+		}
+		requeuing_thread.store(nullptr, std::memory_order_relaxed);
+	}
+};
+
+/// <summary>
+/// Independent loopback pipe: a segmented buffer with its lock and a pair of queues for pending reads and writes
+/// Handles opened on different channels never share a lock, so their throughput is not limited by a single cache line
+/// </summary>
+class channel_t
+{
+	// Requests are indexed by file object, so handle close does not scan requests of other handles. Pending reads may have deadlines
+	alignas(SYSTEM_CACHE_ALIGNMENT_SIZE) drv::cancel_safe_queue_default<drv::storage_policy::per_file_irp_list<>, drv::trace::disabled, drv::spin_lock, drv::deadline_policy::deadline_wheel<>> in_queue;
+	alignas(SYSTEM_CACHE_ALIGNMENT_SIZE) write_queue_t out_queue;
+	// The buffer is only accessed with the lock held, so they share a cache line. Queued lock waiters spin on their own stack entries
+	alignas(SYSTEM_CACHE_ALIGNMENT_SIZE) drv::queued_spin_lock buffer_lock;
+	drv::segmented_buffer buffer;
+	// Counters of the device the channel belongs to
+	device_statistics &statistics;
+
+	//
+	size_t hand_off_to_pending_reads(std::span<const std::byte> data, LIST_ENTRY &served) noexcept;
+	size_t take_from_pending_writes(std::span<std::byte> destination) noexcept;
 
 public:
+	channel_t(drv::lookaside_list &segments, size_t buffer_size, device_statistics &statistics) noexcept :
+		buffer{ segments, buffer_size },
+		statistics{ statistics }
+	{
+	}
+
+	// The queues and the lock are kept on separate cache lines only if the allocation honors the alignment
 	[[nodiscard]]
-	auto free_space() const noexcept
+	static void *operator new(size_t size, std::align_val_t alignment) noexcept
+	{
+		return ::operator new(size, alignment, drv::pool_options{ .tag = ChannelTag });
+	}
+
+	static void operator delete(void *ptr, std::align_val_t alignment) noexcept
 	{
-		return MaxBufferSize - used;
+		::operator delete(ptr, alignment);
 	}
 
 	[[nodiscard]]
-	auto size() const noexcept
+	NTSTATUS read(drv::irp_t &&irp, ULONG timeout_ms) noexcept;
+	[[nodiscard]]
+	NTSTATUS write(drv::irp_t &&irp) noexcept;
+	bool fast_read(void *data, ULONG length, IO_STATUS_BLOCK &io_status) noexcept;
+	bool fast_write(const void *data, ULONG length, IO_STATUS_BLOCK &io_status) noexcept;
+	void cancel_requests(PFILE_OBJECT file_object) noexcept;
+
+	[[nodiscard]]
+	size_t write_batch(batch_t &batch) noexcept;
+	[[nodiscard]]
+	std::expected<size_t, NTSTATUS> read_batch(batch_t &batch) noexcept;
+
+	size_t put(std::span<const std::byte> data) noexcept;
+	size_t get(std::span<std::byte> destination) noexcept;
+	void process_pending_io() noexcept;
+};
+
+/// <summary>
+/// Submission and completion rings shared with the application, registered with IOCTL_REGISTER_RING
+/// The application posts many requests and then makes a single IOCTL_SUBMIT_RING call to have them all processed
+/// The buffer is locked and mapped into the system address space, so it can be accessed in any process context at DISPATCH_LEVEL
+/// A handle duplicated into another process may outlive the process that has registered the ring, so the pages are unlocked when that process exits
+/// </summary>
+class shared_ring_t
+{
+	PKEVENT event{};
+	PMDL mdl{};
+	bool locked{};
+	function::ring_control *control{};
+	const function::submission_entry *sq{};
+	function::completion_entry *cq{};
+	std::span<std::byte> data;
+	u32 sq_entries{}, cq_entries{};
+	// Indices owned by the driver. Shared copies are only written, since the application may change them at any time
+	u32 sq_head{}, cq_tail{};
+	// Serializes IOCTL_SUBMIT_RING requests issued by several threads. Processing puts data into the channel and completes its pending
+	// requests, which must not be done with a spin lock held, so the submitters wait on a mutex
+	FAST_MUTEX mutex;
+	// Process the buffer belongs to
+	PEPROCESS owner{};
+	// Entry in the list of all rings, walked when a process exits
+	LIST_ENTRY rings_entry;
+
+	// All rings with locked pages. The process notification unmaps rings with the mutex held, so a ring cannot be deleted under it
+	static inline LIST_ENTRY rings;
+	static inline FAST_MUTEX rings_mutex;
+
+	[[nodiscard]]
+	NTSTATUS map(const function::ring_registration &registration) noexcept;
+	void unmap() noexcept;
+	static void on_process_notify(HANDLE parent_id, HANDLE process_id, BOOLEAN create) noexcept;
+
+public:
+	shared_ring_t() noexcept
+	{
+		ExInitializeFastMutex(&mutex);
+		InitializeListHead(&rings_entry);
+	}
+
+	shared_ring_t(const shared_ring_t &) = delete;
+	shared_ring_t &operator =(const shared_ring_t &) = delete;
+
+	~shared_ring_t()
 	{
-		return used;
+		ExAcquireFastMutex(&rings_mutex);
+		RemoveEntryList(&rings_entry);
+		ExReleaseFastMutex(&rings_mutex);
+
+		unmap();
+		if (mdl)
+			IoFreeMdl(mdl);
+		if (event)
+			ObDereferenceObject(event);
 	}
 
 	[[nodiscard]]
-	bool empty() const noexcept
+	static void *operator new(size_t size) noexcept
 	{
-		return used == 0;
+		return ::operator new(size, drv::pool_options{ .tag = SharedRingTag });
 	}
 
-	auto *data() noexcept
+	static void operator delete(void *ptr) noexcept
 	{
-		return storage.get();
+		::operator delete(ptr);
 	}
 
-	auto begin() noexcept
+	static NTSTATUS initialize_process_notify() noexcept;
+	static void uninitialize_process_notify() noexcept;
+
+	[[nodiscard]]
+	static std::expected<shared_ring_t *, NTSTATUS> create(const function::ring_registration &registration) noexcept;
+
+	[[nodiscard]]
+	std::expected<size_t, NTSTATUS> process(channel_t &channel) noexcept;
+};
+
+/// <summary>
+/// Per-handle state, stored in the file object's FsContext
+/// </summary>
+class file_context_t
+{
+public:
+	std::atomic<channel_t *> channel;
+	// Shared ring is only used with ring_rundown acquired, so that cleanup can wait for submissions in progress before it is destroyed
+	std::atomic<shared_ring_t *> ring{};
+	EX_RUNDOWN_REF ring_rundown;
+	// Time a read request of the handle may stay pending, in milliseconds. 0 means no limit
+	std::atomic<ULONG> read_timeout{};
+
+	explicit file_context_t(channel_t *channel) noexcept :
+		channel{ channel }
 	{
-		return data();
+		ExInitializeRundownProtection(&ring_rundown);
 	}
 
-	auto end() noexcept
+	~file_context_t()
 	{
-		return data() + size();
+		delete ring.load(std::memory_order_relaxed);
 	}
 
-	void append(std::span<const std::byte> appended_data) noexcept
+	[[nodiscard]]
+	static void *operator new(size_t size) noexcept
 	{
-		assert(used + appended_data.size() <= MaxBufferSize);
-		sr::copy(appended_data, end());
-		used += appended_data.size();
+		return ::operator new(size, drv::pool_options{ .tag = FileContextTag });
 	}
 
-	void erase(size_t bytes) noexcept
+	static void operator delete(void *ptr) noexcept
 	{
-		assert(bytes <= used);
-		if (bytes == used) [[likely]]
-			used = 0;
-		else
-		{
-			sr::copy(std::span{ *this }.subspan(bytes), begin());
-			used -= bytes;
-		}
+		::operator delete(ptr);
 	}
 };
 
 /// <summary>
 /// Function device object C++ object
+/// Every request acquires the device's lifetime reference, a cache-aware rundown reference keeps that from contending across processors
 /// </summary>
-class function_device_t : public drv::device_t<function_device_t>
+class function_device_t : public drv::device_t<function_device_t, drv::trace::disabled, drv::lifetime::cache_aware_rundown>
 {
 	PDEVICE_OBJECT pdo, nextdo;
-	drv::unicode_string_t devinterface;
-	drv::cancel_safe_queue_default<> in_queue, out_queue;
-	std::atomic<int> opened_count{};
-	static_buffer buffer;
-	wil::kernel_spin_lock buffer_lock;
+	// Only used in PnP requests, which arrive at PASSIVE_LEVEL, so the name stays in the paged pool buffer the system allocated it in
+	drv::paged_state<drv::sys_unicode_string_t> devinterface;
+	// Channel 0 is created with the device, others when a handle first selects them. Channels live until the device is removed
+	std::array<std::atomic<channel_t *>, MaxChannels> channels{};
+	// Buffer segments of all channels. An idle channel holds none
+	drv::lookaside_list segments;
+	size_t channel_buffer_size{ DefaultChannelBufferSize };
+	device_statistics statistics;
 
 	//
-	void process_pending_reads() noexcept;
-	void process_pending_writes() noexcept;
+	[[nodiscard]]
+	channel_t *get_channel(size_t index) noexcept;
+	NTSTATUS select_channel(drv::irp_t &&irp) noexcept;
+	NTSTATUS register_ring(drv::irp_t &&irp) noexcept;
+	NTSTATUS submit_ring(drv::irp_t &&irp) noexcept;
+	NTSTATUS set_read_timeout(drv::irp_t &&irp) noexcept;
+	NTSTATUS write_batch(drv::irp_t &&irp) noexcept;
+	NTSTATUS read_batch(drv::irp_t &&irp) noexcept;
+	NTSTATUS get_statistics(drv::irp_t &&irp) noexcept;
+	[[nodiscard]]
+	function::statistics collect_statistics() const noexcept;
+
+	[[nodiscard]]
+	static file_context_t *context_of(PFILE_OBJECT file_object) noexcept
+	{
+		return static_cast<file_context_t *>(file_object->FsContext);
+	}
+
+	/// <summary>
+	/// Get the channel a handle is attached to
+	/// </summary>
+	[[nodiscard]]
+	static channel_t *channel_of(PFILE_OBJECT file_object) noexcept
+	{
+		return context_of(file_object)->channel.load(std::memory_order_acquire);
+	}
+
+	[[nodiscard]]
+	static channel_t *channel_of(const drv::irp_t &irp) noexcept
+	{
+		return channel_of(irp.current_stack_location()->FileObject);
+	}
+
+	/// <summary>
+	/// Get the time a read request may stay pending. IOCTL_READ may pass it in the input buffer, otherwise the handle's timeout is used
+	/// </summary>
+	[[nodiscard]]
+	static ULONG read_timeout_of(const drv::irp_t &irp) noexcept
+	{
+		const auto stack = irp.current_stack_location();
+		if (stack->MajorFunction == IRP_MJ_DEVICE_CONTROL && stack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(ULONG))
+			return *static_cast<const ULONG *>(irp->AssociatedIrp.SystemBuffer);
+		return context_of(stack->FileObject)->read_timeout.load(std::memory_order_relaxed);
+	}
 
 public:
 	function_device_t(PDEVICE_OBJECT pdo, PDEVICE_OBJECT fdo, PDEVICE_OBJECT nextdo) noexcept :
-		drv::device_t<function_device_t>{ fdo },
+		device_base{ fdo },
 		pdo{ pdo },
 		nextdo{ nextdo }
 	{
-		// Our sample device provides buffered I/O for simplicity
-		fdo->Flags |= DO_BUFFERED_IO | DO_POWER_PAGABLE;
+		fdo->Flags |= (UseDirectIo ? DO_DIRECT_IO : DO_BUFFERED_IO) | DO_POWER_PAGABLE;
 		fdo->Flags &= ~DO_DEVICE_INITIALIZING;
 	}
 
+	~function_device_t()
+	{
+		for (auto &channel : channels)
+			delete channel.load(std::memory_order_relaxed);
+		segments.destroy();
+	}
+
 	NTSTATUS drv_final_construct() noexcept;
 
 	NTSTATUS drv_dispatch_pnp(drv::irp_t &&irp) noexcept;
@@ -113,12 +631,43 @@ public:
 	NTSTATUS drv_dispatch_close(drv::irp_t &&irp) noexcept;
 	NTSTATUS drv_dispatch_read(drv::irp_t &&irp) noexcept;
 	NTSTATUS drv_dispatch_write(drv::irp_t &&irp) noexcept;
+	NTSTATUS drv_dispatch_device_control(drv::irp_t &&irp) noexcept;
+
+	bool drv_fast_io_device_control(PFILE_OBJECT file_object, ULONG code, void *input, ULONG input_length, void *output, ULONG output_length, IO_STATUS_BLOCK &io_status) noexcept;
 };
 
+/// <summary>
+/// Set driver dispatch routines. All device objects of this driver are function_device_t objects, so they are dispatched directly
+/// Called once from DriverEntry, so the code is discarded after the driver is loaded
+/// </summary>
+DRV_INIT void Driver_InitDispatchRoutines(PDRIVER_OBJECT DriverObject) noexcept
+{
+	drv::init_dispatch_routines<function_device_t>(DriverObject);
+}
+
+/// <summary>
+/// Register the process notification that unlocks the shared ring buffers of exiting processes
+/// Called once from DriverEntry, so the code is discarded after the driver is loaded
+/// </summary>
+DRV_INIT NTSTATUS Driver_InitProcessNotify() noexcept
+{
+	return shared_ring_t::initialize_process_notify();
+}
+
+/// <summary>
+/// Implementation of driver's Unload routine. It is called after all devices have been removed
+/// </summary>
+DRV_PAGED void Driver_Unload([[maybe_unused]] PDRIVER_OBJECT DriverObject)
+{
+	PAGED_CODE();
+
+	shared_ring_t::uninitialize_process_notify();
+}
+
 /// <summary>
 /// PNP Driver AddDevice
 /// </summary>
-NTSTATUS Driver_AddDevice(PDRIVER_OBJECT DriverObject, PDEVICE_OBJECT pdo)
+DRV_PAGED NTSTATUS Driver_AddDevice(PDRIVER_OBJECT DriverObject, PDEVICE_OBJECT pdo)
 {
 	// AddDevice is called at PASSIVE_LEVEL
 	PAGED_CODE();
@@ -127,14 +676,61 @@ NTSTATUS Driver_AddDevice(PDRIVER_OBJECT DriverObject, PDEVICE_OBJECT pdo)
 	return function_device_t::create_and_attach_device_object(DriverObject, pdo);
 }
 
-NTSTATUS function_device_t::drv_final_construct() noexcept
+DRV_PAGED NTSTATUS function_device_t::drv_final_construct() noexcept
 {
+	PAGED_CODE();
+
+	// Buffer sizes may be set by the INF (HKR,,MaxBufferSize,0x00010001,...) in the device's hardware key
+	auto buffer_size = DefaultMaxBufferSize;
+	HANDLE key;
+	if (nt_success(IoOpenDeviceRegistryKey(pdo, PLUGPLAY_REGKEY_DEVICE, KEY_READ, &key)))
+	{
+		buffer_size = query_buffer_size(key, L"MaxBufferSize", DefaultMaxBufferSize);
+		channel_buffer_size = query_buffer_size(key, L"ChannelBufferSize", DefaultChannelBufferSize);
+		ZwClose(key);
+	}
+
+	if (auto status = segments.initialize(SegmentSize, pool_type::NonPaged, SegmentTag); !nt_success(status))
+		return status;
+
+	// Without the per-processor table the counters still work, only slower
+	std::ignore = statistics.initialize();
+
+	auto shared_channel = new channel_t{ segments, buffer_size, statistics };
+	if (!shared_channel)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	channels[0].store(shared_channel, std::memory_order_relaxed);
+
 	drv::sys_unicode_string_t link;
 	auto status = IoRegisterDeviceInterface(pdo, &function::GUID_DEVINTERFACE_MY_FUNCTION, nullptr, &link); 
-	if (nt_success(status))
-		devinterface = link;
-		
-	return status;
+	if (!nt_success(status))
+		return status;
+
+	return devinterface.create(std::move(link));
+}
+
+/// <summary>
+/// Get a channel, creating it if it does not exist yet
+/// </summary>
+/// <returns>Channel or nullptr if it could not be allocated</returns>
+channel_t *function_device_t::get_channel(size_t index) noexcept
+{
+	auto &slot = channels[index];
+	if (auto channel = slot.load(std::memory_order_acquire))
+		return channel;
+
+	auto channel = new channel_t{ segments, channel_buffer_size, statistics };
+	if (!channel)
+		return nullptr;
+
+	// Another handle may be creating the same channel concurrently, the first one wins
+	channel_t *existing{};
+	if (!slot.compare_exchange_strong(existing, channel, std::memory_order_acq_rel, std::memory_order_acquire))
+	{
+		delete channel;
+		return existing;
+	}
+	return channel;
 }
 
 /// <summary>
@@ -149,13 +745,13 @@ NTSTATUS function_device_t::drv_dispatch_pnp(drv::irp_t &&irp) noexcept
 	switch (irp.current_stack_location()->MinorFunction)
 	{
 	case IRP_MN_START_DEVICE:
-		std::ignore = IoSetDeviceInterfaceState(&devinterface, true);
+		std::ignore = IoSetDeviceInterfaceState(devinterface.get(), true);
 		break;
 	case IRP_MN_STOP_DEVICE:
-		std::ignore = IoSetDeviceInterfaceState(&devinterface, false);
+		std::ignore = IoSetDeviceInterfaceState(devinterface.get(), false);
 		break;
 	case IRP_MN_REMOVE_DEVICE:
-		std::ignore = IoSetDeviceInterfaceState(&devinterface, false);
+		std::ignore = IoSetDeviceInterfaceState(devinterface.get(), false);
 		IoDetachDevice(nextdo);
 		delete_device(irp.tag());
 		return std::move(irp).complete(STATUS_SUCCESS);
@@ -166,14 +762,30 @@ NTSTATUS function_device_t::drv_dispatch_pnp(drv::irp_t &&irp) noexcept
 
 /// <summary>
 /// CREATE dispatch routine
+/// Attaches the new handle to the channel selected by the name it is opened with
 /// </summary>
 /// <param name="irp"></param>
 /// <returns></returns>
 NTSTATUS function_device_t::drv_dispatch_create(drv::irp_t &&irp) noexcept
 {
 	DISPATCH_PROLOG(irp);
-	opened_count.fetch_add(1, std::memory_order_relaxed);
-	return complete_irp_and_release_remove_lock(std::move(irp), STATUS_ACCESS_DENIED);
+
+	const auto file_object = irp.current_stack_location()->FileObject;
+	const auto index = parse_channel_name(file_object->FileName);
+	if (!index)
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_OBJECT_NAME_INVALID);
+
+	const auto channel = get_channel(*index);
+	if (!channel)
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_INSUFFICIENT_RESOURCES);
+
+	const auto context = new file_context_t{ channel };
+	if (!context)
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_INSUFFICIENT_RESOURCES);
+
+	file_object->FsContext = context;
+	statistics.increment(statistic::open_handles);
+	return complete_irp_and_release_remove_lock(std::move(irp), STATUS_SUCCESS);
 }
 
 /// <summary>
@@ -184,14 +796,16 @@ NTSTATUS function_device_t::drv_dispatch_cleanup(drv::irp_t &&irp) noexcept
 {
 	DISPATCH_PROLOG(irp);
 
+	// The handle may have switched channels with IOCTL_SELECT_CHANNEL and still have requests pending in the previous one
 	auto file_object = irp.current_stack_location()->FileObject;
+	for (auto &channel : channels)
+		if (auto p = channel.load(std::memory_order_acquire))
+			p->cancel_requests(file_object);
 
-	// we must cancell all pending requests
-	while (auto pending_irp = in_queue.remove_next(file_object))
-		std::ignore = std::move(pending_irp).complete(STATUS_CANCELLED);
-
-	while (auto pending_irp = out_queue.remove_next(file_object))
-		std::ignore = std::move(pending_irp).complete(STATUS_CANCELLED);
+	// No more submissions can come through the handle, so the ring is destroyed without waiting for CLOSE
+	const auto context = context_of(file_object);
+	ExWaitForRundownProtectionRelease(&context->ring_rundown);
+	delete context->ring.exchange(nullptr, std::memory_order_acq_rel);
 
 	return complete_irp_and_release_remove_lock(std::move(irp), STATUS_SUCCESS);
 }
@@ -202,7 +816,8 @@ NTSTATUS function_device_t::drv_dispatch_cleanup(drv::irp_t &&irp) noexcept
 NTSTATUS function_device_t::drv_dispatch_close(drv::irp_t &&irp) noexcept
 {
 	DISPATCH_PROLOG(irp);
-	opened_count.fetch_sub(1, std::memory_order_relaxed);
+	delete context_of(irp.current_stack_location()->FileObject);
+	statistics.decrement(statistic::open_handles);
 	return complete_irp_and_release_remove_lock(std::move(irp), STATUS_SUCCESS);
 }
 
@@ -212,146 +827,891 @@ NTSTATUS function_device_t::drv_dispatch_close(drv::irp_t &&irp) noexcept
 NTSTATUS function_device_t::drv_dispatch_read(drv::irp_t &&irp) noexcept
 {
 	DISPATCH_PROLOG(irp);
+	statistics.increment(statistic::read_requests);
 	const auto tag = irp.tag();
+	const auto timeout_ms = read_timeout_of(irp);
+	const auto result = channel_of(irp)->read(std::move(irp), timeout_ms);
+	release_remove_lock(tag);
+	return result;
+}
 
-	const auto read_data = std::span{ static_cast<std::byte *>(irp->AssociatedIrp.SystemBuffer), irp.current_stack_location()->Parameters.Read.Length };
-
-	NTSTATUS result;
-
-	if (auto l = buffer_lock.acquire(); !buffer.empty())
-	{
-		// Buffer is not empty, we can complete read request synchronously
-		const auto bytes_to_copy = std::min(read_data.size(), buffer.size());
-		sr::copy(std::span{ buffer }.subspan(0, bytes_to_copy), read_data.begin());
-		buffer.erase(bytes_to_copy);
-		// Release spin lock as we are about to complete IRP
-		l.reset();
-		result = std::move(irp).complete(STATUS_SUCCESS, bytes_to_copy);		
-	}
-	else
-	{
+/// <summary>
+/// WRITE dispatch routine
+/// </summary>
+NTSTATUS function_device_t::drv_dispatch_write(drv::irp_t &&irp) noexcept
+{
+	DISPATCH_PROLOG(irp);
+	statistics.increment(statistic::write_requests);
+	const auto tag = irp.tag();
+	const auto result = channel_of(irp)->write(std::move(irp));
+	release_remove_lock(tag);
+	return result;
+}
+
+/// <summary>
+/// DEVICE_CONTROL dispatch routine
+/// IOCTL_READ and IOCTL_WRITE requests that could not be served by Fast I/O are processed as reads and writes
+/// </summary>
+NTSTATUS function_device_t::drv_dispatch_device_control(drv::irp_t &&irp) noexcept
+{
+	switch (irp.current_stack_location()->Parameters.DeviceIoControl.IoControlCode)
+	{
+	case function::IOCTL_READ:
+		return drv_dispatch_read(std::move(irp));
+	case function::IOCTL_WRITE:
+		return drv_dispatch_write(std::move(irp));
+	case function::IOCTL_SELECT_CHANNEL:
+		return select_channel(std::move(irp));
+	case function::IOCTL_REGISTER_RING:
+		return register_ring(std::move(irp));
+	case function::IOCTL_SUBMIT_RING:
+		return submit_ring(std::move(irp));
+	case function::IOCTL_SET_READ_TIMEOUT:
+		return set_read_timeout(std::move(irp));
+	case function::IOCTL_WRITE_BATCH:
+		return write_batch(std::move(irp));
+	case function::IOCTL_READ_BATCH:
+		return read_batch(std::move(irp));
+	case function::IOCTL_GET_STATISTICS:
+		return get_statistics(std::move(irp));
+	}
+
+	return device_base::drv_dispatch_default(std::move(irp));
+}
+
+/// <summary>
+/// Sum the per-processor counters of the device
+/// </summary>
+function::statistics function_device_t::collect_statistics() const noexcept
+{
+	const auto values = statistics.values();
+	const auto at = [&](statistic s) noexcept { return values[std::to_underlying(s)]; };
+	return {
+		.open_handles = at(statistic::open_handles),
+		.read_requests = at(statistic::read_requests),
+		.write_requests = at(statistic::write_requests),
+		.fast_io_requests = at(statistic::fast_io_requests),
+		.bytes_read = at(statistic::bytes_read),
+		.bytes_written = at(statistic::bytes_written),
+		.pended_reads = at(statistic::pended_reads),
+		.pended_writes = at(statistic::pended_writes),
+		.cancelled_requests = at(statistic::cancelled_requests),
+	};
+}
+
+/// <summary>
+/// Return the device's statistics. Callers that poll them usually take the Fast I/O path instead
+/// </summary>
+NTSTATUS function_device_t::get_statistics(drv::irp_t &&irp) noexcept
+{
+	DISPATCH_PROLOG(irp);
+
+	if (irp.current_stack_location()->Parameters.DeviceIoControl.OutputBufferLength < sizeof(function::statistics))
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_BUFFER_TOO_SMALL);
+
+	*static_cast<function::statistics *>(irp->AssociatedIrp.SystemBuffer) = collect_statistics();
+	return complete_irp_and_release_remove_lock(std::move(irp), STATUS_SUCCESS, sizeof(function::statistics));
+}
+
+/// <summary>
+/// Attach the handle to another channel. Requests already pending in the previous channel stay there
+/// </summary>
+NTSTATUS function_device_t::select_channel(drv::irp_t &&irp) noexcept
+{
+	DISPATCH_PROLOG(irp);
+
+	const auto stack = irp.current_stack_location();
+	if (stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG))
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_BUFFER_TOO_SMALL);
+
+	const auto index = *static_cast<const ULONG *>(irp->AssociatedIrp.SystemBuffer);
+	if (index >= MaxChannels)
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_INVALID_PARAMETER);
+
+	const auto channel = get_channel(index);
+	if (!channel)
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_INSUFFICIENT_RESOURCES);
+
+	context_of(stack->FileObject)->channel.store(channel, std::memory_order_release);
+	return complete_irp_and_release_remove_lock(std::move(irp), STATUS_SUCCESS);
+}
+
+/// <summary>
+/// Set the time read requests of the handle may stay pending
+/// </summary>
+NTSTATUS function_device_t::set_read_timeout(drv::irp_t &&irp) noexcept
+{
+	DISPATCH_PROLOG(irp);
+
+	const auto stack = irp.current_stack_location();
+	if (stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG))
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_BUFFER_TOO_SMALL);
+
+	context_of(stack->FileObject)->read_timeout.store(*static_cast<const ULONG *>(irp->AssociatedIrp.SystemBuffer), std::memory_order_relaxed);
+	return complete_irp_and_release_remove_lock(std::move(irp), STATUS_SUCCESS);
+}
+
+/// <summary>
+/// Register a shared ring for the handle. A handle may only have one ring, it is destroyed when the handle is closed
+/// The request must come directly from a user-mode caller, so that the buffer is locked in the caller's address space
+/// </summary>
+NTSTATUS function_device_t::register_ring(drv::irp_t &&irp) noexcept
+{
+	DISPATCH_PROLOG(irp);
+
+	const auto stack = irp.current_stack_location();
+	if (stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(function::ring_registration))
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_BUFFER_TOO_SMALL);
+
+	if (irp->RequestorMode != UserMode || IoGetRequestorProcess(irp.operator->()) != PsGetCurrentProcess())
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_INVALID_DEVICE_REQUEST);
+
+	const auto context = context_of(stack->FileObject);
+	if (!ExAcquireRundownProtection(&context->ring_rundown))
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_FILE_CLOSED);
+
+	auto status = STATUS_INVALID_DEVICE_STATE;
+	if (!context->ring.load(std::memory_order_acquire))
+	{
+		const auto ring = shared_ring_t::create(*static_cast<const function::ring_registration *>(irp->AssociatedIrp.SystemBuffer));
+		if (!ring)
+			status = ring.error();
+		else
+		{
+			// Another request of the same handle may have registered a ring concurrently
+			shared_ring_t *existing{};
+			if (context->ring.compare_exchange_strong(existing, *ring, std::memory_order_acq_rel, std::memory_order_acquire))
+				status = STATUS_SUCCESS;
+			else
+				delete *ring;
+		}
+	}
+
+	ExReleaseRundownProtection(&context->ring_rundown);
+	return complete_irp_and_release_remove_lock(std::move(irp), status);
+}
+
+/// <summary>
+/// Process the requests posted to the handle's submission ring. The number of processed requests is returned in Information
+/// </summary>
+NTSTATUS function_device_t::submit_ring(drv::irp_t &&irp) noexcept
+{
+	DISPATCH_PROLOG(irp);
+
+	const auto file_object = irp.current_stack_location()->FileObject;
+	const auto context = context_of(file_object);
+	if (!ExAcquireRundownProtection(&context->ring_rundown))
+		return complete_irp_and_release_remove_lock(std::move(irp), STATUS_FILE_CLOSED);
+
+	auto status = STATUS_INVALID_DEVICE_STATE;
+	size_t processed{};
+	if (const auto ring = context->ring.load(std::memory_order_acquire))
+	{
+		if (const auto result = ring->process(*channel_of(file_object)))
+		{
+			processed = *result;
+			status = STATUS_SUCCESS;
+		}
+		else
+			status = result.error();
+	}
+
+	ExReleaseRundownProtection(&context->ring_rundown);
+	return complete_irp_and_release_remove_lock(std::move(irp), status, processed);
+}
+
+/// <summary>
+/// Store several records with one buffer lock acquisition and one completion. The request never waits, it stores the records that fit
+/// </summary>
+NTSTATUS function_device_t::write_batch(drv::irp_t &&irp) noexcept
+{
+	DISPATCH_PROLOG(irp);
+
+	batch_t batch;
+	if (auto status = parse_batch(irp, batch); !nt_success(status))
+		return complete_irp_and_release_remove_lock(std::move(irp), status);
+
+	const auto written = channel_of(irp)->write_batch(batch);
+	return complete_irp_and_release_remove_lock(std::move(irp), STATUS_SUCCESS, written);
+}
+
+/// <summary>
+/// Fill several slots with one buffer lock acquisition and one completion. The request never waits, it returns the records available
+/// </summary>
+NTSTATUS function_device_t::read_batch(drv::irp_t &&irp) noexcept
+{
+	DISPATCH_PROLOG(irp);
+
+	batch_t batch;
+	if (auto status = parse_batch(irp, batch); !nt_success(status))
+		return complete_irp_and_release_remove_lock(std::move(irp), status);
+
+	const auto read = channel_of(irp)->read_batch(batch);
+	if (!read)
+		return complete_irp_and_release_remove_lock(std::move(irp), read.error());
+
+	// Report the results through the header and descriptors of the request buffer
+	batch.header.count = static_cast<u32>(*read);
+	memcpy(batch.data.data(), &batch.header, sizeof(batch.header));
+	memcpy(batch.data.data() + sizeof(batch.header), batch.descriptors.data(), *read * sizeof(function::batch_descriptor));
+	return complete_irp_and_release_remove_lock(std::move(irp), STATUS_SUCCESS, *read);
+}
+
+/// <summary>
+/// Fast I/O device control routine, called by the I/O manager before it builds an IRP
+/// Small IOCTL_READ and IOCTL_WRITE requests that can be completed immediately never get an IRP
+/// </summary>
+/// <returns>true if the request has been completed, false to let the I/O manager send an IRP</returns>
+bool function_device_t::drv_fast_io_device_control(PFILE_OBJECT file_object, ULONG code, [[maybe_unused]] void *input, [[maybe_unused]] ULONG input_length,
+	void *output, ULONG output_length, IO_STATUS_BLOCK &io_status) noexcept
+{
+	bool served;
+	switch (code)
+	{
+	case function::IOCTL_READ:
+		served = channel_of(file_object)->fast_read(output, output_length, io_status);
+		break;
+	case function::IOCTL_WRITE:
+		served = channel_of(file_object)->fast_write(output, output_length, io_status);
+		break;
+	case function::IOCTL_GET_STATISTICS:
+	{
+		if (output_length < sizeof(function::statistics))
+			return false;
+		const auto values = collect_statistics();
+		io_status.Status = copy_to_caller(output, &values, sizeof(values));
+		io_status.Information = nt_success(io_status.Status) ? sizeof(values) : 0;
+		return true;
+	}
+	default:
+		return false;
+	}
+
+	if (served)
+		statistics.increment(statistic::fast_io_requests);
+	return served;
+}
+
+/// <summary>
+/// Serve a read request from the buffer or pending writes, or queue it if there is no data
+/// A queued request that gets no data within `timeout_ms` milliseconds (unless it is 0) is completed with STATUS_TIMEOUT
+/// </summary>
+/// <returns>Status to return from the dispatch routine</returns>
+NTSTATUS channel_t::read(drv::irp_t &&irp, ULONG timeout_ms) noexcept
+{
+	const auto read_data = request_buffer(irp);
+	if (!read_data) [[unlikely]]
+		return std::move(irp).complete(STATUS_INSUFFICIENT_RESOURCES);
+
+	// Take data from the buffer and, once it is drained, straight from pending writes
+	const auto bytes_copied = get(*read_data);
+
+	NTSTATUS result;
+
+	if (bytes_copied)
+	{
+		// There was some data, we can complete read request synchronously
+		result = std::move(irp).complete(STATUS_SUCCESS, bytes_copied);
+	}
+	else
+	{
 		// Buffer is empty, mark this IRP as pending and put it into the CSQ
-		l.reset();
+		statistics.increment(statistic::pended_reads);
 		irp.mark_pending();
-		in_queue.insert(std::move(irp));
+		if (timeout_ms)
+			in_queue.insert_with_timeout(std::move(irp), timeout_ms);
+		else
+			in_queue.insert(std::move(irp));
 		result = STATUS_PENDING;
 	}
 
-	// Check if any pending writes can be processed
-	process_pending_writes();
-	release_remove_lock(tag);
+	// Check if any pending requests can be processed
+	process_pending_io();
 	return result;
 }
 
 /// <summary>
-/// WRITE dispatch routine
+/// Give the data of a write request to pending reads or the buffer, or queue it if there is not enough room
 /// </summary>
-NTSTATUS function_device_t::drv_dispatch_write(drv::irp_t &&irp) noexcept
+/// <returns>Status to return from the dispatch routine</returns>
+NTSTATUS channel_t::write(drv::irp_t &&irp) noexcept
 {
-	DISPATCH_PROLOG(irp);
-	const auto tag = irp.tag();
+	const auto input_data = request_buffer(irp);
+	if (!input_data) [[unlikely]]
+		return std::move(irp).complete(STATUS_INSUFFICIENT_RESOURCES);
 
-	const auto input_data = std::span{ static_cast<std::byte *>(irp->AssociatedIrp.SystemBuffer), irp.current_stack_location()->Parameters.Write.Length };
+	// Give the data to pending readers and store the rest in the buffer
+	const auto bytes_copied = put(*input_data);
 
 	NTSTATUS result;
-	
-	if (auto l = buffer_lock.acquire(); buffer.free_space() >= input_data.size())
+
+	if (bytes_copied == input_data->size())
 	{
-		// There is enough free space in a buffer, copy and complete IRP synchronously
-		buffer.append(input_data);
-		result = std::move(irp).complete(STATUS_SUCCESS, input_data.size());
+		// All data has been consumed, complete IRP synchronously
+		result = std::move(irp).complete(STATUS_SUCCESS, bytes_copied);
 	}
 	else
 	{
-		const auto free_space = buffer.free_space();
-		// There is not enough room in the buffer, we will copy a portion of it and will queue IRP
-		buffer.append(input_data.subspan(0, free_space));
-		// store the number of bytes we already copied
-		irp->Tail.Overlay.DriverContext[0] = reinterpret_cast<PVOID>(free_space);
+		// There is not enough room in the buffer, store the number of bytes we already copied and queue IRP
+		set_bytes_taken(irp, bytes_copied);
+		statistics.increment(statistic::pended_writes);
 		irp.mark_pending();
 		out_queue.insert(std::move(irp));
 		result = STATUS_PENDING;
 	}
 
-	// Check if any pending reads can be processed
-	process_pending_reads();
-	release_remove_lock(tag);
+	// Check if any pending requests can be processed
+	process_pending_io();
 	return result;
 }
 
 /// <summary>
-/// Process any pending reads
+/// Cancel all pending requests of a handle
+/// </summary>
+void channel_t::cancel_requests(PFILE_OBJECT file_object) noexcept
+{
+	std::array<drv::irp_t, PumpBatchSize> pending_irps;
+	while (const auto count = in_queue.remove_batch(pending_irps, file_object))
+	{
+		statistics.add(statistic::cancelled_requests, count);
+		for (auto &pending_irp : std::span{ pending_irps }.first(count))
+			std::ignore = std::move(pending_irp).complete(STATUS_CANCELLED);
+	}
+
+	while (const auto count = out_queue.remove_batch(pending_irps, file_object))
+	{
+		statistics.add(statistic::cancelled_requests, count);
+		for (auto &pending_irp : std::span{ pending_irps }.first(count))
+			std::ignore = complete_write(std::move(pending_irp));
+	}
+}
+
+/// <summary>
+/// Serve a read request from the buffer without an IRP
 /// </summary>
-void function_device_t::process_pending_reads() noexcept
+bool channel_t::fast_read(void *data, ULONG length, IO_STATUS_BLOCK &io_status) noexcept
 {
-	bool requests_processed{};
-	while (auto irp = in_queue.remove_next())
+	if (!length || length > FastIoMaxLength)
+		return false;
+
+	// Data taken from the buffer cannot be put back, so a buffer the copy would fault on is left to the IRP path, which fails the request
+	if (!nt_success(probe_caller_buffer(data, length)))
+		return false;
+
+	// The caller's buffer may be pageable, so the data is staged on the stack while the spin lock is held
+	std::array<std::byte, FastIoMaxLength> staging;
+	size_t bytes_copied;
+	{
+		auto l = buffer_lock.acquire();
+		// Let the IRP path handle an empty buffer, it may need to take data from pending writes or pend the request
+		if (buffer.empty())
+			return false;
+		bytes_copied = buffer.read(std::span{ staging }.first(length));
+	}
+
+	io_status.Status = copy_to_caller(data, staging.data(), bytes_copied);
+	io_status.Information = nt_success(io_status.Status) ? bytes_copied : 0;
+	statistics.add(statistic::bytes_read, io_status.Information);
+
+	// Free space may let pending writes progress
+	process_pending_io();
+	return true;
+}
+
+/// <summary>
+/// Store a write request in the buffer without an IRP
+/// </summary>
+bool channel_t::fast_write(const void *data, ULONG length, IO_STATUS_BLOCK &io_status) noexcept
+{
+	if (!length || length > FastIoMaxLength)
+		return false;
+
+	std::array<std::byte, FastIoMaxLength> staging;
+	if (const auto status = copy_from_caller(staging.data(), data, length); !nt_success(status))
+	{
+		io_status.Status = status;
+		io_status.Information = 0;
+		return true;
+	}
+
 	{
-		auto destination = std::span{ static_cast<std::byte *>(irp->AssociatedIrp.SystemBuffer), irp.current_stack_location()->Parameters.Read.Length };
 		auto l = buffer_lock.acquire();
-		const auto bytes_to_copy = std::min(destination.size(), buffer.size());
-		if (bytes_to_copy)
+		// Only complete writes are served, a partial one would have to be pended
+		if (!buffer.reserve(length))
+			return false;
+		std::ignore = buffer.write(std::span{ staging }.first(length));
+	}
+
+	io_status.Status = STATUS_SUCCESS;
+	io_status.Information = length;
+	statistics.add(statistic::bytes_written, length);
+
+	// Buffered data may complete pending reads
+	process_pending_io();
+	return true;
+}
+
+/// <summary>
+/// Store the records of a batch in the buffer, holding the lock once. Only whole records are stored
+/// Pending reads are served from the buffer afterwards
+/// </summary>
+/// <returns>Number of records stored</returns>
+size_t channel_t::write_batch(batch_t &batch) noexcept
+{
+	const auto prefix_size = batch.framed() ? sizeof(u32) : 0;
+	size_t written{}, bytes_written{};
+	{
+		auto l = buffer_lock.acquire();
+		for (const auto &record : batch.records())
 		{
-			sr::copy(std::span{ buffer }.subspan(0, bytes_to_copy), destination.begin());
-			buffer.erase(bytes_to_copy);
-			requests_processed = true;
-			// do not hold spin lock when we complete IRP
-			l.reset();
-			std::ignore = std::move(irp).complete(STATUS_SUCCESS, bytes_to_copy);
+			// Segments are allocated first, so a record is either stored completely or not at all
+			if (!buffer.reserve(prefix_size + record.length))
+				break;
+			if (prefix_size)
+				std::ignore = buffer.write(std::as_bytes(std::span{ &record.length, 1 }));
+			std::ignore = buffer.write(batch.data.subspan(record.offset, record.length));
+			bytes_written += record.length;
+			++written;
 		}
-		else
+	}
+	statistics.add(statistic::bytes_written, bytes_written);
+
+	// Buffered data may complete pending reads
+	process_pending_io();
+	return written;
+}
+
+/// <summary>
+/// Fill the slots of a batch from the buffer, holding the lock once. The length of each filled slot is stored in its descriptor
+/// In record mode a slot receives exactly one record, and reading stops at a record that does not fit into its slot
+/// </summary>
+/// <returns>Number of slots filled or STATUS_BUFFER_TOO_SMALL if the first record does not fit into the first slot</returns>
+std::expected<size_t, NTSTATUS> channel_t::read_batch(batch_t &batch) noexcept
+{
+	size_t read{}, bytes_read{};
+	bool too_small{};
+	{
+		auto l = buffer_lock.acquire();
+		for (auto &record : batch.records())
 		{
-			// do not hold spin lock as we are going to acquire another one
-			l.reset();
-			// the buffer is empty, requeue irp
-			in_queue.insert(std::move(irp));
-			break;
+			auto slot = batch.data.subspan(record.offset, record.length);
+			if (batch.framed())
+			{
+				u32 length;
+				if (buffer.peek(std::as_writable_bytes(std::span{ &length, 1 })) < sizeof(length) || buffer.size() - sizeof(length) < length)
+					break;
+				if (length > slot.size())
+				{
+					too_small = true;
+					break;
+				}
+				buffer.consume(sizeof(length));
+				slot = slot.first(length);
+			}
+			else if (buffer.empty())
+				break;
+
+			record.length = static_cast<u32>(buffer.read(slot));
+			bytes_read += record.length;
+			++read;
 		}
 	}
+	statistics.add(statistic::bytes_read, bytes_read);
+
+	// Free space may let pending writes progress
+	process_pending_io();
 
-	if (requests_processed)
-		process_pending_writes();
+	if (!read && too_small)
+		return std::unexpected{ STATUS_BUFFER_TOO_SMALL };
+	return read;
 }
 
 /// <summary>
-/// Process any pending writes
+/// Give data to pending reads or store it in the buffer. Pending requests are not processed
 /// </summary>
-void function_device_t::process_pending_writes() noexcept
+/// <returns>Number of bytes consumed</returns>
+size_t channel_t::put(std::span<const std::byte> data) noexcept
 {
-	bool buffer_grown{};
-	while (auto irp = out_queue.remove_next())
+	LIST_ENTRY served;
+	InitializeListHead(&served);
+
+	size_t bytes_consumed;
+	{
+		auto l = buffer_lock.acquire();
+		// Give the data directly to pending readers first, the buffer is only filled when nobody is waiting. The rest is stored
+		// within the same lock hold, so another writer cannot put its data between the parts of this one
+		bytes_consumed = hand_off_to_pending_reads(data, served);
+		bytes_consumed += buffer.write(data.subspan(bytes_consumed));
+	}
+
+	// Complete the served reads without holding the spin lock
+	while (!IsListEmpty(&served))
 	{
-		const auto bytes_taken_so_far = reinterpret_cast<ULONG_PTR>(irp->Tail.Overlay.DriverContext[0]);
-		const auto irp_buffer = std::span{ static_cast<std::byte *>(irp->AssociatedIrp.SystemBuffer), irp.current_stack_location()->Parameters.Write.Length }
-			.subspan(bytes_taken_so_far);
+		const auto read = CONTAINING_RECORD(RemoveHeadList(&served), IRP, Tail.Overlay.ListEntry);
+		std::ignore = drv::irp_t{ read }.complete(STATUS_SUCCESS, read->IoStatus.Information);
+	}
+
+	statistics.add(statistic::bytes_written, bytes_consumed);
+	return bytes_consumed;
+}
 
+/// <summary>
+/// Take data from the buffer or pending writes. Pending requests are not processed
+/// </summary>
+/// <returns>Number of bytes copied</returns>
+size_t channel_t::get(std::span<std::byte> destination) noexcept
+{
+	size_t bytes_copied;
+	{
 		auto l = buffer_lock.acquire();
-		const auto free_space = buffer.free_space();
-		if (const auto bytes_to_copy = std::min(free_space, irp_buffer.size()))
+		bytes_copied = buffer.read(destination);
+	}
+
+	// Once the buffer is drained, the rest of the request may be filled straight from pending writes
+	if (bytes_copied < destination.size())
+		bytes_copied += take_from_pending_writes(destination.subspan(bytes_copied));
+
+	statistics.add(statistic::bytes_read, bytes_copied);
+	return bytes_copied;
+}
+
+/// <summary>
+/// Copy data straight into pending read requests, bypassing the internal buffer. Called with the buffer lock held
+/// The served reads are not completed, they are linked into `served` through their list entries, which the queue no longer uses,
+/// with the number of bytes copied in IoStatus.Information. The caller completes them after it releases the lock
+/// </summary>
+/// <returns>Number of bytes consumed</returns>
+size_t channel_t::hand_off_to_pending_reads(std::span<const std::byte> data, LIST_ENTRY &served) noexcept
+{
+	size_t bytes_consumed{};
+	// Pending reads may only be served directly while the buffer is empty, otherwise they would overtake buffered data
+	while (bytes_consumed < data.size() && buffer.empty())
+	{
+		std::array<drv::irp_t, PumpBatchSize> reads;
+		const auto count = in_queue.remove_batch(reads, take_while_budget(data.size() - bytes_consumed, pending_read_size));
+		if (!count)
+			break;
+
+		for (auto &read : std::span{ reads }.first(count))
+		{
+			const auto destination = *request_buffer(read);
+			const auto bytes_to_copy = std::min(destination.size(), data.size() - bytes_consumed);
+			sr::copy(data.subspan(bytes_consumed, bytes_to_copy), destination.begin());
+			bytes_consumed += bytes_to_copy;
+
+			const auto irp = std::move(read).detach();
+			irp->IoStatus.Information = bytes_to_copy;
+			InsertTailList(&served, &irp->Tail.Overlay.ListEntry);
+		}
+	}
+
+	// The writer's side is counted by the caller
+	statistics.add(statistic::bytes_read, bytes_consumed);
+	return bytes_consumed;
+}
+
+/// <summary>
+/// Copy data straight from pending write requests, bypassing the internal buffer
+/// </summary>
+/// <returns>Number of bytes copied</returns>
+size_t channel_t::take_from_pending_writes(std::span<std::byte> destination) noexcept
+{
+	size_t bytes_copied{};
+	while (bytes_copied < destination.size())
+	{
+		std::array<drv::irp_t, PumpBatchSize> writes;
+		size_t count;
 		{
-			buffer.append(irp_buffer.subspan(bytes_to_copy));
-			buffer_grown = true;
-			l.reset();
-			if (irp_buffer.size() == bytes_to_copy)
+			auto l = buffer_lock.acquire();
+			// Pending writes hold newer data than the buffer, so they may only be read directly once it is drained
+			if (!buffer.empty())
+				break;
+
+			count = out_queue.remove_batch(writes, take_while_budget(destination.size() - bytes_copied, pending_write_size));
+			if (!count)
+				break;
+
+			for (auto &write : std::span{ writes }.first(count))
 			{
-				// all data from the write request has been consumed, we can complete it
-				std::ignore = std::move(irp).complete(STATUS_SUCCESS, bytes_taken_so_far + bytes_to_copy);
+				const auto taken_so_far = bytes_taken(write);
+				const auto source = request_buffer(write)->subspan(taken_so_far);
+				const auto bytes_to_copy = std::min(source.size(), destination.size() - bytes_copied);
+				sr::copy(source.subspan(0, bytes_to_copy), destination.begin() + bytes_copied);
+				bytes_copied += bytes_to_copy;
+				set_bytes_taken(write, taken_so_far + bytes_to_copy);
 			}
-			else
+
+			// Only the last request of the batch can be partially consumed. It goes back to the head of the queue before the lock
+			// is released, so that no other reader or writer can get ahead of its remaining data
+			if (auto &last = writes[count - 1]; bytes_taken(last) != request_length(last))
+				out_queue.requeue({ &last, 1 });
+		}
+
+		// Consumed writes are completed with their full length, a requeued write is only left here if it has been cancelled
+		for (auto &write : std::span{ writes }.first(count))
+			if (write)
+				std::ignore = complete_write(std::move(write));
+	}
+
+	// The reader's side is counted by the caller
+	statistics.add(statistic::bytes_written, bytes_copied);
+	return bytes_copied;
+}
+
+/// <summary>
+/// Move data from pending writes to the buffer and from the buffer to pending reads until neither can progress
+/// </summary>
+void channel_t::process_pending_io() noexcept
+{
+	for (;;)
+	{
+		std::array<drv::irp_t, PumpBatchSize> reads, writes;
+		std::array<size_t, PumpBatchSize> bytes_read;
+		size_t read_count, write_count, bytes_written{}, completed{};
+
+		{
+			auto l = buffer_lock.acquire();
+
+			// Take as many pending reads as the buffered data can serve
+			read_count = in_queue.remove_batch(reads, take_while_budget(buffer.size(), pending_read_size));
+			for (size_t i = 0; i < read_count; ++i)
+				bytes_read[i] = buffer.read(*request_buffer(reads[i]));
+
+			// Take as many pending writes as the free space can hold
+			write_count = out_queue.remove_batch(writes, take_while_budget(buffer.free_space(), pending_write_size));
+
+			// Writes are stored in order, so the completed ones form a prefix of the batch. The buffer may run out of space or
+			// fail to allocate a segment. Storing stops at the first write that does not fit completely, since a later write could
+			// get a segment and the remaining data of the earlier one would be stored after its data
+			for (auto &write : std::span{ writes }.first(write_count))
 			{
-				// update the number of copied bytes and requeue this IRP
-				irp->Tail.Overlay.DriverContext[0] = reinterpret_cast<PVOID>(bytes_taken_so_far + bytes_to_copy);
-				out_queue.insert(std::move(irp));
-				break;
+				const auto taken_so_far = bytes_taken(write);
+				const auto source = request_buffer(write)->subspan(taken_so_far);
+				const auto stored = buffer.write(source);
+				set_bytes_taken(write, taken_so_far + stored);
+				bytes_written += stored;
+				if (stored < source.size())
+					break;
+				++completed;
 			}
+
+			// The rest go back to the head of the queue in their original order before the lock is released,
+			// so that no other write can store its data ahead of theirs
+			out_queue.requeue(std::span{ writes }.subspan(completed, write_count - completed));
 		}
-		else
+
+		// Complete requests without holding the spin lock
+		size_t total_read{};
+		for (size_t i = 0; i < read_count; ++i)
 		{
-			out_queue.insert(std::move(irp));
+			total_read += bytes_read[i];
+			std::ignore = std::move(reads[i]).complete(STATUS_SUCCESS, bytes_read[i]);
+		}
+		statistics.add(statistic::bytes_read, total_read);
+		statistics.add(statistic::bytes_written, bytes_written);
+
+		// Stored writes are completed with their full length, requeued writes are only left here if they have been cancelled
+		for (auto &write : std::span{ writes }.first(write_count))
+			if (write)
+				std::ignore = complete_write(std::move(write));
+
+		// Stop once nothing moves, segment allocation failures included
+		if (!read_count && !bytes_written)
 			break;
+	}
+}
+
+/// <summary>
+/// Validate the registration, lock the buffer and map it into the system address space
+/// Must be called at PASSIVE_LEVEL in the context of the process that owns the buffer
+/// </summary>
+DRV_PAGED std::expected<shared_ring_t *, NTSTATUS> shared_ring_t::create(const function::ring_registration &registration) noexcept
+{
+	PAGED_CODE();
+
+	const auto [address, size, sq_entries, cq_entries, event_handle] = registration;
+	if (!std::has_single_bit(sq_entries) || sq_entries > function::MaxRingEntries || !std::has_single_bit(cq_entries) || cq_entries > function::MaxRingEntries
+		|| address % alignof(function::ring_control) || size > function::MaxRingSize || size < function::ring_data_offset(sq_entries, cq_entries))
+		return std::unexpected{ STATUS_INVALID_PARAMETER };
+
+	auto ring = new shared_ring_t;
+	if (!ring)
+		return std::unexpected{ STATUS_INSUFFICIENT_RESOURCES };
+
+	if (event_handle)
+	{
+		if (auto status = ObReferenceObjectByHandle(reinterpret_cast<HANDLE>(event_handle), EVENT_MODIFY_STATE, *ExEventObjectType, UserMode,
+			reinterpret_cast<void **>(&ring->event), nullptr); !nt_success(status))
+		{
+			delete ring;
+			return std::unexpected{ status };
+		}
+	}
+
+	if (auto status = ring->map(registration); !nt_success(status))
+	{
+		delete ring;
+		return std::unexpected{ status };
+	}
+
+	ring->owner = PsGetCurrentProcess();
+	ExAcquireFastMutex(&rings_mutex);
+	InsertTailList(&rings, &ring->rings_entry);
+	ExReleaseFastMutex(&rings_mutex);
+	return ring;
+}
+
+/// <summary>
+/// Unlock the application's buffer. Called with the ring's mutex held or when the ring is no longer used
+/// </summary>
+void shared_ring_t::unmap() noexcept
+{
+	if (locked)
+	{
+		MmUnlockPages(mdl);
+		locked = false;
+	}
+}
+
+DRV_INIT NTSTATUS shared_ring_t::initialize_process_notify() noexcept
+{
+	PAGED_CODE();
+
+	InitializeListHead(&rings);
+	ExInitializeFastMutex(&rings_mutex);
+	return PsSetCreateProcessNotifyRoutine(on_process_notify, false);
+}
+
+DRV_PAGED void shared_ring_t::uninitialize_process_notify() noexcept
+{
+	PAGED_CODE();
+
+	std::ignore = PsSetCreateProcessNotifyRoutine(on_process_notify, true);
+}
+
+/// <summary>
+/// Process notification routine. When a process exits, it is called at PASSIVE_LEVEL in the context of the process' last thread
+/// Pages still locked when the process exits bugcheck the system, so the rings of the process are unmapped here rather than on CLEANUP.
+/// A ring stays with its handle, and submissions through it fail from now on
+/// </summary>
+void shared_ring_t::on_process_notify([[maybe_unused]] HANDLE parent_id, [[maybe_unused]] HANDLE process_id, BOOLEAN create) noexcept
+{
+	if (create)
+		return;
+
+	const auto process = PsGetCurrentProcess();
+	ExAcquireFastMutex(&rings_mutex);
+	for (auto entry = rings.Flink; entry != &rings; entry = entry->Flink)
+	{
+		// A handle of another process may be submitting, so the pages are unlocked under the ring's mutex
+		if (auto ring = CONTAINING_RECORD(entry, shared_ring_t, rings_entry); ring->owner == process)
+		{
+			ExAcquireFastMutex(&ring->mutex);
+			ring->unmap();
+			ExReleaseFastMutex(&ring->mutex);
 		}
 	}
+	ExReleaseFastMutex(&rings_mutex);
+}
+
+/// <summary>
+/// Lock the application's buffer and map it into the system address space
+/// </summary>
+NTSTATUS shared_ring_t::map(const function::ring_registration &registration) noexcept
+{
+	mdl = IoAllocateMdl(reinterpret_cast<void *>(registration.address), static_cast<ULONG>(registration.size), false, false, nullptr);
+	if (!mdl)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	__try
+	{
+		MmProbeAndLockPages(mdl, UserMode, IoModifyAccess);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		return GetExceptionCode();
+	}
+	locked = true;
+
+	// The system mapping is removed by MmUnlockPages
+	const auto base = static_cast<std::byte *>(MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute));
+	if (!base)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	const auto data_offset = function::ring_data_offset(registration.sq_entries, registration.cq_entries);
+	control = reinterpret_cast<function::ring_control *>(base);
+	sq = reinterpret_cast<const function::submission_entry *>(base + function::ring_sq_offset());
+	cq = reinterpret_cast<function::completion_entry *>(base + function::ring_cq_offset(registration.sq_entries));
+	data = std::span{ base + data_offset, static_cast<size_t>(registration.size - data_offset) };
+	sq_entries = registration.sq_entries;
+	cq_entries = registration.cq_entries;
+
+	// Start from the indices the application has put into the control block
+	sq_head = std::atomic_ref{ control->sq_head }.load(std::memory_order_relaxed);
+	cq_tail = std::atomic_ref{ control->cq_tail }.load(std::memory_order_relaxed);
+	return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Process the posted requests while there is room for their completions
+/// Requests never wait: a write takes what fits into the channel, a read returns the data available
+/// </summary>
+/// <returns>Number of processed requests, or STATUS_PROCESS_IS_TERMINATING if the process that has registered the ring has exited</returns>
+std::expected<size_t, NTSTATUS> shared_ring_t::process(channel_t &channel) noexcept
+{
+	// IOCTL_SUBMIT_RING is sent by the application, so it arrives at PASSIVE_LEVEL
+	assert(KeGetCurrentIrql() <= APC_LEVEL);
+
+	size_t processed{};
+	ExAcquireFastMutex(&mutex);
+	if (!locked) [[unlikely]]
+	{
+		ExReleaseFastMutex(&mutex);
+		return std::unexpected{ STATUS_PROCESS_IS_TERMINATING };
+	}
+
+	// The application owns these indices. If it corrupts them, the requests are still taken from within the rings only
+	const auto sq_tail = std::atomic_ref{ control->sq_tail }.load(std::memory_order_acquire);
+	const auto cq_head = std::atomic_ref{ control->cq_head }.load(std::memory_order_acquire);
+	const auto posted = std::min(sq_tail - sq_head, sq_entries);
+	const auto room = cq_entries - std::min(cq_tail - cq_head, cq_entries);
+
+	for (auto count = std::min(posted, room); count; --count)
+	{
+		// Take a private copy, the application may change the entry while it is validated
+		function::submission_entry entry;
+		RtlCopyVolatileMemory(&entry, &sq[sq_head & (sq_entries - 1)], sizeof(entry));
+
+		function::completion_entry completion{ entry.user_data, STATUS_SUCCESS, 0 };
+		if (entry.offset > data.size() || entry.length > data.size() - entry.offset)
+			completion.status = STATUS_INVALID_PARAMETER;
+		else if (entry.opcode == function::ring_opcode::write)
+			completion.bytes = static_cast<u32>(channel.put(data.subspan(entry.offset, entry.length)));
+		else if (entry.opcode == function::ring_opcode::read)
+			completion.bytes = static_cast<u32>(channel.get(data.subspan(entry.offset, entry.length)));
+		else
+			completion.status = STATUS_INVALID_PARAMETER;
+
+		cq[cq_tail & (cq_entries - 1)] = completion;
+		++sq_head;
+		++cq_tail;
+		++processed;
+	}
+
+	// Publish the whole batch at once
+	std::atomic_ref{ control->sq_head }.store(sq_head, std::memory_order_release);
+	std::atomic_ref{ control->cq_tail }.store(cq_tail, std::memory_order_release);
+
+	// The application sets the flag and then checks the completion ring once more before it waits,
+	// so either it sees the completions or the driver sees the flag. The buffer may be unmapped once the mutex is released
+	const auto wakeup = processed && event && std::atomic_ref{ control->wakeup }.exchange(0);
+	ExReleaseFastMutex(&mutex);
+
+	// Data put into the channel may complete pending reads of other handles and free space may let pending writes progress
+	channel.process_pending_io();
+
+	if (wakeup)
+		KeSetEvent(event, IO_NO_INCREMENT, false);
 
-	if (buffer_grown)
-		process_pending_reads();
+	return processed;
 }
@@ -15,6 +15,162 @@
 namespace function
 {
 	using namespace drv::literals;
+
+	constexpr const u16 FunctionDriver = 0x1235;
+	// Read from the device. The data is returned in the output buffer
+	// The input buffer may contain the ULONG time in milliseconds the request may stay pending, which overrides IOCTL_SET_READ_TIMEOUT
+	constexpr const auto IOCTL_READ = drv::ctl::code(FunctionDriver, 0x1, drv::ctl::Method::DirectOut, drv::ctl::Access::Read);
+	// Write to the device. As required by METHOD_IN_DIRECT, the data is passed in the output buffer
+	constexpr const auto IOCTL_WRITE = drv::ctl::code(FunctionDriver, 0x2, drv::ctl::Method::DirectIn, drv::ctl::Access::Write);
+	// Attach the handle to a channel. The input buffer contains the ULONG channel number, less than 64
+	constexpr const auto IOCTL_SELECT_CHANNEL = drv::ctl::code(FunctionDriver, 0x3, drv::ctl::Method::Buffered, drv::ctl::Access::Any);
+	// Register a shared ring buffer for the handle. The input buffer contains ring_registration
+	constexpr const auto IOCTL_REGISTER_RING = drv::ctl::code(FunctionDriver, 0x4, drv::ctl::Method::Buffered, drv::ctl::Access::ReadWrite);
+	// Process the entries posted to the handle's submission ring. The number of processed entries is returned in Information
+	// Fails with STATUS_PROCESS_IS_TERMINATING after the process that has registered the ring has exited
+	constexpr const auto IOCTL_SUBMIT_RING = drv::ctl::code(FunctionDriver, 0x5, drv::ctl::Method::Buffered, drv::ctl::Access::ReadWrite);
+	// Write several records with one request. The output buffer contains batch_header, the descriptors and the record data
+	// The number of records written is returned in Information
+	constexpr const auto IOCTL_WRITE_BATCH = drv::ctl::code(FunctionDriver, 0x6, drv::ctl::Method::DirectIn, drv::ctl::Access::Write);
+	// Read several records with one request. The output buffer contains batch_header, the descriptors of the slots to fill and the slots
+	// The driver stores the number of records read in the header and the length of each record in its descriptor
+	constexpr const auto IOCTL_READ_BATCH = drv::ctl::code(FunctionDriver, 0x7, drv::ctl::Method::DirectOut, drv::ctl::Access::Read);
+	// Set the time read requests of the handle may stay pending. The input buffer contains the ULONG time in milliseconds, 0 means no limit
+	// A read request that gets no data in time is completed with STATUS_TIMEOUT
+	constexpr const auto IOCTL_SET_READ_TIMEOUT = drv::ctl::code(FunctionDriver, 0x8, drv::ctl::Method::Buffered, drv::ctl::Access::Any);
+	// Get the counters of the device. The output buffer receives statistics. The request is served by Fast I/O, so polling it is cheap
+	constexpr const auto IOCTL_GET_STATISTICS = drv::ctl::code(FunctionDriver, 0x9, drv::ctl::Method::Buffered, drv::ctl::Access::Any);
+
+	// Maximum number of records in IOCTL_READ_BATCH and IOCTL_WRITE_BATCH requests
+	constexpr const u32 MaxBatchRecords = 128;
+	// Batch flag: keep record boundaries. Each record is stored with a length prefix and a read returns whole records only
+	// Channels used with this flag should not be accessed with ordinary reads and writes, which see the prefixes as data
+	constexpr const u32 BatchRecords = 0x1;
+
+	// Maximum number of entries in a submission or completion ring
+	constexpr const u32 MaxRingEntries = 4096;
+	// Maximum size of the shared ring buffer
+	constexpr const u64 MaxRingSize = 16 * 1024 * 1024;
+
+	struct batch_header
+	{
+		u32 count;
+		u32 flags;
+	};
+
+	/// <summary>
+	/// Record of a batch request. The offset is counted from the start of the buffer and must be past the descriptors
+	/// </summary>
+	struct batch_descriptor
+	{
+		u32 offset;
+		u32 length;
+	};
+
+	/// <summary>
+	/// Output of IOCTL_GET_STATISTICS, counted since the device was started
+	/// The driver keeps a copy of the counters for each processor and sums them for the request, so they are not an atomic snapshot
+	/// </summary>
+	struct statistics
+	{
+		u64 open_handles;		// handles open now
+		u64 read_requests;		// read and IOCTL_READ requests that went through an IRP
+		u64 write_requests;		// write and IOCTL_WRITE requests that went through an IRP
+		u64 fast_io_requests;	// IOCTL_READ and IOCTL_WRITE requests served by Fast I/O
+		u64 bytes_read;			// bytes returned by all kinds of reads
+		u64 bytes_written;		// bytes taken from all kinds of writes
+		u64 pended_reads;		// reads queued because there was no data
+		u64 pended_writes;		// writes queued because there was not enough room
+		u64 cancelled_requests;	// pending requests cancelled by handle cleanup
+	};
+
+	[[nodiscard]]
+	constexpr u64 batch_data_offset(u32 count) noexcept
+	{
+		return sizeof(batch_header) + u64{ count } * sizeof(batch_descriptor);
+	}
+
+	enum class ring_opcode : u8
+	{
+		write = 1,
+		read = 2,
+	};
+
+	/// <summary>
+	/// Request posted by the application. The data is at `offset` of the data area
+	/// A write takes as much data as the channel can hold, a read returns the data available, neither waits
+	/// </summary>
+	struct submission_entry
+	{
+		u64 user_data;
+		u32 offset;
+		u32 length;
+		ring_opcode opcode;
+		u8 reserved[7];
+	};
+
+	/// <summary>
+	/// Result of a request, posted by the driver in the order the requests were submitted
+	/// </summary>
+	struct completion_entry
+	{
+		u64 user_data;
+		i32 status;
+		u32 bytes;
+	};
+
+	/// <summary>
+	/// Control block at the start of the shared buffer. Ring indices are never wrapped, the entry is taken at index & (entries - 1)
+	/// Each index is written by one side only and lives in its own cache line
+	/// </summary>
+	struct ring_control
+	{
+		// Written by the driver
+		alignas(64) u32 sq_head;
+		// Written by the application
+		alignas(64) u32 sq_tail;
+		// Written by the application
+		alignas(64) u32 cq_head;
+		// Written by the driver
+		alignas(64) u32 cq_tail;
+		// Set to 1 by the application before it waits for the event. The driver resets it when it signals the event
+		alignas(64) u32 wakeup;
+	};
+
+	/// <summary>
+	/// Input of IOCTL_REGISTER_RING
+	/// The buffer holds ring_control, sq_entries submission entries and cq_entries completion entries, the rest is the data area
+	/// </summary>
+	struct ring_registration
+	{
+		// Buffer address, must be aligned to 64 bytes
+		u64 address;
+		u64 size;
+		// Number of ring entries, must be powers of two
+		u32 sq_entries;
+		u32 cq_entries;
+		// Handle of an event signaled when the application has asked to be woken, or 0
+		u64 event;
+	};
+
+	[[nodiscard]]
+	constexpr u64 ring_sq_offset() noexcept
+	{
+		return sizeof(ring_control);
+	}
+
+	[[nodiscard]]
+	constexpr u64 ring_cq_offset(u32 sq_entries) noexcept
+	{
+		return ring_sq_offset() + u64{ sq_entries } * sizeof(submission_entry);
+	}
+
+	[[nodiscard]]
+	constexpr u64 ring_data_offset(u32 sq_entries, u32 cq_entries) noexcept
+	{
+		return ring_cq_offset(sq_entries) + u64{ cq_entries } * sizeof(completion_entry);
+	}
+
 	constexpr const auto GUID_DEVINTERFACE_MY_FUNCTION = "{df4c41f9-5548-4189-b3c0-0108f5ce388e}"_guid;
 }
 
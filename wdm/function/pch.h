@@ -26,9 +26,12 @@
 #include <memory>
 #include <atomic>
 #include <algorithm>
+#include <bit>
+#include <array>
 #include <ranges>
 #include <tuple>
 #include <optional>
+#include <span>
 #include <expected>
 #include <coroutine>
 